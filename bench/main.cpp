@@ -0,0 +1,433 @@
+// Dispense benchmark. Drives PumpController::dispense() through the full
+// state machine against the simulator for a matrix of target amounts and
+// flow rates, and prints one JSON object per matrix cell so dose latency and
+// accuracy can be tracked per commit.
+//
+//   pio run -e bench && .pio/build/bench/program [options]
+//
+//   --doses N        doses per matrix cell (default 20)
+//   --seed S         simulator seed (default 1)
+//   --tolerance G    error band counted as on target, in grams (default 0.05)
+//   --fine-flow G    flow of the slow last part of each pass, in g/s (default
+//                    that of PumpController); 0 runs every pass at full speed
+//   --replay FILE    replay a recorded pump run ("time_ms,grams" per line)
+//                    instead of the modelled pump start-up
+//   --filters        instead of dosing, time the load-cell filter chains and
+//                    measure their error on a noise trace of the empty platform
+//   --noise FILE     with --filters: a recorded trace (one raw count per line)
+//                    instead of simulated noise with spikes
+//   --recording FILE instead of dosing, replay a telemetry recording of the
+//                    device (see TelemetryRecorder) into the controller and
+//                    compare it with what the recorded one did; repeat for a
+//                    corpus of runs, one JSON object each
+//   --edge-tolerance US  with --recording: edges this close to the recorded
+//                    time still match (default 0)
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "DispenseSimulator.h"
+#include "FilterChain.h"
+#include "LiquidManager.h"
+#include "Logger.h"
+#include "PumpController.h"
+#include "ServoSwitch.h"
+#include "TelemetryReplay.h"
+#include "WeightSampler.h"
+
+static const float TARGETS[] = {0.5, 1.5, 5.0, 20.0};
+static const float FLOW_RATES[] = {0.6, 1.0, 1.5, 2.5};
+static const unsigned long MAX_DOSE_MS = 600000;
+static const size_t NOISE_CONVERSIONS = 20000;
+static const size_t FILTER_BENCH_CONVERSIONS = 2000000;
+
+struct Options
+{
+    int doses = 20;
+    uint32_t seed = 1;
+    float tolerance = 0.05;
+    float fineFlowRate = -1; // The controller's own
+    std::vector<FlowPoint> flowCurve;
+    bool filters = false;
+    std::vector<int32_t> noise;
+    std::vector<const char *> recordings;
+    uint32_t edgeToleranceUs = 0;
+};
+
+struct DoseResult
+{
+    PumpController::DispenseStats stats;
+    float error;
+    float flushWater;
+    double hostUs;
+};
+
+struct Summary
+{
+    double mean;
+    double stddev;
+    double min;
+    double p05;
+    double p50;
+    double p95;
+    double max;
+};
+
+static Summary summarize(std::vector<double> values)
+{
+    Summary summary = {};
+    if (values.empty())
+    {
+        return summary;
+    }
+
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double v : values)
+    {
+        sum += v;
+    }
+    summary.mean = sum / values.size();
+    double squares = 0;
+    for (double v : values)
+    {
+        squares += (v - summary.mean) * (v - summary.mean);
+    }
+    summary.stddev = sqrt(squares / values.size());
+    summary.min = values.front();
+    summary.max = values.back();
+    summary.p05 = values[static_cast<size_t>(0.05 * (values.size() - 1))];
+    summary.p50 = values[static_cast<size_t>(0.50 * (values.size() - 1))];
+    summary.p95 = values[static_cast<size_t>(0.95 * (values.size() - 1))];
+    return summary;
+}
+
+static void printSummary(const char *name, const Summary &s, bool last = false)
+{
+    printf("\"%s\":{\"mean\":%.4f,\"stddev\":%.4f,\"min\":%.4f,\"p05\":%.4f,\"p50\":%.4f,\"p95\":%.4f,\"max\":%.4f}%s",
+           name, s.mean, s.stddev, s.min, s.p05, s.p50, s.p95, s.max, last ? "" : ",");
+}
+
+static bool loadFlowCurve(const char *path, std::vector<FlowPoint> &curve)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        return false;
+    }
+
+    char line[128];
+    while (fgets(line, sizeof(line), file))
+    {
+        FlowPoint point;
+        if (sscanf(line, "%f,%f", &point.timeMs, &point.grams) == 2)
+        {
+            curve.push_back(point);
+        }
+    }
+    fclose(file);
+    return curve.size() >= 2;
+}
+
+static bool loadNoise(const char *path, std::vector<int32_t> &noise)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        return false;
+    }
+
+    char line[64];
+    while (fgets(line, sizeof(line), file))
+    {
+        long raw;
+        if (sscanf(line, "%ld", &raw) == 1)
+        {
+            noise.push_back(static_cast<int32_t>(raw));
+        }
+    }
+    fclose(file);
+    return noise.size() >= 100;
+}
+
+// Conversions of the empty platform, with the odd knock
+static std::vector<int32_t> recordNoise(uint32_t seed)
+{
+    SimConfig config;
+    config.seed = seed;
+    config.spikeChance = 0.02;
+    DispenseSimulator sim(config);
+    WeightSampler sampler(sim.loadCell());
+    sampler.begin();
+
+    std::vector<int32_t> noise;
+    uint32_t intervalUs = 1000000 / config.samplesPerSecond;
+    while (noise.size() < NOISE_CONVERSIONS)
+    {
+        sim.clock().advance(intervalUs);
+        WeightSampler::Sample sample;
+        if (sampler.getLatestSample(sample))
+        {
+            noise.push_back(sample.raw);
+        }
+    }
+    return noise;
+}
+
+template <typename Chain>
+static void benchFilter(const char *name, const std::vector<int32_t> &noise, float scale)
+{
+    // The platform does not move: the median of the trace is the true level
+    std::vector<int32_t> sorted(noise);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    int32_t level = sorted[sorted.size() / 2];
+
+    Chain chain;
+    std::vector<double> errors;
+    for (size_t i = 0; i < noise.size(); i++)
+    {
+        int32_t out;
+        // Skip the start-up of the slower chains
+        if (chain.push(noise[i], out) && i >= 64)
+        {
+            errors.push_back(fabs((out - level) / scale));
+        }
+    }
+
+    chain.reset();
+    int64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < FILTER_BENCH_CONVERSIONS; i++)
+    {
+        int32_t out;
+        if (chain.push(noise[i % noise.size()], out))
+        {
+            sink += out;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    double squares = 0;
+    for (double e : errors)
+    {
+        squares += e * e;
+    }
+    printf("{\"filter\":\"%s\",\"ns_per_conversion\":%.2f,\"outputs\":%zu,\"rms_error_g\":%.4f,", name,
+           ns / FILTER_BENCH_CONVERSIONS, errors.size(), errors.empty() ? 0.0 : sqrt(squares / errors.size()));
+    printSummary("error_g", summarize(errors), true);
+    printf(",\"checksum\":%lld}\n", static_cast<long long>(sink & 0xffff));
+    fflush(stdout);
+}
+
+static void runFilters(const Options &options)
+{
+    std::vector<int32_t> noise = options.noise.empty() ? recordNoise(options.seed) : options.noise;
+    float scale = SimConfig().scaleFactor;
+    benchFilter<FilterChain<>>("none", noise, scale);
+    benchFilter<FilterChain<MovingAverage<10>>>("MovingAverage<10>", noise, scale);
+    benchFilter<FilterChain<Median<5>>>("Median<5>", noise, scale);
+    benchFilter<FilterChain<Ema<3>>>("Ema<3>", noise, scale);
+    benchFilter<FilterChain<Cic<4, 2>>>("Cic<4,2>", noise, scale);
+    benchFilter<WeightSampler::SampleFilter>("Median<5>,Ema<2>", noise, scale);
+    benchFilter<FilterChain<Median<5>, Cic<4, 2>>>("Median<5>,Cic<4,2>", noise, scale);
+    benchFilter<FilterChain<Median<9>, MovingAverage<8>, Ema<2>>>("Median<9>,MovingAverage<8>,Ema<2>", noise, scale);
+}
+
+static bool runRecording(const Options &options, const char *path)
+{
+    TelemetryReplay replay(options.edgeToleranceUs);
+    if (!replay.load(path))
+    {
+        fprintf(stderr, "Cannot read a recording from %s\n", path);
+        return false;
+    }
+    auto hostStart = std::chrono::steady_clock::now();
+    TelemetryReplay::Result r = replay.run();
+    double hostMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - hostStart).count();
+
+    printf("{\"recording\":\"%s\",\"samples\":%zu,\"bad_frames\":%lu,\"jobs\":%lu,\"recorded_jobs\":%lu,"
+           "\"edges\":%lu,\"recorded_edges\":%lu,\"matched_edges\":%lu,\"first_divergence_us\":%llu,"
+           "\"max_edge_shift_us\":%lu,\"doses\":%lu,\"max_dose_error_g\":%.4f,\"duration_ms\":%.1f,"
+           "\"host_ms\":%.1f,\"speedup\":%.0f}\n",
+           path, replay.getSampleCount(), static_cast<unsigned long>(replay.getBadFrameCount()),
+           static_cast<unsigned long>(r.jobs), static_cast<unsigned long>(r.recordedJobs),
+           static_cast<unsigned long>(r.edges), static_cast<unsigned long>(r.recordedEdges),
+           static_cast<unsigned long>(r.matchedEdges), static_cast<unsigned long long>(r.firstDivergenceUs),
+           static_cast<unsigned long>(r.maxEdgeShiftUs), static_cast<unsigned long>(r.doses), r.maxDoseError,
+           r.durationUs / 1000.0, hostMs, hostMs > 0 ? r.durationUs / 1000.0 / hostMs : 0.0);
+    fflush(stdout);
+    return true;
+}
+
+static void runCell(const Options &options, float target, float flowRate, uint32_t seed)
+{
+    SimConfig config;
+    config.seed = seed;
+    DispenseSimulator sim(config);
+    if (!options.flowCurve.empty())
+    {
+        sim.setFlowCurve(options.flowCurve);
+    }
+
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(flowRate), "Bench");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(config.pumpPin, &flushSwitch);
+    Liquid liquid("Bench", target, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(config.scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+    if (options.fineFlowRate >= 0)
+    {
+        PumpController::DosingProfile profile = pumpController.getProfile();
+        profile.fineFlowRate = options.fineFlowRate;
+        pumpController.setProfile(profile);
+    }
+
+    std::vector<DoseResult> results;
+    for (int i = 0; i < options.doses; i++)
+    {
+        float liquidBefore = sim.getLiquidDelivered(0);
+        float flushBefore = sim.getFlushDelivered();
+        auto hostStart = std::chrono::steady_clock::now();
+
+        unsigned long start = Hal::millis();
+        pumpController.dispense(&liquid);
+        while (pumpController.isBusy() && Hal::millis() - start < MAX_DOSE_MS)
+        {
+            pumpController.update();
+            sim.clock().advance(1000);
+        }
+
+        DoseResult result;
+        result.stats = pumpController.getLastDispenseStats();
+        result.error = sim.getLiquidDelivered(0) - liquidBefore - target;
+        result.flushWater = sim.getFlushDelivered() - flushBefore;
+        result.hostUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - hostStart).count();
+        results.push_back(result);
+        sim.emptyContainer();
+    }
+
+    std::vector<double> timeMs, dispensing, stabilizing, settleMs, error, flushWater, hostUs;
+    int completed = 0;
+    int overshoot = 0;
+    int undershoot = 0;
+    for (const DoseResult &r : results)
+    {
+        timeMs.push_back(r.stats.durationMs);
+        dispensing.push_back(r.stats.dispensingIterations);
+        stabilizing.push_back(r.stats.stabilizingIterations);
+        settleMs.push_back(r.stats.settleTimeMs);
+        error.push_back(r.error);
+        flushWater.push_back(r.flushWater);
+        hostUs.push_back(r.hostUs);
+        completed += r.stats.completed ? 1 : 0;
+        overshoot += r.error > options.tolerance ? 1 : 0;
+        undershoot += r.error < -options.tolerance ? 1 : 0;
+    }
+
+    printf("{\"target_g\":%.2f,\"flow_gps\":%.2f,\"doses\":%d,\"completed\":%d,\"overshoot\":%d,\"undershoot\":%d,",
+           target, flowRate, options.doses, completed, overshoot, undershoot);
+    printSummary("time_ms", summarize(timeMs));
+    printSummary("dispensing_iterations", summarize(dispensing));
+    printSummary("stabilizing_iterations", summarize(stabilizing));
+    printSummary("settle_ms", summarize(settleMs));
+    printSummary("error_g", summarize(error));
+    printSummary("flush_water_g", summarize(flushWater));
+    printSummary("host_us", summarize(hostUs), true);
+    printf("}\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--doses") && i + 1 < argc)
+        {
+            options.doses = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+        {
+            options.seed = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+        {
+            options.tolerance = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--fine-flow") && i + 1 < argc)
+        {
+            options.fineFlowRate = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+        {
+            if (!loadFlowCurve(argv[++i], options.flowCurve))
+            {
+                fprintf(stderr, "Cannot read flow curve from %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--filters"))
+        {
+            options.filters = true;
+        }
+        else if (!strcmp(argv[i], "--recording") && i + 1 < argc)
+        {
+            options.recordings.push_back(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--edge-tolerance") && i + 1 < argc)
+        {
+            options.edgeToleranceUs = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--noise") && i + 1 < argc)
+        {
+            if (!loadNoise(argv[++i], options.noise))
+            {
+                fprintf(stderr, "Cannot read a noise trace from %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr,
+                    "Usage: %s [--doses N] [--seed S] [--tolerance G] [--fine-flow G] [--replay FILE]\n"
+                    "       %s --filters [--noise FILE]\n"
+                    "       %s --recording FILE [--recording FILE...] [--edge-tolerance US]\n",
+                    argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    Logger::setMinimumLevel(Logger::ERROR);
+    if (options.filters)
+    {
+        runFilters(options);
+        return 0;
+    }
+    if (!options.recordings.empty())
+    {
+        bool ok = true;
+        for (const char *path : options.recordings)
+        {
+            ok = runRecording(options, path) && ok;
+        }
+        return ok ? 0 : 1;
+    }
+
+    uint32_t cell = 0;
+    for (float target : TARGETS)
+    {
+        for (float flowRate : FLOW_RATES)
+        {
+            runCell(options, target, flowRate, options.seed + cell++);
+        }
+    }
+    return 0;
+}
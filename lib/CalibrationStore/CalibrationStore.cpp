@@ -0,0 +1,153 @@
+#include "CalibrationStore.h"
+#include <string.h>
+#include "Logger.h"
+
+CalibrationStore::CalibrationStore(HalStorage &storage, uint8_t station)
+    : storage(storage), station(station), ready(false)
+{
+    if (station == 0)
+    {
+        snprintf(scaleKey, KEY_LENGTH, "scale");
+    }
+    else
+    {
+        snprintf(scaleKey, KEY_LENGTH, "scale%u", station);
+    }
+}
+
+bool CalibrationStore::begin()
+{
+    ready = storage.begin();
+    if (!ready)
+    {
+        LOG_WARNING("Calibration storage unavailable; using defaults");
+    }
+    return ready;
+}
+
+uint32_t CalibrationStore::crc32(const void *data, size_t size, uint32_t crc)
+{
+    // Bitwise CRC-32 (IEEE); records are a few dozen bytes, no table needed
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+template <typename Record>
+bool CalibrationStore::readRecord(const char *key, Record &record)
+{
+    if (!ready || !storage.read(key, &record, sizeof(record)))
+    {
+        return false;
+    }
+    if (record.version != VERSION)
+    {
+        LOG_WARNING("Ignoring stored {}: version {}", key, record.version);
+        return false;
+    }
+    if (record.crc != crc32(&record, offsetof(Record, crc)))
+    {
+        LOG_WARNING("Ignoring stored {}: CRC mismatch", key);
+        return false;
+    }
+    return true;
+}
+
+template <typename Record>
+bool CalibrationStore::writeRecord(const char *key, Record &record)
+{
+    if (!ready)
+    {
+        return false;
+    }
+    record.version = VERSION;
+    record.crc = crc32(&record, offsetof(Record, crc));
+    if (!storage.write(key, &record, sizeof(record)))
+    {
+        LOG_ERROR("Failed to store {}", key);
+        return false;
+    }
+    return true;
+}
+
+bool CalibrationStore::loadScale(WeightSampler &sampler)
+{
+    ScaleRecord record;
+    if (!readRecord(scaleKey, record) || record.scale == 0)
+    {
+        LOG_INFO("No stored calibration; using the default factor");
+        sampler.setScale(DEFAULT_SCALE);
+        return false;
+    }
+    sampler.setScale(record.scale);
+    sampler.setOffset(record.offset);
+    sampler.setCompensation(record.compensation);
+    LOG_INFO("Loaded calibration factor {}, offset {}, curvature {}", record.scale, record.offset,
+             record.compensation.curvature);
+    return true;
+}
+
+void CalibrationStore::saveScale(const WeightSampler &sampler)
+{
+    ScaleRecord record;
+    memset(&record, 0, sizeof(record));
+    record.scale = sampler.getScale();
+    record.offset = sampler.getOffset();
+    record.compensation = sampler.getCompensation();
+    writeRecord(scaleKey, record);
+}
+
+void CalibrationStore::liquidKey(const String &name, char *key) const
+{
+    // Names can be longer than an NVS key; the record itself holds the full name.
+    // Seeded with the station, so each pump learns its own model of a liquid.
+    snprintf(key, KEY_LENGTH, "f%08lx", static_cast<unsigned long>(crc32(name.c_str(), name.length(), station)));
+}
+
+bool CalibrationStore::loadLiquid(Liquid &liquid)
+{
+    char key[KEY_LENGTH];
+    liquidKey(liquid.name, key);
+    LiquidRecord record;
+    if (!readRecord(key, record) || strncmp(record.name, liquid.name.c_str(), NAME_LENGTH - 1) != 0)
+    {
+        return false;
+    }
+    liquid.flowModel.setParameters(record.flow);
+    liquid.flushVolume = record.flushVolume;
+    LOG_INFO("Loaded flow model for {}: {} g/s, flush {}g", liquid.name, record.flow.flowRate, record.flushVolume);
+    return true;
+}
+
+int CalibrationStore::loadLiquids(LiquidManager &liquidManager)
+{
+    int loaded = 0;
+    for (int i = 0; i < liquidManager.getLiquidCount(); i++)
+    {
+        if (loadLiquid(*liquidManager.getLiquid(i)))
+        {
+            loaded++;
+        }
+    }
+    return loaded;
+}
+
+void CalibrationStore::saveLiquid(const Liquid &liquid)
+{
+    char key[KEY_LENGTH];
+    liquidKey(liquid.name, key);
+    LiquidRecord record;
+    memset(&record, 0, sizeof(record));
+    strncpy(record.name, liquid.name.c_str(), NAME_LENGTH - 1);
+    record.flow = liquid.flowModel.getParameters();
+    record.flushVolume = liquid.flushVolume;
+    writeRecord(key, record);
+}
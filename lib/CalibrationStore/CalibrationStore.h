@@ -0,0 +1,64 @@
+#pragma once
+#include "Hal.h"
+#include "LiquidManager.h"
+#include "WeightSampler.h"
+
+// Persistent scale calibration, and flow model and flush volume per liquid.
+// Every record is stored under its own key with a format version and a CRC,
+// so one record can be rewritten after a dose without touching the others,
+// and a torn or outdated record is ignored instead of loaded.
+class CalibrationStore
+{
+public:
+    static const uint16_t VERSION = 4; // 2: flush volume per liquid, 3: scale compensation, 4: stall duty
+    static constexpr float DEFAULT_SCALE = 2111.45; // Used until the scale has been calibrated once
+
+    // Stations sharing one storage keep their records apart by station
+    // number; station 0 uses the keys of a single-station build
+    CalibrationStore(HalStorage &storage, uint8_t station = 0);
+    bool begin();
+
+    // Applies the stored scale, tare offset and compensation, or DEFAULT_SCALE if none is stored
+    bool loadScale(WeightSampler &sampler);
+    void saveScale(const WeightSampler &sampler);
+
+    // Warm start: restores the flow model and flush volume learned in an earlier run
+    bool loadLiquid(Liquid &liquid);
+    int loadLiquids(LiquidManager &liquidManager);
+    void saveLiquid(const Liquid &liquid);
+
+    static uint32_t crc32(const void *data, size_t size, uint32_t crc = 0);
+
+private:
+    static const size_t NAME_LENGTH = 16;
+    static const size_t KEY_LENGTH = 12; // NVS allows 15 characters
+
+    struct ScaleRecord
+    {
+        uint16_t version;
+        float scale;
+        int32_t offset;
+        WeightSampler::Compensation compensation;
+        uint32_t crc;
+    };
+
+    struct LiquidRecord
+    {
+        uint16_t version;
+        char name[NAME_LENGTH];
+        FlowModel::Parameters flow;
+        float flushVolume;
+        uint32_t crc;
+    };
+
+    template <typename Record>
+    bool readRecord(const char *key, Record &record);
+    template <typename Record>
+    bool writeRecord(const char *key, Record &record);
+    void liquidKey(const String &name, char *key) const;
+
+    HalStorage &storage;
+    uint8_t station;
+    char scaleKey[KEY_LENGTH];
+    bool ready;
+};
@@ -0,0 +1,328 @@
+#include "ControlLink.h"
+#include "Logger.h"
+
+uint16_t ControlLink::requestDispense(int liquidIndex, float amount, uint8_t priority)
+{
+    ControlCommand command = {};
+    command.type = ControlCommand::DISPENSE;
+    command.index = liquidIndex;
+    command.amount = amount;
+    command.priority = priority;
+    return request(command);
+}
+
+uint16_t ControlLink::requestRecipe(int recipeIndex, uint8_t priority)
+{
+    ControlCommand command = {};
+    command.type = ControlCommand::RECIPE;
+    command.index = recipeIndex;
+    command.priority = priority;
+    return request(command);
+}
+
+uint16_t ControlLink::requestFlush(uint8_t priority)
+{
+    ControlCommand command = {};
+    command.type = ControlCommand::FLUSH;
+    command.index = -1;
+    command.priority = priority;
+    return request(command);
+}
+
+uint16_t ControlLink::requestSession(bool open, uint8_t priority)
+{
+    ControlCommand command = {};
+    command.type = ControlCommand::SESSION;
+    command.index = open ? 1 : 0;
+    command.priority = priority;
+    return request(command);
+}
+
+bool ControlLink::requestCancel(uint16_t jobId)
+{
+    ControlCommand command = {};
+    command.type = ControlCommand::CANCEL;
+    command.index = -1;
+    command.jobId = jobId;
+    if (!commands.tryPush(command))
+    {
+        return false;
+    }
+    notify(commandListener, commandListenerArg);
+    return true;
+}
+
+uint16_t ControlLink::request(ControlCommand &command)
+{
+    // Ids wrap, but never to 0, which stands for no job
+    uint16_t id = nextJobId.fetch_add(1, std::memory_order_relaxed);
+    if (id == 0)
+    {
+        id = nextJobId.fetch_add(1, std::memory_order_relaxed);
+    }
+    command.jobId = id;
+    if (!commands.tryPush(command))
+    {
+        return 0;
+    }
+    notify(commandListener, commandListenerArg);
+    return id;
+}
+
+void ControlLink::setCommandListener(Listener listener, void *arg)
+{
+    commandListener = listener;
+    commandListenerArg = arg;
+}
+
+void ControlLink::setPublishListener(Listener listener, void *arg)
+{
+    publishListener = listener;
+    publishListenerArg = arg;
+}
+
+void ControlLink::notify(Listener listener, void *arg)
+{
+    if (listener)
+    {
+        listener(arg);
+    }
+}
+
+bool ControlLink::pollStatus(ControlStatus &status)
+{
+    bool received = false;
+    while (statuses.tryPop(status))
+    {
+        received = true;
+    }
+    return received;
+}
+
+bool ControlLink::pollEvent(ControlEvent &event)
+{
+    return events.tryPop(event);
+}
+
+bool ControlLink::pollCommand(ControlCommand &command)
+{
+    return commands.tryPop(command);
+}
+
+bool ControlLink::publishStatus(const ControlStatus &status)
+{
+    if (!statuses.tryPush(status))
+    {
+        return false;
+    }
+    notify(publishListener, publishListenerArg);
+    return true;
+}
+
+void ControlLink::publishEvent(const ControlEvent &event)
+{
+    if (!events.tryPush(event))
+    {
+        droppedEvents.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    notify(publishListener, publishListenerArg);
+}
+
+ControlLoop::ControlLoop(ControlLink &link, PumpController &pumpController, LiquidManager &liquidManager)
+    : link(link), pumpController(pumpController), liquidManager(liquidManager), runningJob(),
+      eventState(nullptr), publishedState(nullptr), lastStatusMs(0)
+{
+}
+
+void ControlLoop::step()
+{
+    ControlCommand command;
+    while (link.pollCommand(command))
+    {
+        runCommand(command);
+    }
+
+    pumpController.update();
+    if (!pumpController.isBusy())
+    {
+        // Back to back: the next job starts in the step the last one ended
+        finishJob();
+        startNextJob();
+    }
+
+    // State names are literals, so a pointer compare detects a change
+    if (pumpController.getState() != eventState)
+    {
+        eventState = pumpController.getState();
+        publishEvent(ControlEvent::STATE, runningJob.jobId);
+    }
+    if (pumpController.getState() != publishedState ||
+        (pumpController.isBusy() && Hal::millis() - lastStatusMs >= STATUS_INTERVAL_MS))
+    {
+        publishStatus();
+    }
+}
+
+bool ControlLoop::getDeadline(uint32_t &atMs) const
+{
+    bool due = pumpController.getDeadline(atMs);
+    // Past while the UI falls behind: the next conversion retries it
+    uint32_t statusMs = lastStatusMs + STATUS_INTERVAL_MS;
+    if (pumpController.isBusy() && static_cast<int32_t>(statusMs - Hal::millis()) > 0 &&
+        (!due || static_cast<int32_t>(statusMs - atMs) < 0))
+    {
+        atMs = statusMs;
+        due = true;
+    }
+    return due;
+}
+
+void ControlLoop::runCommand(const ControlCommand &command)
+{
+    if (command.type == ControlCommand::CANCEL)
+    {
+        if (jobs.remove(command.jobId))
+        {
+            publishEvent(ControlEvent::CANCELLED, command.jobId);
+        }
+        else
+        {
+            LOG_WARNING("Job {} is not waiting, cannot cancel it", command.jobId);
+        }
+        return;
+    }
+    if (!jobs.push(command))
+    {
+        LOG_WARNING("Job queue full, job {} rejected", command.jobId);
+        publishEvent(ControlEvent::REJECTED, command.jobId);
+        return;
+    }
+    publishEvent(ControlEvent::QUEUED, command.jobId);
+}
+
+void ControlLoop::finishJob()
+{
+    if (runningJob.jobId == 0)
+    {
+        return;
+    }
+    if (runningJob.type == ControlCommand::FLUSH)
+    {
+        publishEvent(ControlEvent::DONE, runningJob.jobId);
+    }
+    else if (runningJob.type == ControlCommand::SESSION)
+    {
+        publishEvent(ControlEvent::DONE, runningJob.jobId, runningJob.index ? 0 : pumpController.getSessionTotal());
+    }
+    else
+    {
+        const PumpController::DispenseStats &stats = pumpController.getLastDispenseStats();
+        publishEvent(stats.completed ? ControlEvent::DONE : ControlEvent::FAILED, runningJob.jobId,
+                     stats.dispensedAmount);
+    }
+    runningJob.jobId = 0;
+}
+
+void ControlLoop::startNextJob()
+{
+    ControlCommand job;
+    while (!pumpController.isBusy() && jobs.pop(job))
+    {
+        if (startJob(job))
+        {
+            runningJob = job;
+            publishEvent(ControlEvent::STARTED, job.jobId);
+            if (!pumpController.isBusy())
+            {
+                finishJob(); // Done on the spot, like a session change
+            }
+        }
+        else
+        {
+            publishEvent(ControlEvent::FAILED, job.jobId);
+        }
+    }
+}
+
+bool ControlLoop::startJob(const ControlCommand &job)
+{
+    switch (job.type)
+    {
+    case ControlCommand::DISPENSE:
+    {
+        Liquid *liquid = liquidManager.getLiquid(job.index);
+        if (!liquid)
+        {
+            LOG_WARNING("Dispense requested for unknown liquid {}", job.index);
+            return false;
+        }
+        return pumpController.dispense(liquid, job.amount > 0 ? job.amount : liquid->targetAmount);
+    }
+    case ControlCommand::RECIPE:
+    {
+        Recipe *recipe = liquidManager.getRecipe(job.index);
+        if (!recipe)
+        {
+            LOG_WARNING("Unknown recipe {} requested", job.index);
+            return false;
+        }
+        return pumpController.dispense(recipe);
+    }
+    case ControlCommand::FLUSH:
+        return pumpController.flush();
+    case ControlCommand::SESSION:
+        if (job.index)
+        {
+            return pumpController.beginSession();
+        }
+        pumpController.endSession();
+        return true;
+    default:
+        return false;
+    }
+}
+
+void ControlLoop::publishStatus()
+{
+    ControlStatus status;
+    status.timestampMs = Hal::millis();
+    status.state = pumpController.getState();
+    status.busy = pumpController.isBusy();
+    status.liquidIndex = findLiquidIndex(pumpController.getActiveLiquid());
+    status.weight = pumpController.getDispensedAmount();
+    status.targetAmount = pumpController.getTargetAmount();
+    status.jobId = runningJob.jobId;
+    status.queuedJobs = jobs.size();
+
+    // When the UI falls behind, the snapshot is retried on the next step
+    if (link.publishStatus(status))
+    {
+        publishedState = status.state;
+        lastStatusMs = status.timestampMs;
+    }
+}
+
+void ControlLoop::publishEvent(ControlEvent::Type type, uint16_t jobId, float dispensed)
+{
+    ControlEvent event = {};
+    event.type = type;
+    event.jobId = jobId;
+    event.timestampMs = Hal::millis();
+    event.state = pumpController.getState();
+    event.dispensed = dispensed;
+    event.queuedJobs = jobs.size();
+    link.publishEvent(event);
+}
+
+int8_t ControlLoop::findLiquidIndex(const Liquid *liquid)
+{
+    for (int i = 0; i < liquidManager.getLiquidCount(); i++)
+    {
+        if (liquidManager.getLiquid(i) == liquid)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include "BoundedQueue.h"
+#include "JobQueue.h"
+#include "LiquidManager.h"
+#include "PumpController.h"
+
+// Snapshot of the control core for the UI core
+struct ControlStatus
+{
+    uint32_t timestampMs;
+    const char *state; // String literal, safe to read on the other core
+    bool busy;
+    int8_t liquidIndex;
+    float weight; // g dispensed of the current liquid
+    float targetAmount;
+    uint16_t jobId;     // Of the running job, 0 if none
+    uint8_t queuedJobs; // Waiting behind it
+};
+
+// What happened to a job, or a state change, for the serial side
+struct ControlEvent
+{
+    enum Type : uint8_t
+    {
+        QUEUED,
+        REJECTED, // The job queue was full
+        STARTED,
+        DONE,
+        FAILED,
+        CANCELLED,
+        STATE
+    };
+
+    Type type;
+    uint16_t jobId;
+    uint32_t timestampMs;
+    const char *state; // String literal
+    float dispensed;   // DONE, FAILED: g; DONE of a session close: g of all its liquids
+    uint8_t queuedJobs;
+};
+
+// The only link between the two cores: lock-free queues, commands towards
+// the control core, status snapshots and events back. Neither side ever
+// blocks; a full command queue rejects the request, a full status queue is
+// retried by the control loop with a newer snapshot, a full event queue
+// drops the event and counts it.
+class ControlLink
+{
+public:
+    typedef void (*Listener)(void *arg);
+
+    static const size_t QUEUE_SIZE = 8;
+    static const size_t EVENT_QUEUE_SIZE = 16;
+
+    // Wake the other side of an event-driven build: the command listener after
+    // each queued command, the publish listener after each status and event.
+    // Set before the tasks start.
+    void setCommandListener(Listener listener, void *arg);
+    void setPublishListener(Listener listener, void *arg);
+
+    // UI and serial side. Each request returns the id of the new job, 0 if
+    // the command queue was full. amount 0 is the liquid's target amount.
+    uint16_t requestDispense(int liquidIndex, float amount = 0, uint8_t priority = ControlCommand::DEFAULT_PRIORITY);
+    uint16_t requestRecipe(int recipeIndex, uint8_t priority = ControlCommand::DEFAULT_PRIORITY);
+    uint16_t requestFlush(uint8_t priority = ControlCommand::DEFAULT_PRIORITY);
+    // Queued like a dispense, so it takes effect between the jobs around it
+    uint16_t requestSession(bool open, uint8_t priority = ControlCommand::DEFAULT_PRIORITY);
+    bool requestCancel(uint16_t jobId); // Only a job still waiting in the queue
+    bool pollStatus(ControlStatus &status); // Newest snapshot, false if none arrived
+    bool pollEvent(ControlEvent &event);    // One consumer only
+    uint32_t getDroppedEventCount() const { return droppedEvents.load(std::memory_order_relaxed); }
+
+    // Control side
+    bool pollCommand(ControlCommand &command);
+    bool publishStatus(const ControlStatus &status);
+    void publishEvent(const ControlEvent &event);
+
+private:
+    uint16_t request(ControlCommand &command);
+    static void notify(Listener listener, void *arg);
+
+    BoundedQueue<ControlCommand, QUEUE_SIZE> commands;
+    BoundedQueue<ControlStatus, QUEUE_SIZE> statuses;
+    BoundedQueue<ControlEvent, EVENT_QUEUE_SIZE> events;
+    std::atomic<uint16_t> nextJobId{1};
+    std::atomic<uint32_t> droppedEvents{0};
+    Listener commandListener = nullptr;
+    void *commandListenerArg = nullptr;
+    Listener publishListener = nullptr;
+    void *publishListenerArg = nullptr;
+};
+
+// Body of the real-time control task: queues the jobs from the UI and the
+// serial port, runs them one after the other, highest priority first, and
+// starts the next in the same step the last one finished, so the pump never
+// idles while work is waiting. Steps the PumpController FSM and publishes its
+// status on every state change and every STATUS_INTERVAL_MS while busy.
+class ControlLoop
+{
+public:
+    static const uint32_t STATUS_INTERVAL_MS = 100;
+
+    ControlLoop(ControlLink &link, PumpController &pumpController, LiquidManager &liquidManager);
+    void step();
+    // When step() is next due without a conversion, pulse or command: the
+    // PumpController's deadline or the next status while busy
+    bool getDeadline(uint32_t &atMs) const;
+
+private:
+    void runCommand(const ControlCommand &command);
+    void finishJob();
+    void startNextJob();
+    bool startJob(const ControlCommand &job);
+    void publishStatus();
+    void publishEvent(ControlEvent::Type type, uint16_t jobId, float dispensed = 0);
+    int8_t findLiquidIndex(const Liquid *liquid);
+
+    ControlLink &link;
+    PumpController &pumpController;
+    LiquidManager &liquidManager;
+    JobQueue jobs;
+    ControlCommand runningJob; // jobId 0 while no job runs
+    const char *eventState;
+    const char *publishedState;
+    uint32_t lastStatusMs;
+};
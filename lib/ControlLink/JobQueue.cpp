@@ -0,0 +1,50 @@
+#include "JobQueue.h"
+
+JobQueue::JobQueue() : count(0), nextSequence(0)
+{
+}
+
+bool JobQueue::push(const ControlCommand &job)
+{
+    if (count == CAPACITY)
+    {
+        return false;
+    }
+    entries[count++] = {job, nextSequence++};
+    return true;
+}
+
+bool JobQueue::pop(ControlCommand &job)
+{
+    if (count == 0)
+    {
+        return false;
+    }
+    size_t next = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        const Entry &entry = entries[i];
+        if (entry.job.priority > entries[next].job.priority ||
+            (entry.job.priority == entries[next].job.priority &&
+             static_cast<int32_t>(entry.sequence - entries[next].sequence) < 0))
+        {
+            next = i;
+        }
+    }
+    job = entries[next].job;
+    entries[next] = entries[--count];
+    return true;
+}
+
+bool JobQueue::remove(uint16_t jobId)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (entries[i].job.jobId == jobId)
+        {
+            entries[i] = entries[--count];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Request to the control core; once accepted it is a job in the JobQueue
+struct ControlCommand
+{
+    static const uint8_t DEFAULT_PRIORITY = 1;
+
+    enum Type : uint8_t
+    {
+        DISPENSE,
+        RECIPE,
+        FLUSH,
+        SESSION, // index 1 opens a container session, 0 closes it
+        CANCEL   // Of the queued job jobId
+    };
+
+    Type type;
+    int8_t index;     // Of the liquid or recipe in LiquidManager
+    float amount;     // DISPENSE: g, 0 for the liquid's target amount
+    uint8_t priority; // Higher runs first
+    uint16_t jobId;
+};
+
+// Jobs waiting for the pump, in a fixed array. The highest priority comes
+// out first, jobs of equal priority in the order they were queued.
+class JobQueue
+{
+public:
+    static const size_t CAPACITY = 16;
+
+    JobQueue();
+    bool push(const ControlCommand &job); // False when full
+    bool pop(ControlCommand &job);
+    bool remove(uint16_t jobId);          // False if the job is not waiting
+    size_t size() const { return count; }
+
+private:
+    struct Entry
+    {
+        ControlCommand job;
+        uint32_t sequence; // Order of arrival
+    };
+
+    Entry entries[CAPACITY];
+    size_t count;
+    uint32_t nextSequence;
+};
@@ -0,0 +1,284 @@
+#include "SerialCommands.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "Profiler.h"
+#include "PumpController.h"
+
+SerialCommands::SerialCommands(ControlLink &link, LiquidManager &liquidManager, Writer writer)
+    : link(link), liquidManager(liquidManager), writer(writer), lineLength(0), overflow(false)
+{
+}
+
+void SerialCommands::receive(char c)
+{
+    if (c == '\r')
+    {
+        return;
+    }
+    if (c != '\n')
+    {
+        if (lineLength + 1 < LINE_LENGTH)
+        {
+            line[lineLength++] = c;
+        }
+        else
+        {
+            overflow = true;
+        }
+        return;
+    }
+
+    line[lineLength] = '\0';
+    if (overflow)
+    {
+        writer("ERR line too long");
+    }
+    else if (lineLength > 0)
+    {
+        runLine(line);
+    }
+    lineLength = 0;
+    overflow = false;
+}
+
+void SerialCommands::update()
+{
+    char out[LINE_LENGTH];
+    ControlEvent event;
+    while (link.pollEvent(event))
+    {
+        switch (event.type)
+        {
+        case ControlEvent::STATE:
+            snprintf(out, sizeof(out), "STATE %s %u", event.state, event.jobId);
+            break;
+        case ControlEvent::DONE:
+        case ControlEvent::FAILED:
+            snprintf(out, sizeof(out), "JOB %u %s %.2f %u", event.jobId, getEventName(event.type), event.dispensed,
+                     event.queuedJobs);
+            break;
+        default:
+            snprintf(out, sizeof(out), "JOB %u %s %u", event.jobId, getEventName(event.type), event.queuedJobs);
+            break;
+        }
+        writer(out);
+    }
+}
+
+void SerialCommands::runLine(char *text)
+{
+    char *save = nullptr;
+    const char *command = strtok_r(text, " \t", &save);
+    const char *first = strtok_r(nullptr, " \t", &save);
+    const char *second = strtok_r(nullptr, " \t", &save);
+    const char *third = strtok_r(nullptr, " \t", &save);
+    if (!command)
+    {
+        return;
+    }
+
+    if (!strcasecmp(command, "DISPENSE"))
+    {
+        int liquid = first ? findLiquid(first) : -1;
+        float amount = 0; // Its target amount
+        char *end = nullptr;
+        if (second)
+        {
+            amount = strtof(second, &end);
+        }
+        bool badAmount = second && (*end != '\0' || !(amount > 0 && amount <= PumpController::MAX_DOSE));
+        if (liquid < 0 || badAmount)
+        {
+            writer("ERR unknown liquid or bad amount");
+            return;
+        }
+        uint8_t priority;
+        if (!parsePriority(third, priority))
+        {
+            writer("ERR bad priority");
+            return;
+        }
+        reply(link.requestDispense(liquid, amount, priority));
+    }
+    else if (!strcasecmp(command, "RECIPE"))
+    {
+        int recipe = first ? findRecipe(first) : -1;
+        if (recipe < 0)
+        {
+            writer("ERR unknown recipe");
+            return;
+        }
+        uint8_t priority;
+        if (!parsePriority(second, priority))
+        {
+            writer("ERR bad priority");
+            return;
+        }
+        reply(link.requestRecipe(recipe, priority));
+    }
+    else if (!strcasecmp(command, "FLUSH"))
+    {
+        uint8_t priority;
+        if (!parsePriority(first, priority))
+        {
+            writer("ERR bad priority");
+            return;
+        }
+        reply(link.requestFlush(priority));
+    }
+    else if (!strcasecmp(command, "SESSION"))
+    {
+        if (!first || (strcasecmp(first, "OPEN") && strcasecmp(first, "CLOSE")))
+        {
+            writer("ERR expected OPEN or CLOSE");
+            return;
+        }
+        uint8_t priority;
+        if (!parsePriority(second, priority))
+        {
+            writer("ERR bad priority");
+            return;
+        }
+        reply(link.requestSession(!strcasecmp(first, "OPEN"), priority));
+    }
+    else if (!strcasecmp(command, "CANCEL"))
+    {
+        unsigned long jobId = 0;
+        if (!first || !parseNumber(first, UINT16_MAX, jobId) || jobId == 0 ||
+            !link.requestCancel(static_cast<uint16_t>(jobId)))
+        {
+            writer("ERR cannot cancel");
+            return;
+        }
+        writer("OK");
+    }
+    else if (!strcasecmp(command, "PROFILE"))
+    {
+        if (first && !strcasecmp(first, "RESET"))
+        {
+            Profiler::reset();
+            writer("OK");
+            return;
+        }
+        Profiler::print(writer);
+    }
+    else
+    {
+        writer("ERR unknown command");
+    }
+}
+
+int SerialCommands::findLiquid(const char *token)
+{
+    if (isdigit(static_cast<unsigned char>(token[0])))
+    {
+        unsigned long index;
+        if (!parseNumber(token, INT16_MAX, index))
+        {
+            return -1;
+        }
+        return liquidManager.getLiquid(static_cast<int>(index)) ? static_cast<int>(index) : -1;
+    }
+    for (int i = 0; i < liquidManager.getLiquidCount(); i++)
+    {
+        if (matchesName(token, liquidManager.getLiquid(i)->name.c_str()))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int SerialCommands::findRecipe(const char *token)
+{
+    if (isdigit(static_cast<unsigned char>(token[0])))
+    {
+        unsigned long index;
+        if (!parseNumber(token, INT16_MAX, index))
+        {
+            return -1;
+        }
+        return liquidManager.getRecipe(static_cast<int>(index)) ? static_cast<int>(index) : -1;
+    }
+    for (int i = 0; i < liquidManager.getRecipeCount(); i++)
+    {
+        if (matchesName(token, liquidManager.getRecipe(i)->name.c_str()))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool SerialCommands::matchesName(const char *token, const char *name)
+{
+    // Case-insensitive; spaces in a name are written as underscores, e.g. Bio_Grow
+    for (; *token && *name; token++, name++)
+    {
+        char c = *token == '_' ? ' ' : *token;
+        if (tolower(static_cast<unsigned char>(c)) != tolower(static_cast<unsigned char>(*name)))
+        {
+            return false;
+        }
+    }
+    return *token == '\0' && *name == '\0';
+}
+
+bool SerialCommands::parseNumber(const char *token, unsigned long max, unsigned long &value)
+{
+    // strtoul() would take a sign and leading spaces, and stop at the first non-digit
+    if (!isdigit(static_cast<unsigned char>(token[0])))
+    {
+        return false;
+    }
+    char *end = nullptr;
+    value = strtoul(token, &end, 10);
+    return *end == '\0' && value <= max;
+}
+
+bool SerialCommands::parsePriority(const char *token, uint8_t &priority)
+{
+    unsigned long value = ControlCommand::DEFAULT_PRIORITY;
+    if (token && !parseNumber(token, UINT8_MAX, value))
+    {
+        return false;
+    }
+    priority = static_cast<uint8_t>(value);
+    return true;
+}
+
+void SerialCommands::reply(uint16_t jobId)
+{
+    if (jobId == 0)
+    {
+        writer("ERR busy, try again");
+        return;
+    }
+    char out[16];
+    snprintf(out, sizeof(out), "OK %u", jobId);
+    writer(out);
+}
+
+const char *SerialCommands::getEventName(ControlEvent::Type type)
+{
+    switch (type)
+    {
+    case ControlEvent::QUEUED:
+        return "QUEUED";
+    case ControlEvent::REJECTED:
+        return "REJECTED";
+    case ControlEvent::STARTED:
+        return "STARTED";
+    case ControlEvent::DONE:
+        return "DONE";
+    case ControlEvent::FAILED:
+        return "FAILED";
+    case ControlEvent::CANCELLED:
+        return "CANCELLED";
+    default:
+        return "UNKNOWN";
+    }
+}
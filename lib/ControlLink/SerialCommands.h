@@ -0,0 +1,53 @@
+#pragma once
+#include "ControlLink.h"
+
+// Line-based job submission over the serial port, on the UI core. Commands
+// (case-insensitive; liquids and recipes by index or by name, with
+// underscores for spaces):
+//
+//     DISPENSE <liquid> [grams] [priority]   -> OK <job id> | ERR <reason>
+//     RECIPE <recipe> [priority]
+//     FLUSH [priority]
+//     SESSION OPEN|CLOSE [priority]            (container session, see PumpController)
+//     CANCEL <job id>                          (only while the job waits)
+//     PROFILE [RESET]                          -> PROFILE lines, see Profiler::print()
+//
+// Indexes, job ids and priorities (0-255) are plain decimal numbers; anything
+// else in the token is an error, not a 0.
+//
+// Events from the control core come back as lines:
+//
+//     JOB <id> QUEUED|REJECTED|STARTED|CANCELLED <queued jobs>
+//     JOB <id> DONE|FAILED <grams dispensed> <queued jobs>  (SESSION CLOSE: grams of the session)
+//     STATE <name> <job id>
+//
+// Nothing blocks: receive() takes the bytes as they arrive, update() writes
+// the events that are waiting.
+class SerialCommands
+{
+public:
+    typedef void (*Writer)(const char *line);
+
+    static const size_t LINE_LENGTH = 64;
+
+    SerialCommands(ControlLink &link, LiquidManager &liquidManager, Writer writer);
+    void receive(char c);
+    void update();
+
+private:
+    void runLine(char *line);
+    int findLiquid(const char *token);
+    int findRecipe(const char *token);
+    static bool matchesName(const char *token, const char *name);
+    static bool parseNumber(const char *token, unsigned long max, unsigned long &value);
+    static bool parsePriority(const char *token, uint8_t &priority); // The default without a token
+    void reply(uint16_t jobId);
+    static const char *getEventName(ControlEvent::Type type);
+
+    ControlLink &link;
+    LiquidManager &liquidManager;
+    Writer writer;
+    char line[LINE_LENGTH];
+    size_t lineLength;
+    bool overflow; // The line is too long: ignored up to its end
+};
@@ -0,0 +1,117 @@
+#include "EventLoop.h"
+
+EventLoop::EventLoop(Profiler::Section latencySection)
+    : latencySection(latencySection), waiting(false), wakeAtMs(0), dropped(0)
+#ifdef ARDUINO
+      ,
+      task(nullptr)
+#endif
+{
+}
+
+void EventLoop::begin()
+{
+#ifdef ARDUINO
+    task = xTaskGetCurrentTaskHandle();
+#endif
+}
+
+bool IRAM_ATTR EventLoop::post(Handler handler, void *arg)
+{
+    if (!events.tryPush({handler, arg}))
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+#ifdef ARDUINO
+    // Before begin() the event waits in the queue for the first runOnce()
+    TaskHandle_t loopTask = task.load(std::memory_order_acquire);
+    if (!loopTask)
+    {
+        return true;
+    }
+    if (xPortInIsrContext())
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(loopTask, &woken);
+        if (woken)
+        {
+            portYIELD_FROM_ISR();
+        }
+    }
+    else
+    {
+        xTaskNotifyGive(loopTask);
+    }
+#endif
+    return true;
+}
+
+size_t EventLoop::runOnce()
+{
+    size_t total = 0;
+    for (;;)
+    {
+        uint32_t nowMs = Hal::millis();
+        bool woken = waiting && static_cast<int32_t>(nowMs - wakeAtMs) >= 0;
+        size_t ran = wheel.advance(nowMs);
+        if (woken)
+        {
+            // Only a deadline that fired counts; a coarser level moving down does not
+            waiting = false;
+            if (ran > 0 && latencySection != Profiler::SECTION_COUNT)
+            {
+                // Both wrap together in 32 bits
+                int32_t lateUs = static_cast<int32_t>(static_cast<uint32_t>(Hal::micros()) - wakeAtMs * 1000);
+                Profiler::record(latencySection, lateUs > 0 ? static_cast<uint32_t>(lateUs) : 0);
+            }
+        }
+
+        Event event;
+        while (events.tryPop(event))
+        {
+            event.handler(event.arg);
+            ran++;
+        }
+        if (ran == 0)
+        {
+            return total;
+        }
+        total += ran;
+    }
+}
+
+void EventLoop::sleep()
+{
+    waiting = wheel.getNextMs(wakeAtMs);
+#ifdef ARDUINO
+    TickType_t ticks = portMAX_DELAY;
+    if (waiting)
+    {
+        int32_t waitMs = static_cast<int32_t>(wakeAtMs - Hal::millis());
+        ticks = waitMs > 0 ? pdMS_TO_TICKS(waitMs) : 0;
+    }
+    // A post() since the last runOnce() left a notification: no wait then
+    ulTaskNotifyTake(pdTRUE, ticks);
+#endif
+}
+
+void IRAM_ATTR Trigger::fire()
+{
+    if (pending.exchange(true, std::memory_order_acq_rel))
+    {
+        return;
+    }
+    if (!loop || !loop->post(run, this))
+    {
+        pending.store(false, std::memory_order_release); // Not queued: the next fire() tries again
+    }
+}
+
+void Trigger::run(void *arg)
+{
+    Trigger *trigger = static_cast<Trigger *>(arg);
+    // Cleared first: what fires while the handler runs gets a run of its own
+    trigger->pending.store(false, std::memory_order_release);
+    trigger->handler(trigger->arg);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include "BoundedQueue.h"
+#include "Hal.h"
+#include "Profiler.h"
+#include "TimerWheel.h"
+
+// Run-to-completion event loop for one task. Interrupts and other tasks
+// post() a handler to run on the loop's task; timers on a TimerWheel run
+// their callbacks there at their deadlines. Each handler runs to the end
+// before the next starts, so what the handlers share needs no locking.
+//
+// Between two runOnce() calls, sleep() blocks the task until something is
+// posted or the next deadline comes up; with nothing to do, the idle task
+// halts the core until the next interrupt. On the host sleep() returns at
+// once: the simulated clock is advanced by the caller instead.
+class EventLoop
+{
+public:
+    typedef void (*Handler)(void *arg);
+
+    static const size_t QUEUE_SIZE = 32;
+
+    // Records how late the loop woke for a deadline into the section, if any
+    explicit EventLoop(Profiler::Section latencySection = Profiler::SECTION_COUNT);
+    void begin(); // On the task that runs the loop
+
+    // Any task or interrupt; false, and counted, when the queue is full
+    bool IRAM_ATTR post(Handler handler, void *arg);
+    // Loop task only
+    void start(TimerWheel::Timer &timer, uint32_t delayMs) { startAt(timer, Hal::millis() + delayMs); }
+    void startAt(TimerWheel::Timer &timer, uint32_t deadlineMs) { wheel.start(timer, deadlineMs); }
+    void stop(TimerWheel::Timer &timer) { wheel.stop(timer); }
+
+    // Runs the handlers posted and the timers due, until neither is left;
+    // returns how many ran
+    size_t runOnce();
+    void sleep();
+
+    uint32_t getDroppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Event
+    {
+        Handler handler;
+        void *arg;
+    };
+
+    BoundedQueue<Event, QUEUE_SIZE> events;
+    TimerWheel wheel;
+    Profiler::Section latencySection;
+    bool waiting;     // For a deadline, at wakeAtMs
+    uint32_t wakeAtMs;
+    std::atomic<uint32_t> dropped;
+#ifdef ARDUINO
+    std::atomic<TaskHandle_t> task;
+#endif
+};
+
+// Asks for one handler to run on an event loop. Any number of sources may
+// fire() it, from interrupts too; whatever fires before the handler runs is
+// merged into one run, so a burst never fills the loop's queue.
+class Trigger
+{
+public:
+    Trigger(EventLoop::Handler handler, void *arg) : loop(nullptr), handler(handler), arg(arg), pending(false) {}
+    void attach(EventLoop &loop) { this->loop = &loop; }
+
+    void IRAM_ATTR fire();
+    // As a listener or timer callback, with the trigger as the argument
+    static void IRAM_ATTR notify(void *trigger) { static_cast<Trigger *>(trigger)->fire(); }
+
+private:
+    static void run(void *arg);
+
+    EventLoop *loop;
+    EventLoop::Handler handler;
+    void *arg;
+    std::atomic<bool> pending;
+};
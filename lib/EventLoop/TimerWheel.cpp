@@ -0,0 +1,219 @@
+#include "TimerWheel.h"
+
+namespace
+{
+    const uint32_t SLOT_MASK = TimerWheel::SLOTS - 1;
+    // Furthest a timer can be placed ahead of the next tick
+    const uint32_t MAX_AHEAD_MS = (1UL << (TimerWheel::LEVEL_BITS * TimerWheel::LEVELS)) - 1;
+
+    bool isBefore(uint32_t aMs, uint32_t bMs)
+    {
+        return static_cast<int32_t>(aMs - bMs) < 0;
+    }
+}
+
+TimerWheel::TimerWheel(uint32_t nowMs) : slots(), due(nullptr), nextMs(nowMs), armed(0), levelCounts()
+{
+}
+
+void TimerWheel::start(Timer &timer, uint32_t deadlineMs)
+{
+    if (timer.isArmed())
+    {
+        unlink(timer);
+    }
+    timer.deadlineMs = deadlineMs;
+    insert(timer);
+}
+
+void TimerWheel::stop(Timer &timer)
+{
+    if (timer.isArmed())
+    {
+        unlink(timer);
+    }
+}
+
+size_t TimerWheel::advance(uint32_t nowMs)
+{
+    // Started past their deadline since the last advance()
+    Timer *expired;
+    move(due, expired);
+    size_t fired = fire(expired, nextMs - 1);
+    while (!isBefore(nowMs, nextMs))
+    {
+        if (armed == 0)
+        {
+            nextMs = nowMs + 1;
+            break;
+        }
+
+        uint32_t tickMs = nextMs;
+        uint32_t index = tickMs & SLOT_MASK;
+        if (index == 0)
+        {
+            // The finest level wrapped: move the next slot of each coarser level down
+            for (uint8_t level = 1; level < LEVELS; level++)
+            {
+                uint32_t levelIndex = (tickMs >> (LEVEL_BITS * level)) & SLOT_MASK;
+                cascade(level, levelIndex);
+                if (levelIndex != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        // Past the tick before the callbacks run, so a timer they start for
+        // this tick goes to the due list instead of a slot already emptied
+        move(slots[0][index], expired);
+        nextMs = tickMs + 1;
+        fired += fire(expired, tickMs);
+
+        if (levelCounts[0] == 0 && (nextMs & SLOT_MASK) != 0)
+        {
+            // Nothing in the finest level: on to where the next level moves down
+            uint32_t wrapMs = (nextMs | SLOT_MASK) + 1;
+            nextMs = isBefore(nowMs, wrapMs) ? nowMs + 1 : wrapMs;
+        }
+    }
+    return fired;
+}
+
+bool TimerWheel::getNextMs(uint32_t &atMs) const
+{
+    if (armed == 0)
+    {
+        return false;
+    }
+    if (due)
+    {
+        atMs = nextMs - 1;
+        return true;
+    }
+
+    bool found = false;
+    if (levelCounts[0] > 0)
+    {
+        for (uint32_t k = 0; k < SLOTS && !found; k++)
+        {
+            if (slots[0][(nextMs + k) & SLOT_MASK])
+            {
+                atMs = nextMs + k;
+                found = true;
+            }
+        }
+    }
+    // A coarser slot moves down once the levels below it wrap to its start
+    for (uint8_t level = 1; level < LEVELS; level++)
+    {
+        if (levelCounts[level] == 0)
+        {
+            continue;
+        }
+        uint8_t shift = LEVEL_BITS * level;
+        uint32_t base = nextMs >> shift;
+        for (uint32_t k = 0; k <= SLOTS; k++)
+        {
+            uint32_t startMs = (base + k) << shift;
+            if (isBefore(startMs, nextMs) || !slots[level][(base + k) & SLOT_MASK])
+            {
+                continue;
+            }
+            if (!found || isBefore(startMs, atMs))
+            {
+                atMs = startMs;
+                found = true;
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+void TimerWheel::insert(Timer &timer)
+{
+    Timer **list;
+    uint8_t level;
+    if (isBefore(timer.deadlineMs, nextMs))
+    {
+        list = &due;
+        level = DUE;
+    }
+    else
+    {
+        uint32_t aheadMs = timer.deadlineMs - nextMs;
+        uint32_t placedMs = aheadMs > MAX_AHEAD_MS ? nextMs + MAX_AHEAD_MS : timer.deadlineMs;
+        aheadMs = placedMs - nextMs;
+        level = 0;
+        while (level < LEVELS - 1 && aheadMs >= (1UL << (LEVEL_BITS * (level + 1))))
+        {
+            level++;
+        }
+        list = &slots[level][(placedMs >> (LEVEL_BITS * level)) & SLOT_MASK];
+    }
+
+    timer.next = *list;
+    if (timer.next)
+    {
+        timer.next->link = &timer.next;
+    }
+    *list = &timer;
+    timer.link = list;
+    timer.level = level;
+    levelCounts[level]++;
+    armed++;
+}
+
+void TimerWheel::unlink(Timer &timer)
+{
+    *timer.link = timer.next;
+    if (timer.next)
+    {
+        timer.next->link = timer.link;
+    }
+    timer.next = nullptr;
+    timer.link = nullptr;
+    levelCounts[timer.level]--;
+    armed--;
+}
+
+void TimerWheel::cascade(uint8_t level, uint32_t index)
+{
+    Timer *moving;
+    move(slots[level][index], moving);
+    while (moving)
+    {
+        Timer &timer = *moving;
+        unlink(timer);
+        insert(timer);
+    }
+}
+
+void TimerWheel::move(Timer *&from, Timer *&to)
+{
+    to = from;
+    from = nullptr;
+    if (to)
+    {
+        to->link = &to;
+    }
+}
+
+size_t TimerWheel::fire(Timer *&list, uint32_t tickMs)
+{
+    size_t fired = 0;
+    while (list)
+    {
+        Timer &timer = *list;
+        unlink(timer);
+        if (isBefore(tickMs, timer.deadlineMs))
+        {
+            insert(timer); // Parked beyond the coarsest level, not due yet
+            continue;
+        }
+        timer.callback(timer.arg);
+        fired++;
+    }
+    return fired;
+}
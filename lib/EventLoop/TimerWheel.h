@@ -0,0 +1,72 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel with a resolution of one millisecond. Four levels
+// of 64 slots each cover 64ms, 4s, 4min and 4.6h ahead; a timer sits in the
+// level its deadline falls into and moves one level down each time the
+// level below wraps around, until it fires from the finest level exactly at
+// its deadline. Starting and stopping a timer is O(1), and the timers are
+// intrusive: the wheel allocates nothing.
+//
+// Timers further out than the coarsest level are parked at its end and
+// moved on when they come up. Deadlines wrap with Hal::millis(), so a timer
+// may be at most 24 days ahead.
+class TimerWheel
+{
+public:
+    typedef void (*Callback)(void *arg);
+
+    class Timer
+    {
+    public:
+        Timer(Callback callback, void *arg) : callback(callback), arg(arg), deadlineMs(0), next(nullptr),
+                                              link(nullptr), level(0) {}
+        bool isArmed() const { return link != nullptr; }
+        uint32_t getDeadlineMs() const { return deadlineMs; }
+
+    private:
+        friend class TimerWheel;
+
+        Callback callback;
+        void *arg;
+        uint32_t deadlineMs;
+        Timer *next;
+        Timer **link; // The pointer that points at this timer, nullptr while not armed
+        uint8_t level;
+    };
+
+    static const uint8_t LEVEL_BITS = 6;
+    static const uint8_t LEVELS = 4;
+    static const uint32_t SLOTS = 1 << LEVEL_BITS;
+
+    // Ticks before nowMs are taken as done
+    explicit TimerWheel(uint32_t nowMs = 0);
+
+    // Arms the timer, or moves an armed one
+    void start(Timer &timer, uint32_t deadlineMs);
+    void stop(Timer &timer);
+    // Fires every timer due by nowMs, earliest first; the callbacks may start
+    // and stop timers, one started for a time already past fires on the next
+    // advance(). Returns how many fired.
+    size_t advance(uint32_t nowMs);
+    // When advance() next has work: the earliest deadline, or earlier, when
+    // a coarser level has to move its timers down. False with no timer armed.
+    bool getNextMs(uint32_t &atMs) const;
+    size_t getArmedCount() const { return armed; }
+
+private:
+    static const uint8_t DUE = LEVELS; // Level of the timers started past their deadline
+
+    void insert(Timer &timer);
+    void unlink(Timer &timer);
+    void cascade(uint8_t level, uint32_t index);
+    static void move(Timer *&from, Timer *&to); // A whole list, to a list of the caller's
+    size_t fire(Timer *&list, uint32_t tickMs);
+
+    Timer *slots[LEVELS][SLOTS];
+    Timer *due;
+    uint32_t nextMs; // The next tick to process
+    size_t armed;
+    size_t levelCounts[LEVELS + 1];
+};
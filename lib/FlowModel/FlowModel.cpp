@@ -0,0 +1,219 @@
+#include "FlowModel.h"
+
+namespace
+{
+    // Initial RLS covariance: the flow rate is unknown, the intercept is small
+    const float SLOPE_VARIANCE = 100.0;
+    const float INTERCEPT_VARIANCE = 0.1;
+    const float INITIAL_RELATIVE_ERROR = 0.35;
+    const float MIN_RELATIVE_ERROR = 0.01;
+    const float MAX_RELATIVE_ERROR = 0.35;
+    const float INITIAL_ABSOLUTE_ERROR = 0.05;
+    const float MIN_ABSOLUTE_ERROR = 0.01; // g, noise of a difference of two settled weights
+    const float MAX_ABSOLUTE_ERROR = 0.2;
+    const float ERROR_SMOOTHING = 0.3;
+    const float DRIP_SMOOTHING = 0.2;
+    const float MAX_DRIP_VOLUME = 0.2; // g, more is a leaking line rather than run-on
+    const float STALL_SMOOTHING = 0.3;
+    const float MIN_OBSERVED_FLOW = 0.05;  // Relative, slower flows tell little about the stall duty
+    const float MIN_OBSERVED_DOSE = 0.05;  // g, smaller pulses are mostly noise
+    const float MIN_RELATIVE_DOSE = 0.2;   // g, smaller pulses update the absolute error
+    const float MIN_COARSE_FRACTION = 0.3; // of the remaining amount
+
+    float clampf(float value, float low, float high)
+    {
+        return value < low ? low : (value > high ? high : value);
+    }
+}
+
+FlowModel::FlowModel(float flowRate, float deadTime, float dripVolume)
+    : relativeError(INITIAL_RELATIVE_ERROR), absoluteError(INITIAL_ABSOLUTE_ERROR), stallDuty(DEFAULT_STALL_DUTY),
+      pulseCount(0), dripCount(0)
+{
+    reset(flowRate, deadTime, dripVolume);
+}
+
+FlowModel::Parameters FlowModel::getParameters() const
+{
+    Parameters parameters;
+    parameters.flowRate = flowRate;
+    parameters.deadTime = deadTime;
+    parameters.dripVolume = dripVolume;
+    parameters.relativeError = relativeError;
+    parameters.absoluteError = absoluteError;
+    parameters.stallDuty = stallDuty;
+    parameters.pulseCount = pulseCount;
+    return parameters;
+}
+
+void FlowModel::setParameters(const Parameters &parameters)
+{
+    reset(parameters.flowRate, parameters.deadTime, parameters.dripVolume);
+    relativeError = clampf(parameters.relativeError, MIN_RELATIVE_ERROR, MAX_RELATIVE_ERROR);
+    absoluteError = clampf(parameters.absoluteError, MIN_ABSOLUTE_ERROR, MAX_ABSOLUTE_ERROR);
+    stallDuty = clampf(parameters.stallDuty, 0, MAX_STALL_DUTY);
+    pulseCount = parameters.pulseCount;
+}
+
+void FlowModel::reset(float flowRate, float deadTime, float dripVolume)
+{
+    dripVolume = clampf(dripVolume, 0, MAX_DRIP_VOLUME);
+    slope = clampf(flowRate, MIN_FLOW_RATE, MAX_FLOW_RATE);
+    intercept = dripVolume - slope * deadTime;
+    p[0][0] = SLOPE_VARIANCE;
+    p[0][1] = 0;
+    p[1][0] = 0;
+    p[1][1] = INTERCEPT_VARIANCE;
+    this->dripVolume = dripVolume;
+    dripCount = dripVolume > 0 ? 1 : 0; // A given drip volume counts as observed
+    updateDerived();
+}
+
+void FlowModel::addPulse(float onTime, float grams)
+{
+    if (onTime <= 0 || grams < MIN_OBSERVED_DOSE)
+    {
+        return;
+    }
+
+    // Prediction error is modelled as absoluteError + relativeError * grams:
+    // short trim pulses tell the first, long coarse pulses the second.
+    float error = grams - predict(onTime);
+    error = error < 0 ? -error : error;
+    if (grams < MIN_RELATIVE_DOSE)
+    {
+        absoluteError = clampf(absoluteError + ERROR_SMOOTHING * (error - absoluteError),
+                               MIN_ABSOLUTE_ERROR, MAX_ABSOLUTE_ERROR);
+    }
+    else
+    {
+        float observedError = (error > absoluteError ? error - absoluteError : 0) / grams;
+        relativeError = clampf(relativeError + ERROR_SMOOTHING * (observedError - relativeError),
+                               MIN_RELATIVE_ERROR, MAX_RELATIVE_ERROR);
+    }
+
+    // Recursive least squares on x = [onTime, 1] with exponential forgetting
+    float px0 = p[0][0] * onTime + p[0][1];
+    float px1 = p[1][0] * onTime + p[1][1];
+    float denominator = FORGETTING_FACTOR + onTime * px0 + px1;
+    float k0 = px0 / denominator;
+    float k1 = px1 / denominator;
+
+    float residual = grams - (slope * onTime + intercept);
+    slope += k0 * residual;
+    intercept += k1 * residual;
+
+    float p00 = (p[0][0] - k0 * px0) / FORGETTING_FACTOR;
+    float p01 = (p[0][1] - k0 * px1) / FORGETTING_FACTOR;
+    float p11 = (p[1][1] - k1 * px1) / FORGETTING_FACTOR;
+    // Pulses of similar length carry little information; keep the covariance
+    // from winding up while the forgetting factor discounts old pulses.
+    p[0][0] = clampf(p00, 0, SLOPE_VARIANCE);
+    p[1][1] = clampf(p11, 0, INTERCEPT_VARIANCE);
+    p[0][1] = p[1][0] = p01;
+
+    slope = clampf(slope, MIN_FLOW_RATE, MAX_FLOW_RATE);
+    pulseCount++;
+    updateDerived();
+}
+
+void FlowModel::addPass(float onTime, float fineTime, float fineDuty, float grams)
+{
+    float relative = getRelativeFlow(fineDuty);
+    if (fineTime <= 0)
+    {
+        addPulse(onTime, grams);
+    }
+    else if (onTime > 0)
+    {
+        addPulse(onTime + relative * fineTime, grams);
+    }
+}
+
+void FlowModel::addDutyObservation(float duty, float relativeFlow)
+{
+    if (duty <= 0 || duty >= 1 || relativeFlow < MIN_OBSERVED_FLOW || relativeFlow >= 1)
+    {
+        return;
+    }
+    float observed = clampf((duty - relativeFlow) / (1 - relativeFlow), 0, MAX_STALL_DUTY);
+    stallDuty += STALL_SMOOTHING * (observed - stallDuty);
+}
+
+void FlowModel::addDripObservation(float grams)
+{
+    grams = clampf(grams, 0, MAX_DRIP_VOLUME);
+    dripVolume += DRIP_SMOOTHING * (grams - dripVolume);
+    dripCount++;
+    updateDerived();
+}
+
+void FlowModel::updateDerived()
+{
+    flowRate = slope;
+    if (dripCount == 0)
+    {
+        // Without a drip measurement the intercept is all we know: a positive
+        // one is extra volume, a negative one is start-up loss.
+        dripVolume = clampf(intercept, 0, MAX_DRIP_VOLUME);
+    }
+    deadTime = clampf((dripVolume - intercept) / flowRate, 0, MAX_DEAD_TIME);
+}
+
+float FlowModel::predict(float onTime) const
+{
+    float flowing = onTime > deadTime ? onTime - deadTime : 0;
+    return flowRate * flowing + dripVolume;
+}
+
+float FlowModel::predictPass(float onTime, float fineTime, float fineDuty) const
+{
+    float relative = getRelativeFlow(fineDuty);
+    if (onTime > 0)
+    {
+        return predict(onTime + relative * fineTime);
+    }
+    return relative * predict(fineTime);
+}
+
+float FlowModel::getRelativeFlow(float duty) const
+{
+    if (duty >= 1)
+    {
+        return 1;
+    }
+    return duty > stallDuty ? (duty - stallDuty) / (1 - stallDuty) : 0;
+}
+
+float FlowModel::getDutyFor(float relativeFlow) const
+{
+    return stallDuty + clampf(relativeFlow, 0, 1) * (1 - stallDuty);
+}
+
+float FlowModel::onTimeFor(float grams) const
+{
+    if (grams <= dripVolume)
+    {
+        return deadTime;
+    }
+    return deadTime + (grams - dripVolume) / flowRate;
+}
+
+float FlowModel::planDose(float remaining) const
+{
+    // Two standard errors below the target, so the coarse pulse does not
+    // overshoot; once the expected error is small the pulse aims at the target.
+    float margin = 2 * (absoluteError + relativeError * remaining);
+    float coarse = remaining - margin;
+    if (coarse < MIN_COARSE_FRACTION * remaining)
+    {
+        coarse = MIN_COARSE_FRACTION * remaining;
+    }
+    // Not worth splitting: the trim pulse would be lost in the drip, or the
+    // coarse pulse too small to learn from
+    if (margin < dripVolume + MIN_OBSERVED_DOSE || coarse < 2 * MIN_OBSERVED_DOSE)
+    {
+        return remaining;
+    }
+    return coarse;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+
+// Per-liquid pump model, learned online from every dispense pulse:
+//
+//   grams(t) = flowRate * max(0, t - deadTime) + dripVolume    (g/s, s, g)
+//
+// flowRate and the intercept (dripVolume - flowRate * deadTime) are tracked
+// with recursive least squares over (on-time, weight delta) pairs. The drip
+// volume is observed separately from the weight that arrives after cutoff,
+// which splits the intercept into dead time and drip.
+//
+// Below full speed the flow is taken as linear in the PWM duty above the
+// duty the motor stalls at, which is learned from flows measured while the
+// pump runs slow. A pass of onTime at full speed, then fineTime at a fine
+// duty, delivers what onTime + relativeFlow * fineTime would at full speed:
+// the flow left over from the coarse phase and the smaller drip after it add
+// up to one full drip. A pass that is all fine phase delivers relativeFlow
+// times what the same pulse would at full speed; addPass() leaves the fit
+// alone for it, its flow is measured from the weight while it runs.
+class FlowModel
+{
+public:
+    // Everything needed to resume learning after a reboot
+    struct Parameters
+    {
+        float flowRate;
+        float deadTime;
+        float dripVolume;
+        float relativeError;
+        float absoluteError;
+        float stallDuty;
+        uint16_t pulseCount;
+    };
+
+    FlowModel(float flowRate = 1.0, float deadTime = 0.0, float dripVolume = 0.0);
+
+    void addPulse(float onTime, float grams);
+    void addPass(float onTime, float fineTime, float fineDuty, float grams);
+    void addDripObservation(float grams);
+    // A flow measured at a duty below 1, relative to the full flow rate
+    void addDutyObservation(float duty, float relativeFlow);
+
+    float predict(float onTime) const;   // grams delivered by a pulse of onTime seconds
+    float predictPass(float onTime, float fineTime, float fineDuty) const;
+    float onTimeFor(float grams) const;  // seconds needed to deliver grams
+    float getRelativeFlow(float duty) const; // 0 up to the stall duty, 1 at full speed
+    float getDutyFor(float relativeFlow) const;
+    // Amount to aim for with the next pulse. Far from the target this leaves
+    // a margin for the model's uncertainty (coarse pulse); close to it the
+    // pulse aims at the target itself (trim pulse).
+    float planDose(float remaining) const;
+    // The smallest dose a pulse at duty can deliver: the drip after any start/stop
+    float getMinimumDose(float duty = 1) const { return getRelativeFlow(duty) * dripVolume; }
+
+    float getFlowRate() const { return flowRate; }
+    float getDeadTime() const { return deadTime; }
+    float getDripVolume() const { return dripVolume; }
+    float getRelativeError() const { return relativeError; }
+    float getAbsoluteError() const { return absoluteError; }
+    float getStallDuty() const { return stallDuty; }
+    uint16_t getPulseCount() const { return pulseCount; }
+
+    Parameters getParameters() const;
+    void setParameters(const Parameters &parameters);
+
+private:
+    static constexpr float FORGETTING_FACTOR = 0.9;
+    static constexpr float MIN_FLOW_RATE = 0.05;
+    static constexpr float MAX_FLOW_RATE = 20.0;
+    static constexpr float MAX_DEAD_TIME = 2.0;
+    static constexpr float DEFAULT_STALL_DUTY = 0.2; // Until one is measured
+    static constexpr float MAX_STALL_DUTY = 0.8;
+
+    void reset(float flowRate, float deadTime, float dripVolume);
+    void updateDerived();
+
+    // RLS state for grams = slope * t + intercept
+    float slope;
+    float intercept;
+    float p[2][2];
+
+    float flowRate;
+    float deadTime;
+    float dripVolume;
+    float relativeError; // Smoothed |prediction error| / delivered, long pulses
+    float absoluteError; // Smoothed |prediction error| in g, short pulses
+    float stallDuty;
+    uint16_t pulseCount;
+    uint16_t dripCount;
+};
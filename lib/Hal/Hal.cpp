@@ -0,0 +1,10 @@
+#include "Hal.h"
+
+HalClock *Hal::activeClock = nullptr;
+HalGpio *Hal::activeGpio = nullptr;
+
+void Hal::install(HalClock *clock, HalGpio *gpio)
+{
+    activeClock = clock;
+    activeGpio = gpio;
+}
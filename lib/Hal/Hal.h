@@ -0,0 +1,141 @@
+#pragma once
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "HostCompat.h"
+#endif
+
+// Hardware abstraction layer. Controller code talks to these interfaces
+// instead of Arduino, HX711, ESP32Servo and SSD1306 directly, so the same
+// code runs on the ESP32 (lib/HalEsp32) and on the host (lib/Simulator).
+
+class HalTimer
+{
+public:
+    typedef void (*Callback)(void *arg);
+
+    virtual ~HalTimer() {}
+    // One-shot: the callback fires once, delayUs after start()
+    virtual void start(uint32_t delayUs) = 0;
+    virtual void stop() = 0;
+};
+
+class HalClock
+{
+public:
+    virtual ~HalClock() {}
+    virtual uint32_t millis() = 0;
+    virtual uint64_t micros() = 0;
+    virtual void delay(uint32_t ms) = 0;
+    virtual HalTimer *createTimer(HalTimer::Callback callback, void *arg) = 0;
+};
+
+class HalGpio
+{
+public:
+    virtual ~HalGpio() {}
+    virtual void pinMode(int pin, int mode) = 0;
+    virtual void digitalWrite(int pin, int level) = 0;
+    virtual int digitalRead(int pin) = 0;
+    // PWM output, duty 0 (off) to 1 (on). The first write sets the pin up;
+    // from then on it is driven with pwmWrite() only. False, and the pin
+    // left alone, when it cannot be set up.
+    virtual bool pwmWrite(int pin, float duty) = 0;
+};
+
+class HalLoadCell
+{
+public:
+    // Called once per conversion, possibly from interrupt context
+    typedef void (*SampleCallback)(void *arg, int32_t raw, uint32_t timestampUs);
+
+    virtual ~HalLoadCell() {}
+    virtual void begin(SampleCallback callback, void *arg) = 0;
+};
+
+// Temperature near the load cell, for the drift compensation of the scale
+class HalThermometer
+{
+public:
+    virtual ~HalThermometer() {}
+    virtual float read() = 0; // Degrees C
+};
+
+class HalServo
+{
+public:
+    virtual ~HalServo() {}
+    virtual void attach() = 0;
+    virtual void detach() = 0;
+    virtual void write(int angle) = 0;
+};
+
+class HalDisplay
+{
+public:
+    static const int WIDTH = 128;
+    static const int HEIGHT = 64;
+
+    virtual ~HalDisplay() {}
+    virtual bool begin() = 0;
+    virtual void clear() = 0;
+    virtual void setTextSize(uint8_t size) = 0;
+    virtual void setCursor(int16_t x, int16_t y) = 0;
+    virtual void print(const char *text) = 0;
+    virtual void print(float value, int digits) = 0;
+    virtual void println(const char *text) = 0;
+    virtual void drawFastHLine(int16_t x, int16_t y, int16_t width) = 0;
+    virtual void drawRect(int16_t x, int16_t y, int16_t width, int16_t height) = 0;
+    virtual void fillRect(int16_t x, int16_t y, int16_t width, int16_t height) = 0;
+    virtual void show() = 0;
+};
+
+// Rotary encoder with a push button, decoded and debounced on the interrupt
+// side: a reader that comes late still sees every detent and every press.
+class HalInput
+{
+public:
+    typedef void (*Listener)(void *arg);
+
+    struct ButtonEdge
+    {
+        bool pressed;
+        uint32_t timestampMs; // Of the first bounce
+    };
+
+    virtual ~HalInput() {}
+    // The listener is called after each detent and button edge, possibly from an interrupt
+    virtual void begin(Listener listener, void *arg) = 0;
+    virtual int32_t getPosition() = 0;            // Detents, clockwise positive
+    virtual int32_t getAcceleratedPosition() = 0; // Detents, each weighted by the turning speed
+    virtual bool pollButton(ButtonEdge &edge) = 0; // Oldest first
+};
+
+// Small named blobs that survive a reboot: NVS on the device, a file on the host
+class HalStorage
+{
+public:
+    virtual ~HalStorage() {}
+    virtual bool begin() = 0;
+    // False if the key is missing or was stored with a different size
+    virtual bool read(const char *key, void *data, size_t size) = 0;
+    virtual bool write(const char *key, const void *data, size_t size) = 0;
+};
+
+// Process-wide clock and GPIO, installed once at startup (setup() on the
+// device, the simulator on the host). Everything else is passed in.
+class Hal
+{
+public:
+    static void install(HalClock *clock, HalGpio *gpio);
+    static HalClock &clock() { return *activeClock; }
+    static HalGpio &gpio() { return *activeGpio; }
+
+    static uint32_t millis() { return activeClock->millis(); }
+    static uint64_t micros() { return activeClock->micros(); }
+    static void delay(uint32_t ms) { activeClock->delay(ms); }
+
+private:
+    static HalClock *activeClock;
+    static HalGpio *activeGpio;
+};
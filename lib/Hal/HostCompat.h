@@ -0,0 +1,70 @@
+#pragma once
+// The small part of the Arduino core that controller code uses outside the
+// HAL, for builds without Arduino (the native simulator and tests).
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <cmath>
+#include <algorithm>
+#include <string>
+
+using std::abs;
+using std::max;
+using std::min;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define IRAM_ATTR
+
+template <typename T, typename L, typename H>
+inline T constrain(T value, L low, H high)
+{
+    return value < low ? low : (value > high ? high : value);
+}
+
+class String
+{
+public:
+    String() {}
+    String(const char *text) : value(text ? text : "") {}
+    String(const std::string &text) : value(text) {}
+    String(char c) : value(1, c) {}
+    String(int number) : value(std::to_string(number)) {}
+    String(unsigned int number) : value(std::to_string(number)) {}
+    String(long number) : value(std::to_string(number)) {}
+    String(unsigned long number) : value(std::to_string(number)) {}
+    String(long long number) : value(std::to_string(number)) {}
+    String(unsigned long long number) : value(std::to_string(number)) {}
+    String(float number, unsigned int decimals = 2) { format(number, decimals); }
+    String(double number, unsigned int decimals = 2) { format(number, decimals); }
+
+    const char *c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.length(); }
+
+    String &operator+=(const String &other)
+    {
+        value += other.value;
+        return *this;
+    }
+
+    bool operator==(const String &other) const { return value == other.value; }
+    bool operator!=(const String &other) const { return value != other.value; }
+
+    friend String operator+(const String &lhs, const String &rhs) { return String(lhs.value + rhs.value); }
+    friend String operator+(const String &lhs, const char *rhs) { return String(lhs.value + rhs); }
+    friend String operator+(const char *lhs, const String &rhs) { return String(lhs + rhs.value); }
+
+private:
+    void format(double number, unsigned int decimals)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.*f", static_cast<int>(decimals), number);
+        value = buffer;
+    }
+
+    std::string value;
+};
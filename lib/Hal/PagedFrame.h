@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "Hal.h"
+
+// Copy of a 1-bit framebuffer in SSD1306 layout: PAGES rows of 8 pixels,
+// one byte per column. submit() keeps only the pages that changed and marks
+// them dirty; take() hands the dirty pages to the transfer and clears them.
+// Frames submitted before the transfer runs coalesce into one.
+class PagedFrame
+{
+public:
+    static const int PAGES = HalDisplay::HEIGHT / 8;
+    static const size_t PAGE_SIZE = HalDisplay::WIDTH;
+    static const size_t SIZE = PAGES * PAGE_SIZE;
+
+    PagedFrame() : dirty(0xFF) // Nothing is known about the panel yet
+    {
+        memset(frame, 0, sizeof(frame));
+    }
+
+    // Returns the pages that differ from the last submitted frame
+    uint8_t submit(const uint8_t *buffer)
+    {
+        uint8_t changed = 0;
+        for (int page = 0; page < PAGES; page++)
+        {
+            const uint8_t *source = buffer + page * PAGE_SIZE;
+            uint8_t *target = frame + page * PAGE_SIZE;
+            if (memcmp(source, target, PAGE_SIZE) != 0)
+            {
+                memcpy(target, source, PAGE_SIZE);
+                changed |= 1 << page;
+            }
+        }
+        dirty |= changed;
+        return changed;
+    }
+
+    // Copies the dirty pages to `out` (SIZE bytes) and returns their mask
+    uint8_t take(uint8_t *out)
+    {
+        uint8_t pages = dirty;
+        for (int page = 0; page < PAGES; page++)
+        {
+            if (pages & (1 << page))
+            {
+                memcpy(out + page * PAGE_SIZE, frame + page * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+        dirty = 0;
+        return pages;
+    }
+
+    uint8_t getDirtyPages() const { return dirty; }
+
+private:
+    uint8_t frame[SIZE];
+    uint8_t dirty;
+};
@@ -0,0 +1,108 @@
+#include "Esp32Hal.h"
+#include "Logger.h"
+
+Esp32Timer::Esp32Timer(Callback callback, void *arg) : handle(nullptr)
+{
+    esp_timer_create_args_t args = {};
+    args.callback = callback;
+    args.arg = arg;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "hal_timer";
+    esp_timer_create(&args, &handle);
+}
+
+Esp32Timer::~Esp32Timer()
+{
+    esp_timer_stop(handle);
+    esp_timer_delete(handle);
+}
+
+// In IRAM like esp_timer's own start and stop, so an interrupt may restart a timer
+void IRAM_ATTR Esp32Timer::start(uint32_t delayUs)
+{
+    esp_timer_stop(handle);
+    esp_timer_start_once(handle, delayUs);
+}
+
+void Esp32Timer::stop()
+{
+    esp_timer_stop(handle);
+}
+
+HalTimer *Esp32Clock::createTimer(HalTimer::Callback callback, void *arg)
+{
+    return new Esp32Timer(callback, arg);
+}
+
+Esp32Gpio::Esp32Gpio() : pwmPins(), pwmCount(0)
+{
+}
+
+bool Esp32Gpio::pwmWrite(int pin, float duty)
+{
+    uint8_t index = 0;
+    while (index < pwmCount && pwmPins[index] != pin)
+    {
+        index++;
+    }
+    if (index == pwmCount)
+    {
+        if (pwmCount == MAX_PWM_PINS)
+        {
+            LOG_ERROR("No PWM left for pin {}: {} pins already use it", pin, MAX_PWM_PINS);
+            return false;
+        }
+        pwms[index].attachPin(pin, PWM_FREQUENCY, PWM_BITS);
+        if (!pwms[index].attached())
+        {
+            LOG_ERROR("No LEDC channel left for PWM on pin {}", pin);
+            return false;
+        }
+        pwmPins[pwmCount++] = pin;
+    }
+    pwms[index].writeScaled(constrain(duty, 0.0f, 1.0f));
+    return true;
+}
+
+Esp32ServoDriver::Esp32ServoDriver(int pin) : pin(pin)
+{
+}
+
+void Esp32ServoDriver::attach()
+{
+    servo.setPeriodHertz(50);    // Standard 50hz servo
+    servo.attach(pin, 500, 2400); // 500us-2400us pulse width range
+}
+
+void Esp32ServoDriver::detach()
+{
+    servo.detach();
+}
+
+void Esp32ServoDriver::write(int angle)
+{
+    servo.write(angle);
+}
+
+Esp32Storage::Esp32Storage(const char *name) : name(name)
+{
+}
+
+bool Esp32Storage::begin()
+{
+    return preferences.begin(name, false);
+}
+
+bool Esp32Storage::read(const char *key, void *data, size_t size)
+{
+    if (preferences.getBytesLength(key) != size)
+    {
+        return false;
+    }
+    return preferences.getBytes(key, data, size) == size;
+}
+
+bool Esp32Storage::write(const char *key, const void *data, size_t size)
+{
+    return preferences.putBytes(key, data, size) == size;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <ESP32Servo.h>
+#include <Preferences.h>
+#include <esp_timer.h>
+#include "Hal.h"
+
+class Esp32Timer : public HalTimer
+{
+public:
+    Esp32Timer(Callback callback, void *arg);
+    ~Esp32Timer();
+    void IRAM_ATTR start(uint32_t delayUs) override;
+    void stop() override;
+
+private:
+    esp_timer_handle_t handle;
+};
+
+class Esp32Clock : public HalClock
+{
+public:
+    uint32_t millis() override { return ::millis(); }
+    uint64_t micros() override { return esp_timer_get_time(); }
+    void delay(uint32_t ms) override { ::delay(ms); }
+    HalTimer *createTimer(HalTimer::Callback callback, void *arg) override;
+};
+
+// PWM pins run on the LEDC through ESP32Servo's ESP32PWM, which hands out
+// the channels and timers, so they never collide with the servos' 50Hz ones.
+// Up to ESP32PWM's channel count (16 LEDC channels on the ESP32), less the
+// servos attached at the time.
+class Esp32Gpio : public HalGpio
+{
+public:
+    static const uint32_t PWM_FREQUENCY = 20000; // Above hearing, for the motor drivers
+    static const uint8_t PWM_BITS = 10;
+    static const uint8_t MAX_PWM_PINS = NUM_PWM;
+
+    Esp32Gpio();
+    void pinMode(int pin, int mode) override { ::pinMode(pin, mode); }
+    void digitalWrite(int pin, int level) override { ::digitalWrite(pin, level); }
+    int digitalRead(int pin) override { return ::digitalRead(pin); }
+    bool pwmWrite(int pin, float duty) override;
+
+private:
+    ESP32PWM pwms[MAX_PWM_PINS];
+    int pwmPins[MAX_PWM_PINS];
+    uint8_t pwmCount;
+};
+
+// The chip's internal sensor: it follows the temperature inside the
+// enclosure, which is what drifts the load cell and the HX711
+class Esp32Thermometer : public HalThermometer
+{
+public:
+    float read() override { return temperatureRead(); }
+};
+
+class Esp32ServoDriver : public HalServo
+{
+public:
+    Esp32ServoDriver(int pin);
+    void attach() override;
+    void detach() override;
+    void write(int angle) override;
+
+private:
+    Servo servo;
+    int pin;
+};
+
+// NVS-backed storage, one namespace for the whole application
+class Esp32Storage : public HalStorage
+{
+public:
+    Esp32Storage(const char *name = "dosing");
+    bool begin() override;
+    bool read(const char *key, void *data, size_t size) override;
+    bool write(const char *key, const void *data, size_t size) override;
+
+private:
+    Preferences preferences;
+    const char *name;
+};
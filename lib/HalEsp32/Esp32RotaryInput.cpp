@@ -0,0 +1,64 @@
+#include "Esp32RotaryInput.h"
+
+Esp32RotaryInput::Esp32RotaryInput(int pinA, int pinB, int buttonPin)
+    : pinA(pinA), pinB(pinB), buttonPin(buttonPin), settleTimer(nullptr), listener(nullptr), listenerArg(nullptr)
+{
+}
+
+Esp32RotaryInput::~Esp32RotaryInput()
+{
+    delete settleTimer;
+}
+
+void Esp32RotaryInput::begin(Listener listener, void *arg)
+{
+    listenerArg = arg;
+    this->listener = listener;
+    pinMode(pinA, INPUT_PULLUP);
+    pinMode(pinB, INPUT_PULLUP);
+    pinMode(buttonPin, INPUT_PULLUP);
+    settleTimer = Hal::clock().createTimer(onButtonSettled, this);
+    decoder.begin(readChannels());
+
+    attachInterruptArg(digitalPinToInterrupt(pinA), onEncoderEdge, this, CHANGE);
+    attachInterruptArg(digitalPinToInterrupt(pinB), onEncoderEdge, this, CHANGE);
+    attachInterruptArg(digitalPinToInterrupt(buttonPin), onButtonEdge, this, CHANGE);
+}
+
+void IRAM_ATTR Esp32RotaryInput::onEncoderEdge(void *arg)
+{
+    Esp32RotaryInput *input = static_cast<Esp32RotaryInput *>(arg);
+    if (input->decoder.update(input->readChannels(), micros()))
+    {
+        input->notify();
+    }
+}
+
+void IRAM_ATTR Esp32RotaryInput::onButtonEdge(void *arg)
+{
+    Esp32RotaryInput *input = static_cast<Esp32RotaryInput *>(arg);
+    input->debouncer.onEdge(millis());
+    input->settleTimer->start(ButtonDebouncer::SETTLE_US);
+}
+
+void Esp32RotaryInput::onButtonSettled(void *arg)
+{
+    Esp32RotaryInput *input = static_cast<Esp32RotaryInput *>(arg);
+    if (input->debouncer.settle(digitalRead(input->buttonPin) == LOW))
+    {
+        input->notify();
+    }
+}
+
+uint8_t IRAM_ATTR Esp32RotaryInput::readChannels() const
+{
+    return (digitalRead(pinA) << 1) | digitalRead(pinB);
+}
+
+void IRAM_ATTR Esp32RotaryInput::notify()
+{
+    if (listener)
+    {
+        listener(listenerArg);
+    }
+}
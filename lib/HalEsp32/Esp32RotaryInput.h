@@ -0,0 +1,35 @@
+#pragma once
+#include "ButtonDebouncer.h"
+#include "Hal.h"
+#include "RotaryDecoder.h"
+
+// Encoder and button on GPIO interrupts: both encoder channels interrupt on
+// every edge and are decoded in the handler, the button's edges restart an
+// esp_timer that takes its level once it stopped bouncing. The button is
+// active low, with a pull-up on the board.
+class Esp32RotaryInput : public HalInput
+{
+public:
+    Esp32RotaryInput(int pinA, int pinB, int buttonPin);
+    ~Esp32RotaryInput();
+    void begin(Listener listener, void *arg) override;
+    int32_t getPosition() override { return decoder.getPosition(); }
+    int32_t getAcceleratedPosition() override { return decoder.getAcceleratedPosition(); }
+    bool pollButton(ButtonEdge &edge) override { return debouncer.poll(edge); }
+
+private:
+    static void IRAM_ATTR onEncoderEdge(void *arg);
+    static void IRAM_ATTR onButtonEdge(void *arg);
+    static void onButtonSettled(void *arg);
+    uint8_t IRAM_ATTR readChannels() const;
+    void IRAM_ATTR notify();
+
+    int pinA;
+    int pinB;
+    int buttonPin;
+    RotaryDecoder decoder;
+    ButtonDebouncer debouncer;
+    HalTimer *settleTimer;
+    Listener listener;
+    void *listenerArg;
+};
@@ -0,0 +1,59 @@
+#include "Hx711LoadCell.h"
+
+Hx711LoadCell::Hx711LoadCell(int dataPin, int clockPin)
+    : dataPin(dataPin), clockPin(clockPin), callback(nullptr), callbackArg(nullptr)
+{
+}
+
+void Hx711LoadCell::begin(SampleCallback callback, void *arg)
+{
+    this->callback = callback;
+    this->callbackArg = arg;
+    pinMode(clockPin, OUTPUT);
+    digitalWrite(clockPin, LOW);
+    pinMode(dataPin, INPUT);
+
+    // DOUT goes low when a conversion is ready
+    attachInterruptArg(digitalPinToInterrupt(dataPin), onDataReady, this, FALLING);
+}
+
+void IRAM_ATTR Hx711LoadCell::onDataReady(void *arg)
+{
+    Hx711LoadCell *loadCell = static_cast<Hx711LoadCell *>(arg);
+
+    // Clocking the conversion out toggles DOUT and re-triggers this handler;
+    // those edges are ignored because DOUT is high again after the read.
+    if (digitalRead(loadCell->dataPin) != LOW)
+    {
+        return;
+    }
+
+    uint32_t timestampUs = micros();
+    int32_t raw = loadCell->readConversion();
+    loadCell->callback(loadCell->callbackArg, raw, timestampUs);
+}
+
+int32_t IRAM_ATTR Hx711LoadCell::readConversion()
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 24; i++)
+    {
+        digitalWrite(clockPin, HIGH);
+        delayMicroseconds(1);
+        value = (value << 1) | digitalRead(dataPin);
+        digitalWrite(clockPin, LOW);
+        delayMicroseconds(1);
+    }
+
+    // 25th pulse selects channel A, gain 128 for the next conversion
+    digitalWrite(clockPin, HIGH);
+    delayMicroseconds(1);
+    digitalWrite(clockPin, LOW);
+
+    // Sign-extend the 24-bit two's complement value
+    if (value & 0x800000)
+    {
+        value |= 0xFF000000;
+    }
+    return static_cast<int32_t>(value);
+}
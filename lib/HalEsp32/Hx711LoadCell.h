@@ -0,0 +1,20 @@
+#pragma once
+#include "Hal.h"
+
+// HX711 read from the DOUT data-ready interrupt. Each conversion is clocked
+// out inside the ISR and handed to the sample callback with its timestamp.
+class Hx711LoadCell : public HalLoadCell
+{
+public:
+    Hx711LoadCell(int dataPin, int clockPin);
+    void begin(SampleCallback callback, void *arg) override;
+
+private:
+    static void IRAM_ATTR onDataReady(void *arg);
+    int32_t IRAM_ATTR readConversion();
+
+    int dataPin;
+    int clockPin;
+    SampleCallback callback;
+    void *callbackArg;
+};
@@ -0,0 +1,138 @@
+#include "Ssd1306Display.h"
+#include "Profiler.h"
+
+Ssd1306Display::Ssd1306Display(int sdaPin, int sclPin, int transferCore)
+    : display(WIDTH, HEIGHT, &Wire, OLED_RESET), sdaPin(sdaPin), sclPin(sclPin), transferCore(transferCore),
+      frameLock(nullptr), transferHandle(nullptr), lastFrameMs(0)
+{
+}
+
+bool Ssd1306Display::begin()
+{
+    Wire.begin(sdaPin, sclPin);
+    if (!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS))
+    {
+        return false;
+    }
+
+    display.clearDisplay();
+    display.setRotation(2);
+    display.setTextColor(SSD1306_WHITE);
+
+    // From here on only the transfer task uses the bus
+    Wire.setClock(I2C_CLOCK);
+    frameLock = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(transferTask, "display", 2048, this, 1, &transferHandle, transferCore);
+    return true;
+}
+
+void Ssd1306Display::clear()
+{
+    display.clearDisplay();
+}
+
+void Ssd1306Display::setTextSize(uint8_t size)
+{
+    display.setTextSize(size);
+}
+
+void Ssd1306Display::setCursor(int16_t x, int16_t y)
+{
+    display.setCursor(x, y);
+}
+
+void Ssd1306Display::print(const char *text)
+{
+    display.print(text);
+}
+
+void Ssd1306Display::print(float value, int digits)
+{
+    display.print(value, digits);
+}
+
+void Ssd1306Display::println(const char *text)
+{
+    display.println(text);
+}
+
+void Ssd1306Display::drawFastHLine(int16_t x, int16_t y, int16_t width)
+{
+    display.drawFastHLine(x, y, width, SSD1306_WHITE);
+}
+
+void Ssd1306Display::drawRect(int16_t x, int16_t y, int16_t width, int16_t height)
+{
+    display.drawRect(x, y, width, height, SSD1306_WHITE);
+}
+
+void Ssd1306Display::fillRect(int16_t x, int16_t y, int16_t width, int16_t height)
+{
+    display.fillRect(x, y, width, height, SSD1306_WHITE);
+}
+
+void Ssd1306Display::show()
+{
+    xSemaphoreTake(frameLock, portMAX_DELAY);
+    uint8_t changed = frame.submit(display.getBuffer());
+    xSemaphoreGive(frameLock);
+    if (changed)
+    {
+        xTaskNotifyGive(transferHandle);
+    }
+}
+
+void Ssd1306Display::transferTask(void *arg)
+{
+    Ssd1306Display *self = static_cast<Ssd1306Display *>(arg);
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t elapsed = millis() - self->lastFrameMs;
+        if (elapsed < MIN_FRAME_INTERVAL_MS)
+        {
+            vTaskDelay(pdMS_TO_TICKS(MIN_FRAME_INTERVAL_MS - elapsed));
+        }
+        {
+            ProfileScope profile(Profiler::DISPLAY_TRANSFER);
+            self->transferPages();
+        }
+        self->lastFrameMs = millis();
+    }
+}
+
+void Ssd1306Display::transferPages()
+{
+    xSemaphoreTake(frameLock, portMAX_DELAY);
+    uint8_t pages = frame.take(transferBuffer);
+    xSemaphoreGive(frameLock);
+
+    for (int page = 0; page < PagedFrame::PAGES; page++)
+    {
+        if (!(pages & (1 << page)))
+        {
+            continue;
+        }
+        // Horizontal addressing (set by begin()): one page, all columns
+        display.ssd1306_command(SSD1306_PAGEADDR);
+        display.ssd1306_command(page);
+        display.ssd1306_command(page);
+        display.ssd1306_command(SSD1306_COLUMNADDR);
+        display.ssd1306_command(0);
+        display.ssd1306_command(WIDTH - 1);
+
+        const uint8_t *data = transferBuffer + page * PagedFrame::PAGE_SIZE;
+        for (size_t sent = 0; sent < PagedFrame::PAGE_SIZE; sent += I2C_CHUNK)
+        {
+            size_t count = PagedFrame::PAGE_SIZE - sent;
+            if (count > I2C_CHUNK)
+            {
+                count = I2C_CHUNK;
+            }
+            Wire.beginTransmission(SCREEN_ADDRESS);
+            Wire.write(0x40); // Co = 0, D/C = 1: data follows
+            Wire.write(data + sent, count);
+            Wire.endTransmission();
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <Adafruit_GFX.h>
+#include <Adafruit_SSD1306.h>
+#include <Wire.h>
+#include "Hal.h"
+#include "PagedFrame.h"
+
+// Drawing goes to the Adafruit framebuffer as before, but show() does not
+// touch the bus: it records the changed 128-byte pages and wakes a transfer
+// task on `transferCore`, which sends only those pages at most once every
+// MIN_FRAME_INTERVAL_MS. Frames drawn faster than that coalesce.
+class Ssd1306Display : public HalDisplay
+{
+public:
+    static const uint32_t MIN_FRAME_INTERVAL_MS = 50;
+
+    Ssd1306Display(int sdaPin, int sclPin, int transferCore = 0);
+    bool begin() override;
+    void clear() override;
+    void setTextSize(uint8_t size) override;
+    void setCursor(int16_t x, int16_t y) override;
+    void print(const char *text) override;
+    void print(float value, int digits) override;
+    void println(const char *text) override;
+    void drawFastHLine(int16_t x, int16_t y, int16_t width) override;
+    void drawRect(int16_t x, int16_t y, int16_t width, int16_t height) override;
+    void fillRect(int16_t x, int16_t y, int16_t width, int16_t height) override;
+    void show() override;
+
+private:
+    static const int OLED_RESET = -1;
+    static const int SCREEN_ADDRESS = 0x3C;
+    static const uint32_t I2C_CLOCK = 400000;
+    static const size_t I2C_CHUNK = 31; // Data bytes per transmission, after the control byte
+
+    static void transferTask(void *arg);
+    void transferPages();
+
+    Adafruit_SSD1306 display;
+    int sdaPin;
+    int sclPin;
+    int transferCore;
+    PagedFrame frame;     // Guarded by frameLock
+    uint8_t transferBuffer[PagedFrame::SIZE];
+    SemaphoreHandle_t frameLock;
+    TaskHandle_t transferHandle;
+    uint32_t lastFrameMs;
+};
@@ -1,13 +1,179 @@
 #include "Logger.h"
+#include <stdio.h>
+#include <string.h>
+#include "Profiler.h"
 
-void Logger::log(const String &message, LogLevel level)
+namespace
 {
-    String timestamp = String(millis());
-    String logMessage = "[" + timestamp + "] " + getLogLevelString(level) + ": " + message;
-    Serial.println(logMessage);
+    void defaultSink(const char *line)
+    {
+#ifdef ARDUINO
+        Serial.println(line);
+#else
+        puts(line);
+#endif
+    }
+
+#ifdef ARDUINO
+    const uint32_t DRAIN_INTERVAL_MS = 20;
+
+    void drainTask(void *)
+    {
+        for (;;)
+        {
+            Logger::drain();
+            vTaskDelay(pdMS_TO_TICKS(DRAIN_INTERVAL_MS));
+        }
+    }
+#endif
+}
+
+BoundedQueue<Logger::Record, Logger::QUEUE_SIZE> Logger::queue;
+std::atomic<uint32_t> Logger::dropped(0);
+Logger::LogLevel Logger::minimumLevel = Logger::INFO;
+#ifdef ARDUINO
+bool Logger::inlineDrain = false;
+#else
+bool Logger::inlineDrain = true;
+#endif
+Logger::Sink Logger::sink = defaultSink;
+
+void Logger::begin(int core)
+{
+#ifdef ARDUINO
+    // Just above idle: the UART write never delays the control loop
+    if (core < 0)
+    {
+        xTaskCreate(drainTask, "logger", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr);
+    }
+    else
+    {
+        xTaskCreatePinnedToCore(drainTask, "logger", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr, core);
+    }
+#else
+    (void)core;
+#endif
+}
+
+size_t Logger::drain(size_t maxRecords)
+{
+    ProfileScope profile(Profiler::LOG_DRAIN);
+    static uint32_t reportedDropped = 0;
+    char line[LINE_LENGTH];
+    size_t drained = 0;
+
+    Record record;
+    while (drained < maxRecords && queue.tryPop(record))
+    {
+        format(record, line, sizeof(line));
+        sink(line);
+        drained++;
+    }
+
+    uint32_t droppedNow = getDroppedCount();
+    if (droppedNow != reportedDropped)
+    {
+        snprintf(line, sizeof(line), "[%lu] WARNING: %lu log records dropped",
+                 static_cast<unsigned long>(Hal::millis()), static_cast<unsigned long>(droppedNow - reportedDropped));
+        sink(line);
+        reportedDropped = droppedNow;
+    }
+    return drained;
+}
+
+void Logger::setSink(Sink newSink)
+{
+    sink = newSink ? newSink : defaultSink;
+}
+
+void Logger::setMinimumLevel(LogLevel level)
+{
+    minimumLevel = level;
+}
+
+void Logger::addInt(Record &record, int32_t value)
+{
+    record.types[record.argCount] = ARG_INT;
+    record.args[record.argCount++].i = value;
+}
+
+void Logger::addUint(Record &record, uint32_t value)
+{
+    record.types[record.argCount] = ARG_UINT;
+    record.args[record.argCount++].u = value;
+}
+
+void Logger::addFloat(Record &record, float value)
+{
+    record.types[record.argCount] = ARG_FLOAT;
+    record.args[record.argCount++].f = value;
 }
 
-String Logger::getLogLevelString(LogLevel level)
+void Logger::addText(Record &record, const char *value)
+{
+    record.types[record.argCount++] = ARG_TEXT;
+    if (record.text[0] == '\0' && value)
+    {
+        strncpy(record.text, value, TEXT_LENGTH - 1);
+        record.text[TEXT_LENGTH - 1] = '\0';
+    }
+}
+
+size_t Logger::format(const Record &record, char *line, size_t size)
+{
+    int written = snprintf(line, size, "[%lu] %s: ", static_cast<unsigned long>(record.timestampMs),
+                           getLogLevelString(record.level));
+    size_t length = written > 0 ? static_cast<size_t>(written) : 0;
+    uint8_t arg = 0;
+    bool textUsed = false;
+
+    for (const char *c = record.format; *c && length + 1 < size; c++)
+    {
+        if (c[0] != '{' || c[1] != '}')
+        {
+            line[length++] = *c;
+            continue;
+        }
+        c++;
+
+        char *out = line + length;
+        size_t room = size - length;
+        if (arg >= record.argCount)
+        {
+            written = snprintf(out, room, "{}");
+        }
+        else
+        {
+            switch (record.types[arg])
+            {
+            case ARG_INT:
+                written = snprintf(out, room, "%ld", static_cast<long>(record.args[arg].i));
+                break;
+            case ARG_UINT:
+                written = snprintf(out, room, "%lu", static_cast<unsigned long>(record.args[arg].u));
+                break;
+            case ARG_FLOAT:
+                written = snprintf(out, room, "%.2f", record.args[arg].f);
+                break;
+            case ARG_TEXT:
+                written = snprintf(out, room, "%s", textUsed ? "?" : record.text);
+                textUsed = true;
+                break;
+            }
+            arg++;
+        }
+        length += written > 0 ? static_cast<size_t>(written) : 0;
+    }
+
+    if (length >= size)
+    {
+        length = size - 1;
+    }
+    line[length] = '\0';
+    return length;
+}
+
+const char *Logger::getLogLevelString(uint8_t level)
 {
     switch (level)
     {
@@ -20,4 +186,4 @@ String Logger::getLogLevelString(LogLevel level)
     default:
         return "UNKNOWN";
     }
-}
\ No newline at end of file
+}
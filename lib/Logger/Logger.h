@@ -1,8 +1,43 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
-#include <Arduino.h>
+#include <atomic>
+#include "Hal.h"
+#include "BoundedQueue.h"
 
+// Levels below LOG_MIN_LEVEL are compiled out, arguments included:
+// 0 = INFO, 1 = WARNING, 2 = ERROR, 3 = nothing. Set with -DLOG_MIN_LEVEL=n.
+// A disabled call is still type-checked but never evaluated.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+#define LOG_DISABLED(level, ...) do { if (false) Logger::log(level, __VA_ARGS__); } while (0)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_INFO(...) Logger::log(Logger::INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_DISABLED(Logger::INFO, __VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 1
+#define LOG_WARNING(...) Logger::log(Logger::WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) LOG_DISABLED(Logger::WARNING, __VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL <= 2
+#define LOG_ERROR(...) Logger::log(Logger::ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_DISABLED(Logger::ERROR, __VA_ARGS__)
+#endif
+
+// Deferred logger. log() only copies the format pointer and its arguments
+// into a fixed-size record in a lock-free queue; formatting and the UART
+// write happen later in drain(), on a low-priority task on the device. The
+// caller never allocates and never blocks: when the queue is full the record
+// is dropped and counted.
+//
+// The format must be a string literal; each {} is replaced by the next
+// argument. Numbers are stored as is, at most one string argument is copied
+// (truncated to TEXT_LENGTH - 1 characters).
 class Logger
 {
 public:
@@ -13,10 +48,108 @@ public:
         ERROR
     };
 
-    static void log(const String &message, LogLevel level = INFO);
+    typedef void (*Sink)(const char *line);
+
+    static const size_t QUEUE_SIZE = 64;
+    static const uint8_t MAX_ARGS = 4;
+    static const size_t TEXT_LENGTH = 16;
+    static const size_t LINE_LENGTH = 160;
+
+    template <typename... Args>
+    static void log(LogLevel level, const char *format, Args... args)
+    {
+        if (level < minimumLevel)
+        {
+            return;
+        }
+        Record *record = queue.reserve();
+        if (!record)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        record->timestampMs = Hal::millis();
+        record->level = level;
+        record->format = format;
+        record->argCount = 0;
+        record->text[0] = '\0';
+        pack(*record, args...);
+        queue.commit(record);
+
+        if (inlineDrain)
+        {
+            drain();
+        }
+    }
+
+    // Starts the background drain task on the device, pinned to `core` if
+    // given. On the host, records are drained inline by log() unless
+    // setInlineDrain(false) is called.
+    static void begin(int core = -1);
+    static size_t drain(size_t maxRecords = QUEUE_SIZE);
+    static void setInlineDrain(bool enabled) { inlineDrain = enabled; }
+    static void setSink(Sink sink);
+    static void setMinimumLevel(LogLevel level);
+    static uint32_t getDroppedCount() { return dropped.load(std::memory_order_relaxed); }
 
 private:
-    static String getLogLevelString(LogLevel level);
+    enum ArgType : uint8_t
+    {
+        ARG_INT,
+        ARG_UINT,
+        ARG_FLOAT,
+        ARG_TEXT
+    };
+
+    struct Record
+    {
+        uint32_t timestampMs;
+        const char *format;
+        uint8_t level;
+        uint8_t argCount;
+        ArgType types[MAX_ARGS];
+        union
+        {
+            int32_t i;
+            uint32_t u;
+            float f;
+        } args[MAX_ARGS];
+        char text[TEXT_LENGTH];
+    };
+
+    static void pack(Record &) {}
+    template <typename T, typename... Rest>
+    static void pack(Record &record, T value, Rest... rest)
+    {
+        if (record.argCount < MAX_ARGS)
+        {
+            addArg(record, value);
+        }
+        pack(record, rest...);
+    }
+
+    static void addArg(Record &record, int value) { addInt(record, value); }
+    static void addArg(Record &record, long value) { addInt(record, value); }
+    static void addArg(Record &record, long long value) { addInt(record, static_cast<int32_t>(value)); }
+    static void addArg(Record &record, unsigned int value) { addUint(record, value); }
+    static void addArg(Record &record, unsigned long value) { addUint(record, value); }
+    static void addArg(Record &record, unsigned long long value) { addUint(record, static_cast<uint32_t>(value)); }
+    static void addArg(Record &record, double value) { addFloat(record, value); }
+    static void addArg(Record &record, const char *value) { addText(record, value); }
+    static void addArg(Record &record, const String &value) { addText(record, value.c_str()); }
+    static void addInt(Record &record, int32_t value);
+    static void addUint(Record &record, uint32_t value);
+    static void addFloat(Record &record, float value);
+    static void addText(Record &record, const char *value);
+
+    static size_t format(const Record &record, char *line, size_t size);
+    static const char *getLogLevelString(uint8_t level);
+
+    static BoundedQueue<Record, QUEUE_SIZE> queue;
+    static std::atomic<uint32_t> dropped;
+    static LogLevel minimumLevel;
+    static bool inlineDrain;
+    static Sink sink;
 };
 
-#endif // LOGGER_H
\ No newline at end of file
+#endif // LOGGER_H
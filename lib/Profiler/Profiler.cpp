@@ -0,0 +1,211 @@
+#include "Profiler.h"
+#include <stdio.h>
+#include <string.h>
+#include "Hal.h"
+#ifndef ARDUINO
+#include <chrono>
+#endif
+
+namespace
+{
+#ifdef ARDUINO
+    uint32_t cycleCount()
+    {
+        return ESP.getCycleCount();
+    }
+    const Profiler::TickSource DEFAULT_TICK_SOURCE = cycleCount;
+    const uint32_t DEFAULT_TICKS_PER_US = F_CPU / 1000000;
+#else
+    uint32_t hostMicros()
+    {
+        using namespace std::chrono;
+        return static_cast<uint32_t>(duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count());
+    }
+    const Profiler::TickSource DEFAULT_TICK_SOURCE = hostMicros;
+    const uint32_t DEFAULT_TICKS_PER_US = 1;
+#endif
+
+    const char *const NAMES[] = {"control", "latency", "pump", "scale", "serial", "ui", "display", "log", "telemetry", "flash"};
+    static_assert(sizeof(NAMES) / sizeof(NAMES[0]) == Profiler::SECTION_COUNT, "One name per section");
+}
+
+Profiler::TickSource Profiler::tickSource = DEFAULT_TICK_SOURCE;
+uint32_t Profiler::ticksPerUs = DEFAULT_TICKS_PER_US;
+Profiler::Stats Profiler::stats[SECTION_COUNT];
+// A deadline may slip by a FreeRTOS tick; the drains run every 10ms. A flash
+// write holds up the control task like a late wake-up does.
+uint32_t Profiler::budgets[SECTION_COUNT] = {1000, 1000, 500, 200, 2000, 5000, 20000, 5000, 10000, 1000};
+volatile bool Profiler::resetRequested[SECTION_COUNT] = {};
+
+void Profiler::stop(Section section, uint32_t startTicks)
+{
+    record(section, (now() - startTicks) / ticksPerUs);
+}
+
+void Profiler::mark(Section section)
+{
+    Stats &s = stats[section];
+    uint32_t ticks = now();
+    if (s.marked)
+    {
+        record(section, (ticks - s.lastMark) / ticksPerUs);
+    }
+    s.lastMark = ticks;
+    s.marked = true;
+}
+
+void Profiler::record(Section section, uint32_t us)
+{
+    Stats &s = stats[section];
+    if (resetRequested[section])
+    {
+        clear(s);
+        resetRequested[section] = false;
+    }
+    s.count++;
+    s.totalUs += us;
+    if (s.count == 1 || us < s.minUs)
+    {
+        s.minUs = us;
+    }
+    if (us > s.maxUs)
+    {
+        s.maxUs = us;
+        s.maxAtMs = Hal::millis();
+    }
+    if (us > budgets[section])
+    {
+        s.overruns++;
+    }
+    s.histogram[bucketOf(us)]++;
+}
+
+void Profiler::setBudget(Section section, uint32_t us)
+{
+    budgets[section] = us;
+}
+
+void Profiler::setTickSource(TickSource source, uint32_t newTicksPerUs)
+{
+    tickSource = source ? source : DEFAULT_TICK_SOURCE;
+    ticksPerUs = source ? newTicksPerUs : DEFAULT_TICKS_PER_US;
+}
+
+void Profiler::reset()
+{
+    for (uint8_t i = 0; i < SECTION_COUNT; i++)
+    {
+        resetRequested[i] = true;
+    }
+}
+
+const char *Profiler::getName(Section section)
+{
+    return section < SECTION_COUNT ? NAMES[section] : "none";
+}
+
+Profiler::Report Profiler::getReport(Section section)
+{
+    Report report = {};
+    report.name = getName(section);
+    report.budgetUs = budgets[section];
+    const Stats &s = stats[section];
+    if (resetRequested[section] || s.count == 0)
+    {
+        return report;
+    }
+    report.count = s.count;
+    report.minUs = s.minUs;
+    report.averageUs = static_cast<uint32_t>(s.totalUs / s.count);
+    report.maxUs = s.maxUs;
+    report.maxAtMs = s.maxAtMs;
+    report.overruns = s.overruns;
+
+    // The top of the bucket the 99th percentile falls in
+    uint32_t rank = s.count - s.count / 100;
+    uint32_t seen = 0;
+    for (uint8_t b = 0; b < BUCKETS; b++)
+    {
+        seen += s.histogram[b];
+        if (seen >= rank)
+        {
+            uint32_t top = bucketTop(b);
+            report.p99Us = top < s.maxUs ? top : s.maxUs;
+            break;
+        }
+    }
+    return report;
+}
+
+Profiler::Section Profiler::getWorstOffender()
+{
+    Section worst = SECTION_COUNT;
+    float worstRatio = 1;
+    for (uint8_t i = 0; i < SECTION_COUNT; i++)
+    {
+        Report report = getReport(static_cast<Section>(i));
+        float ratio = static_cast<float>(report.maxUs) / report.budgetUs;
+        if (report.overruns > 0 && ratio > worstRatio)
+        {
+            worst = static_cast<Section>(i);
+            worstRatio = ratio;
+        }
+    }
+    return worst;
+}
+
+void Profiler::print(Writer writer)
+{
+    char line[160];
+    for (uint8_t i = 0; i < SECTION_COUNT; i++)
+    {
+        Report r = getReport(static_cast<Section>(i));
+        if (r.count == 0)
+        {
+            continue;
+        }
+        snprintf(line, sizeof(line), "PROFILE %s n=%lu min=%lu avg=%lu p99=%lu max=%lu@%lums budget=%lu over=%lu",
+                 r.name, static_cast<unsigned long>(r.count), static_cast<unsigned long>(r.minUs),
+                 static_cast<unsigned long>(r.averageUs), static_cast<unsigned long>(r.p99Us),
+                 static_cast<unsigned long>(r.maxUs), static_cast<unsigned long>(r.maxAtMs),
+                 static_cast<unsigned long>(r.budgetUs), static_cast<unsigned long>(r.overruns));
+        writer(line);
+    }
+    snprintf(line, sizeof(line), "PROFILE WORST %s", getName(getWorstOffender()));
+    writer(line);
+}
+
+// Below 4us one bucket per microsecond, above four per octave
+uint8_t Profiler::bucketOf(uint32_t us)
+{
+    if (us < BUCKETS_PER_OCTAVE)
+    {
+        return us;
+    }
+    uint8_t octave = 31 - __builtin_clz(us);
+    if (octave >= OCTAVES)
+    {
+        return BUCKETS - 1;
+    }
+    return (octave - 1) * BUCKETS_PER_OCTAVE + ((us >> (octave - 2)) & (BUCKETS_PER_OCTAVE - 1));
+}
+
+uint32_t Profiler::bucketTop(uint8_t bucket)
+{
+    if (bucket < BUCKETS_PER_OCTAVE)
+    {
+        return bucket;
+    }
+    uint8_t octave = bucket / BUCKETS_PER_OCTAVE + 1;
+    uint32_t sub = bucket % BUCKETS_PER_OCTAVE;
+    return ((BUCKETS_PER_OCTAVE + sub + 1) << (octave - 2)) - 1;
+}
+
+void Profiler::clear(Stats &s)
+{
+    bool marked = s.marked;
+    uint32_t lastMark = s.lastMark;
+    memset(&s, 0, sizeof(s));
+    s.marked = marked; // The next mark still measures from the last one
+    s.lastMark = lastMark;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Time spent in each subsystem call, against a budget. A ProfileScope
+// around the call reads a free-running tick counter on entry and exit, the
+// CPU cycle counter on the device; that is two counter reads and a few
+// adds, so the timers can stay in the release build.
+//
+// Each section keeps count, min, average and max, and a histogram with four
+// buckets per octave of microseconds, for percentiles within 19%, in fixed
+// memory. A call over its budget is counted as an overrun, and the time of
+// the longest one is kept. The worst offender is the section whose longest
+// call is furthest over its budget.
+//
+// A section is written by the one task that runs the call; other tasks may
+// read it for display while it changes. reset() only asks the writer to
+// start over with its next call.
+class Profiler
+{
+public:
+    enum Section : uint8_t
+    {
+        CONTROL_PASS,     // Everything the control task runs on one wake-up
+        CONTROL_LATENCY,  // How late the control task woke for a deadline
+        PUMP_UPDATE,      // PumpController::update(), all of one station
+        SCALE_UPDATE,     // ScaleModule::update(), part of PUMP_UPDATE
+        SERIAL_COMMANDS,  // Reading and answering serial commands
+        UI_UPDATE,        // Encoder, button and drawing a screen
+        DISPLAY_TRANSFER, // Changed pages over I2C
+        LOG_DRAIN,
+        TELEMETRY_DRAIN,  // Including the recording on flash
+        FLASH_WRITE,      // One recording block; both cores wait on the flash meanwhile
+        SECTION_COUNT
+    };
+
+    struct Report
+    {
+        const char *name;
+        uint32_t count;
+        uint32_t minUs;
+        uint32_t averageUs;
+        uint32_t p99Us;
+        uint32_t maxUs;
+        uint32_t maxAtMs; // Hal::millis() of the longest call
+        uint32_t budgetUs;
+        uint32_t overruns;
+    };
+
+    typedef uint32_t (*TickSource)();
+    typedef void (*Writer)(const char *line);
+
+    static const uint8_t BUCKETS_PER_OCTAVE = 4;
+    static const uint8_t OCTAVES = 24; // Up to 16s
+    static const uint8_t BUCKETS = OCTAVES * BUCKETS_PER_OCTAVE;
+
+    static uint32_t now() { return tickSource(); }
+    static void stop(Section section, uint32_t startTicks); // Records now() - startTicks
+    static void mark(Section section);                      // Records the time since the last mark
+    static void record(Section section, uint32_t us);
+
+    static void setBudget(Section section, uint32_t us);
+    // The cycle counter on the device, a monotonic clock on the host; nullptr restores it
+    static void setTickSource(TickSource source, uint32_t ticksPerUs = 1);
+    static void reset();
+
+    static const char *getName(Section section);
+    static Report getReport(Section section);
+    static Section getWorstOffender(); // SECTION_COUNT while every call kept its budget
+    // One line per section that ran, then the worst offender
+    static void print(Writer writer);
+
+private:
+    struct Stats
+    {
+        uint32_t count;
+        uint32_t minUs;
+        uint32_t maxUs;
+        uint32_t maxAtMs;
+        uint32_t overruns;
+        uint64_t totalUs;
+        uint32_t lastMark; // Ticks, sections timed with mark() only
+        bool marked;
+        uint32_t histogram[BUCKETS];
+    };
+
+    static uint8_t bucketOf(uint32_t us);
+    static uint32_t bucketTop(uint8_t bucket);
+    static void clear(Stats &stats);
+
+    static TickSource tickSource;
+    static uint32_t ticksPerUs;
+    static Stats stats[SECTION_COUNT];
+    static uint32_t budgets[SECTION_COUNT];
+    static volatile bool resetRequested[SECTION_COUNT];
+};
+
+// Times its own lifetime into a section
+class ProfileScope
+{
+public:
+    explicit ProfileScope(Profiler::Section section) : section(section), startTicks(Profiler::now()) {}
+    ~ProfileScope() { Profiler::stop(section, startTicks); }
+
+private:
+    Profiler::Section section;
+    uint32_t startTicks;
+};
@@ -0,0 +1,170 @@
+#include "FlushEngine.h"
+#include "Logger.h"
+#include <math.h>
+
+FlushEngine::FlushEngine()
+    : sampler(nullptr), targetVolume(0), startUs(0), lastSampleCount(0), baseline(0), baselinePending(false),
+      measured(false), finished(false),
+      primeTimeMs(0), volume(0), flowRate(DEFAULT_FLOW_RATE), recordCount(0), lastRecordUs(0)
+{
+}
+
+void FlushEngine::start(WeightSampler *sampler, float targetVolume, uint32_t pumpStartUs)
+{
+    this->sampler = sampler;
+    this->targetVolume = targetVolume;
+    startUs = pumpStartUs;
+    lastSampleCount = sampler->getSampleCount();
+    // Right after boot there is nothing to average yet; the first conversion
+    // still comes long before the water
+    baselinePending = !sampler->hasSamples();
+    baseline = baselinePending ? 0 : sampler->getFilteredWeight();
+    measured = false;
+    finished = false;
+    primeTimeMs = 0;
+    volume = 0;
+    recordCount = 0;
+    lastRecordUs = startUs;
+    LOG_INFO("Flushing {}g of water", targetVolume);
+}
+
+bool FlushEngine::update()
+{
+    uint32_t count = sampler->getSampleCount();
+    if (count != lastSampleCount)
+    {
+        lastSampleCount = count;
+        measure();
+    }
+    if (finished)
+    {
+        return true;
+    }
+    if (!measured)
+    {
+        int32_t pumpedUs = static_cast<int32_t>(Hal::micros() - startUs);
+        volume = pumpedUs > 0 ? flowRate * pumpedUs / 1e6f : 0;
+    }
+    if (volume < targetVolume)
+    {
+        return false;
+    }
+
+    finished = true;
+    if (measured && recordCount >= MIN_RECORDS)
+    {
+        // Plain water by now; times without the scale are estimated with it
+        flowRate += LEARNING_RATE * (records[recordCount - 1].flowRate - flowRate);
+    }
+    return true;
+}
+
+void FlushEngine::measure()
+{
+    if (baselinePending)
+    {
+        baseline = sampler->getWeight();
+        baselinePending = false;
+    }
+
+    // Least-squares line through the newest conversions taken since the pump started
+    WeightSampler::Sample buffer[RATE_WINDOW];
+    size_t n = sampler->getLatestSamples(buffer, RATE_WINDOW);
+    size_t first = 0;
+    while (first < n && static_cast<int32_t>(buffer[first].timestampUs - startUs) < 0)
+    {
+        first++;
+    }
+    size_t used = n - first;
+    if (used < RATE_WINDOW / 4)
+    {
+        return;
+    }
+
+    uint32_t originUs = buffer[first].timestampUs;
+    float sumT = 0, sumW = 0;
+    for (size_t i = first; i < n; i++)
+    {
+        sumT += (buffer[i].timestampUs - originUs) / 1e6f;
+        sumW += sampler->toGrams(buffer[i].raw);
+    }
+    float meanT = sumT / used;
+    float meanW = sumW / used;
+    float covariance = 0, varianceT = 0;
+    for (size_t i = first; i < n; i++)
+    {
+        float dt = (buffer[i].timestampUs - originUs) / 1e6f - meanT;
+        covariance += dt * (sampler->toGrams(buffer[i].raw) - meanW);
+        varianceT += dt * dt;
+    }
+    if (varianceT <= 0)
+    {
+        return;
+    }
+    float rate = covariance / varianceT;
+    uint32_t newestUs = buffer[n - 1].timestampUs;
+
+    if (!measured)
+    {
+        // A few noisy conversions can fit a steep line; the rate has to stand out of its own error
+        float residuals = 0;
+        for (size_t i = first; i < n; i++)
+        {
+            float dt = (buffer[i].timestampUs - originUs) / 1e6f - meanT;
+            float residual = sampler->toGrams(buffer[i].raw) - meanW - rate * dt;
+            residuals += residual * residual;
+        }
+        float rateError = sqrtf(residuals / (used - 2) / varianceT);
+        if (rate < MIN_MEASURED_FLOW || rate < MIN_RATE_SIGNIFICANCE * rateError)
+        {
+            return;
+        }
+        measured = true;
+        primeTimeMs = (newestUs - startUs) / 1000;
+        LOG_INFO("Flush water on the scale after {}ms", primeTimeMs);
+    }
+
+    // The fitted line at the newest conversion, less noisy than the conversion itself
+    float newestT = (newestUs - originUs) / 1e6f;
+    volume = meanW + rate * (newestT - meanT) - baseline;
+    if (used == RATE_WINDOW && newestUs - lastRecordUs >= RECORD_INTERVAL_US && recordCount < MAX_RECORDS)
+    {
+        records[recordCount++] = {volume, rate};
+        lastRecordUs = newestUs;
+    }
+}
+
+bool FlushEngine::findClearVolume(float &clearVolume) const
+{
+    if (!measured || recordCount < MIN_RECORDS)
+    {
+        return false;
+    }
+
+    // The line was clear from the first record after the last one off the final rate
+    float finalRate = records[recordCount - 1].flowRate;
+    uint8_t clear = 0;
+    for (uint8_t i = recordCount - 1; i > 0; i--)
+    {
+        if (fabsf(records[i - 1].flowRate - finalRate) > CLEAR_TOLERANCE * finalRate)
+        {
+            clear = i;
+            break;
+        }
+    }
+    clearVolume = records[clear].volume;
+    return true;
+}
+
+float FlushEngine::learnVolume(float volume) const
+{
+    float clearVolume;
+    if (!findClearVolume(clearVolume))
+    {
+        return volume;
+    }
+    float learned = volume + LEARNING_RATE * (clearVolume * VOLUME_MARGIN - volume);
+    learned = learned < MIN_VOLUME ? MIN_VOLUME : (learned > MAX_VOLUME ? MAX_VOLUME : learned);
+    LOG_INFO("Line clear after {}g; flush volume {}g -> {}g", clearVolume, volume, learned);
+    return learned;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "WeightSampler.h"
+
+// Runs one flush of the shared line by volume instead of by time, without
+// blocking. While the flush water lands on the scale, the volume is measured
+// from the weight-rate stream; otherwise it is estimated from the last measured
+// water flow. The flow rate is recorded along the way: a liquid left in the
+// line flows at its own rate, so once the rate stops changing the line is
+// clear, and the water it took until then is what the next flush of that
+// liquid needs, plus a margin.
+class FlushEngine
+{
+public:
+    static const uint8_t RATE_WINDOW = 20;           // Conversions per flow-rate fit
+    static const uint8_t MAX_RECORDS = 40;
+    static const uint8_t MIN_RECORDS = 6;            // Before the final flow rate can be trusted
+    static const uint32_t RECORD_INTERVAL_US = 500000;
+    static const uint32_t DRAIN_MS = 500;             // Valve stays open after the pump stops
+    static constexpr float DEFAULT_FLOW_RATE = 1.5;   // g/s of water until one is measured
+    static constexpr float MIN_MEASURED_FLOW = 0.3;   // g/s on the scale that counts as primed
+    static constexpr float MIN_RATE_SIGNIFICANCE = 5; // Standard errors of that rate, few conversions
+    static constexpr float CLEAR_TOLERANCE = 0.1;     // Of the final flow rate
+    static constexpr float VOLUME_MARGIN = 1.5;       // Flush volume per volume it took to clear
+    static constexpr float LEARNING_RATE = 0.5;
+    static constexpr float MIN_VOLUME = 2.0;          // g
+    static constexpr float MAX_VOLUME = 30.0;         // g
+
+    FlushEngine();
+    // pumpStartUs: when the pump starts, which may be a little after now
+    void start(WeightSampler *sampler, float targetVolume, uint32_t pumpStartUs);
+    // True once the target volume has passed; the pump can stop
+    bool update();
+
+    float getVolume() const { return volume; }
+    float getTargetVolume() const { return targetVolume; }
+    bool isMeasured() const { return measured; } // The flush water is seen on the scale
+    uint32_t getPrimeTimeMs() const { return primeTimeMs; }
+    float getFlowRate() const { return flowRate; }
+    // Flush volume for the liquid that was in the line, moved towards what
+    // this flush showed; unchanged if the flow was not seen on the scale
+    float learnVolume(float volume) const;
+
+private:
+    struct Record
+    {
+        float volume;
+        float flowRate;
+    };
+
+    void measure();
+    bool findClearVolume(float &clearVolume) const;
+
+    WeightSampler *sampler;
+    float targetVolume;
+    uint32_t startUs;
+    uint32_t lastSampleCount;
+    float baseline; // Weight before the pump started
+    bool baselinePending;
+    bool measured;
+    bool finished;
+    uint32_t primeTimeMs;
+    float volume;
+    float flowRate; // Water, kept from flush to flush
+    Record records[MAX_RECORDS];
+    uint8_t recordCount;
+    uint32_t lastRecordUs;
+};
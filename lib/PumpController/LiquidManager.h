@@ -1,28 +1,35 @@
 #pragma once
+#include <deque>
 #include <vector>
-#include <Arduino.h>
+#include "FlowModel.h"
+#include "Hal.h"
+#include "SampleHistory.h"
 #include "ServoSwitch.h"
 
-struct DataPoint
-{
-    unsigned long timestamp;
-    float weight;
-};
-
 class Liquid
 {
 public:
-    Liquid(const String &name, float targetAmount, ServoSwitch *switch_)
-        : name(name), targetAmount(targetAmount), switch_(switch_) {}
+    static const size_t HISTORY_SIZE = 32;
+    static constexpr float DEFAULT_FLUSH_VOLUME = 12.0; // g of water, 8s of the pump
+    typedef SampleHistory<HISTORY_SIZE>::Point DataPoint;
+
+    Liquid(const String &name, float targetAmount, ServoSwitch *switch_, uint8_t flushGroup = 0)
+        : name(name), targetAmount(targetAmount), switch_(switch_), flushGroup(flushGroup),
+          flushVolume(DEFAULT_FLUSH_VOLUME) {}
 
     String name;
     float targetAmount;
     ServoSwitch *switch_;
-    std::vector<DataPoint> dataPoints;
+    // Liquids of the same non-zero group may follow each other in the line
+    // without a flush in between; group 0 is always flushed out.
+    uint8_t flushGroup;
+    float flushVolume;   // Water that clears this liquid out of the line, learned by FlushEngine
+    FlowModel flowModel; // Learned from every dispense pulse of this liquid
+    SampleHistory<HISTORY_SIZE> dataPoints; // Dispensed weight over the last dose
 
     void addDataPoint(float weight)
     {
-        dataPoints.push_back({millis(), weight});
+        dataPoints.add(Hal::millis(), weight);
     }
 
     void clearDataPoints()
@@ -31,18 +38,48 @@ public:
     }
 };
 
-class LiquidManager
+struct RecipeStep
+{
+    Liquid *liquid;
+    float amount;
+};
+
+// Several liquids dispensed into one container as a single job. The steps
+// point into LiquidManager, so all liquids must be added before recipes.
+class Recipe
 {
 public:
-    static LiquidManager &getInstance()
+    static const uint8_t MAX_STEPS = 8;
+
+    Recipe(const String &name) : name(name), stepCount(0) {}
+
+    bool addStep(Liquid *liquid, float amount)
     {
-        static LiquidManager instance;
-        return instance;
+        if (!liquid || stepCount >= MAX_STEPS)
+        {
+            return false;
+        }
+        steps[stepCount++] = {liquid, amount};
+        return true;
     }
 
-    void addLiquid(const String &name, float targetAmount, ServoSwitch *switch_)
+    void clear()
     {
-        liquids.emplace_back(name, targetAmount, switch_);
+        stepCount = 0;
+    }
+
+    String name;
+    uint8_t stepCount;
+    RecipeStep steps[MAX_STEPS];
+};
+
+// The liquids and recipes of one station
+class LiquidManager
+{
+public:
+    void addLiquid(const String &name, float targetAmount, ServoSwitch *switch_, uint8_t flushGroup = 0)
+    {
+        liquids.emplace_back(name, targetAmount, switch_, flushGroup);
     }
 
     Liquid *getLiquid(int index)
@@ -67,7 +104,27 @@ public:
         return liquids.size();
     }
 
+    Recipe *addRecipe(const String &name)
+    {
+        recipes.emplace_back(name);
+        return &recipes.back();
+    }
+
+    Recipe *getRecipe(int index)
+    {
+        if (index >= 0 && index < recipes.size())
+        {
+            return &recipes[index];
+        }
+        return nullptr;
+    }
+
+    int getRecipeCount() const
+    {
+        return recipes.size();
+    }
+
 private:
-    LiquidManager() {}
     std::vector<Liquid> liquids;
+    std::deque<Recipe> recipes; // Stable addresses while recipes are added
 };
\ No newline at end of file
@@ -1,70 +1,197 @@
 #include "PumpController.h"
+#include "CalibrationStore.h"
 #include "Logger.h"
+#include "Profiler.h"
+#include "ScaleModule.h"
+#include "Telemetry.h"
 
 PumpController::PumpController(int pumpPin, ServoSwitch *flushSwitch)
-    : pumpPin(pumpPin), flushSwitch(flushSwitch), state(State::IDLE),
-      estimatedFlowRate(1.0), minFlowRate(0.8), maxFlowRate(10.0),
-      stabilizationTime(500), flushingTime(8000), lastDispensedAmount(0.0),
-      fraction(0.6) // Added fraction for partial dispensing
+    : pumpPin(pumpPin), pumpTimer(pumpPin), flushedLiquid(nullptr), flushSwitch(flushSwitch),
+      weightSampler(nullptr), calibrationStore(nullptr), scaleModule(nullptr), activeLiquid(nullptr), targetAmount(0),
+      activeRecipe(nullptr), singleDose(""), stepIndex(0), stepStartTime(0),
+      lineState(LineState::UNKNOWN), lineLiquid(nullptr), state(State::IDLE),
+      pumpActive(false), pulseDurationUs(0), lastPulseTimeUs(0), pulseStartUs(0),
+      pulsePending(false), profile{0.3, 1.5, 8.0}, fineDuty(1), fineCutoffPlanned(false),
+      lastFineTimeUs(0), cutoffWeightValid(false), cutoffWeight(0), cutoffWeightUs(0),
+      lastDispensedAmount(0.0), topUps(0), dispenseStartTime(0), stats(),
+      sessionOpen(false), sessionWeightValid(false), sessionWeight(0), sessionFlushWater(0), sessionLiquidCount(0)
 {
 }
 
-void PumpController::init(int scaleDataPin, int scaleClockPin)
+void PumpController::init(WeightSampler *weightSampler, CalibrationStore *calibrationStore, ScaleModule *scaleModule)
 {
-    pinMode(pumpPin, OUTPUT);
+    if (!pumpTimer.begin())
+    {
+        LOG_ERROR("Pump pin {} cannot be driven; dispensing is disabled", pumpPin);
+    }
     pumpOff();
     dispenseTime = 0;
-    scale.begin(scaleDataPin, scaleClockPin);
-    scale.set_scale(2111.45); // Use a calibration factor from calibrateScale()
-    scale.tare();
-    Logger::log("Pump controller initialized", Logger::INFO);
+    this->weightSampler = weightSampler;
+    this->calibrationStore = calibrationStore;
+    this->scaleModule = scaleModule;
+    weightSampler->tare(WEIGHT_SAMPLES);
+    LOG_INFO("Pump controller initialized");
+}
+
+bool PumpController::flush()
+{
+    if (state != State::IDLE)
+    {
+        LOG_WARNING("Pump is busy. Cannot flush.");
+        return false;
+    }
+    if (!pumpTimer.isReady())
+    {
+        LOG_ERROR("Pump pin {} cannot be driven. Cannot flush.", pumpPin);
+        return false;
+    }
+    LOG_INFO("Flushing pump...");
+    Telemetry::job(TelemetryFrame::JOB_FLUSH);
+    lastActionTime = Hal::millis();
+    setState(State::FLUSHING);
+    bool known = lineState == LineState::LIQUID;
+    startFlush(known ? lineLiquid : nullptr, known ? lineLiquid->flushVolume : Liquid::DEFAULT_FLUSH_VOLUME);
+    return true;
 }
 
-void PumpController::calibrateScale(float knownWeight)
+bool PumpController::dispense(Liquid *liquid)
 {
-    Logger::log("Place known weight on the scale...", Logger::INFO);
-    delay(5000);
-    long reading = scale.get_units(10);
-    float calibrationFactor = reading / knownWeight;
-    scale.set_scale(calibrationFactor);
-    Logger::log("Scale calibrated. Calibration factor: " + String(calibrationFactor), Logger::INFO);
+    return dispense(liquid, liquid->targetAmount);
 }
 
-void PumpController::flush()
+bool PumpController::dispense(Liquid *liquid, float amount)
 {
     if (state != State::IDLE)
     {
-        Logger::log("Pump is busy. Cannot flush.", Logger::WARNING);
-        return;
+        LOG_WARNING("Pump is busy. Cannot start new dispense operation.");
+        return false;
     }
-    Logger::log("Flushing pump...", Logger::INFO);
-    flushSwitch->open();
-    pumpOn();
-    delay(flushingTime);
-    pumpOff();
-    flushSwitch->close();
-    Logger::log("Pump flushed", Logger::INFO);
+    singleDose.clear();
+    singleDose.addStep(liquid, amount);
+    return dispense(&singleDose);
 }
 
-void PumpController::dispense(Liquid *liquid)
+bool PumpController::dispense(const Recipe *recipe)
 {
-    if (state == State::IDLE)
+    if (state != State::IDLE)
+    {
+        LOG_WARNING("Pump is busy. Cannot start new dispense operation.");
+        return false;
+    }
+    if (recipe->stepCount == 0)
+    {
+        LOG_WARNING("Recipe {} has no steps", recipe->name);
+        return false;
+    }
+    for (uint8_t i = 0; i < recipe->stepCount; i++)
+    {
+        const RecipeStep &step = recipe->steps[i];
+        if (!(step.amount > 0 && step.amount <= MAX_DOSE))
+        {
+            LOG_WARNING("Refusing to dispense {}g of {}", step.amount, step.liquid->name);
+            return false;
+        }
+    }
+    if (!pumpTimer.isReady())
+    {
+        LOG_ERROR("Pump pin {} cannot be driven. Cannot dispense.", pumpPin);
+        return false;
+    }
+
+    recordJob(recipe);
+    activeRecipe = recipe;
+    for (uint8_t i = 0; i < recipe->stepCount; i++)
+    {
+        stepStats[i] = DispenseStats();
+    }
+    planSteps();
+    stepIndex = 0;
+    stats = DispenseStats();
+    dispenseStartTime = Hal::millis();
+
+    activeLiquid = recipe->steps[stepOrder[0]].liquid;
+    targetAmount = recipe->steps[stepOrder[0]].amount;
+    bool continuing = continueSession();
+    if (needsFlush(activeLiquid))
     {
-        activeLiquid = liquid;
-        activeLiquid->clearDataPoints();
-        activeLiquid->addDataPoint(0);
-        lastDispensedAmount = 0.0;
-        remainingAmount = activeLiquid->targetAmount;
         startInitialFlushing();
     }
+    else if (continuing)
+    {
+        LOG_INFO("Container session goes on at {}g", sessionWeight);
+        startStep(sessionWeight);
+    }
+    else if (scaleModule && scaleModule->isZeroed())
+    {
+        LOG_INFO("Line already primed for {}, starting from the tracked zero", activeLiquid->name);
+        startStep(getCurrentWeight());
+    }
     else
     {
-        Logger::log("Pump is busy. Cannot start new dispense operation.", Logger::WARNING);
+        LOG_INFO("Line already primed for {}", activeLiquid->name);
+        startTare();
     }
+    return true;
+}
+
+void PumpController::planSteps()
+{
+    // Compatible liquids run back to back so the line is flushed once per
+    // group, starting with the group already in the line; otherwise the
+    // recipe order is kept.
+    uint8_t count = activeRecipe->stepCount;
+    bool placed[Recipe::MAX_STEPS] = {};
+    uint8_t planned = 0;
+    for (int8_t seed = -1; seed < count; seed++)
+    {
+        const Liquid *group = seed < 0 ? (lineState == LineState::LIQUID ? lineLiquid : nullptr)
+                                       : activeRecipe->steps[seed].liquid;
+        if (!group || (seed >= 0 && placed[seed]))
+        {
+            continue;
+        }
+        for (uint8_t i = 0; i < count; i++)
+        {
+            const Liquid *liquid = activeRecipe->steps[i].liquid;
+            if (!placed[i] && (liquid == group || (liquid->flushGroup != 0 && liquid->flushGroup == group->flushGroup)))
+            {
+                stepOrder[planned++] = i;
+                placed[i] = true;
+            }
+        }
+    }
+}
+
+bool PumpController::needsFlush(const Liquid *next) const
+{
+    switch (lineState)
+    {
+    case LineState::WATER:
+        return false;
+    case LineState::LIQUID:
+        return next != lineLiquid && (next->flushGroup == 0 || next->flushGroup != lineLiquid->flushGroup);
+    default:
+        return true;
+    }
+}
+
+const Liquid *PumpController::getNextLiquid() const
+{
+    if (stepIndex + 1 >= activeRecipe->stepCount)
+    {
+        return nullptr;
+    }
+    return activeRecipe->steps[stepOrder[stepIndex + 1]].liquid;
 }
 
 void PumpController::update()
 {
+    ProfileScope profile(Profiler::PUMP_UPDATE);
+    if (scaleModule)
+    {
+        // A session keeps its absolute weights: no zero tracking in between
+        scaleModule->update(state == State::IDLE && !sessionOpen);
+    }
     if (state != State::IDLE)
     {
         checkStateTimeout();
@@ -72,9 +199,15 @@ void PumpController::update()
 
     switch (state)
     {
+    case State::FLUSHING:
+        updateManualFlushing();
+        break;
     case State::INITIAL_FLUSHING:
         updateInitialFlushing();
         break;
+    case State::TARING:
+        updateTaring();
+        break;
     case State::DISPENSING:
         updateDispensing();
         break;
@@ -85,150 +218,667 @@ void PumpController::update()
         updateFinalFlushing();
         break;
     case State::DONE:
-        state = State::IDLE;
+        setState(State::IDLE);
         break;
     default:
         break;
     }
 }
 
-void PumpController::startInitialFlushing()
+bool PumpController::getDeadline(uint32_t &atMs) const
 {
-    Logger::log("Starting initial flushing...", Logger::INFO);
+    if (state == State::IDLE)
+    {
+        return false;
+    }
+    if (state == State::DONE)
+    {
+        atMs = Hal::millis();
+        return true;
+    }
+    atMs = lastActionTime + MAX_STATE_DURATION + 1;
+    bool flushing = state == State::FLUSHING || state == State::INITIAL_FLUSHING || state == State::FINAL_FLUSHING;
+    if (flushing && flushSwitch->isOpen() && !pumpActive)
+    {
+        // Draining, see updateFlush()
+        uint32_t drainedMs = lastActionTime + FlushEngine::DRAIN_MS;
+        atMs = static_cast<int32_t>(drainedMs - atMs) < 0 ? drainedMs : atMs;
+    }
+    return true;
+}
+
+void PumpController::startFlush(Liquid *lineContent, float volume)
+{
+    flushedLiquid = lineContent;
     flushSwitch->open();
-    lastActionTime = millis();
-    state = State::INITIAL_FLUSHING;
-    pumpOn();
+    if (!pumpOn(maxFlushUs))
+    {
+        abortJob();
+        return;
+    }
+    flushEngine.start(weightSampler, volume, pulseStartUs);
+}
+
+bool PumpController::updateFlush()
+{
+    if (pumpActive)
+    {
+        // The cutoff timer only ends a flush whose water never arrives
+        if (flushEngine.update() || !pumpTimer.isRunning())
+        {
+            pumpOff();
+            LOG_INFO("Flushed {}g of water", flushEngine.getVolume());
+            lastActionTime = Hal::millis();
+        }
+        return false;
+    }
+
+    // Let the line drain with the valve open, then close it
+    if (Hal::millis() - lastActionTime < FlushEngine::DRAIN_MS)
+    {
+        return false;
+    }
+    flushSwitch->close();
+    lineState = LineState::WATER;
+    lastActionTime = Hal::millis();
+    return true;
+}
+
+bool PumpController::learnFlushVolume()
+{
+    if (!flushedLiquid)
+    {
+        return false;
+    }
+    float volume = flushEngine.learnVolume(flushedLiquid->flushVolume);
+    if (volume == flushedLiquid->flushVolume)
+    {
+        return false;
+    }
+    flushedLiquid->flushVolume = volume;
+    Telemetry::estimate(TelemetryFrame::FLUSH_VOLUME, volume);
+    return true;
+}
+
+void PumpController::updateManualFlushing()
+{
+    if (updateFlush())
+    {
+        if (learnFlushVolume() && calibrationStore)
+        {
+            calibrationStore->saveLiquid(*flushedLiquid);
+        }
+        setState(State::IDLE);
+        LOG_INFO("Pump flushed");
+    }
+}
+
+void PumpController::startInitialFlushing()
+{
+    LOG_INFO("Starting initial flushing...");
+    lastActionTime = Hal::millis();
+    setState(State::INITIAL_FLUSHING);
+    bool known = lineState == LineState::LIQUID;
+    startFlush(known ? lineLiquid : nullptr, known ? lineLiquid->flushVolume : Liquid::DEFAULT_FLUSH_VOLUME);
 }
 
 void PumpController::updateInitialFlushing()
 {
-    static float lastWeight = 0;
-    static unsigned long lastWeightChange = 0;
-    float currentWeight = getCurrentWeight();
+    if (flushSwitch->isOpen())
+    {
+        if (!updateFlush())
+        {
+            return;
+        }
+        // The liquid of an earlier job; this job only saves its own
+        if (learnFlushVolume() && calibrationStore)
+        {
+            calibrationStore->saveLiquid(*flushedLiquid);
+        }
+        LOG_INFO("Initial flushing complete. Starting dispensing...");
+        if (!sessionWeightValid)
+        {
+            startTare();
+        }
+        else if (flushEngine.isMeasured())
+        {
+            startSettling(Hal::micros()); // Weigh the flush water that went into the container
+        }
+        else
+        {
+            startStep(sessionWeight);
+        }
+        return;
+    }
 
-    if (abs(currentWeight - lastWeight) > 0.1)
+    if (settle())
     {
-        lastWeight = currentWeight;
-        lastWeightChange = millis();
+        float weight = settleDetector.getWeight();
+        sessionFlushWater += weight - sessionWeight;
+        startStep(weight);
     }
+}
 
-    if (millis() - lastWeightChange > 2000)
+void PumpController::recordJob(const Recipe *recipe)
+{
+    Telemetry::estimate(TelemetryFrame::SCALE, weightSampler->getScale());
+    for (uint8_t i = 0; i < recipe->stepCount; i++)
     {
-        Logger::log("Initial flushing complete. Starting dispensing...", Logger::INFO);
-        pumpOff();
-        delay(500);
-        flushSwitch->close();
+        const Liquid *liquid = recipe->steps[i].liquid;
+        const FlowModel &model = liquid->flowModel;
+        const float values[TelemetryFrame::MODEL_VALUE_COUNT] = {
+            model.getFlowRate(), model.getDeadTime(), model.getDripVolume(),
+            model.getRelativeError(), model.getAbsoluteError(), liquid->flushVolume, model.getStallDuty()};
+        Telemetry::model(liquid->name.c_str(), values, model.getPulseCount());
+        Telemetry::job(TelemetryFrame::JOB_DOSE, i, recipe->stepCount, liquid->flushGroup, recipe->steps[i].amount,
+                       liquid->name.c_str());
+    }
+}
+
+bool PumpController::beginSession()
+{
+    if (state != State::IDLE)
+    {
+        LOG_WARNING("Pump is busy. Cannot start a container session.");
+        return false;
+    }
+    Telemetry::job(TelemetryFrame::JOB_SESSION_OPEN);
+    sessionOpen = true;
+    sessionWeightValid = false; // The first job takes the reference
+    sessionFlushWater = 0;
+    sessionLiquidCount = 0;
+    LOG_INFO("Container session started");
+    return true;
+}
+
+void PumpController::endSession()
+{
+    Telemetry::job(TelemetryFrame::JOB_SESSION_CLOSE);
+    sessionOpen = false;
+    sessionWeightValid = false;
+    LOG_INFO("Container session ended: {}g of liquids, {}g of flush water", getSessionTotal(), sessionFlushWater);
+}
+
+float PumpController::getSessionAmount(const Liquid *liquid) const
+{
+    for (uint8_t i = 0; i < sessionLiquidCount; i++)
+    {
+        if (sessionAmounts[i].liquid == liquid)
+        {
+            return sessionAmounts[i].amount;
+        }
+    }
+    return 0;
+}
+
+float PumpController::getSessionTotal() const
+{
+    float total = 0;
+    for (uint8_t i = 0; i < sessionLiquidCount; i++)
+    {
+        total += sessionAmounts[i].amount;
+    }
+    return total;
+}
 
-        scale.tare();
-        initialWeight = getCurrentWeight();
-        activeLiquid->switch_->open();
-        startDispensing();
+bool PumpController::continueSession()
+{
+    if (!sessionOpen || !sessionWeightValid)
+    {
+        return false;
+    }
+    float weight = getCurrentWeight();
+    if (fabsf(weight - sessionWeight) > SESSION_TOLERANCE)
+    {
+        LOG_WARNING("Container moved since the last dose ({}g, was {}g); taring again", weight, sessionWeight);
+        sessionWeightValid = false;
+        return false;
+    }
+    return true;
+}
+
+void PumpController::addSessionAmount(const Liquid *liquid, float amount)
+{
+    for (uint8_t i = 0; i < sessionLiquidCount; i++)
+    {
+        if (sessionAmounts[i].liquid == liquid)
+        {
+            sessionAmounts[i].amount += amount;
+            return;
+        }
+    }
+    if (sessionLiquidCount < SESSION_LIQUIDS)
+    {
+        sessionAmounts[sessionLiquidCount++] = {liquid, amount};
+    }
+    else
+    {
+        LOG_WARNING("Too many liquids in one session; {} is not counted", liquid->name);
+    }
+}
+
+void PumpController::startTare()
+{
+    weightSampler->tare(WEIGHT_SAMPLES);
+    setState(State::TARING);
+    lastActionTime = Hal::millis();
+}
+
+void PumpController::updateTaring()
+{
+    // Wait for the sampler to collect fresh conversions for the tare
+    if (weightSampler->isTareComplete())
+    {
+        startStep(getCurrentWeight());
+    }
+}
+
+void PumpController::startStep(float referenceWeight)
+{
+    const RecipeStep &step = activeRecipe->steps[stepOrder[stepIndex]];
+    activeLiquid = step.liquid;
+    targetAmount = step.amount;
+    remainingAmount = targetAmount;
+    lastDispensedAmount = 0.0;
+    topUps = 0;
+    pulsePending = false;
+    initialWeight = referenceWeight;
+    activeLiquid->clearDataPoints();
+    activeLiquid->addDataPoint(0);
+    stepStart = stats;
+    stepStartTime = Hal::millis();
+    LOG_INFO("Step {} of {}: {}g of {}", stepIndex + 1, activeRecipe->stepCount, targetAmount, activeLiquid->name);
+
+    activeLiquid->switch_->open();
+    lineState = LineState::LIQUID;
+    lineLiquid = activeLiquid;
+    startDispensing();
+}
+
+void PumpController::finishStep(float dispensedAmount, bool completed)
+{
+    DispenseStats &result = stepStats[stepOrder[stepIndex]];
+    result.durationMs = Hal::millis() - stepStartTime;
+    result.dispensingIterations = stats.dispensingIterations - stepStart.dispensingIterations;
+    result.stabilizingIterations = stats.stabilizingIterations - stepStart.stabilizingIterations;
+    result.flushPumpTimeMs = stats.flushPumpTimeMs - stepStart.flushPumpTimeMs;
+    result.settleTimeMs = stats.settleTimeMs - stepStart.settleTimeMs;
+    result.dispensedAmount = dispensedAmount;
+    result.completed = completed;
+    Telemetry::estimate(TelemetryFrame::DOSE, dispensedAmount);
+    if (sessionOpen)
+    {
+        addSessionAmount(activeLiquid, dispensedAmount);
+    }
+    if (completed && calibrationStore)
+    {
+        // Keep what this step taught the flow model
+        calibrationStore->saveLiquid(*activeLiquid);
     }
 }
 
 void PumpController::startDispensing()
 {
-    Logger::log("Starting dispensing...", Logger::INFO);
-    state = State::DISPENSING;
-    lastActionTime = millis();
+    LOG_INFO("Starting dispensing...");
+    setState(State::DISPENSING);
+    lastActionTime = Hal::millis();
+    stats.dispensingIterations++;
 
-    float amountToDispense = remainingAmount * fraction;
-    Logger::log("Dispensing " + String(amountToDispense) + "g out of " + String(remainingAmount) + "g remaining", Logger::INFO);
+    if (startFinePass())
+    {
+        return;
+    }
+    fineDuty = 1;
+    float amountToDispense = activeLiquid->flowModel.planDose(remainingAmount);
+    LOG_INFO("Dispensing {}g out of {}g remaining", amountToDispense, remainingAmount);
 
-    pumpOn();
+    if (!pumpOn(calculateDispenseTimeUs(amountToDispense)))
+    {
+        abortJob();
+    }
 }
 
-void PumpController::updateDispensing()
+bool PumpController::startFinePass()
 {
-    float targetThisIteration = remainingAmount * fraction;
-    long pumpTime = millis() - lastDispenseTime;
+    const FlowModel &model = activeLiquid->flowModel;
+    fineDuty = getFineDuty(model);
+    if (fineDuty >= 1)
+    {
+        return false;
+    }
 
-    if (pumpTime >= calculateDispenseTime(targetThisIteration))
+    // Once the model's relative error is small a timed pass, trimmed, ends
+    // closer to the target than the moving weight can; the fine phase only
+    // takes over the margin a timed pass would leave for a large one
+    float coarseAmount = model.planDose(remainingAmount);
+    if (coarseAmount >= remainingAmount || 2 * model.getRelativeError() * remainingAmount < MIN_FINE_MARGIN)
+    {
+        return false;
+    }
+    // The coarse phase leaves the fine one at least its planned amount; the
+    // fine phase runs until the weight reaches the target
+    float fineFlow = model.getFlowRate() * model.getRelativeFlow(fineDuty);
+    float fineAmount = min(remainingAmount, fineFlow * profile.fineSeconds);
+    coarseAmount = min(coarseAmount, remainingAmount - fineAmount);
+    float coarseTime = model.getDeadTime() + coarseAmount / model.getFlowRate();
+    uint32_t settleUs = static_cast<uint32_t>(model.getDeadTime() * 1000000) + flowSettleUs;
+    if (coarseTime * 1000000 < settleUs)
+    {
+        return false; // Too short to reach full flow, and to learn from
+    }
+    float expectedFine = remainingAmount - coarseAmount;
+    float fineTime = expectedFine / fineFlow;
+    if (fineTime > profile.maxFineSeconds)
+    {
+        return false; // The model is too unsure; a timed pass teaches it
+    }
+
+    uint32_t coarseUs = static_cast<uint32_t>(coarseTime * 1000000);
+    // Room for a coarse phase that fell short by the margin
+    uint32_t fineUs = static_cast<uint32_t>(2 * fineTime * 1000000);
+    if (fineUs < flowSettleUs + minFineWindowUs)
+    {
+        return false; // Over before the weight could end it
+    }
+    fineCutoffPlanned = false;
+    if (coarseUs + fineUs > maxPulseUs)
+    {
+        return false; // More than one pass can deliver
+    }
+    LOG_INFO("Dispensing {}g out of {}g remaining, the last {}g at duty {}", coarseAmount + expectedFine,
+             remainingAmount, expectedFine, fineDuty);
+
+    if (!pumpOn(coarseUs, fineUs))
+    {
+        abortJob();
+    }
+    return true;
+}
+
+float PumpController::getFineDuty(const FlowModel &model) const
+{
+    float relativeFlow = profile.fineFlowRate / model.getFlowRate();
+    // Until the model knows the pump, the live weight cannot be carried forward
+    if (profile.fineFlowRate <= 0 || relativeFlow >= 1 || model.getRelativeError() > MAX_FINE_MODEL_ERROR)
+    {
+        return 1;
+    }
+    return model.getDutyFor(relativeFlow > MIN_FINE_FLOW ? relativeFlow : MIN_FINE_FLOW);
+}
+
+// The weight along the steady part of the fine phase, carried forward to now
+// at the fine flow, and what still arrives after a cutoff, against the
+// target. Once the target comes up before the next conversion, the cutoff
+// moves to that moment.
+void PumpController::updateFinePhase()
+{
+    uint32_t nowUs = static_cast<uint32_t>(Hal::micros());
+    uint32_t steadyUs = pumpTimer.getFineStartUs() + flowSettleUs;
+    if (static_cast<int32_t>(nowUs - steadyUs) < static_cast<int32_t>(minFineWindowUs))
+    {
+        return;
+    }
+    float weight, slope, timeSpread;
+    uint32_t weightUs;
+    WeightSampler::Sample latest[2]; // Oldest first
+    if (!weightSampler->getTrendBetween(steadyUs, nowUs, weight, weightUs, slope, timeSpread) ||
+        weightSampler->getLatestSamples(latest, 2) < 2)
+    {
+        return;
+    }
+
+    // The fine flow from the model, and from the weight as it comes in: the
+    // stall duty the model has it from is only learned after a pass
+    const FlowModel &model = activeLiquid->flowModel;
+    float relativeFlow = model.getRelativeFlow(fineDuty);
+    float modelFlow = model.getFlowRate() * relativeFlow;
+    float modelSpread = FINE_WEIGHT_NOISE / (FINE_FLOW_ERROR * modelFlow);
+    modelSpread *= modelSpread;
+    float fineFlow = (slope * timeSpread + modelFlow * modelSpread) / (timeSpread + modelSpread);
+    if (fineFlow <= 0)
+    {
+        return; // Noise, this early in the fine phase
+    }
+    float dispensed = weight - initialWeight + fineFlow * static_cast<int32_t>(nowUs - weightUs) / 1000000.0f;
+    float remaining = targetAmount - FINE_SHORTFALL - relativeFlow * model.getDripVolume() - dispensed;
+    float remainingUs = remaining / fineFlow * 1000000;
+    if (remainingUs <= 0)
+    {
+        pumpTimer.stop();
+    }
+    else if (remainingUs < latest[1].timestampUs - latest[0].timestampUs)
+    {
+        pumpTimer.finishIn(static_cast<uint32_t>(remainingUs));
+        fineCutoffPlanned = true;
+    }
+}
+
+// The flow in the steady part of the fine phase, from the weight gained
+// between its two halves, tells the model how fast the pump runs at that duty
+void PumpController::observeFineFlow()
+{
+    uint32_t fromUs = pumpTimer.getFineStartUs() + flowSettleUs;
+    uint32_t toUs = pulseStartUs + lastPulseTimeUs;
+    if (static_cast<int32_t>(toUs - fromUs) < static_cast<int32_t>(minFineObservationUs))
+    {
+        return;
+    }
+    uint32_t middleUs = fromUs + (toUs - fromUs) / 2;
+    float first, second;
+    uint32_t firstUs, secondUs;
+    if (!weightSampler->getAverageBetween(fromUs, middleUs, first, firstUs) ||
+        !weightSampler->getAverageBetween(middleUs, toUs, second, secondUs) || secondUs == firstUs)
+    {
+        return;
+    }
+    FlowModel &model = activeLiquid->flowModel;
+    float fineFlow = (second - first) / ((secondUs - firstUs) / 1000000.0f);
+    model.addDutyObservation(fineDuty, fineFlow / model.getFlowRate());
+    Telemetry::estimate(TelemetryFrame::STALL_DUTY, model.getStallDuty());
+}
+
+void PumpController::updateDispensing()
+{
+    if (!fineCutoffPlanned && pumpTimer.isFine())
+    {
+        updateFinePhase();
+    }
+    // The cutoff timer switches the pump off at the deadline; only the bookkeeping happens here
+    if (!pumpTimer.isRunning())
     {
         pumpOff();
-        Logger::log("Calculated dispense time " + String(calculateDispenseTime(targetThisIteration)) + "ms", Logger::INFO);
-        Logger::log("Pump was on for " + String(pumpTime) + "ms", Logger::INFO);
-        Logger::log("Dispensing stopped; Stabilizing...", Logger::INFO);
-        state = State::STABILIZING;
-        lastActionTime = millis();
+        lastPulseTimeUs = pumpTimer.getLastOnTimeUs();
+        lastFineTimeUs = pumpTimer.getLastFineTimeUs();
+        pulsePending = true;
+
+        // Conversions taken at full flow, to split the drip off the settled weight later. After a
+        // fine phase only its small drip is left, too small to measure.
+        uint32_t deadTimeUs = static_cast<uint32_t>(activeLiquid->flowModel.getDeadTime() * 1000000);
+        uint32_t flowingSinceUs = pulseStartUs + deadTimeUs + flowSettleUs;
+        cutoffWeightValid = lastFineTimeUs == 0 && lastPulseTimeUs > deadTimeUs + flowSettleUs &&
+                            weightSampler->getAverageBetween(flowingSinceUs, pulseStartUs + lastPulseTimeUs,
+                                                             cutoffWeight, cutoffWeightUs);
+        if (lastFineTimeUs > 0)
+        {
+            observeFineFlow();
+        }
+
+        LOG_INFO("Calculated dispense time {}us", pulseDurationUs);
+        LOG_INFO("Pump was on for {}us", lastPulseTimeUs);
+        LOG_INFO("Dispensing stopped; Stabilizing...");
+        startSettling(pulseStartUs + lastPulseTimeUs);
+        setState(State::STABILIZING);
+        lastActionTime = Hal::millis();
+        stats.stabilizingIterations++;
     }
 }
 
 void PumpController::updateStabilizing()
 {
-    if (millis() - lastActionTime > stabilizationTime)
+    if (settle())
     {
-        float currentWeight = getCurrentWeight();
+        float currentWeight = settleDetector.getWeight();
         float dispensedAmount = currentWeight - initialWeight;
-        float dispensedThisIteration = dispensedAmount - lastDispensedAmount;
         activeLiquid->addDataPoint(dispensedAmount);
 
-        // Adjust flow rate based on the last iteration
-        // adjustFlowRate(dispensedThisIteration);
+        if (pulsePending)
+        {
+            updateFlowModel(dispensedAmount);
+        }
 
         lastDispensedAmount = dispensedAmount;
-        remainingAmount = activeLiquid->targetAmount - dispensedAmount;
+        remainingAmount = targetAmount - dispensedAmount;
 
-        Logger::log("After stabilization - Dispensed: " + String(dispensedAmount) + "g, Remaining: " + String(remainingAmount) + "g", Logger::INFO);
+        LOG_INFO("After stabilization - Dispensed: {}g, Remaining: {}g", dispensedAmount, remainingAmount);
 
-        if (remainingAmount > 0.01)
+        if (isShortfall(remainingAmount))
         {
-            Logger::log("Stabilization complete. Resuming dispensing for remaining " + String(remainingAmount) + "g", Logger::INFO);
+            LOG_INFO("Stabilization complete. Resuming dispensing for remaining {}g", remainingAmount);
             startDispensing();
         }
         else
         {
             activeLiquid->switch_->close();
-            startFinalFlushing();
+            const Liquid *next = getNextLiquid();
+            if (next && !needsFlush(next))
+            {
+                // Compatible: the next liquid pushes this one out of the line
+                finishStep(dispensedAmount, true);
+                stepIndex++;
+                startStep(currentWeight);
+            }
+            else
+            {
+                startFinalFlushing();
+            }
         }
     }
 }
 
+// A pulse cannot deliver less than the drip, so the dose is done once that is
+// the closer outcome. The final flush asks the same, only with the larger error
+// of a second weighing: whatever it sends back to dosing gets another pulse.
+bool PumpController::isShortfall(float remaining, float weightError) const
+{
+    return remaining > weightError && remaining > activeLiquid->flowModel.getMinimumDose() / 2;
+}
+
 void PumpController::startFinalFlushing()
 {
-    Logger::log("Starting final flushing...", Logger::INFO);
-    flushSwitch->open();
-    state = State::FINAL_FLUSHING;
-    lastActionTime = millis();
-    pumpOn();
+    LOG_INFO("Starting final flushing...");
+    setState(State::FINAL_FLUSHING);
+    lastActionTime = Hal::millis();
+    startFlush(activeLiquid, activeLiquid->flushVolume);
 }
 
 void PumpController::updateFinalFlushing()
 {
-    if (millis() - lastActionTime > flushingTime)
+    if (flushSwitch->isOpen())
     {
-        Logger::log("Flushing ended", Logger::INFO);
-        pumpOff();
-        flushSwitch->close();
-        delay(500);
-        float finalWeight = getCurrentWeight();
-        float totalDispensed = finalWeight - initialWeight;
+        if (updateFlush())
+        {
+            LOG_INFO("Flushing ended");
+            learnFlushVolume(); // Saved with the step
+            startSettling(Hal::micros());
+        }
+        return;
+    }
+
+    if (settle())
+    {
+        // When the flush water went onto the scale, the dose is what was weighed before the flush
+        float finalWeight = settleDetector.getWeight();
+        float totalDispensed = flushEngine.isMeasured() ? lastDispensedAmount : finalWeight - initialWeight;
         activeLiquid->addDataPoint(finalWeight);
-        if (totalDispensed < activeLiquid->targetAmount && abs(totalDispensed - activeLiquid->targetAmount) > 0.1)
+        bool completed = !isShortfall(targetAmount - totalDispensed, FLUSHED_WEIGHT_ERROR);
+        // With the water on the platform, more dosing would weigh it as liquid
+        if (!completed && topUps < MAX_TOP_UPS && !flushEngine.isMeasured())
         {
-            Logger::log("Dispense operation incomplete. Total dispensed: " + String(totalDispensed) + "g", Logger::WARNING);
-            state = State::STABILIZING;
+            LOG_WARNING("Dispense operation incomplete. Total dispensed: {}g", totalDispensed);
+            topUps++;
+            setState(State::STABILIZING);
+            stats.stabilizingIterations++;
             activeLiquid->switch_->open();
+            startSettling(Hal::micros());
+            lineState = LineState::LIQUID;
             return;
         }
-        state = State::DONE;
-        Logger::log("Dispense operation complete. Total dispensed: " + String(totalDispensed) + "g", Logger::INFO);
+        if (!completed)
+        {
+            LOG_ERROR("Step short by {}g after {} top-ups", targetAmount - totalDispensed, topUps);
+        }
+        finishStep(totalDispensed, completed);
+        if (sessionOpen && flushEngine.isMeasured())
+        {
+            sessionFlushWater += finalWeight - initialWeight - totalDispensed;
+        }
+        if (getNextLiquid())
+        {
+            stepIndex++;
+            startStep(finalWeight);
+            return;
+        }
+        setState(State::DONE);
+        finishStats(true);
+        if (sessionOpen)
+        {
+            // The next job of the session starts from here
+            sessionWeight = finalWeight;
+            sessionWeightValid = true;
+        }
+        if (calibrationStore)
+        {
+            // Keep the fresh tare
+            calibrationStore->saveScale(*weightSampler);
+        }
+        LOG_INFO("Dispense operation complete. Total dispensed: {}g", stats.dispensedAmount);
     }
 }
 
-void PumpController::pumpOn()
+bool PumpController::pumpOn(uint32_t durationUs, uint32_t fineUs)
 {
-    lastDispenseTime = millis();
-    digitalWrite(pumpPin, HIGH);
-    Logger::log("Pump turned on", Logger::INFO);
+    // The valves move without blocking; the timer starts the pump once they are in place
+    uint32_t nowUs = static_cast<uint32_t>(Hal::micros());
+    uint32_t leadUs = getValveLeadUs(flushSwitch, nowUs);
+    if (activeLiquid)
+    {
+        uint32_t valveLeadUs = getValveLeadUs(activeLiquid->switch_, nowUs);
+        leadUs = valveLeadUs > leadUs ? valveLeadUs : leadUs;
+    }
+    bool started = fineUs > 0 ? pumpTimer.startPass(durationUs, fineUs, fineDuty, leadUs)
+                              : pumpTimer.start(durationUs, leadUs);
+    if (!started)
+    {
+        LOG_ERROR("Pump pin {} cannot be driven", pumpPin);
+        return false;
+    }
+    lastDispenseTime = Hal::millis();
+    pulseStartUs = nowUs + leadUs;
+    pulseDurationUs = durationUs + fineUs;
+    pumpActive = true;
+    LOG_INFO("Pump turned on");
+    return true;
+}
+
+uint32_t PumpController::getValveLeadUs(const ServoSwitch *valve, uint32_t nowUs)
+{
+    int32_t leadUs = valve ? static_cast<int32_t>(valve->getSettledAtUs() - nowUs) : 0;
+    return leadUs > 0 ? leadUs : 0;
 }
 
 void PumpController::pumpOff()
 {
-    dispenseTime += millis() - lastDispenseTime;
-    digitalWrite(pumpPin, LOW);
-    Logger::log("Pump turned off", Logger::INFO);
+    pumpTimer.stop();
+    if (pumpActive)
+    {
+        dispenseTime += pumpTimer.getLastOnTimeUs() / 1000;
+        if (flushSwitch->isOpen())
+        {
+            stats.flushPumpTimeMs += pumpTimer.getLastOnTimeUs() / 1000;
+        }
+        pumpActive = false;
+    }
+    LOG_INFO("Pump turned off");
 }
 
 bool PumpController::isBusy() const
@@ -238,54 +888,119 @@ bool PumpController::isBusy() const
 
 float PumpController::getCurrentWeight()
 {
-    float weight = scale.get_units(10);
-    return weight;
+    return weightSampler->getFilteredWeight(WEIGHT_SAMPLES);
+}
+
+float PumpController::getDispensedAmount()
+{
+    return state == State::IDLE || state == State::FLUSHING || state == State::INITIAL_FLUSHING ||
+                   state == State::TARING
+               ? 0
+               : getCurrentWeight() - initialWeight;
 }
 
-void PumpController::adjustFlowRate(float actualDispensed)
+void PumpController::updateFlowModel(float dispensedAmount)
 {
-    unsigned long elapsedTime = millis() - lastDispenseTime;
-    float newFlowRate = (actualDispensed / elapsedTime) * 1000;
-    Logger::log("Current flow rate: " + String(newFlowRate) + " g/s", Logger::INFO);
+    FlowModel &model = activeLiquid->flowModel;
+    pulsePending = false;
 
-    // Use a moving average to smooth out flow rate adjustments
-    estimatedFlowRate = (estimatedFlowRate * 0.7) + (newFlowRate * 0.3);
-    estimatedFlowRate = constrain(estimatedFlowRate, minFlowRate, maxFlowRate);
+    model.addPass((lastPulseTimeUs - lastFineTimeUs) / 1000000.0, lastFineTimeUs / 1000000.0, fineDuty,
+                  dispensedAmount - lastDispensedAmount);
+    if (cutoffWeightValid && model.getPulseCount() > 1)
+    {
+        // Extrapolate the full-flow weight to the cutoff with the updated flow rate
+        uint32_t cutoffUs = pulseStartUs + lastPulseTimeUs;
+        float cutoffAmount = cutoffWeight - initialWeight + model.getFlowRate() * (cutoffUs - cutoffWeightUs) / 1000000.0;
+        model.addDripObservation(dispensedAmount - cutoffAmount);
+    }
 
-    Logger::log("Adjusted estimated flow rate to: " + String(estimatedFlowRate) + " g/s", Logger::INFO);
+    Telemetry::estimate(TelemetryFrame::FLOW_RATE, model.getFlowRate());
+    Telemetry::estimate(TelemetryFrame::DEAD_TIME, model.getDeadTime());
+    Telemetry::estimate(TelemetryFrame::DRIP_VOLUME, model.getDripVolume());
+    Telemetry::estimate(TelemetryFrame::MODEL_ERROR, model.getRelativeError());
+    LOG_INFO("Flow model: {} g/s, dead time {}ms, drip {}g, error {}%", model.getFlowRate(),
+             model.getDeadTime() * 1000, model.getDripVolume(), model.getRelativeError() * 100);
+}
 
-    // Adjust fraction based on how close we are to the target
-    if (remainingAmount < activeLiquid->targetAmount * 0.2)
+void PumpController::startSettling(uint32_t quietSinceUs)
+{
+    settleDetector.start(weightSampler, quietSinceUs);
+    settleDetector.hold(flushSwitch->getSettledAtUs());
+    if (activeLiquid)
     {
-        fraction = 0.25; // Smaller fraction for fine-tuning
+        settleDetector.hold(activeLiquid->switch_->getSettledAtUs());
     }
-    else if (remainingAmount < activeLiquid->targetAmount * 0.5)
+}
+
+bool PumpController::settle()
+{
+    if (!settleDetector.update())
+    {
+        return false;
+    }
+    stats.settleTimeMs += settleDetector.getSettleTimeMs();
+    Telemetry::estimate(TelemetryFrame::SETTLE_TIME, settleDetector.getSettleTimeMs());
+    if (settleDetector.isTimedOut())
     {
-        fraction = 0.4; // Medium fraction for mid-range
+        LOG_WARNING("Scale did not settle within {}ms", SettleDetector::TIMEOUT_MS);
     }
     else
     {
-        fraction = 0.5; // Larger fraction for initial dispenses
+        LOG_INFO("Scale settled after {}ms", settleDetector.getSettleTimeMs());
     }
-    Logger::log("Adjusted fraction to: " + String(fraction), Logger::INFO);
+    return true;
 }
 
-unsigned long PumpController::calculateDispenseTime(float grams)
+uint32_t PumpController::calculateDispenseTimeUs(float grams)
 {
-    return static_cast<unsigned long>((grams / estimatedFlowRate) * 1000);
+    uint32_t durationUs = static_cast<uint32_t>(activeLiquid->flowModel.onTimeFor(grams) * 1000000);
+    return constrain(durationUs, minPulseUs, maxPulseUs);
+}
+
+void PumpController::setState(State next)
+{
+    state = next;
+    Telemetry::state(getState());
 }
 
 void PumpController::checkStateTimeout()
 {
-    if (millis() - lastActionTime > MAX_STATE_DURATION)
+    if (Hal::millis() - lastActionTime > MAX_STATE_DURATION)
     {
-        Logger::log("State timeout occurred. Resetting to IDLE state.", Logger::ERROR);
-        pumpOff();
-        flushSwitch->close();
-        if (activeLiquid && activeLiquid->switch_)
-        {
-            activeLiquid->switch_->close();
-        }
-        state = State::IDLE;
+        LOG_ERROR("State timeout occurred. Resetting to IDLE state.");
+        abortJob();
+    }
+}
+
+void PumpController::abortJob()
+{
+    pumpOff();
+    flushSwitch->close();
+    if (activeLiquid && activeLiquid->switch_)
+    {
+        activeLiquid->switch_->close();
+    }
+    if (state != State::FLUSHING && state != State::INITIAL_FLUSHING && state != State::TARING)
+    {
+        finishStep(lastDispensedAmount, false);
+    }
+    if (state != State::FLUSHING)
+    {
+        finishStats(false);
+    }
+    lineState = LineState::UNKNOWN;
+    sessionWeightValid = false; // Whatever happened to the container, it was not weighed
+    setState(State::IDLE);
+}
+
+void PumpController::finishStats(bool completed)
+{
+    stats.durationMs = Hal::millis() - dispenseStartTime;
+    stats.dispensedAmount = 0;
+    for (uint8_t i = 0; i < activeRecipe->stepCount; i++)
+    {
+        stats.dispensedAmount += stepStats[i].dispensedAmount;
+        completed = completed && stepStats[i].completed;
     }
+    stats.completed = completed;
 }
\ No newline at end of file
@@ -1,13 +1,21 @@
 #pragma once
+#include "FlushEngine.h"
 #include "LiquidManager.h"
-#include "HX711.h"
+#include "WeightSampler.h"
+#include "PumpTimer.h"
+#include "SettleDetector.h"
+
+class CalibrationStore;
+class ScaleModule;
 
 class PumpController
 {
     enum class State
     {
         IDLE,
+        FLUSHING,
         INITIAL_FLUSHING,
+        TARING,
         DISPENSING,
         STABILIZING,
         FINAL_FLUSHING,
@@ -15,23 +23,92 @@ class PumpController
     };
 
 public:
+    // Summary of the last dispense operation, or of one recipe step, for tuning and benchmarks
+    struct DispenseStats
+    {
+        unsigned long durationMs;
+        uint16_t dispensingIterations;
+        uint16_t stabilizingIterations;
+        unsigned long flushPumpTimeMs;
+        unsigned long settleTimeMs; // Waiting for the scale to come to rest
+        float dispensedAmount;
+        bool completed;
+    };
+
+    // How a dispensing pass ends while the flow model is still unsure. The
+    // bulk of the dose runs at full speed; the last part runs at the duty
+    // that gives fineFlowRate, slow enough that the pump stops on the live
+    // weight instead of on the model's timing, so the dose ends in one pass
+    // where a timed one would stop short by the model's margin.
+    struct DosingProfile
+    {
+        float fineFlowRate;   // g/s; 0, or one at or above the full flow, for full speed throughout
+        float fineSeconds;    // Shortest planned length of the fine phase
+        float maxFineSeconds; // A pass that would need a longer fine phase runs timed at full speed
+    };
+
+    static constexpr float MAX_DOSE = 100; // g in one dispense; beyond it a request is taken for a mistake
+
     PumpController(int pumpPin, ServoSwitch *flushSwitch);
-    void init(int scaleDataPin, int scaleClockPin);
-    void calibrateScale(float knownWeight);
-    void dispense(Liquid *liquid);
+    // With a ScaleModule, the zero is tracked while idle and a dispense
+    // starts without a tare when the platform has been stable
+    void init(WeightSampler *weightSampler, CalibrationStore *calibrationStore = nullptr,
+              ScaleModule *scaleModule = nullptr);
+    // Each returns false, and does nothing, while busy or for an amount
+    // that is not in (0, MAX_DOSE]
+    bool dispense(Liquid *liquid); // Its target amount
+    bool dispense(Liquid *liquid, float amount);
+    // Runs all steps as one job: one tare, and the line is only flushed
+    // where the next liquid is not compatible with the one in it
+    bool dispense(const Recipe *recipe);
     void update();
+    // Event-driven callers run update() after each conversion and each time
+    // the pump timer switched the pump (the listener), and at the deadline:
+    // the state timeout, the end of a drain, or at once to leave DONE. No
+    // deadline while idle.
+    void setListener(PumpTimer::Listener listener, void *arg) { pumpTimer.setListener(listener, arg); }
+    bool getDeadline(uint32_t &atMs) const;
+    void setProfile(const DosingProfile &profile) { this->profile = profile; } // While idle
+    const DosingProfile &getProfile() const { return profile; }
     bool isBusy() const;
+    bool isReady() const { return pumpTimer.isReady(); } // The pump pin was set up by init()
     float getCurrentWeight();
-    void flush();
+    float getDispensedAmount(); // By the current step, live
+    // Flushes the line without dispensing; runs in update() like a dispense
+    bool flush();
+    const DispenseStats &getLastDispenseStats() const { return stats; }
+    // Results of the last job, in recipe order
+    uint8_t getStepCount() const { return activeRecipe ? activeRecipe->stepCount : 0; }
+    const DispenseStats &getStepStats(uint8_t step) const { return stepStats[step]; }
+    const Liquid *getActiveLiquid() const { return activeLiquid; }
+    float getTargetAmount() const { return targetAmount; }
 
-    String getState() const
+    // Container session: one container stays on the scale for several jobs.
+    // Each job weighs its doses against the settled weight the last one left
+    // behind, so it starts without a tare and without settling first; what
+    // each liquid added and the flush water that landed in the container are
+    // kept apart, from the tare of the first job on. A container that moved
+    // in between ends the run of doses: the next job tares again.
+    bool beginSession(); // False while busy
+    void endSession();   // The totals stay readable until the next session
+    bool isSessionOpen() const { return sessionOpen; }
+    float getSessionAmount(const Liquid *liquid) const; // g of this liquid in the container
+    float getSessionTotal() const;                      // g of all liquids
+    float getSessionFlushWater() const { return sessionFlushWater; }
+
+    // Static names, so the state can be handed to another task without copying
+    const char *getState() const
     {
         switch (state)
         {
         case State::IDLE:
             return "IDLE";
+        case State::FLUSHING:
+            return "FLUSHING";
         case State::INITIAL_FLUSHING:
             return "INITIAL_FLUSH";
+        case State::TARING:
+            return "TARING";
         case State::DISPENSING:
             return "DISPENSING";
         case State::STABILIZING:
@@ -46,42 +123,129 @@ public:
     }
 
 private:
+    enum class LineState
+    {
+        UNKNOWN, // After boot or an aborted job
+        WATER,
+        LIQUID
+    };
+
     int MAX_STATE_DURATION = 30000;
+    static const uint8_t WEIGHT_SAMPLES = 10;
+    static const uint8_t SESSION_LIQUIDS = 8;
+    static const uint8_t MAX_TOP_UPS = 2; // Times a step goes back to dosing after its final flush
+    static constexpr float FLUSHED_WEIGHT_ERROR = 0.1; // g, of a dose weighed again after the line was flushed
+    static constexpr float SESSION_TOLERANCE = 0.2;    // g the idle container may differ from the session weight
+    static constexpr float MIN_FINE_FLOW = 0.1;        // Relative; closer to the stall duty the flow is too uncertain
+    static constexpr float MAX_FINE_MODEL_ERROR = 0.1; // Relative flow model error up to which passes slow down
+    static constexpr float MIN_FINE_MARGIN = 0.3;      // g of relative-error margin below which passes run timed
+    static constexpr float FINE_FLOW_ERROR = 0.3;      // Relative, of the model's fine flow before the weight shows it
+    static constexpr float FINE_WEIGHT_NOISE = 0.03;   // g per conversion while the pump runs
+    static constexpr float FINE_SHORTFALL = 0.01;      // g the fine phase stops short: a trim can add, not take away
+
+    struct SessionAmount
+    {
+        const Liquid *liquid;
+        float amount;
+    };
 
-    float fraction;
     float remainingAmount;
 
-    void pumpOn();
+    // The fine phase at fineDuty; false when the pin cannot be driven
+    bool pumpOn(uint32_t durationUs = 0, uint32_t fineUs = 0);
+    static uint32_t getValveLeadUs(const ServoSwitch *valve, uint32_t nowUs); // Until it is in place
     void pumpOff();
+    void planSteps();
+    bool needsFlush(const Liquid *next) const;
+    const Liquid *getNextLiquid() const;
+    void startFlush(Liquid *lineContent, float volume);
+    bool updateFlush(); // True once the line is flushed and the valve closed
+    bool learnFlushVolume();
+    void updateManualFlushing();
     void startInitialFlushing();
     void updateInitialFlushing();
+    void startTare();
+    void updateTaring();
+    bool continueSession(); // The container is where the last job left it
+    void addSessionAmount(const Liquid *liquid, float amount);
+    void startStep(float referenceWeight);
+    void finishStep(float dispensedAmount, bool completed);
     void startDispensing();
+    bool startFinePass(); // False when this pass runs timed at full speed
+    float getFineDuty(const FlowModel &model) const; // 1 for no fine phase
+    void updateFinePhase();
+    void observeFineFlow();
     void updateDispensing();
     void updateStabilizing();
+    // Worth another pulse: more than the weight's own error, and closer after one
+    bool isShortfall(float remaining, float weightError = 0.01) const;
     void startFinalFlushing();
     void updateFinalFlushing();
-    void adjustFlowRate(float actualDispensed);
-    unsigned long calculateDispenseTime(float grams);
+    void startSettling(uint32_t quietSinceUs);
+    bool settle();
+    void updateFlowModel(float dispensedAmount);
+    uint32_t calculateDispenseTimeUs(float grams);
     float getRemainingAmount();
+    void setState(State next); // Every transition goes out on the telemetry
+    void recordJob(const Recipe *recipe); // What a replay needs to run it again
     void checkStateTimeout();
+    void abortJob(); // Pump off, valves closed, IDLE; the step and job count as failed
+    void finishStats(bool completed); // Job totals from the step results; complete only if each step is
 
     int pumpPin;
+    PumpTimer pumpTimer;
+    SettleDetector settleDetector;
+    FlushEngine flushEngine;
+    Liquid *flushedLiquid; // What the running flush pushes out, if known
     ServoSwitch *flushSwitch;
-    HX711 scale;
+    WeightSampler *weightSampler;
+    CalibrationStore *calibrationStore;
+    ScaleModule *scaleModule;
     Liquid *activeLiquid;
+    float targetAmount;
+    const Recipe *activeRecipe;
+    Recipe singleDose; // dispense(Liquid *) runs as a one-step recipe
+    uint8_t stepOrder[Recipe::MAX_STEPS];
+    uint8_t stepIndex; // Position in stepOrder
+    DispenseStats stepStats[Recipe::MAX_STEPS];
+    DispenseStats stepStart; // Job totals when the current step started
+    unsigned long stepStartTime;
+    LineState lineState;
+    Liquid *lineLiquid;
     State state;
     unsigned long lastActionTime;
     unsigned long lastDispenseTime;
     unsigned long dispenseTime;
+    bool pumpActive;
+    uint32_t pulseDurationUs;
+    uint32_t lastPulseTimeUs; // Measured on-time of the last dispense pulse
+    uint32_t pulseStartUs;
+    bool pulsePending;        // A pulse has ended and is not yet fed to the flow model
+    DosingProfile profile;
+    float fineDuty;           // Of the running or last pass, 1 for none
+    bool fineCutoffPlanned;   // From the weight, on the pump timer
+    uint32_t lastFineTimeUs;  // Part of lastPulseTimeUs
+    bool cutoffWeightValid;
+    float cutoffWeight;       // Mean weight at full flow before the cutoff
+    uint32_t cutoffWeightUs;  // and the mean time it was taken at
     float lastDispensedAmount;
-    int flushingTime;
+    uint8_t topUps;           // Of the current step
     float initialWeight;
+    unsigned long dispenseStartTime;
+    DispenseStats stats;
+    bool sessionOpen;
+    bool sessionWeightValid; // A job of this session has ended settled
+    float sessionWeight;     // Absolute weight it left behind
+    float sessionFlushWater;
+    SessionAmount sessionAmounts[SESSION_LIQUIDS];
+    uint8_t sessionLiquidCount;
 
     // Pump-specific parameters
-    float estimatedFlowRate;
-    float minFlowRate;
-    float maxFlowRate;
     const unsigned long minUpdateInterval = 100;
-    const unsigned long stabilizationTime = 500;
-    const float dispenseFraction = 0.6;
+    const uint32_t minPulseUs = 5000;
+    const uint32_t maxPulseUs = 20000000; // Well inside MAX_STATE_DURATION
+    const uint32_t flowSettleUs = 200000; // Full flow is reached this long after the dead time, and fine flow after a slowdown
+    const uint32_t minFineWindowUs = 300000; // Of steady fine flow before the weight can end the fine phase
+    const uint32_t minFineObservationUs = 1000000; // Of steady fine flow, to measure it
+    const uint32_t maxFlushUs = 25000000; // Ends a flush whose water is never seen, inside MAX_STATE_DURATION
 };
\ No newline at end of file
@@ -0,0 +1,225 @@
+#include "PumpTimer.h"
+#include "Telemetry.h"
+
+std::atomic<uint8_t> PumpTimer::runningCount(0);
+
+PumpTimer::PumpTimer(int pumpPin)
+    : pumpPin(pumpPin), timer(nullptr), listener(nullptr), listenerArg(nullptr), ready(false), running(false), phase(Phase::OFF),
+      coarseUs(0), fineUs(0), fineDuty(1), startUs(0), fineStartUs(0), lastOnTimeUs(0), lastFineTimeUs(0)
+{
+}
+
+PumpTimer::~PumpTimer()
+{
+    delete timer;
+    setRunning(false);
+}
+
+bool PumpTimer::begin()
+{
+    Hal::gpio().pinMode(pumpPin, OUTPUT);
+    ready = Hal::gpio().pwmWrite(pumpPin, 0);
+    if (!timer)
+    {
+        timer = Hal::clock().createTimer(&PumpTimer::onExpired, this);
+    }
+    return ready;
+}
+
+void PumpTimer::setListener(Listener listener, void *arg)
+{
+    listenerArg = arg;
+    this->listener = listener;
+}
+
+bool PumpTimer::start(uint32_t durationUs, uint32_t delayUs)
+{
+    return startPass(durationUs, 0, 1, delayUs);
+}
+
+bool PumpTimer::startPass(uint32_t durationUs, uint32_t fineUs, float fineDuty, uint32_t delayUs)
+{
+    if (!ready)
+    {
+        return false;
+    }
+    timer->stop();
+    coarseUs = durationUs;
+    this->fineUs = fineUs;
+    this->fineDuty = fineDuty;
+    setRunning(true);
+    if (delayUs > 0)
+    {
+        phase = Phase::DELAYED;
+        timer->start(delayUs);
+        return true;
+    }
+    switchOn(phase);
+    return true;
+}
+
+void PumpTimer::switchOn(Phase from)
+{
+    startUs = Hal::micros();
+    if (coarseUs == 0 && fineUs > 0)
+    {
+        slowDown(from);
+        return;
+    }
+
+    // Pin first, phase second: a stop() in between finds the pump on and cuts it off
+    Hal::gpio().pwmWrite(pumpPin, 1);
+    if (!phase.compare_exchange_strong(from, Phase::COARSE))
+    {
+        Hal::gpio().pwmWrite(pumpPin, 0); // stop() came first
+        return;
+    }
+    Telemetry::edge("pump", true);
+    if (coarseUs > 0)
+    {
+        timer->start(coarseUs);
+    }
+}
+
+void PumpTimer::slowDown(Phase from)
+{
+    fineStartUs = static_cast<uint32_t>(Hal::micros());
+    Hal::gpio().pwmWrite(pumpPin, fineDuty);
+    if (!phase.compare_exchange_strong(from, Phase::FINE))
+    {
+        Hal::gpio().pwmWrite(pumpPin, 0); // stop() came first
+        return;
+    }
+    if (from == Phase::DELAYED || from == Phase::OFF)
+    {
+        Telemetry::edge("pump", true);
+    }
+    Telemetry::edge("fine", true);
+    timer->start(fineUs);
+}
+
+void PumpTimer::finishIn(uint32_t delayUs)
+{
+    if (phase == Phase::FINE)
+    {
+        timer->stop();
+        timer->start(delayUs);
+        if (phase != Phase::FINE)
+        {
+            // The cutoff came first; the timer has nothing left to switch
+            timer->stop();
+        }
+    }
+}
+
+void PumpTimer::stop()
+{
+    timer->stop();
+    // The timer may be expiring on the other core; whoever moves the phase
+    // to OFF first does the cutoff
+    Phase current = phase;
+    while (current != Phase::OFF)
+    {
+        if (current == Phase::DELAYED)
+        {
+            if (phase.compare_exchange_strong(current, Phase::OFF))
+            {
+                // Never switched on
+                lastOnTimeUs = 0;
+                lastFineTimeUs = 0;
+                setRunning(false);
+                break;
+            }
+        }
+        else if (cutoff(current))
+        {
+            break;
+        }
+    }
+    Hal::gpio().pwmWrite(pumpPin, 0);
+}
+
+bool PumpTimer::isRunning() const
+{
+    return running;
+}
+
+bool PumpTimer::isFine() const
+{
+    return phase == Phase::FINE;
+}
+
+uint32_t PumpTimer::getLastOnTimeUs() const
+{
+    return lastOnTimeUs;
+}
+
+void PumpTimer::onExpired(void *arg)
+{
+    PumpTimer *pump = static_cast<PumpTimer *>(arg);
+    Phase current = pump->phase;
+    switch (current)
+    {
+    case Phase::OFF:
+        return; // stop() or an earlier expiry cut the pump off already
+    case Phase::DELAYED:
+        pump->switchOn(current);
+        break;
+    case Phase::COARSE:
+        if (pump->fineUs > 0)
+        {
+            pump->slowDown(current);
+        }
+        else
+        {
+            pump->cutoff(current);
+        }
+        break;
+    case Phase::FINE:
+        pump->cutoff(current);
+        break;
+    }
+    if (pump->listener)
+    {
+        pump->listener(pump->listenerArg);
+    }
+}
+
+// Only for the party that takes the phase from `from` to OFF; otherwise
+// false, with the phase it found in `from`
+bool PumpTimer::cutoff(Phase &from)
+{
+    if (!phase.compare_exchange_strong(from, Phase::OFF))
+    {
+        return false;
+    }
+    Hal::gpio().pwmWrite(pumpPin, 0);
+    uint32_t nowUs = static_cast<uint32_t>(Hal::micros());
+    lastOnTimeUs = nowUs - static_cast<uint32_t>(startUs);
+    bool fine = from == Phase::FINE;
+    lastFineTimeUs = fine ? nowUs - fineStartUs : 0;
+    setRunning(false);
+    if (fine)
+    {
+        Telemetry::edge("fine", false);
+    }
+    Telemetry::edge("pump", false);
+    return true;
+}
+
+void PumpTimer::setRunning(bool on)
+{
+    // Only the call that flips the flag counts, so a restart or a second
+    // cutoff leaves the count alone
+    if (running.exchange(on) != on)
+    {
+        if (on)
+        {
+            runningCount++;
+        }
+        else
+        {
+            runningCount--;
+        }
+    }
+}
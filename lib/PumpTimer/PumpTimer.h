@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+
+// Drives the pump pin and cuts it off from a one-shot timer, so the on-time
+// of a dispense pulse does not depend on how quickly loop() comes around.
+// The actual on-time is measured in microseconds for the flow model.
+//
+// The pin is driven by PWM. A pass runs at full speed, then may slow down to
+// a fine duty for its last part: the timer switches to the fine phase at the
+// end of the coarse one and cuts the pump off at the end of the fine one,
+// unless stop() comes first or finishIn() moves the cutoff.
+//
+// The timer comes from the HAL clock: an esp_timer on the ESP32, a timer on
+// the simulated clock (firing exactly at its deadline) on the host.
+class PumpTimer
+{
+public:
+    typedef void (*Listener)(void *arg);
+
+    PumpTimer(int pumpPin);
+    ~PumpTimer();
+    bool begin(); // False when the pin cannot be driven; the pump then never starts
+    // Called each time the timer switched the pump, from the timer's context
+    void setListener(Listener listener, void *arg);
+
+    // Turns the pump on, or after delayUs from the timer, e.g. once a valve
+    // is in place. A non-zero duration arms the cutoff timer. False when
+    // begin() could not set the pin up.
+    bool start(uint32_t durationUs = 0, uint32_t delayUs = 0);
+    // The same, then at most fineUs at fineDuty before the cutoff. With a
+    // durationUs of 0 the pass is all fine phase.
+    bool startPass(uint32_t durationUs, uint32_t fineUs, float fineDuty, uint32_t delayUs = 0);
+    // In the fine phase, moves the cutoff to delayUs from now
+    void finishIn(uint32_t delayUs);
+    // Turns the pump off immediately and cancels a pending start or cutoff.
+    void stop();
+
+    bool isReady() const { return ready; }
+    bool isRunning() const; // Also while a delayed start is pending
+    // Of any pump timer, e.g. to keep flash writes, which stall both cores,
+    // out of a pass; safe from any task
+    static bool isAnyRunning() { return runningCount > 0; }
+    bool isFine() const;
+    uint32_t getFineStartUs() const { return fineStartUs; } // Of the running or last fine phase
+    uint32_t getLastOnTimeUs() const;
+    uint32_t getLastFineTimeUs() const { return lastFineTimeUs; } // Part of the on-time
+    float getFineDuty() const { return fineDuty; }
+
+private:
+    enum class Phase : uint8_t
+    {
+        OFF,
+        DELAYED, // The timer switches the pump on next
+        COARSE,
+        FINE
+    };
+
+    static void onExpired(void *arg);
+    void switchOn(Phase from);
+    void slowDown(Phase from);
+    bool cutoff(Phase &from);
+    void setRunning(bool on); // Keeps runningCount
+
+    int pumpPin;
+    HalTimer *timer;
+    Listener listener;
+    void *listenerArg;
+    bool ready;
+    std::atomic<bool> running;
+    std::atomic<Phase> phase;
+    uint32_t coarseUs;
+    uint32_t fineUs;
+    float fineDuty;
+    uint64_t startUs;
+    std::atomic<uint32_t> fineStartUs;
+    std::atomic<uint32_t> lastOnTimeUs;
+    std::atomic<uint32_t> lastFineTimeUs;
+
+    static std::atomic<uint8_t> runningCount;
+};
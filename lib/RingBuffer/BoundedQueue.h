@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-size lock-free queue for any number of producers and one consumer.
+// Unlike RingBuffer nothing is overwritten: tryPush() fails when the queue
+// is full and the producer decides what to do (count, drop, retry later).
+// Each slot carries a sequence number that tells producers and the consumer
+// whose turn it is, so neither side ever waits on the other.
+template <typename T, size_t Capacity>
+class BoundedQueue
+{
+    static_assert(Capacity > 1 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    BoundedQueue() : enqueuePos(0), dequeuePos(0)
+    {
+        for (size_t i = 0; i < Capacity; i++)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(const T &item)
+    {
+        T *slot = reserve();
+        if (!slot)
+        {
+            return false;
+        }
+        *slot = item;
+        commit(slot);
+        return true;
+    }
+
+    // Two-phase push, to fill the slot in place: reserve() returns nullptr
+    // when the queue is full, otherwise commit() must follow.
+    T *reserve()
+    {
+        uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot &slot = slots[pos & (Capacity - 1)];
+            uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+            int32_t diff = static_cast<int32_t>(sequence - pos);
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    slot.reservedPos = pos;
+                    return &slot.item;
+                }
+            }
+            else if (diff < 0)
+            {
+                return nullptr; // Full
+            }
+            else
+            {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void commit(T *item)
+    {
+        Slot *slot = reinterpret_cast<Slot *>(reinterpret_cast<uint8_t *>(item) - offsetof(Slot, item));
+        slot->sequence.store(slot->reservedPos + 1, std::memory_order_release);
+    }
+
+    // Consumer side only.
+    bool tryPop(T &out)
+    {
+        uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Slot &slot = slots[pos & (Capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+        {
+            return false; // Empty, or the producer has not committed yet
+        }
+        out = slot.item;
+        slot.sequence.store(pos + Capacity, std::memory_order_release);
+        dequeuePos.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool empty() const
+    {
+        uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+        return slots[pos & (Capacity - 1)].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    struct Slot
+    {
+        T item;
+        uint32_t reservedPos;
+        std::atomic<uint32_t> sequence;
+    };
+
+    Slot slots[Capacity];
+    std::atomic<uint32_t> enqueuePos;
+    std::atomic<uint32_t> dequeuePos;
+};
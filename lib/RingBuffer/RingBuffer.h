@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-size overwriting ring buffer with a single producer (typically an ISR)
+// and any number of readers. The producer never blocks: once the buffer is
+// full the oldest entry is overwritten. Readers copy entries out and drop any
+// that the producer may have overwritten while they were being copied.
+template <typename T, size_t Capacity>
+class RingBuffer
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Producer side only.
+    void push(const T &item)
+    {
+        uint32_t head = writeIndex.load(std::memory_order_relaxed);
+        items[head & (Capacity - 1)] = item;
+        writeIndex.store(head + 1, std::memory_order_release);
+    }
+
+    // Total number of items ever pushed. Wraps at 2^32.
+    uint32_t totalCount() const
+    {
+        return writeIndex.load(std::memory_order_acquire);
+    }
+
+    size_t size() const
+    {
+        uint32_t head = totalCount();
+        return head < Capacity ? head : Capacity;
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+    bool latest(T &out) const
+    {
+        return copyLatest(&out, 1) == 1;
+    }
+
+    // Copies up to `count` of the newest items into `out`, oldest first.
+    // Returns the number of items copied.
+    size_t copyLatest(T *out, size_t count) const
+    {
+        if (count > Capacity)
+        {
+            count = Capacity;
+        }
+
+        for (;;)
+        {
+            uint32_t head = totalCount();
+            size_t available = head < Capacity ? head : Capacity;
+            size_t n = count < available ? count : available;
+            uint32_t first = head - n;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                out[i] = items[(first + i) & (Capacity - 1)];
+            }
+
+            // Anything older than (newHead - Capacity) may have been overwritten mid-copy.
+            uint32_t newHead = totalCount();
+            if (newHead - first <= Capacity)
+            {
+                return n;
+            }
+        }
+    }
+
+    // Copies up to `count` items, oldest first, starting with the one pushed
+    // as number `first`. If that one has been overwritten already, `first`
+    // moves up to the oldest item still there. Returns the number copied.
+    size_t copyFrom(uint32_t &first, T *out, size_t count) const
+    {
+        for (;;)
+        {
+            uint32_t head = totalCount();
+            if (head - first > Capacity)
+            {
+                first = head - Capacity;
+            }
+            size_t pending = head - first;
+            size_t n = count < pending ? count : pending;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                out[i] = items[(first + i) & (Capacity - 1)];
+            }
+
+            uint32_t newHead = totalCount();
+            if (newHead - first <= Capacity)
+            {
+                return n;
+            }
+        }
+    }
+
+private:
+    T items[Capacity];
+    std::atomic<uint32_t> writeIndex{0};
+};
@@ -0,0 +1,160 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-capacity weight-over-time history, 4 bytes per point. Each point is
+// stored as a 16-bit delta to the previous one: milliseconds, and weight in
+// WEIGHT_RESOLUTION steps. When full, every group of four points is reduced
+// to its lowest and highest point, so peaks and dips survive while the older
+// part of the history gets coarser. Nothing is allocated after construction;
+// readers iterate in place, decoding on the fly.
+template <size_t Capacity>
+class SampleHistory
+{
+    static_assert(Capacity >= 4 && Capacity % 4 == 0, "Capacity must be a multiple of 4");
+
+public:
+    static constexpr float WEIGHT_RESOLUTION = 0.01; // g
+
+    struct Point
+    {
+        uint32_t timestampMs;
+        float weight;
+    };
+
+    class Iterator
+    {
+    public:
+        Iterator(const SampleHistory *history, size_t index)
+            : history(history), index(index), timestampMs(history->baseMs), counts(0)
+        {
+            decode();
+        }
+
+        Point operator*() const { return {timestampMs, history->baseWeight + counts * WEIGHT_RESOLUTION}; }
+        Iterator &operator++()
+        {
+            index++;
+            decode();
+            return *this;
+        }
+        bool operator!=(const Iterator &other) const { return index != other.index; }
+
+    private:
+        void decode()
+        {
+            if (index < history->count)
+            {
+                timestampMs += history->entries[index].deltaMs;
+                counts += history->entries[index].deltaCounts;
+            }
+        }
+
+        const SampleHistory *history;
+        size_t index;
+        uint32_t timestampMs;
+        int32_t counts;
+    };
+
+    SampleHistory() { clear(); }
+
+    void clear()
+    {
+        count = 0;
+        decimations = 0;
+        baseMs = lastMs = 0;
+        baseWeight = 0;
+        lastCounts = 0;
+    }
+
+    void add(uint32_t timestampMs, float weight)
+    {
+        if (count == 0)
+        {
+            baseMs = lastMs = timestampMs;
+            baseWeight = weight;
+            lastCounts = 0;
+        }
+        else if (count == Capacity)
+        {
+            decimate();
+        }
+        float scaled = (weight - baseWeight) / WEIGHT_RESOLUTION;
+        append(timestampMs, static_cast<int32_t>(scaled < 0 ? scaled - 0.5f : scaled + 0.5f));
+    }
+
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, count); }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    static constexpr size_t capacity() { return Capacity; }
+    uint16_t getDecimationCount() const { return decimations; }
+
+private:
+    struct Entry
+    {
+        uint16_t deltaMs;
+        int16_t deltaCounts;
+    };
+
+    // Deltas that do not fit are saturated; the next point then carries the
+    // remainder, so one gap over 65 s or a 327 g jump smears over two points.
+    void append(uint32_t timestampMs, int32_t counts)
+    {
+        uint32_t deltaMs = timestampMs - lastMs;
+        int32_t deltaCounts = counts - lastCounts;
+        deltaMs = deltaMs > UINT16_MAX ? UINT16_MAX : deltaMs;
+        deltaCounts = deltaCounts > INT16_MAX ? INT16_MAX : (deltaCounts < INT16_MIN ? INT16_MIN : deltaCounts);
+        entries[count].deltaMs = deltaMs;
+        entries[count].deltaCounts = deltaCounts;
+        lastMs += deltaMs;
+        lastCounts += deltaCounts;
+        count++;
+    }
+
+    // Keeps the lowest and highest point of every group of four, in time
+    // order. Re-encodes in place: the write position never passes the read.
+    void decimate()
+    {
+        uint32_t readMs = baseMs;
+        int32_t readCounts = 0;
+        size_t readCount = count;
+        count = 0;
+        lastMs = baseMs;
+        lastCounts = 0;
+
+        for (size_t group = 0; group < readCount; group += 4)
+        {
+            uint32_t times[4];
+            int32_t values[4];
+            size_t low = 0;
+            size_t high = 0;
+            for (size_t i = 0; i < 4; i++)
+            {
+                readMs += entries[group + i].deltaMs;
+                readCounts += entries[group + i].deltaCounts;
+                times[i] = readMs;
+                values[i] = readCounts;
+                low = values[i] < values[low] ? i : low;
+                high = values[i] > values[high] ? i : high;
+            }
+            if (low == high)
+            {
+                high = 3; // Flat group: keep its first and last point
+            }
+            size_t first = low < high ? low : high;
+            size_t second = low < high ? high : low;
+            append(times[first], values[first]);
+            append(times[second], values[second]);
+        }
+        decimations++;
+    }
+
+    Entry entries[Capacity];
+    size_t count;
+    uint16_t decimations;
+    uint32_t baseMs;
+    float baseWeight;
+    uint32_t lastMs;
+    int32_t lastCounts;
+};
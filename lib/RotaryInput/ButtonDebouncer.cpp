@@ -0,0 +1,34 @@
+#include "ButtonDebouncer.h"
+
+ButtonDebouncer::ButtonDebouncer() : pressed(false), bouncing(false), bounceStartMs(0), dropped(0)
+{
+}
+
+void IRAM_ATTR ButtonDebouncer::onEdge(uint32_t nowMs)
+{
+    if (!bouncing.exchange(true, std::memory_order_acq_rel))
+    {
+        bounceStartMs.store(nowMs, std::memory_order_relaxed);
+    }
+}
+
+bool ButtonDebouncer::settle(bool pressed)
+{
+    uint32_t startMs = bounceStartMs.load(std::memory_order_relaxed);
+    bouncing.store(false, std::memory_order_release);
+    if (pressed == this->pressed)
+    {
+        return false; // A glitch, back where it was
+    }
+    this->pressed = pressed;
+    if (!edges.tryPush({pressed, startMs}))
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool ButtonDebouncer::poll(HalInput::ButtonEdge &edge)
+{
+    return edges.tryPop(edge);
+}
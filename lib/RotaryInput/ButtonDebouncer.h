@@ -0,0 +1,33 @@
+#pragma once
+#include <atomic>
+#include "BoundedQueue.h"
+#include "Hal.h"
+
+// Debounces a push button in the interrupt and timer domain. Every edge of
+// the pin (re)starts a one-shot timer; when the pin has been quiet for
+// SETTLE_US, the timer takes its level. Each press and release is queued
+// with the time of its first bounce, so the reader may come late without
+// losing one or misjudging how long the button was held.
+class ButtonDebouncer
+{
+public:
+    static const uint32_t SETTLE_US = 10000;
+    static const size_t QUEUE_SIZE = 16;
+
+    ButtonDebouncer();
+    // From the pin interrupt; the caller restarts its timer for SETTLE_US
+    void IRAM_ATTR onEdge(uint32_t nowMs);
+    // From the timer with the quiet pin's level; true when it was a press or release
+    bool settle(bool pressed);
+
+    bool poll(HalInput::ButtonEdge &edge);
+    bool isPressed() const { return pressed; }
+    uint32_t getDroppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    bool pressed;
+    std::atomic<bool> bouncing;
+    std::atomic<uint32_t> bounceStartMs;
+    BoundedQueue<HalInput::ButtonEdge, QUEUE_SIZE> edges;
+    std::atomic<uint32_t> dropped;
+};
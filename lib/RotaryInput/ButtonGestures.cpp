@@ -0,0 +1,85 @@
+#include "ButtonGestures.h"
+
+ButtonGestures::ButtonGestures() : state(State::IDLE), pressedMs(0), releasedMs(0), longReported(false)
+{
+}
+
+ButtonGestures::Gesture ButtonGestures::add(const HalInput::ButtonEdge &edge)
+{
+    if (edge.pressed)
+    {
+        Gesture gesture = NONE;
+        if (state == State::RELEASED && edge.timestampMs - releasedMs <= CLICK_MS)
+        {
+            state = State::PRESSED_AGAIN;
+        }
+        else
+        {
+            // The click before is over, even if update() has not seen it yet
+            gesture = state == State::RELEASED ? CLICK : NONE;
+            state = State::PRESSED;
+        }
+        pressedMs = edge.timestampMs;
+        longReported = false;
+        return gesture;
+    }
+
+    switch (state)
+    {
+    case State::PRESSED:
+        return release(edge.timestampMs, NONE);
+    case State::PRESSED_AGAIN:
+        return release(edge.timestampMs, DOUBLE_CLICK);
+    default:
+        return NONE;
+    }
+}
+
+ButtonGestures::Gesture ButtonGestures::release(uint32_t atMs, Gesture click)
+{
+    bool held = atMs - pressedMs >= LONG_PRESS_MS;
+    if (longReported || held)
+    {
+        state = State::IDLE;
+        return longReported ? NONE : LONG_PRESS; // Late, but not lost
+    }
+    if (click == NONE)
+    {
+        state = State::RELEASED;
+        releasedMs = atMs;
+        return NONE;
+    }
+    state = State::IDLE;
+    return click;
+}
+
+ButtonGestures::Gesture ButtonGestures::update(uint32_t nowMs)
+{
+    if (state == State::RELEASED && nowMs - releasedMs > CLICK_MS)
+    {
+        state = State::IDLE;
+        return CLICK;
+    }
+    if ((state == State::PRESSED || state == State::PRESSED_AGAIN) && !longReported &&
+        nowMs - pressedMs >= LONG_PRESS_MS)
+    {
+        longReported = true;
+        return LONG_PRESS;
+    }
+    return NONE;
+}
+
+bool ButtonGestures::getDeadline(uint32_t &atMs) const
+{
+    if (state == State::RELEASED)
+    {
+        atMs = releasedMs + CLICK_MS + 1;
+        return true;
+    }
+    if ((state == State::PRESSED || state == State::PRESSED_AGAIN) && !longReported)
+    {
+        atMs = pressedMs + LONG_PRESS_MS;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "Hal.h"
+
+// Clicks, double clicks and long presses from the debounced, timestamped
+// edges of a button. All timing comes from the edges' timestamps and the
+// time passed to update(), so a reader that runs late reports the same
+// gestures, only later.
+class ButtonGestures
+{
+public:
+    enum Gesture
+    {
+        NONE,
+        CLICK,
+        DOUBLE_CLICK,
+        LONG_PRESS // Reported while still held, once
+    };
+
+    static const uint32_t CLICK_MS = 400;      // For the second click of a double click
+    static const uint32_t LONG_PRESS_MS = 800;
+
+    ButtonGestures();
+    // Edges in order; returns what the edge completed
+    Gesture add(const HalInput::ButtonEdge &edge);
+    // What came due without an edge: a single click, a long press
+    Gesture update(uint32_t nowMs);
+    // When update() may next report, false while it cannot without an edge
+    bool getDeadline(uint32_t &atMs) const;
+
+private:
+    enum class State
+    {
+        IDLE,
+        PRESSED,
+        RELEASED, // One click, unless a second follows within CLICK_MS
+        PRESSED_AGAIN
+    };
+
+    Gesture release(uint32_t atMs, Gesture click);
+
+    State state;
+    uint32_t pressedMs;
+    uint32_t releasedMs;
+    bool longReported;
+};
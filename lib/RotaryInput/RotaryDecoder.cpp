@@ -0,0 +1,58 @@
+#include "RotaryDecoder.h"
+
+namespace
+{
+    // Quarter steps by previous state * 4 + current state; a jump over two
+    // states cannot tell the direction and counts as none
+    const int8_t QUARTER_STEPS[16] = {0, 1, -1, 0, -1, 0, 0, 1, 1, 0, 0, -1, 0, -1, 1, 0};
+}
+
+RotaryDecoder::RotaryDecoder()
+    : state(REST), quarters(0), lastDirection(0), lastDetentUs(0), position(0), acceleratedPosition(0)
+{
+}
+
+void RotaryDecoder::begin(uint8_t levels)
+{
+    state = levels & 3;
+    quarters = 0;
+}
+
+bool IRAM_ATTR RotaryDecoder::update(uint8_t levels, uint32_t nowUs)
+{
+    levels &= 3;
+    quarters += QUARTER_STEPS[(state << 2) | levels];
+    state = levels;
+    if (state != REST)
+    {
+        return false;
+    }
+
+    int8_t direction = quarters >= 2 ? 1 : (quarters <= -2 ? -1 : 0);
+    quarters = 0;
+    if (direction == 0)
+    {
+        return false;
+    }
+    int32_t factor = getFactor(direction, nowUs);
+    lastDirection = direction;
+    lastDetentUs = nowUs;
+    position.fetch_add(direction, std::memory_order_relaxed);
+    acceleratedPosition.fetch_add(direction * factor, std::memory_order_relaxed);
+    return true;
+}
+
+int32_t RotaryDecoder::getFactor(int8_t direction, uint32_t nowUs) const
+{
+    uint32_t intervalUs = nowUs - lastDetentUs;
+    // A turn back is a correction: fine steps
+    if (direction != lastDirection || intervalUs >= SLOW_US)
+    {
+        return 1;
+    }
+    if (intervalUs <= FAST_US)
+    {
+        return MAX_FACTOR;
+    }
+    return 1 + static_cast<int32_t>((SLOW_US - intervalUs) * (MAX_FACTOR - 1) / (SLOW_US - FAST_US));
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+
+// Quadrature decoder for a detented rotary encoder, run from the pin
+// interrupts of both channels. Every valid transition between the four
+// Gray-code states is a quarter step; a detent counts once the encoder is
+// back at rest (both channels high) at least half a detent further, so a
+// bouncing contact that goes back and forth adds nothing and one missed
+// edge loses nothing.
+//
+// Each detent also adds to an accelerated position, weighted by how fast the
+// knob turns: 1 below SLOW_US between detents, rising to MAX_FACTOR at
+// FAST_US. The time is taken per detent in the interrupt, so a late reader
+// sees the same acceleration as a fast one.
+class RotaryDecoder
+{
+public:
+    static const uint32_t SLOW_US = 100000;
+    static const uint32_t FAST_US = 10000;
+    static const int32_t MAX_FACTOR = 10;
+
+    RotaryDecoder();
+    // Levels of both channels, A in bit 1 and B in bit 0
+    void begin(uint8_t levels);
+    // From the pin interrupt after any edge; true when a detent was completed
+    bool IRAM_ATTR update(uint8_t levels, uint32_t nowUs);
+
+    int32_t getPosition() const { return position.load(std::memory_order_relaxed); }
+    int32_t getAcceleratedPosition() const { return acceleratedPosition.load(std::memory_order_relaxed); }
+
+private:
+    static const uint8_t REST = 3;
+
+    int32_t getFactor(int8_t direction, uint32_t nowUs) const;
+
+    uint8_t state;
+    int8_t quarters; // Since the last rest
+    int8_t lastDirection;
+    uint32_t lastDetentUs;
+    std::atomic<int32_t> position;
+    std::atomic<int32_t> acceleratedPosition;
+};
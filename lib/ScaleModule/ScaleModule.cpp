@@ -1,92 +1,248 @@
 #include "ScaleModule.h"
-#include "HX711.h"
-
-HX711 scale;
-
-ScaleModule::ScaleModule(int dataPin, int clockPin) : dataPin(dataPin), clockPin(clockPin)
+#include "CalibrationStore.h"
+#include "Logger.h"
+#include "Profiler.h"
+#include <math.h>
+
+ScaleModule::ScaleModule(WeightSampler &sampler, HalThermometer *thermometer, CalibrationStore *calibrationStore)
+    : sampler(sampler), thermometer(thermometer), calibrationStore(calibrationStore), zeroed(false),
+      stableSinceMs(0), lastSampleCount(0), lastTrackCount(0), segmentValid(false), segmentRaw(0),
+      segmentTemperature(0), temperatureRead(false), lastTemperatureMs(0), temperature(0), driftCovariance(0),
+      temperatureVariance(0), pointCount(0), calibrating(false), measuring(false), measuredWeight(0)
 {
-    Serial.println("Initializing the scale");
-    scale.begin(dataPin, clockPin);
-    scale.set_scale(2111.45);
-    scale.tare();
-    if (scale.is_ready())
-    {
-        Serial.println("Scale is ready");
-    }
-    else
-    {
-        Serial.println("Scale is not ready");
-    }
 }
 
 void ScaleModule::tare()
 {
-    scale.tare();
+    sampler.tare();
 }
 
 float ScaleModule::getWeight()
 {
-    return scale.get_units(10);
+    return sampler.getSmoothedWeight();
+}
+
+float ScaleModule::getZeroDriftPerDegree() const
+{
+    return sampler.getCompensation().zeroPerDegree / sampler.getScale();
 }
 
-void ScaleModule::calibrate()
+void ScaleModule::update(bool idle)
 {
-    if (scale.is_ready())
-    {
-        scale.set_scale();
-        Serial.println("Tare... remove any weights from the scale.");
-        delay(5000);
-        scale.tare();
-        Serial.println("Tare done...");
-        Serial.print("Place a known weight on the scale...");
-        delay(5000);
-        long reading = scale.get_units(10);
-        Serial.print("Result: ");
-        Serial.println(reading);
+    ProfileScope profile(Profiler::SCALE_UPDATE);
+    updateTemperature();
+    if (!idle)
+    {
+        zeroed = false;
+        stableSinceMs = Hal::millis();
+        return;
     }
-    else
+
+    uint32_t count = sampler.getSampleCount();
+    if (count == lastSampleCount)
     {
-        Serial.println("HX711 not found.");
         return;
     }
-    // calibration factor will be the (reading)/(known weight)
-    float knownWeight = 100.0;
-    float calibrationFactor = scale.get_units(10) / knownWeight;
-    Serial.print("Calibration factor: ");
-    Serial.println(calibrationFactor);
+    lastSampleCount = count;
 
-    // Serial.println("Before setting up the scale:");
-    // Serial.print("read: \t\t");
-    // Serial.println(scale.read()); // print a raw reading from the ADC
+    float meanRaw;
+    if (!readStable(meanRaw))
+    {
+        zeroed = false;
+        stableSinceMs = Hal::millis();
+        return;
+    }
+    if (Hal::millis() - stableSinceMs < ZERO_HOLD_MS)
+    {
+        return;
+    }
 
-    // Serial.print("read average: \t\t");
-    // Serial.println(scale.read_average(20)); // print the average of 20 readings from the ADC
+    if (measuring)
+    {
+        points[pointCount++] = {meanRaw, measuredWeight};
+        measuring = false;
+        LOG_INFO("Calibration point {}: {}g at {} counts", pointCount, measuredWeight, meanRaw);
+        return;
+    }
+    // One zero update per window of fresh conversions, none while calibrating
+    if (!calibrating && count - lastTrackCount >= STABLE_WINDOW)
+    {
+        lastTrackCount = count;
+        trackZero(meanRaw);
+    }
+}
 
-    // Serial.print("get value: \t\t");
-    // Serial.println(scale.get_value(5)); // print the average of 5 readings from the ADC minus the tare weight (not set yet)
+bool ScaleModule::readStable(float &meanRaw)
+{
+    WeightSampler::Sample buffer[STABLE_WINDOW];
+    size_t n = sampler.getLatestSamples(buffer, STABLE_WINDOW);
+    if (n < STABLE_WINDOW)
+    {
+        return false;
+    }
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += buffer[i].raw;
+    }
+    meanRaw = static_cast<float>(sum) / n;
+    float variance = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        variance += (buffer[i].raw - meanRaw) * (buffer[i].raw - meanRaw);
+    }
+    float deviation = sqrtf(variance / (n - 1)) / sampler.getScale();
+    return fabsf(deviation) <= MAX_DEVIATION;
+}
 
-    // Serial.print("get units: \t\t");
-    // Serial.println(scale.get_units(5), 1); // print the average of 5 readings from the ADC minus tare weight (not set) divided
-    //                                        // by the SCALE parameter (not set yet)
+void ScaleModule::trackZero(float meanRaw)
+{
+    float zero = sampler.getEffectiveOffset();
+    float deviation = (meanRaw - zero) / sampler.getScale();
+    if (fabsf(deviation) > TRACK_BAND)
+    {
+        // A load was put on or taken off: zero it like a tare
+        sampler.setOffset(lroundf(meanRaw));
+        segmentValid = false;
+        LOG_INFO("Zeroed a load change of {}g", deviation);
+    }
+    if (!segmentValid)
+    {
+        // The temperature drift is measured against this load from now on
+        segmentValid = true;
+        segmentRaw = meanRaw;
+        segmentTemperature = temperature;
+    }
+    else
+    {
+        learnDrift(meanRaw - segmentRaw, temperature - segmentTemperature);
+        sampler.setOffset(lroundf(zero + TRACK_GAIN * (meanRaw - zero)));
+    }
+    zeroed = true;
+}
 
-    // scale.set_scale(calibrationFactor);
-    // // scale.set_scale(-471.497);                      // this value is obtained by calibrating the scale with known weights; see the README for details
-    // scale.tare(); // reset the scale to 0
+void ScaleModule::learnDrift(float zeroChange, float temperatureChange)
+{
+    if (!thermometer)
+    {
+        return;
+    }
+    driftCovariance = TEMPERATURE_MEMORY * driftCovariance + temperatureChange * zeroChange;
+    temperatureVariance = TEMPERATURE_MEMORY * temperatureVariance + temperatureChange * temperatureChange;
+    if (temperatureVariance >= MIN_TEMPERATURE_SPREAD)
+    {
+        WeightSampler::Compensation compensation = sampler.getCompensation();
+        compensation.zeroPerDegree = driftCovariance / temperatureVariance;
+        sampler.setCompensation(compensation);
+    }
+}
 
-    // Serial.println("After setting up the scale:");
+void ScaleModule::updateTemperature()
+{
+    if (!thermometer || (temperatureRead && Hal::millis() - lastTemperatureMs < TEMPERATURE_INTERVAL_MS))
+    {
+        return;
+    }
+    temperatureRead = true;
+    lastTemperatureMs = Hal::millis();
+    temperature = thermometer->read();
+    sampler.setTemperature(temperature);
+}
 
-    // Serial.print("read: \t\t");
-    // Serial.println(scale.read()); // print a raw reading from the ADC
+void ScaleModule::startCalibration()
+{
+    pointCount = 0;
+    calibrating = true;
+    measuring = false;
+    LOG_INFO("Calibration started; empty the platform");
+}
 
-    // Serial.print("read average: \t\t");
-    // Serial.println(scale.read_average(20)); // print the average of 20 readings from the ADC
+void ScaleModule::measurePoint(float knownWeight)
+{
+    if (!calibrating || pointCount >= MAX_POINTS)
+    {
+        LOG_WARNING("No room for another calibration point");
+        return;
+    }
+    if (pointCount == 0 && knownWeight != 0)
+    {
+        LOG_WARNING("The first calibration point is the empty platform");
+        return;
+    }
+    measuredWeight = knownWeight;
+    measuring = true;
+    stableSinceMs = Hal::millis(); // The weight is only just placed
+}
 
-    // Serial.print("get value: \t\t");
-    // Serial.println(scale.get_value(5)); // print the average of 5 readings from the ADC minus the tare weight, set with tare()
+bool ScaleModule::finishCalibration(uint8_t order, float &maxResidual)
+{
+    order = order == 2 ? 2 : 1;
+    if (measuring || pointCount < order + 1)
+    {
+        LOG_WARNING("Calibration needs the empty platform and {} known weights", order);
+        return false;
+    }
 
-    // Serial.print("get units: \t\t");
-    // Serial.println(scale.get_units(5), 1); // print the average of 5 readings from the ADC minus tare weight, divided
-    // by the SCALE parameter set with set_scale
+    // Least squares of grams = a * c + b * c^2 through the empty platform,
+    // c the counts above it. Double: c^4 is far beyond float precision.
+    double c2 = 0, c3 = 0, c4 = 0, cg = 0, c2g = 0;
+    float zeroRaw = points[0].raw;
+    for (uint8_t i = 1; i < pointCount; i++)
+    {
+        double c = points[i].raw - zeroRaw;
+        if (points[i].grams != 0 && fabs(c) <= MAX_DEVIATION * fabs(sampler.getScale()))
+        {
+            LOG_WARNING("Calibration weight {}g reads as the empty platform", points[i].grams);
+            return false;
+        }
+        c2 += c * c;
+        c3 += c * c * c;
+        c4 += c * c * c * c;
+        cg += c * points[i].grams;
+        c2g += c * c * points[i].grams;
+    }
+    double a = cg / c2;
+    double b = 0;
+    if (order == 2)
+    {
+        // Never negative; about zero when the weights all read alike
+        double determinant = c2 * c4 - c3 * c3;
+        if (!(determinant > MIN_FIT_SPREAD * c2 * c4))
+        {
+            LOG_WARNING("Calibration weights too much alike for a quadratic fit");
+            return false;
+        }
+        a = (cg * c4 - c2g * c3) / determinant;
+        b = (c2 * c2g - c3 * cg) / determinant;
+    }
+    if (!isfinite(1 / a) || !isfinite(b / (a * a)))
+    {
+        LOG_WARNING("Calibration fit is degenerate");
+        return false;
+    }
 
-    // Serial.println("Readings:");
+    maxResidual = 0;
+    for (uint8_t i = 1; i < pointCount; i++)
+    {
+        double c = points[i].raw - zeroRaw;
+        float residual = fabs(a * c + b * c * c - points[i].grams);
+        maxResidual = residual > maxResidual ? residual : maxResidual;
+    }
+
+    // The sampler applies grams = g + curvature * g^2 with g = c / scale
+    WeightSampler::Compensation compensation = sampler.getCompensation();
+    compensation.curvature = b / (a * a);
+    compensation.referenceTemperature = temperature;
+    sampler.setScale(1 / a);
+    sampler.setCompensation(compensation);
+    sampler.setOffset(lroundf(zeroRaw));
+    calibrating = false;
+    segmentValid = false;
+    if (calibrationStore)
+    {
+        calibrationStore->saveScale(sampler);
+    }
+    LOG_INFO("Calibrated from {} points: scale {}, curvature {}, residual {}g", pointCount, sampler.getScale(),
+             compensation.curvature, maxResidual);
+    return true;
 }
@@ -1,17 +1,93 @@
 #ifndef SCALE_MODULE_H
 #define SCALE_MODULE_H
 
+#include "WeightSampler.h"
+
+class CalibrationStore;
+
+// Owns the zero and the calibration of the scale.
+//
+// While the platform is idle the zero is tracked in the background: a small
+// drift is followed, a new load (a container put on or taken off) is zeroed
+// once it has been stable for ZERO_HOLD_MS. A dispense can then start from
+// the tracked zero instead of a tare. How the zero drifts with temperature is
+// learned along the way and applied while the platform is busy.
+//
+// Calibration takes known weights one at a time, each once the reading is
+// stable, and fits a line or a parabola through all of them. Nothing blocks;
+// everything runs from update().
 class ScaleModule
 {
 public:
-    ScaleModule(int dataPin, int clockPin);
-    void tare();
-    float getWeight(); // Returns weight in grams
-    void calibrate();
+    static const uint8_t MAX_POINTS = 8;
+    static const uint8_t STABLE_WINDOW = 10;          // Conversions per zero or calibration reading
+    static const uint32_t ZERO_HOLD_MS = 2000;
+    static const uint32_t TEMPERATURE_INTERVAL_MS = 1000;
+    static constexpr float MAX_DEVIATION = 0.05;      // g, standard deviation of a stable window
+    static constexpr float TRACK_BAND = 0.2;          // g; beyond it a load was put on or taken off
+    static constexpr float TRACK_GAIN = 0.2;          // Of the drift followed per stable window
+    static constexpr float MIN_TEMPERATURE_SPREAD = 25; // Summed squared degrees C before the drift is applied
+    static constexpr float TEMPERATURE_MEMORY = 0.999;  // Per zero update, about a quarter of an hour
+    static constexpr double MIN_FIT_SPREAD = 1e-4;    // Of the quadratic fit's determinant to c2 * c4
+
+    ScaleModule(WeightSampler &sampler, HalThermometer *thermometer = nullptr,
+                CalibrationStore *calibrationStore = nullptr);
+    void tare();       // Non-blocking, see WeightSampler::tare()
+    float getWeight(); // Returns weight in grams, spikes rejected
+
+    // Call from the control loop; idle: nothing is dispensed or moving
+    void update(bool idle);
+    // The zero belongs to the load on the platform right now
+    bool isZeroed() const { return zeroed; }
+    float getZeroDriftPerDegree() const; // g, 0 until learned
+
+    // Multi-point calibration: measurePoint(0) with the platform empty first,
+    // then one call per known weight, each after isMeasuring() turned false.
+    void startCalibration();
+    void measurePoint(float knownWeight);
+    bool isMeasuring() const { return measuring; }
+    uint8_t getPointCount() const { return pointCount; }
+    // Order 1: linear, 2: quadratic. Applies and stores the fit, false if
+    // there are too few points or they do not pin it down, e.g. a weight
+    // that reads as the empty platform. The largest residual is in g.
+    bool finishCalibration(uint8_t order, float &maxResidual);
 
 private:
-    int dataPin;
-    int clockPin;
+    struct Point
+    {
+        float raw; // Mean of a stable window
+        float grams;
+    };
+
+    bool readStable(float &meanRaw);
+    void trackZero(float meanRaw);
+    void learnDrift(float zeroChange, float temperatureChange);
+    void updateTemperature();
+
+    WeightSampler &sampler;
+    HalThermometer *thermometer;
+    CalibrationStore *calibrationStore;
+
+    bool zeroed;
+    uint32_t stableSinceMs;
+    uint32_t lastSampleCount;
+    uint32_t lastTrackCount;
+    // The load the zero is tracked on, for the drift against temperature
+    bool segmentValid;
+    float segmentRaw;
+    float segmentTemperature;
+    bool temperatureRead;
+    uint32_t lastTemperatureMs;
+    float temperature;
+    // Zero change against temperature change, exponentially forgotten
+    float driftCovariance;
+    float temperatureVariance;
+
+    Point points[MAX_POINTS];
+    uint8_t pointCount;
+    bool calibrating;
+    bool measuring;
+    float measuredWeight;
 };
 
 #endif
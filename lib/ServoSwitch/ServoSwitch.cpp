@@ -1,17 +1,36 @@
 #include "ServoSwitch.h"
+#include "Telemetry.h"
 
-ServoSwitch::ServoSwitch(int pin, const char *name) : servoPin(pin), servoName(name), openState(false)
+ServoSwitch::ServoSwitch(HalServo &servo, const char *name)
+    : servo(servo), servoName(name), timer(nullptr), openState(false), settledAtUs(0)
 {
+}
 
-    servo.setPeriodHertz(50);          // Standard 50hz servo
-    servo.attach(servoPin, 500, 2400); // Attach the servo on a pin (GPIO) with 500us-2400us pulse width range
-    close();                           // Ensure the switch starts closed
+ServoSwitch::~ServoSwitch()
+{
+    delete timer;
+}
+
+void ServoSwitch::write(int angle)
+{
+    servo.write(angle);
+    settledAtUs = Hal::micros() + TRAVEL_US;
+}
+
+void ServoSwitch::begin()
+{
+    if (!timer)
+    {
+        timer = Hal::clock().createTimer(&ServoSwitch::onPressed, this);
+    }
+    servo.attach();
+    close(); // Ensure the switch starts closed
 }
 
 void ServoSwitch::set(int angle)
 {
     // this->attach();
-    servo.write(angle);
+    write(angle);
     // this->relax();
 }
 
@@ -19,9 +38,13 @@ void ServoSwitch::open()
 {
     // this->attach();
     // Serial.println("Opening switch");
-    servo.write(0); // Assuming 90° is the open position
+    if (timer)
+    {
+        timer->stop(); // A close still easing off
+    }
+    write(OPEN_ANGLE);
     openState = true;
-    delay(200);
+    Telemetry::edge(servoName, true);
     // this->relax();
 }
 
@@ -29,13 +52,24 @@ void ServoSwitch::close()
 {
     // this->attach();
     // Serial.println("Closing switch");
-    servo.write(70); // Assuming 0° is the closed position
-    delay(200);
-    servo.write(55); // Assuming 0° is the closed position
     openState = false;
+    Telemetry::edge(servoName, false);
+    if (!timer)
+    {
+        write(CLOSED_ANGLE); // Before begin()
+        return;
+    }
+    write(PRESS_ANGLE);
+    timer->start(CLOSE_PRESS_US);
+    settledAtUs = Hal::micros() + CLOSE_PRESS_US + TRAVEL_US; // Including the easing off
     // this->relax();
 }
 
+void ServoSwitch::onPressed(void *arg)
+{
+    static_cast<ServoSwitch *>(arg)->write(CLOSED_ANGLE);
+}
+
 bool ServoSwitch::isOpen() const
 {
     return openState;
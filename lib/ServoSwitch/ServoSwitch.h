@@ -1,30 +1,46 @@
 #ifndef SERVO_SWITCH_H
 #define SERVO_SWITCH_H
 
-#include <ESP32Servo.h>
+#include "Hal.h"
 
+// Valve on a hobby servo. Nothing blocks: a move is only commanded, and
+// getSettledAtUs() tells when it is done. Whoever needs the valve in place,
+// the pump or the settle detector, waits for that time on its own.
 class ServoSwitch
 {
 public:
-    ServoSwitch(int pin, const char *name);
+    static const uint32_t TRAVEL_US = 150000; // Worst-case move, the scale sees it as vibration
+    static const uint32_t CLOSE_PRESS_US = 200000; // Pressed past closed this long, then eased off
+
+    ServoSwitch(HalServo &servo, const char *name);
+    ~ServoSwitch();
+    void begin();
     void open();
     void close();
     void set(int angle);
 
     bool isOpen() const;
+    // Hal::micros() when the last commanded move has finished
+    uint32_t getSettledAtUs() const { return settledAtUs; }
     const char *getName() const { return servoName; }
     void relax() { servo.detach(); }
-    void attach()
-    {
-        servo.attach(servoPin, 500, 2400);
-    }
+    void attach() { servo.attach(); }
 
 private:
-    Servo servo; // ESP32Servo instance
-    int servoPin;
+    static const int OPEN_ANGLE = 0;
+    static const int PRESS_ANGLE = 70;
+    static const int CLOSED_ANGLE = 55;
+
+    static void onPressed(void *arg);
+
+    HalServo &servo;
     const char *servoName;
+    HalTimer *timer; // Eases the servo off after a close
     bool openState;
     bool isRelaxed;
+    volatile uint32_t settledAtUs;
+
+    void write(int angle);
 };
 
 #endif
@@ -0,0 +1,222 @@
+#include "DispenseSimulator.h"
+
+DispenseSimulator::DispenseSimulator(const SimConfig &config)
+    : config(config), simClock(ownClock), simGpio(ownGpio), flushValve(simClock), random(config.seed), noise(0.0f, 1.0f),
+      sampleCallback(nullptr), sampleArg(nullptr), nextSampleUs(0),
+      lastTickUs(0), pumpWasOn(false), pumpOnSinceUs(0), pumpOnTimeUs(0),
+      flowLevel(0), sourceFlowRate(0), lineFlowRate(config.flushFlowRate), source(Source::NONE), sourceLiquid(0),
+      scaleContents(0), flushDelivered(0), placedWeight(0), temperature(config.temperature)
+{
+    simClock.addListener(this);
+    Hal::install(&simClock, &simGpio);
+}
+
+DispenseSimulator::DispenseSimulator(DispenseSimulator &host, const SimConfig &config)
+    : config(config), simClock(host.simClock), simGpio(host.simGpio), flushValve(simClock), random(config.seed), noise(0.0f, 1.0f),
+      sampleCallback(nullptr), sampleArg(nullptr), nextSampleUs(0),
+      lastTickUs(simClock.micros()), pumpWasOn(false), pumpOnSinceUs(0), pumpOnTimeUs(0),
+      flowLevel(0), sourceFlowRate(0), lineFlowRate(config.flushFlowRate), source(Source::NONE), sourceLiquid(0),
+      scaleContents(0), flushDelivered(0), placedWeight(0), temperature(config.temperature)
+{
+    simClock.addListener(this);
+}
+
+SimServo &DispenseSimulator::addLiquid(float flowRate)
+{
+    liquidValves.emplace_back(simClock);
+    flowRates.push_back(flowRate);
+    liquidDelivered.push_back(0);
+    return liquidValves.back();
+}
+
+void DispenseSimulator::setFlowCurve(const std::vector<FlowPoint> &curve)
+{
+    flowCurve = curve;
+}
+
+float DispenseSimulator::startupFactor(float runningMs) const
+{
+    if (flowCurve.size() < 2)
+    {
+        return 1.0f - expf(-runningMs / config.startupTimeMs);
+    }
+
+    // Slope of the recorded curve at runningMs relative to its final slope
+    const FlowPoint &a = flowCurve[flowCurve.size() - 2];
+    const FlowPoint &b = flowCurve.back();
+    float fullRate = (b.grams - a.grams) / (b.timeMs - a.timeMs);
+    if (fullRate <= 0)
+    {
+        return 0;
+    }
+    for (size_t i = 1; i < flowCurve.size(); i++)
+    {
+        if (runningMs < flowCurve[i].timeMs)
+        {
+            const FlowPoint &p0 = flowCurve[i - 1];
+            const FlowPoint &p1 = flowCurve[i];
+            float rate = (p1.grams - p0.grams) / (p1.timeMs - p0.timeMs);
+            return constrain(rate / fullRate, 0.0f, 1.0f);
+        }
+    }
+    return 1.0f;
+}
+
+float DispenseSimulator::speedFactor(float duty) const
+{
+    if (duty >= 1)
+    {
+        return 1;
+    }
+    return duty > config.stallDuty ? (duty - config.stallDuty) / (1 - config.stallDuty) : 0;
+}
+
+void DispenseSimulator::begin(SampleCallback callback, void *arg)
+{
+    sampleCallback = callback;
+    sampleArg = arg;
+    nextSampleUs = simClock.micros() + 1000000 / config.samplesPerSecond;
+}
+
+void DispenseSimulator::onTick(uint64_t nowUs)
+{
+    integrate(nowUs);
+    sampleLoadCell(nowUs);
+}
+
+void DispenseSimulator::integrate(uint64_t nowUs)
+{
+    float dt = (nowUs - lastTickUs) / 1e6f;
+    lastTickUs = nowUs;
+
+    float duty = simGpio.getDuty(config.pumpPin);
+    bool pumpOn = duty > 0;
+    if (pumpOn && !pumpWasOn)
+    {
+        pumpOnSinceUs = nowUs;
+    }
+    if (pumpOn)
+    {
+        pumpOnTimeUs += static_cast<uint64_t>(dt * 1e6f);
+    }
+    pumpWasOn = pumpOn;
+
+    // Where the pump is drawing from; a drip keeps going where the flow went
+    float commandedFlow = 0;
+    if (pumpOn)
+    {
+        Source newSource = Source::NONE;
+        if (flushValve.isOpen())
+        {
+            newSource = Source::FLUSH;
+            sourceFlowRate = config.flushFlowRate;
+        }
+        else
+        {
+            for (size_t i = 0; i < liquidValves.size(); i++)
+            {
+                if (liquidValves[i].isOpen())
+                {
+                    newSource = Source::LIQUID;
+                    sourceLiquid = i;
+                    sourceFlowRate = flowRates[i];
+                    break;
+                }
+            }
+        }
+
+        if (newSource != Source::NONE)
+        {
+            source = newSource;
+            // A thick liquid in the line slows water down until it is pushed out, and the other way round
+            float flowRate = config.lineVolume > 0 ? lineFlowRate : sourceFlowRate;
+            commandedFlow = flowRate * speedFactor(duty) * startupFactor((nowUs - pumpOnSinceUs) / 1000.0f);
+        }
+    }
+
+    if (commandedFlow >= flowLevel || sourceFlowRate <= 0)
+    {
+        flowLevel = commandedFlow;
+    }
+    else
+    {
+        float dripTau = config.dripVolume / sourceFlowRate;
+        flowLevel = commandedFlow + (flowLevel - commandedFlow) * expf(-dt / dripTau);
+    }
+
+    float delivered = flowLevel * dt;
+    if (config.lineVolume > 0 && source != Source::NONE)
+    {
+        lineFlowRate += (sourceFlowRate - lineFlowRate) * fminf(delivered / config.lineVolume, 1.0f);
+    }
+    if (source == Source::LIQUID)
+    {
+        liquidDelivered[sourceLiquid] += delivered;
+        scaleContents += delivered;
+    }
+    else if (source == Source::FLUSH)
+    {
+        flushDelivered += delivered;
+        if (config.flushToScale)
+        {
+            scaleContents += delivered;
+        }
+    }
+}
+
+void DispenseSimulator::sampleLoadCell(uint64_t nowUs)
+{
+    if (!sampleCallback)
+    {
+        return;
+    }
+
+    uint32_t intervalUs = 1000000 / config.samplesPerSecond;
+    while (nextSampleUs <= nowUs)
+    {
+        // What the cell reports for the load, with its curvature and temperature drift
+        float load = config.containerWeight + scaleContents + placedWeight;
+        float degrees = temperature - 25.0f;
+        float grams = (load + config.nonlinearity * load * load) * (1 + config.spanDrift * degrees) +
+                      config.zeroDrift * degrees + config.noiseStdDev * noise(random);
+        if (pumpWasOn)
+        {
+            // A slower motor shakes the platform less
+            grams += config.pumpNoiseStdDev * speedFactor(simGpio.getDuty(config.pumpPin)) * noise(random);
+        }
+        if (isAnyValveMoving())
+        {
+            std::uniform_real_distribution<float> spike(-config.vibrationNoise, config.vibrationNoise);
+            grams += spike(random);
+        }
+        if (config.spikeChance > 0)
+        {
+            std::uniform_real_distribution<float> unit(0, 1);
+            if (unit(random) < config.spikeChance)
+            {
+                float size = config.spikeSize * (0.5f + 0.5f * unit(random));
+                grams += unit(random) < 0.5f ? -size : size;
+            }
+        }
+
+        int32_t raw = config.rawOffset + static_cast<int32_t>(lroundf(grams * config.scaleFactor));
+        sampleCallback(sampleArg, raw, static_cast<uint32_t>(nextSampleUs));
+        nextSampleUs += intervalUs;
+    }
+}
+
+bool DispenseSimulator::isAnyValveMoving() const
+{
+    if (flushValve.isMoving())
+    {
+        return true;
+    }
+    for (const SimServo &valve : liquidValves)
+    {
+        if (valve.isMoving())
+        {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <deque>
+#include <random>
+#include <vector>
+#include "SimHal.h"
+
+struct SimConfig
+{
+    int pumpPin = 14;
+
+    // Load cell
+    uint32_t samplesPerSecond = 10;
+    float scaleFactor = 2111.45;
+    int32_t rawOffset = 84210;
+    float containerWeight = 250.0; // g already on the platform
+    float noiseStdDev = 0.02;      // g per conversion
+    float pumpNoiseStdDev = 0.05;  // g extra while the pump runs at full speed
+    float vibrationNoise = 0.3;    // g peak while a servo is moving
+    float spikeChance = 0;         // Per conversion, of a one-conversion spike (a knock, EMI)
+    float spikeSize = 2.0;         // g peak of a spike
+    float nonlinearity = 0;        // 1/g: the cell reads grams + nonlinearity * grams^2
+    float temperature = 25.0;      // Degrees C, see setTemperature()
+    float zeroDrift = 0;           // g per degree C away from 25
+    float spanDrift = 0;           // Relative per degree C away from 25
+
+    // Pump and tubing
+    float startupTimeMs = 50;  // flow ramps up with this time constant (dead time)
+    float stallDuty = 0.15;    // PWM duty the motor starts turning at; the flow rises linearly to full at 1
+    float dripVolume = 0.03;   // g still arriving after a full-flow stop
+    float flushFlowRate = 1.5; // g/s of flush water
+    bool flushToScale = false; // false: flush water goes to the drain
+    float lineVolume = 0;      // g held by the line; > 0: the flow follows what is still in it
+
+    uint32_t seed = 1;
+};
+
+// One point of a recorded pump run: grams on the scale, ms after pump start
+struct FlowPoint
+{
+    float timeMs;
+    float grams;
+};
+
+// Physics model of the dispensing hardware: a PWM-driven pump feeding one
+// shared line through servo valves, a drip tail after the pump stops or slows
+// down and an HX711 load cell with noise. It owns the simulated clock and
+// GPIO and installs them as the active HAL, so PumpController, WeightSampler
+// and ServoSwitch run unmodified against it.
+//
+// Further stations join the clock and GPIO of a first one: each has its own
+// pump pin, valves and load cell, and all of them move in the same time.
+class DispenseSimulator : public SimClock::Listener, public HalLoadCell, public HalThermometer
+{
+public:
+    explicit DispenseSimulator(const SimConfig &config = SimConfig());
+    DispenseSimulator(DispenseSimulator &host, const SimConfig &config);
+
+    SimClock &clock() { return simClock; }
+    SimGpio &gpio() { return simGpio; }
+    HalLoadCell &loadCell() { return *this; }
+    HalThermometer &thermometer() { return *this; }
+    SimServo &flushServo() { return flushValve; }
+    SimServo &addLiquid(float flowRate);
+    SimServo &liquidServo(size_t index) { return liquidValves[index]; }
+    const SimConfig &getConfig() const { return config; }
+
+    // Ground truth, independent of load-cell noise
+    float getScaleContents() const { return scaleContents; }
+    float getLiquidDelivered(size_t index) const { return liquidDelivered[index]; }
+    float getFlushDelivered() const { return flushDelivered; }
+    uint64_t getPumpOnTimeUs() const { return pumpOnTimeUs; }
+
+    // Liquid taken off the platform, e.g. the container is swapped
+    void emptyContainer() { scaleContents = 0; }
+    // A known weight put on the platform next to the container, 0 to take it off
+    void placeWeight(float grams) { placedWeight = grams; }
+    void setTemperature(float celsius) { temperature = celsius; }
+
+    // Replays the start-up shape of a recorded pump run instead of the
+    // modelled dead time. The curve is scaled to each liquid's flow rate.
+    void setFlowCurve(const std::vector<FlowPoint> &curve);
+
+    void begin(SampleCallback callback, void *arg) override;
+    void onTick(uint64_t nowUs) override;
+    float read() override { return temperature; }
+
+private:
+    enum class Source
+    {
+        NONE,
+        FLUSH,
+        LIQUID
+    };
+
+    void integrate(uint64_t nowUs);
+    void sampleLoadCell(uint64_t nowUs);
+    bool isAnyValveMoving() const;
+    float startupFactor(float runningMs) const;
+    float speedFactor(float duty) const;
+
+    SimConfig config;
+    SimClock ownClock; // Unused by a station that joined a host
+    SimGpio ownGpio;
+    SimClock &simClock;
+    SimGpio &simGpio;
+    SimServo flushValve;
+    std::deque<SimServo> liquidValves;
+    std::vector<float> flowRates;
+    std::vector<double> liquidDelivered; // Totals in double: float drifts over long runs
+    std::vector<FlowPoint> flowCurve;
+    std::mt19937 random;
+    std::normal_distribution<float> noise;
+
+    SampleCallback sampleCallback;
+    void *sampleArg;
+    uint64_t nextSampleUs;
+
+    uint64_t lastTickUs;
+    bool pumpWasOn;
+    uint64_t pumpOnSinceUs;
+    uint64_t pumpOnTimeUs;
+    float flowLevel; // g/s currently leaving the outlet
+    float sourceFlowRate;
+    float lineFlowRate; // Of the line content, mixed by what passed through; water at first
+    Source source;
+    size_t sourceLiquid;
+    double scaleContents;
+    double flushDelivered;
+    float placedWeight;
+    float temperature;
+};
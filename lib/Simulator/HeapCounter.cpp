@@ -0,0 +1,32 @@
+#include "HeapCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<uint32_t> allocations(0);
+
+    void *allocate(std::size_t size)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        void *block = std::malloc(size ? size : 1);
+        if (!block)
+        {
+            throw std::bad_alloc();
+        }
+        return block;
+    }
+}
+
+uint32_t HeapCounter::getAllocations()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void *operator new(std::size_t size) { return allocate(size); }
+void *operator new[](std::size_t size) { return allocate(size); }
+void operator delete(void *block) noexcept { std::free(block); }
+void operator delete[](void *block) noexcept { std::free(block); }
+void operator delete(void *block, std::size_t) noexcept { std::free(block); }
+void operator delete[](void *block, std::size_t) noexcept { std::free(block); }
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+// Counts the heap allocations of the host build. The global operator new and
+// delete are replaced in HeapCounter.cpp, linked in with the first call to
+// getAllocations(); a test takes the count around a hot path to assert that
+// it allocates nothing.
+class HeapCounter
+{
+public:
+    static uint32_t getAllocations();
+};
@@ -0,0 +1,220 @@
+#include "SimHal.h"
+#include <cstring>
+#include <fstream>
+
+SimTimer::SimTimer(SimClock &clock, Callback callback, void *arg)
+    : clock(clock), callback(callback), arg(arg), armed(false), deadlineUs(0)
+{
+    clock.timers.push_back(this);
+}
+
+SimTimer::~SimTimer()
+{
+    std::vector<SimTimer *> &timers = clock.timers;
+    timers.erase(std::remove(timers.begin(), timers.end(), this), timers.end());
+}
+
+void SimTimer::start(uint32_t delayUs)
+{
+    deadlineUs = clock.micros() + delayUs;
+    armed = true;
+}
+
+void SimTimer::stop()
+{
+    armed = false;
+}
+
+SimClock::SimClock(uint32_t stepUs) : nowUs(0), stepUs(stepUs)
+{
+}
+
+HalTimer *SimClock::createTimer(HalTimer::Callback callback, void *arg)
+{
+    return new SimTimer(*this, callback, arg);
+}
+
+void SimClock::addListener(Listener *listener)
+{
+    listeners.push_back(listener);
+}
+
+uint64_t SimClock::nextDeadline(uint64_t limitUs) const
+{
+    uint64_t next = limitUs;
+    for (SimTimer *timer : timers)
+    {
+        if (timer->armed && timer->deadlineUs < next)
+        {
+            next = timer->deadlineUs;
+        }
+    }
+    return next;
+}
+
+void SimClock::advance(uint64_t us)
+{
+    uint64_t targetUs = nowUs + us;
+    while (nowUs < targetUs)
+    {
+        uint64_t stepEndUs = nowUs + stepUs < targetUs ? nowUs + stepUs : targetUs;
+        nowUs = nextDeadline(stepEndUs);
+
+        // Listeners integrate up to nowUs with the outputs as they were during
+        // the step; timers due now then change them for the next step.
+        for (Listener *listener : listeners)
+        {
+            listener->onTick(nowUs);
+        }
+
+        for (SimTimer *timer : timers)
+        {
+            if (timer->armed && timer->deadlineUs <= nowUs)
+            {
+                timer->armed = false;
+                timer->callback(timer->arg);
+            }
+        }
+    }
+}
+
+SimGpio::SimGpio()
+{
+    for (int i = 0; i < PIN_COUNT; i++)
+    {
+        levels[i] = LOW;
+        modes[i] = INPUT;
+        duties[i] = 0;
+    }
+}
+
+void SimGpio::pinMode(int pin, int mode)
+{
+    if (pin >= 0 && pin < PIN_COUNT)
+    {
+        modes[pin] = mode;
+    }
+}
+
+void SimGpio::digitalWrite(int pin, int level)
+{
+    if (pin >= 0 && pin < PIN_COUNT)
+    {
+        levels[pin] = level;
+        duties[pin] = level == HIGH ? 1 : 0;
+    }
+}
+
+int SimGpio::digitalRead(int pin)
+{
+    return pin >= 0 && pin < PIN_COUNT ? levels[pin] : LOW;
+}
+
+bool SimGpio::pwmWrite(int pin, float duty)
+{
+    if (pin < 0 || pin >= PIN_COUNT)
+    {
+        return false;
+    }
+    duties[pin] = constrain(duty, 0.0f, 1.0f);
+    levels[pin] = duties[pin] > 0 ? HIGH : LOW;
+    return true;
+}
+
+float SimGpio::getDuty(int pin) const
+{
+    return pin >= 0 && pin < PIN_COUNT ? duties[pin] : 0;
+}
+
+void SimGpio::setInput(int pin, int level)
+{
+    digitalWrite(pin, level);
+}
+
+SimServo::SimServo(SimClock &clock, uint32_t travelUs)
+    : clock(clock), travelUs(travelUs), attached(false), angle(90), wasOpen(false), lastMoveUs(0)
+{
+}
+
+void SimServo::write(int angle)
+{
+    if (!attached || angle == this->angle)
+    {
+        return;
+    }
+    wasOpen = isOpen();
+    this->angle = angle;
+    lastMoveUs = clock.micros();
+}
+
+bool SimServo::isMoving() const
+{
+    return lastMoveUs > 0 && clock.micros() - lastMoveUs < travelUs;
+}
+
+bool SimServo::isOpen() const
+{
+    return isMoving() ? wasOpen : angle < OPEN_BELOW_ANGLE;
+}
+
+FileStorage::FileStorage(const std::string &path) : path(path), writes(0)
+{
+}
+
+bool FileStorage::begin()
+{
+    entries.clear();
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return true; // Nothing stored yet
+    }
+
+    uint8_t keyLength;
+    while (file.read(reinterpret_cast<char *>(&keyLength), 1))
+    {
+        std::string key(keyLength, '\0');
+        uint16_t size;
+        if (!file.read(&key[0], keyLength) || !file.read(reinterpret_cast<char *>(&size), sizeof(size)))
+        {
+            return false;
+        }
+        std::vector<uint8_t> data(size);
+        if (size > 0 && !file.read(reinterpret_cast<char *>(data.data()), size))
+        {
+            return false;
+        }
+        entries[key] = data;
+    }
+    return true;
+}
+
+bool FileStorage::read(const char *key, void *data, size_t size)
+{
+    auto entry = entries.find(key);
+    if (entry == entries.end() || entry->second.size() != size)
+    {
+        return false;
+    }
+    memcpy(data, entry->second.data(), size);
+    return true;
+}
+
+bool FileStorage::write(const char *key, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    entries[key].assign(bytes, bytes + size);
+    writes++;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    for (const auto &entry : entries)
+    {
+        uint8_t keyLength = static_cast<uint8_t>(entry.first.size());
+        uint16_t length = static_cast<uint16_t>(entry.second.size());
+        file.write(reinterpret_cast<const char *>(&keyLength), 1);
+        file.write(entry.first.data(), keyLength);
+        file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+        file.write(reinterpret_cast<const char *>(entry.second.data()), length);
+    }
+    return static_cast<bool>(file);
+}
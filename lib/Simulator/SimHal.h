@@ -0,0 +1,148 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Hal.h"
+
+class SimClock;
+
+class SimTimer : public HalTimer
+{
+public:
+    SimTimer(SimClock &clock, Callback callback, void *arg);
+    ~SimTimer();
+    void start(uint32_t delayUs) override;
+    void stop() override;
+
+private:
+    friend class SimClock;
+
+    SimClock &clock;
+    Callback callback;
+    void *arg;
+    bool armed;
+    uint64_t deadlineUs;
+};
+
+// Virtual clock. Time only moves when advance() or delay() is called, so a
+// dispense that takes 20s on the bench completes in a few milliseconds.
+// Time advances in steps of at most stepUs; listeners run after every step
+// and timers fire exactly at their deadline.
+class SimClock : public HalClock
+{
+public:
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+        virtual void onTick(uint64_t nowUs) = 0;
+    };
+
+    SimClock(uint32_t stepUs = 1000);
+
+    uint32_t millis() override { return static_cast<uint32_t>(nowUs / 1000); }
+    uint64_t micros() override { return nowUs; }
+    void delay(uint32_t ms) override { advance(static_cast<uint64_t>(ms) * 1000); }
+    HalTimer *createTimer(HalTimer::Callback callback, void *arg) override;
+
+    void addListener(Listener *listener);
+    void advance(uint64_t us);
+
+private:
+    friend class SimTimer;
+
+    uint64_t nextDeadline(uint64_t limitUs) const;
+
+    uint64_t nowUs;
+    uint32_t stepUs;
+    std::vector<Listener *> listeners;
+    std::vector<SimTimer *> timers;
+};
+
+class SimGpio : public HalGpio
+{
+public:
+    static const int PIN_COUNT = 40;
+
+    SimGpio();
+    void pinMode(int pin, int mode) override;
+    void digitalWrite(int pin, int level) override;
+    int digitalRead(int pin) override;
+    // A pin with a duty above 0 reads HIGH
+    bool pwmWrite(int pin, float duty) override;
+
+    // Drives an input pin from the simulation side
+    void setInput(int pin, int level);
+    float getDuty(int pin) const; // 1 for a pin driven HIGH
+
+private:
+    int levels[PIN_COUNT];
+    int modes[PIN_COUNT];
+    float duties[PIN_COUNT];
+};
+
+// Servo-driven valve. The valve follows the commanded angle after travelUs.
+class SimServo : public HalServo
+{
+public:
+    static const int OPEN_BELOW_ANGLE = 30;
+
+    SimServo(SimClock &clock, uint32_t travelUs = 150000);
+    void attach() override { attached = true; }
+    void detach() override { attached = false; }
+    void write(int angle) override;
+
+    bool isOpen() const;
+    bool isMoving() const;
+    int getAngle() const { return angle; }
+
+private:
+    SimClock &clock;
+    uint32_t travelUs;
+    bool attached;
+    int angle;
+    bool wasOpen;
+    uint64_t lastMoveUs;
+};
+
+// Display that only counts frames; the UI is not exercised on the host.
+class SimDisplay : public HalDisplay
+{
+public:
+    SimDisplay() : frames(0) {}
+    bool begin() override { return true; }
+    void clear() override {}
+    void setTextSize(uint8_t) override {}
+    void setCursor(int16_t, int16_t) override {}
+    void print(const char *) override {}
+    void print(float, int) override {}
+    void println(const char *) override {}
+    void drawFastHLine(int16_t, int16_t, int16_t) override {}
+    void drawRect(int16_t, int16_t, int16_t, int16_t) override {}
+    void fillRect(int16_t, int16_t, int16_t, int16_t) override {}
+    void show() override { frames++; }
+
+    uint32_t getFrameCount() const { return frames; }
+
+private:
+    uint32_t frames;
+};
+
+// Storage kept in one file, rewritten on every write like an NVS page would be.
+// Each entry: key length (1 byte), key, data length (2 bytes), data.
+class FileStorage : public HalStorage
+{
+public:
+    FileStorage(const std::string &path);
+    bool begin() override;
+    bool read(const char *key, void *data, size_t size) override;
+    bool write(const char *key, const void *data, size_t size) override;
+
+    uint32_t getWriteCount() const { return writes; }
+
+private:
+    std::string path;
+    std::map<std::string, std::vector<uint8_t>> entries;
+    uint32_t writes;
+};
@@ -0,0 +1,338 @@
+#include "TelemetryReplay.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "PumpController.h"
+#include "ScaleModule.h"
+#include "Telemetry.h"
+#include "WeightSampler.h"
+
+TelemetryReplay *TelemetryReplay::replaying = nullptr;
+
+TelemetryReplay::TelemetryReplay(uint32_t edgeToleranceUs)
+    : edgeToleranceUs(edgeToleranceUs), decoder(onRecorded, this), replayDecoder(onReplayed, this), lastTimeUs(0),
+      sampleCallback(nullptr), sampleArg(nullptr), nextSample(0)
+{
+    clock.addListener(this);
+}
+
+bool TelemetryReplay::load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        push(buffer, n);
+    }
+    fclose(file);
+    return true;
+}
+
+void TelemetryReplay::push(const uint8_t *data, size_t length)
+{
+    decoder.push(data, length);
+}
+
+void TelemetryReplay::onRecorded(void *arg, const TelemetryRecord &record)
+{
+    TelemetryReplay &replay = *static_cast<TelemetryReplay *>(arg);
+    uint64_t timeUs = replay.unwrap(record.timestampUs);
+    if (record.type == TelemetryFrame::SAMPLES)
+    {
+        replay.samples.push_back({timeUs, record.raw});
+    }
+    else
+    {
+        replay.records.push_back({timeUs, record});
+    }
+}
+
+// Conversions and events are sent in separate batches, so a timestamp may
+// be a little older than the last one: take the 64-bit time closest to it
+uint64_t TelemetryReplay::unwrap(uint32_t timestampUs)
+{
+    const uint64_t wrap = 1ull << 32;
+    uint64_t timeUs = (lastTimeUs & ~(wrap - 1)) | timestampUs;
+    if (timeUs + wrap / 2 < lastTimeUs)
+    {
+        timeUs += wrap;
+    }
+    else if (timeUs > lastTimeUs + wrap / 2 && timeUs >= wrap)
+    {
+        timeUs -= wrap;
+    }
+    lastTimeUs = timeUs;
+    return timeUs;
+}
+
+void TelemetryReplay::begin(SampleCallback callback, void *arg)
+{
+    sampleCallback = callback;
+    sampleArg = arg;
+}
+
+void TelemetryReplay::onTick(uint64_t nowUs)
+{
+    if (!sampleCallback)
+    {
+        return;
+    }
+    while (nextSample < samples.size() && samples[nextSample].timeUs <= nowUs)
+    {
+        sampleCallback(sampleArg, samples[nextSample].raw, static_cast<uint32_t>(samples[nextSample].timeUs));
+        nextSample++;
+    }
+}
+
+TelemetryReplay::Result TelemetryReplay::run()
+{
+    Result result = {};
+    Hal::install(&clock, &gpio);
+
+    // The controller as it was at boot, with the liquids its jobs used
+    LiquidManager liquids;
+    std::deque<SimServo> servos;
+    std::deque<ServoSwitch> valves;
+    addLiquids(liquids, servos, valves);
+    std::vector<Job> jobs;
+    addJobs(liquids, jobs);
+    result.recordedJobs = jobs.size();
+
+    uint64_t firstUs = UINT64_MAX;
+    uint64_t lastUs = 0;
+    if (!samples.empty())
+    {
+        firstUs = samples.front().timeUs;
+        lastUs = samples.back().timeUs;
+    }
+    for (const Record &r : records)
+    {
+        firstUs = std::min(firstUs, r.timeUs);
+        lastUs = std::max(lastUs, r.timeUs);
+    }
+    if (firstUs == UINT64_MAX)
+    {
+        return result;
+    }
+
+    // Boot when the recording starts, which is when the device booted: its
+    // first records are the valves closing in begin()
+    uint64_t startUs = firstUs / CONTROL_PERIOD_US * CONTROL_PERIOD_US;
+    clock.advance(startUs - clock.micros());
+
+    SimServo flushServo(clock);
+    ServoSwitch flushSwitch(flushServo, "Flush");
+    WeightSampler sampler(*this);
+    ScaleModule scaleModule(sampler);
+    PumpController controller(PUMP_PIN, &flushSwitch);
+    replaying = this;
+    Telemetry::watch(nullptr);
+    Telemetry::setWriter(writeReplayed);
+    flushSwitch.begin();
+    for (ServoSwitch &valve : valves)
+    {
+        valve.begin();
+    }
+    sampler.begin();
+    for (const Record &r : records)
+    {
+        if (r.record.type == TelemetryFrame::ESTIMATE && r.record.estimate == TelemetryFrame::SCALE)
+        {
+            sampler.setScale(r.record.value);
+            break;
+        }
+    }
+    controller.init(&sampler, nullptr, &scaleModule);
+
+    // Like the control task: step the controller, then start what is due
+    size_t nextJob = 0;
+    while (clock.micros() <= lastUs + CONTROL_PERIOD_US)
+    {
+        controller.update();
+        while (nextJob < jobs.size() && jobs[nextJob].timeUs <= clock.micros() && !controller.isBusy())
+        {
+            if (startJob(controller, jobs[nextJob++]))
+            {
+                result.jobs++;
+            }
+        }
+        Telemetry::drain();
+        clock.advance(CONTROL_PERIOD_US);
+    }
+    Telemetry::drain();
+    Telemetry::setWriter(nullptr);
+    replaying = nullptr;
+
+    result.durationUs = clock.micros() - startUs;
+    compare(result);
+    return result;
+}
+
+void TelemetryReplay::addLiquids(LiquidManager &liquids, std::deque<SimServo> &servos,
+                                 std::deque<ServoSwitch> &valves)
+{
+    for (const Record &r : records)
+    {
+        if (r.record.type != TelemetryFrame::JOB || r.record.kind != TelemetryFrame::JOB_DOSE)
+        {
+            continue;
+        }
+        bool known = false;
+        for (const std::string &name : names)
+        {
+            known = known || name == r.record.name;
+        }
+        if (known)
+        {
+            continue;
+        }
+        names.push_back(r.record.name);
+        servos.emplace_back(clock);
+        valves.emplace_back(servos.back(), names.back().c_str());
+        liquids.addLiquid(names.back().c_str(), r.record.value, &valves.back(), r.record.group);
+    }
+
+    // Each liquid as the controller knew it at its first job: that is still
+    // the model it loaded at boot
+    for (int i = 0; i < liquids.getLiquidCount(); i++)
+    {
+        Liquid *liquid = liquids.getLiquid(i);
+        for (const Record &r : records)
+        {
+            if (r.record.type != TelemetryFrame::MODEL || strcmp(r.record.name, liquid->name.c_str()) != 0)
+            {
+                continue;
+            }
+            FlowModel::Parameters parameters;
+            parameters.flowRate = r.record.model[TelemetryFrame::MODEL_FLOW_RATE];
+            parameters.deadTime = r.record.model[TelemetryFrame::MODEL_DEAD_TIME];
+            parameters.dripVolume = r.record.model[TelemetryFrame::MODEL_DRIP_VOLUME];
+            parameters.relativeError = r.record.model[TelemetryFrame::MODEL_RELATIVE_ERROR];
+            parameters.absoluteError = r.record.model[TelemetryFrame::MODEL_ABSOLUTE_ERROR];
+            parameters.stallDuty = r.record.model[TelemetryFrame::MODEL_STALL_DUTY];
+            parameters.pulseCount = r.record.pulseCount;
+            liquid->flowModel.setParameters(parameters);
+            liquid->flushVolume = r.record.model[TelemetryFrame::MODEL_FLUSH_VOLUME];
+            break;
+        }
+    }
+}
+
+void TelemetryReplay::addJobs(LiquidManager &liquids, std::vector<Job> &jobs)
+{
+    Recipe *recipe = nullptr;
+    for (const Record &r : records)
+    {
+        if (r.record.type != TelemetryFrame::JOB)
+        {
+            continue;
+        }
+        if (r.record.kind != TelemetryFrame::JOB_DOSE)
+        {
+            jobs.push_back({r.timeUs, r.record.kind, nullptr});
+            continue;
+        }
+        if (r.record.step == 0)
+        {
+            recipe = liquids.addRecipe("Replay");
+            jobs.push_back({r.timeUs, r.record.kind, recipe});
+        }
+        for (int i = 0; recipe && i < liquids.getLiquidCount(); i++)
+        {
+            if (strcmp(liquids.getLiquid(i)->name.c_str(), r.record.name) == 0)
+            {
+                recipe->addStep(liquids.getLiquid(i), r.record.value);
+                break;
+            }
+        }
+    }
+}
+
+bool TelemetryReplay::startJob(PumpController &controller, const Job &job)
+{
+    switch (job.kind)
+    {
+    case TelemetryFrame::JOB_DOSE:
+        return controller.dispense(job.recipe);
+    case TelemetryFrame::JOB_FLUSH:
+        return controller.flush();
+    case TelemetryFrame::JOB_SESSION_OPEN:
+        return controller.beginSession();
+    case TelemetryFrame::JOB_SESSION_CLOSE:
+        controller.endSession();
+        return true;
+    default:
+        return false;
+    }
+}
+
+void TelemetryReplay::writeReplayed(const uint8_t *data, size_t length)
+{
+    replaying->replayDecoder.push(data, length);
+}
+
+void TelemetryReplay::onReplayed(void *arg, const TelemetryRecord &record)
+{
+    TelemetryReplay &replay = *static_cast<TelemetryReplay *>(arg);
+    if (record.type == TelemetryFrame::EDGE)
+    {
+        replay.replayedEdges.push_back(record);
+    }
+    else if (record.type == TelemetryFrame::ESTIMATE && record.estimate == TelemetryFrame::DOSE)
+    {
+        replay.replayedDoses.push_back(record.value);
+    }
+}
+
+void TelemetryReplay::compare(Result &result) const
+{
+    std::vector<const Record *> edges;
+    std::vector<float> doses;
+    for (const Record &r : records)
+    {
+        if (r.record.type == TelemetryFrame::EDGE)
+        {
+            edges.push_back(&r);
+        }
+        else if (r.record.type == TelemetryFrame::ESTIMATE && r.record.estimate == TelemetryFrame::DOSE)
+        {
+            doses.push_back(r.record.value);
+        }
+    }
+    result.edges = replayedEdges.size();
+    result.recordedEdges = edges.size();
+
+    size_t n = std::min(edges.size(), replayedEdges.size());
+    size_t i = 0;
+    for (; i < n; i++)
+    {
+        const TelemetryRecord &recorded = edges[i]->record;
+        const TelemetryRecord &replayed = replayedEdges[i];
+        uint32_t shiftUs = std::abs(static_cast<int32_t>(replayed.timestampUs - recorded.timestampUs));
+        if (strcmp(recorded.name, replayed.name) != 0 || recorded.on != replayed.on || shiftUs > edgeToleranceUs)
+        {
+            break;
+        }
+        result.matchedEdges++;
+        result.maxEdgeShiftUs = std::max(result.maxEdgeShiftUs, shiftUs);
+    }
+    if (i < edges.size())
+    {
+        result.firstDivergenceUs = edges[i]->timeUs;
+    }
+    else if (i < replayedEdges.size())
+    {
+        result.firstDivergenceUs = replayedEdges[i].timestampUs; // An edge the recording does not have
+    }
+
+    result.doses = std::min(doses.size(), replayedDoses.size());
+    for (size_t d = 0; d < result.doses; d++)
+    {
+        result.maxDoseError = std::max(result.maxDoseError, fabsf(replayedDoses[d] - doses[d]));
+    }
+}
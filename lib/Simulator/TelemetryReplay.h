@@ -0,0 +1,112 @@
+#pragma once
+#include <deque>
+#include <string>
+#include <vector>
+#include "LiquidManager.h"
+#include "SimHal.h"
+#include "TelemetryFrame.h"
+
+class PumpController;
+
+// Runs a telemetry recording (see TelemetryRecorder) through a fresh
+// PumpController on the simulated clock, many times faster than real time.
+// The recorded conversions reach the controller's WeightSampler at their
+// recorded time, and the recorded jobs start at theirs with the liquids as
+// the recorded controller knew them. What the replayed controller does goes
+// out on its own telemetry and is compared with the recording, edge by edge
+// and dose by dose.
+//
+// The load-cell stream is open loop: it shows what the recorded pump did. As
+// long as the replayed controller switches the same actuators at the same
+// time the replay is exact; from the first edge that differs it is not, and
+// firstDivergenceUs tells where that was. A controller change that should
+// not change behaviour replays without a divergence.
+//
+// A recording replays exactly if it started at boot, before the first job:
+// the replay starts from a controller in its boot state, which tares on the
+// first conversions. Temperature is not recorded, so the replay runs without
+// drift compensation.
+class TelemetryReplay : public SimClock::Listener, public HalLoadCell
+{
+public:
+    static const uint32_t CONTROL_PERIOD_US = 1000; // Of the control task
+
+    struct Result
+    {
+        uint32_t jobs;              // Started by the replay
+        uint32_t recordedJobs;
+        uint32_t edges;             // Pump and valve edges of the replayed controller
+        uint32_t recordedEdges;
+        uint32_t matchedEdges;      // Leading edges that equal the recorded ones
+        uint64_t firstDivergenceUs; // When the first edge that differs was due, 0 if none
+        uint32_t maxEdgeShiftUs;    // Among the matched edges
+        uint32_t doses;             // Dose estimates compared
+        float maxDoseError;         // g between a replayed and the recorded dose
+        uint64_t durationUs;        // Simulated time
+    };
+
+    // Edges up to edgeToleranceUs away from the recorded time still match
+    explicit TelemetryReplay(uint32_t edgeToleranceUs = 0);
+    bool load(const char *path);                   // False if the file cannot be read
+    void push(const uint8_t *data, size_t length); // The raw stream, e.g. a capture in memory
+    // Once per instance. Installs its own clock as the HAL and takes over the
+    // telemetry writer while it runs.
+    Result run();
+
+    size_t getSampleCount() const { return samples.size(); }
+    size_t getRecordCount() const { return records.size(); }
+    uint32_t getBadFrameCount() const { return decoder.getBadFrameCount(); }
+
+    void begin(SampleCallback callback, void *arg) override;
+    void onTick(uint64_t nowUs) override;
+
+private:
+    static const int PUMP_PIN = 14;
+
+    struct Sample
+    {
+        uint64_t timeUs;
+        int32_t raw;
+    };
+
+    // A record with its time past the 32-bit wrap
+    struct Record
+    {
+        uint64_t timeUs;
+        TelemetryRecord record;
+    };
+
+    struct Job
+    {
+        uint64_t timeUs;
+        uint8_t kind;
+        const Recipe *recipe;
+    };
+
+    static void onRecorded(void *arg, const TelemetryRecord &record);
+    static void onReplayed(void *arg, const TelemetryRecord &record);
+    static void writeReplayed(const uint8_t *data, size_t length);
+    uint64_t unwrap(uint32_t timestampUs);
+    void addLiquids(LiquidManager &liquids, std::deque<SimServo> &servos, std::deque<ServoSwitch> &valves);
+    void addJobs(LiquidManager &liquids, std::vector<Job> &jobs);
+    static bool startJob(PumpController &controller, const Job &job);
+    void compare(Result &result) const;
+
+    static TelemetryReplay *replaying; // Owner of the telemetry writer during run()
+
+    uint32_t edgeToleranceUs;
+    SimClock clock;
+    SimGpio gpio;
+    TelemetryDecoder decoder;
+    TelemetryDecoder replayDecoder;
+    uint64_t lastTimeUs;
+    std::vector<Sample> samples;
+    std::vector<Record> records; // Everything but the conversions
+    std::vector<TelemetryRecord> replayedEdges;
+    std::vector<float> replayedDoses;
+    std::deque<std::string> names; // The liquids' valves keep a pointer
+
+    SampleCallback sampleCallback;
+    void *sampleArg;
+    size_t nextSample;
+};
@@ -0,0 +1,39 @@
+#include "Station.h"
+
+Station::Station(uint8_t id, int pumpPin, HalLoadCell &loadCell, HalServo &flushServo, HalStorage &storage,
+                 HalThermometer *thermometer)
+    : id(id), weightSampler(loadCell), calibrationStore(storage, id),
+      scaleModule(weightSampler, thermometer, &calibrationStore), flushSwitch(flushServo, "Flush"),
+      pumpController(pumpPin, &flushSwitch), controlLoop(controlLink, pumpController, liquidManager)
+{
+}
+
+void Station::addLiquid(const char *name, float targetAmount, HalServo &valve, uint8_t flushGroup)
+{
+    valves.emplace_back(valve, name);
+    liquidManager.addLiquid(name, targetAmount, &valves.back(), flushGroup);
+}
+
+void Station::setListener(WeightSampler::Listener listener, void *arg)
+{
+    weightSampler.setListener(listener, arg);
+    pumpController.setListener(listener, arg);
+    controlLink.setCommandListener(listener, arg);
+}
+
+bool Station::begin()
+{
+    flushSwitch.begin();
+    for (ServoSwitch &valve : valves)
+    {
+        valve.begin();
+    }
+
+    // Warm start from the calibration and flow models of the last run
+    calibrationStore.begin();
+    calibrationStore.loadLiquids(liquidManager);
+    weightSampler.begin();
+    calibrationStore.loadScale(weightSampler);
+    pumpController.init(&weightSampler, &calibrationStore, &scaleModule);
+    return pumpController.isReady();
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <deque>
+#include "CalibrationStore.h"
+#include "ControlLink.h"
+#include "Hal.h"
+#include "LiquidManager.h"
+#include "PumpController.h"
+#include "ScaleModule.h"
+#include "ServoSwitch.h"
+#include "WeightSampler.h"
+
+// One dispensing station: a pump, a load cell, a flush valve and a valve per
+// liquid, with its own liquids, recipes, calibration and job queue. Several
+// stations run side by side on one controller, stepped by a StationScheduler
+// on the control task. The UI and serial side talk to a station only through
+// getLink(), like to a single-station build.
+class Station
+{
+public:
+    // Stations sharing `storage` keep their calibration apart by id
+    Station(uint8_t id, int pumpPin, HalLoadCell &loadCell, HalServo &flushServo, HalStorage &storage,
+            HalThermometer *thermometer = nullptr);
+
+    // A liquid behind its own valve, before begin(). The name must outlive
+    // the station: a string literal.
+    void addLiquid(const char *name, float targetAmount, HalServo &valve, uint8_t flushGroup = 0);
+    // Valves, sampler, the pump pin and the stored calibration and flow
+    // models. False when the pump pin cannot be driven (no PWM channel left):
+    // the station then refuses every job.
+    bool begin();
+    // Control task only: commands, the PumpController FSM and the status
+    void step() { controlLoop.step(); }
+    // For event-driven stepping: the listener is called, possibly from an
+    // interrupt, whenever step() has something new to see (a conversion, a
+    // pump timer edge, a command); getDeadline() tells when it is due anyway
+    void setListener(WeightSampler::Listener listener, void *arg);
+    bool getDeadline(uint32_t &atMs) const { return controlLoop.getDeadline(atMs); }
+
+    uint8_t getId() const { return id; }
+    LiquidManager &getLiquidManager() { return liquidManager; }
+    PumpController &getPumpController() { return pumpController; }
+    WeightSampler &getSampler() { return weightSampler; }
+    ScaleModule &getScaleModule() { return scaleModule; }
+    ControlLink &getLink() { return controlLink; }
+
+private:
+    uint8_t id;
+    WeightSampler weightSampler;
+    CalibrationStore calibrationStore;
+    ScaleModule scaleModule;
+    ServoSwitch flushSwitch;
+    std::deque<ServoSwitch> valves; // Stable addresses for the liquids
+    LiquidManager liquidManager;
+    PumpController pumpController;
+    ControlLink controlLink;
+    ControlLoop controlLoop;
+};
@@ -0,0 +1,115 @@
+#include "StationScheduler.h"
+
+StationScheduler::Wakeup::Wakeup(StationScheduler &scheduler, uint8_t index)
+    : scheduler(scheduler), index(index), trigger(onWakeup, this), deadline(Trigger::notify, &trigger)
+{
+}
+
+StationScheduler::~StationScheduler()
+{
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (wakeups[i])
+        {
+            loop->stop(wakeups[i]->deadline);
+            delete wakeups[i];
+        }
+    }
+}
+
+bool StationScheduler::add(Station &station)
+{
+    if (count >= MAX_STATIONS)
+    {
+        return false;
+    }
+    stations[count] = &station;
+    timing[count] = {};
+    count++;
+    if (loop)
+    {
+        attachStation(count - 1);
+    }
+    return true;
+}
+
+void StationScheduler::step()
+{
+    uint32_t passStartUs = static_cast<uint32_t>(Hal::micros());
+    for (uint8_t i = 0; i < count; i++)
+    {
+        stepStation((first + i) % count);
+    }
+    first = count > 0 ? (first + 1) % count : 0;
+
+    uint32_t passUs = static_cast<uint32_t>(Hal::micros()) - passStartUs;
+    if (passUs > maxPassUs)
+    {
+        maxPassUs = passUs;
+    }
+}
+
+void StationScheduler::attach(EventLoop &loop)
+{
+    this->loop = &loop;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        attachStation(i);
+    }
+}
+
+void StationScheduler::resetTiming()
+{
+    for (uint8_t i = 0; i < count; i++)
+    {
+        timing[i] = {};
+    }
+    maxPassUs = 0;
+}
+
+void StationScheduler::stepStation(uint8_t index)
+{
+    Timing &t = timing[index];
+    uint32_t startUs = static_cast<uint32_t>(Hal::micros());
+    if (t.stepped && startUs - t.lastStepUs > t.maxGapUs)
+    {
+        t.maxGapUs = startUs - t.lastStepUs;
+    }
+    t.stepped = true;
+    t.lastStepUs = startUs;
+
+    stations[index]->step();
+
+    uint32_t stepUs = static_cast<uint32_t>(Hal::micros()) - startUs;
+    if (stepUs > t.maxStepUs)
+    {
+        t.maxStepUs = stepUs;
+    }
+}
+
+void StationScheduler::attachStation(uint8_t index)
+{
+    wakeups[index] = new Wakeup(*this, index);
+    wakeups[index]->trigger.attach(*loop);
+    stations[index]->setListener(Trigger::notify, &wakeups[index]->trigger);
+    wakeups[index]->trigger.fire(); // A first step, for the boot tare
+}
+
+void StationScheduler::onWakeup(void *arg)
+{
+    Wakeup *wakeup = static_cast<Wakeup *>(arg);
+    StationScheduler &scheduler = wakeup->scheduler;
+    scheduler.stepStation(wakeup->index);
+
+    uint32_t atMs;
+    if (scheduler.stations[wakeup->index]->getDeadline(atMs))
+    {
+        // One already past is retried on the next tick, never in a tight loop
+        uint32_t earliestMs = Hal::millis() + 1;
+        scheduler.loop->startAt(wakeup->deadline, static_cast<int32_t>(atMs - earliestMs) < 0 ? earliestMs : atMs);
+    }
+    else
+    {
+        scheduler.loop->stop(wakeup->deadline);
+    }
+}
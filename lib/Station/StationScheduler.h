@@ -0,0 +1,70 @@
+#pragma once
+#include "EventLoop.h"
+#include "Station.h"
+
+// Runs all stations from the one control task. Sampling needs no
+// multiplexing: every load cell interrupts on its own and fills its own
+// sampler's ring buffer, and every pump pulse ends on its own hardware timer.
+// What the stations share is the control task's time, so each pass steps
+// every station once, starting one station further along on every pass:
+// no station always waits behind all the others.
+//
+// The time between two steps of a station bounds how late it sees a
+// conversion or starts a pulse; its maximum is tracked per station.
+//
+// Attached to an EventLoop, the stations are stepped on events instead of
+// passes: a station steps when it has a conversion, a pump timer edge or a
+// command, or when its deadline is up, and the control task sleeps in
+// between. Whatever a station waits for without an event (a state timeout,
+// a drain, the next status) is a deadline on the loop's timer wheel.
+class StationScheduler
+{
+public:
+    static const uint8_t MAX_STATIONS = 16;
+
+    ~StationScheduler();
+    bool add(Station &station); // False when full
+    void step();                // One pass over all stations
+    // From here on the loop's task steps the stations, and step() is not
+    // called; stations added later are attached too
+    void attach(EventLoop &loop);
+
+    uint8_t getStationCount() const { return count; }
+    Station &getStation(uint8_t index) { return *stations[index]; }
+    uint32_t getMaxGapUs(uint8_t index) const { return timing[index].maxGapUs; }   // Between two steps
+    uint32_t getMaxStepUs(uint8_t index) const { return timing[index].maxStepUs; } // One step
+    uint32_t getMaxPassUs() const { return maxPassUs; }
+    void resetTiming();
+
+private:
+    struct Timing
+    {
+        bool stepped;
+        uint32_t lastStepUs;
+        uint32_t maxGapUs;
+        uint32_t maxStepUs;
+    };
+
+    // What wakes one station on the loop
+    struct Wakeup
+    {
+        Wakeup(StationScheduler &scheduler, uint8_t index);
+
+        StationScheduler &scheduler;
+        uint8_t index;
+        Trigger trigger;
+        TimerWheel::Timer deadline;
+    };
+
+    void stepStation(uint8_t index);
+    void attachStation(uint8_t index);
+    static void onWakeup(void *arg);
+
+    Station *stations[MAX_STATIONS] = {};
+    Timing timing[MAX_STATIONS] = {};
+    EventLoop *loop = nullptr;
+    Wakeup *wakeups[MAX_STATIONS] = {};
+    uint8_t count = 0;
+    uint8_t first = 0; // Steps first in the next pass
+    uint32_t maxPassUs = 0;
+};
@@ -0,0 +1,264 @@
+#include "Telemetry.h"
+#include <string.h>
+#include "Profiler.h"
+#include "WeightSampler.h"
+
+namespace
+{
+#ifdef ARDUINO
+    const uint32_t DRAIN_INTERVAL_MS = 10;
+
+    void drainTask(void *)
+    {
+        for (;;)
+        {
+            Telemetry::drain();
+            vTaskDelay(pdMS_TO_TICKS(DRAIN_INTERVAL_MS));
+        }
+    }
+#endif
+}
+
+BoundedQueue<Telemetry::Event, Telemetry::QUEUE_SIZE> Telemetry::queue;
+std::atomic<uint32_t> Telemetry::dropped(0);
+Telemetry::Writer Telemetry::writer = nullptr;
+const WeightSampler *Telemetry::sampler = nullptr;
+uint32_t Telemetry::sampleCount = 0;
+uint32_t Telemetry::missedSamples = 0;
+uint32_t Telemetry::reportedDropped = 0;
+uint32_t Telemetry::reportedMissed = 0;
+uint8_t Telemetry::sequence = 0;
+uint8_t Telemetry::frame[TelemetryFrame::MAX_FRAME];
+uint8_t Telemetry::encoded[TelemetryFrame::MAX_ENCODED];
+
+void Telemetry::begin(Writer writer, int core)
+{
+    setWriter(writer);
+#ifdef ARDUINO
+    // Same priority as the log drain: the UART write never delays the control loop
+    if (core < 0)
+    {
+        xTaskCreate(drainTask, "telemetry", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr);
+    }
+    else
+    {
+        xTaskCreatePinnedToCore(drainTask, "telemetry", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr, core);
+    }
+#else
+    (void)core;
+#endif
+}
+
+void Telemetry::setWriter(Writer newWriter)
+{
+    writer = newWriter;
+}
+
+void Telemetry::watch(const WeightSampler *newSampler)
+{
+    sampler = newSampler;
+    sampleCount = newSampler ? newSampler->getSampleCount() : 0;
+}
+
+void Telemetry::edge(const char *name, bool on)
+{
+    Event event = {};
+    event.type = TelemetryFrame::EDGE;
+    event.on = on;
+    event.name = name;
+    push(event);
+}
+
+void Telemetry::state(const char *name)
+{
+    Event event = {};
+    event.type = TelemetryFrame::STATE;
+    event.name = name;
+    push(event);
+}
+
+void Telemetry::estimate(TelemetryFrame::Estimate estimate, float value)
+{
+    Event event = {};
+    event.type = TelemetryFrame::ESTIMATE;
+    event.estimate = estimate;
+    event.values[0] = value;
+    push(event);
+}
+
+void Telemetry::job(TelemetryFrame::JobKind kind, uint8_t step, uint8_t steps, uint8_t group, float amount,
+                    const char *name)
+{
+    Event event = {};
+    event.type = TelemetryFrame::JOB;
+    event.estimate = kind;
+    event.step = step;
+    event.steps = steps;
+    event.group = group;
+    event.values[0] = amount;
+    event.name = name;
+    push(event);
+}
+
+void Telemetry::model(const char *name, const float (&values)[TelemetryFrame::MODEL_VALUE_COUNT], uint16_t pulseCount)
+{
+    Event event = {};
+    event.type = TelemetryFrame::MODEL;
+    memcpy(event.values, values, sizeof(event.values));
+    event.pulseCount = pulseCount;
+    event.name = name;
+    push(event);
+}
+
+void Telemetry::push(const Event &event)
+{
+    if (!writer)
+    {
+        return;
+    }
+    Event *slot = queue.reserve();
+    if (!slot)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    *slot = event;
+    slot->timestampUs = static_cast<uint32_t>(Hal::micros());
+    queue.commit(slot);
+}
+
+size_t Telemetry::drain(size_t maxRecords)
+{
+    if (!writer)
+    {
+        return 0;
+    }
+    ProfileScope profile(Profiler::TELEMETRY_DRAIN);
+    drainSamples();
+
+    size_t drained = 0;
+    Event event;
+    while (drained < maxRecords && queue.tryPop(event))
+    {
+        sendEvent(event);
+        drained++;
+    }
+
+    if (getDroppedCount() != reportedDropped || missedSamples != reportedMissed)
+    {
+        sendDropped();
+    }
+    return drained;
+}
+
+void Telemetry::drainSamples()
+{
+    if (!sampler)
+    {
+        return;
+    }
+
+    WeightSampler::Sample samples[TelemetryFrame::SAMPLES_PER_FRAME];
+    for (;;)
+    {
+        uint32_t first = sampleCount;
+        size_t n = sampler->getSamplesFrom(first, samples, TelemetryFrame::SAMPLES_PER_FRAME);
+        missedSamples += first - sampleCount; // Overwritten before they were sent
+        sampleCount = first + n;
+        if (n == 0)
+        {
+            return;
+        }
+
+        uint8_t *payload = frame + TelemetryFrame::HEADER_SIZE;
+        payload[0] = n;
+        for (size_t i = 0; i < n; i++)
+        {
+            TelemetryFrame::putU32(payload + 1 + i * 8, samples[i].timestampUs);
+            TelemetryFrame::putU32(payload + 5 + i * 8, static_cast<uint32_t>(samples[i].raw));
+        }
+        send(TelemetryFrame::SAMPLES, 1 + n * 8);
+    }
+}
+
+void Telemetry::sendEvent(const Event &event)
+{
+    uint8_t *payload = frame + TelemetryFrame::HEADER_SIZE;
+    TelemetryFrame::putU32(payload, event.timestampUs);
+    switch (event.type)
+    {
+    case TelemetryFrame::EDGE:
+        payload[4] = event.on ? 1 : 0;
+        send(event.type, 5 + putName(payload + 5, event.name));
+        break;
+    case TelemetryFrame::STATE:
+        send(event.type, 4 + putName(payload + 4, event.name));
+        break;
+    case TelemetryFrame::ESTIMATE:
+        payload[4] = event.estimate;
+        TelemetryFrame::putFloat(payload + 5, event.values[0]);
+        send(event.type, 9);
+        break;
+    case TelemetryFrame::JOB:
+        payload[4] = event.estimate;
+        payload[5] = event.step;
+        payload[6] = event.steps;
+        payload[7] = event.group;
+        TelemetryFrame::putFloat(payload + 8, event.values[0]);
+        send(event.type, 12 + putName(payload + 12, event.name));
+        break;
+    case TelemetryFrame::MODEL:
+    {
+        for (uint8_t i = 0; i < TelemetryFrame::MODEL_VALUE_COUNT; i++)
+        {
+            TelemetryFrame::putFloat(payload + 4 + i * 4, event.values[i]);
+        }
+        uint8_t *count = payload + 4 + TelemetryFrame::MODEL_VALUE_COUNT * 4;
+        count[0] = event.pulseCount;
+        count[1] = event.pulseCount >> 8;
+        send(event.type, 4 + TelemetryFrame::MODEL_VALUE_COUNT * 4 + 2 + putName(count + 2, event.name));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void Telemetry::sendDropped()
+{
+    reportedDropped = getDroppedCount();
+    reportedMissed = missedSamples;
+    uint8_t *payload = frame + TelemetryFrame::HEADER_SIZE;
+    TelemetryFrame::putU32(payload, static_cast<uint32_t>(Hal::micros()));
+    TelemetryFrame::putU32(payload + 4, reportedDropped);
+    TelemetryFrame::putU32(payload + 8, reportedMissed);
+    send(TelemetryFrame::DROPPED, 12);
+}
+
+size_t Telemetry::putName(uint8_t *out, const char *name)
+{
+    size_t length = name ? strlen(name) : 0;
+    length = length > TelemetryFrame::MAX_NAME_LENGTH ? TelemetryFrame::MAX_NAME_LENGTH : length;
+    out[0] = length;
+    if (length > 0)
+    {
+        memcpy(out + 1, name, length);
+    }
+    return 1 + length;
+}
+
+void Telemetry::send(TelemetryFrame::Type type, size_t payloadLength)
+{
+    frame[0] = type;
+    frame[1] = sequence++;
+    size_t length = TelemetryFrame::HEADER_SIZE + payloadLength;
+    uint16_t crc = TelemetryFrame::crc16(frame, length);
+    frame[length++] = crc;
+    frame[length++] = crc >> 8;
+
+    // Delimiters on both sides: a log line in between only spoils itself
+    encoded[0] = 0;
+    size_t encodedLength = 1 + TelemetryFrame::cobsEncode(frame, length, encoded + 1);
+    encoded[encodedLength++] = 0;
+    writer(encoded, encodedLength);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include "BoundedQueue.h"
+#include "Hal.h"
+#include "TelemetryFrame.h"
+
+class WeightSampler;
+
+// Binary telemetry for offline analysis: every load-cell conversion, pump
+// and valve edges, state machine transitions and estimator values, as
+// COBS frames (see TelemetryFrame.h) decoded on the host by tools/telemetry.
+//
+// Like the Logger, producers only queue a small fixed-size record and never
+// block; a full queue drops the record and counts it. The conversions are
+// not queued at all: drain() reads them from the WeightSampler ring buffer.
+// drain() builds the frames in preallocated buffers and hands them to the
+// writer, on a low-priority task on the device.
+//
+// Off until a writer is set; then each event costs one queue slot.
+class Telemetry
+{
+public:
+    typedef void (*Writer)(const uint8_t *data, size_t length);
+
+    static const size_t QUEUE_SIZE = 64;
+    static const uint32_t BAUD_RATE = 921600;
+
+    // Starts the background drain task on the device, pinned to `core` if
+    // given. On the host drain() is called by the owner.
+    static void begin(Writer writer, int core = -1);
+    static void setWriter(Writer writer); // nullptr turns telemetry off
+    static bool isEnabled() { return writer != nullptr; }
+    // Streams the conversions of this sampler from now on
+    static void watch(const WeightSampler *sampler);
+
+    // Names must outlive the record: string literals, liquid and valve names
+    static void edge(const char *name, bool on);
+    static void state(const char *name);
+    static void estimate(TelemetryFrame::Estimate estimate, float value);
+    // What a job asks for, and what the controller knows of a liquid when it
+    // starts one, so a recording can be replayed (lib/Simulator/TelemetryReplay)
+    static void job(TelemetryFrame::JobKind kind, uint8_t step = 0, uint8_t steps = 0, uint8_t group = 0,
+                    float amount = 0, const char *name = nullptr);
+    static void model(const char *name, const float (&values)[TelemetryFrame::MODEL_VALUE_COUNT], uint16_t pulseCount);
+
+    static size_t drain(size_t maxRecords = QUEUE_SIZE);
+    static uint32_t getDroppedCount() { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Event
+    {
+        uint32_t timestampUs;
+        TelemetryFrame::Type type;
+        uint8_t estimate; // ESTIMATE: estimate, JOB: kind
+        uint8_t step;
+        uint8_t steps;
+        uint8_t group;
+        bool on;
+        uint16_t pulseCount;
+        float values[TelemetryFrame::MODEL_VALUE_COUNT]; // ESTIMATE: value, JOB: amount, MODEL
+        const char *name;
+    };
+
+    static void push(const Event &event);
+    static void drainSamples();
+    static void sendEvent(const Event &event);
+    static void sendDropped();
+    static size_t putName(uint8_t *out, const char *name);
+    static void send(TelemetryFrame::Type type, size_t payloadLength);
+
+    static BoundedQueue<Event, QUEUE_SIZE> queue;
+    static std::atomic<uint32_t> dropped;
+    static Writer writer;
+    static const WeightSampler *sampler;
+    static uint32_t sampleCount; // Number of the next conversion to send
+    static uint32_t missedSamples;
+    static uint32_t reportedDropped;
+    static uint32_t reportedMissed;
+    static uint8_t sequence;
+    // Frame under construction and its encoding, only touched by drain()
+    static uint8_t frame[TelemetryFrame::MAX_FRAME];
+    static uint8_t encoded[TelemetryFrame::MAX_ENCODED];
+};
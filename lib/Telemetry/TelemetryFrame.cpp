@@ -0,0 +1,289 @@
+#include "TelemetryFrame.h"
+#include <string.h>
+
+const char *TelemetryFrame::getEstimateName(uint8_t estimate)
+{
+    switch (estimate)
+    {
+    case FLOW_RATE:
+        return "flow_rate";
+    case DEAD_TIME:
+        return "dead_time";
+    case DRIP_VOLUME:
+        return "drip_volume";
+    case MODEL_ERROR:
+        return "model_error";
+    case SETTLE_TIME:
+        return "settle_time";
+    case FLUSH_VOLUME:
+        return "flush_volume";
+    case DOSE:
+        return "dose";
+    case SCALE:
+        return "scale";
+    case STALL_DUTY:
+        return "stall_duty";
+    default:
+        return "unknown";
+    }
+}
+
+const char *TelemetryFrame::getJobKindName(uint8_t kind)
+{
+    switch (kind)
+    {
+    case JOB_DOSE:
+        return "dose";
+    case JOB_FLUSH:
+        return "flush";
+    case JOB_SESSION_OPEN:
+        return "session_open";
+    case JOB_SESSION_CLOSE:
+        return "session_close";
+    default:
+        return "unknown";
+    }
+}
+
+uint16_t TelemetryFrame::crc16(const uint8_t *data, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= static_cast<uint16_t>(data[i]) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+size_t TelemetryFrame::cobsEncode(const uint8_t *data, size_t length, uint8_t *out)
+{
+    size_t codeIndex = 0;
+    size_t written = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (data[i] != 0)
+        {
+            out[written++] = data[i];
+            code++;
+        }
+        if (data[i] == 0 || code == 0xFF)
+        {
+            out[codeIndex] = code;
+            codeIndex = written++;
+            code = 1;
+        }
+    }
+    out[codeIndex] = code;
+    return written;
+}
+
+size_t TelemetryFrame::cobsDecode(const uint8_t *data, size_t length, uint8_t *out)
+{
+    size_t read = 0;
+    size_t written = 0;
+    while (read < length)
+    {
+        uint8_t code = data[read++];
+        if (code == 0 || read + code - 1 > length)
+        {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; i++)
+        {
+            if (data[read] == 0)
+            {
+                return 0;
+            }
+            out[written++] = data[read++];
+        }
+        if (code != 0xFF && read < length)
+        {
+            out[written++] = 0;
+        }
+    }
+    return written;
+}
+
+void TelemetryFrame::putU32(uint8_t *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+uint32_t TelemetryFrame::getU32(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+void TelemetryFrame::putFloat(uint8_t *out, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putU32(out, bits);
+}
+
+float TelemetryFrame::getFloat(const uint8_t *in)
+{
+    uint32_t bits = getU32(in);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+TelemetryDecoder::TelemetryDecoder(Handler handler, void *arg)
+    : handler(handler), arg(arg), bufferLength(0), overflow(false), sequenceValid(false), nextSequence(0), frames(0),
+      badFrames(0), lostFrames(0)
+{
+}
+
+void TelemetryDecoder::push(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (data[i] == 0)
+        {
+            if (bufferLength > 0 && !overflow)
+            {
+                decodeFrame();
+            }
+            else if (overflow)
+            {
+                badFrames++;
+            }
+            bufferLength = 0;
+            overflow = false;
+        }
+        else if (bufferLength < sizeof(buffer))
+        {
+            buffer[bufferLength++] = data[i];
+        }
+        else
+        {
+            overflow = true;
+        }
+    }
+}
+
+void TelemetryDecoder::decodeFrame()
+{
+    uint8_t frame[TelemetryFrame::MAX_ENCODED];
+    size_t length = TelemetryFrame::cobsDecode(buffer, bufferLength, frame);
+    if (length < TelemetryFrame::HEADER_SIZE + TelemetryFrame::CRC_SIZE ||
+        TelemetryFrame::crc16(frame, length - TelemetryFrame::CRC_SIZE) !=
+            (frame[length - 2] | (frame[length - 1] << 8)) ||
+        !parse(frame, length - TelemetryFrame::CRC_SIZE))
+    {
+        badFrames++;
+        return;
+    }
+
+    uint8_t sequence = frame[1];
+    if (sequenceValid)
+    {
+        lostFrames += static_cast<uint8_t>(sequence - nextSequence);
+    }
+    sequenceValid = true;
+    nextSequence = sequence + 1;
+    frames++;
+}
+
+bool TelemetryDecoder::parse(const uint8_t *frame, size_t length)
+{
+    const uint8_t *payload = frame + TelemetryFrame::HEADER_SIZE;
+    size_t size = length - TelemetryFrame::HEADER_SIZE;
+    TelemetryRecord record = {};
+    record.type = static_cast<TelemetryFrame::Type>(frame[0]);
+
+    switch (record.type)
+    {
+    case TelemetryFrame::SAMPLES:
+    {
+        if (size < 1 || size != 1 + payload[0] * 8u)
+        {
+            return false;
+        }
+        for (uint8_t i = 0; i < payload[0]; i++)
+        {
+            record.timestampUs = TelemetryFrame::getU32(payload + 1 + i * 8);
+            record.raw = static_cast<int32_t>(TelemetryFrame::getU32(payload + 5 + i * 8));
+            handler(arg, record);
+        }
+        return true;
+    }
+    case TelemetryFrame::EDGE:
+    case TelemetryFrame::STATE:
+    {
+        size_t nameAt = record.type == TelemetryFrame::EDGE ? 6 : 5;
+        if (size < nameAt || payload[nameAt - 1] > TelemetryFrame::MAX_NAME_LENGTH ||
+            size != nameAt + payload[nameAt - 1])
+        {
+            return false;
+        }
+        record.timestampUs = TelemetryFrame::getU32(payload);
+        record.on = record.type == TelemetryFrame::EDGE && payload[4] != 0;
+        memcpy(record.name, payload + nameAt, payload[nameAt - 1]);
+        record.name[payload[nameAt - 1]] = '\0';
+        break;
+    }
+    case TelemetryFrame::ESTIMATE:
+        if (size != 9)
+        {
+            return false;
+        }
+        record.timestampUs = TelemetryFrame::getU32(payload);
+        record.estimate = payload[4];
+        record.value = TelemetryFrame::getFloat(payload + 5);
+        break;
+    case TelemetryFrame::DROPPED:
+        if (size != 12)
+        {
+            return false;
+        }
+        record.timestampUs = TelemetryFrame::getU32(payload);
+        record.dropped = TelemetryFrame::getU32(payload + 4);
+        record.missed = TelemetryFrame::getU32(payload + 8);
+        break;
+    case TelemetryFrame::JOB:
+    case TelemetryFrame::MODEL:
+    {
+        size_t nameAt = record.type == TelemetryFrame::JOB ? 13 : 4 + TelemetryFrame::MODEL_VALUE_COUNT * 4 + 2 + 1;
+        if (size < nameAt || payload[nameAt - 1] > TelemetryFrame::MAX_NAME_LENGTH ||
+            size != nameAt + payload[nameAt - 1])
+        {
+            return false;
+        }
+        record.timestampUs = TelemetryFrame::getU32(payload);
+        if (record.type == TelemetryFrame::JOB)
+        {
+            record.kind = payload[4];
+            record.step = payload[5];
+            record.steps = payload[6];
+            record.group = payload[7];
+            record.value = TelemetryFrame::getFloat(payload + 8);
+        }
+        else
+        {
+            for (uint8_t i = 0; i < TelemetryFrame::MODEL_VALUE_COUNT; i++)
+            {
+                record.model[i] = TelemetryFrame::getFloat(payload + 4 + i * 4);
+            }
+            const uint8_t *count = payload + 4 + TelemetryFrame::MODEL_VALUE_COUNT * 4;
+            record.pulseCount = count[0] | count[1] << 8;
+        }
+        memcpy(record.name, payload + nameAt, payload[nameAt - 1]);
+        record.name[payload[nameAt - 1]] = '\0';
+        break;
+    }
+    default:
+        return false;
+    }
+    handler(arg, record);
+    return true;
+}
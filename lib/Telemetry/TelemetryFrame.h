@@ -0,0 +1,150 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format of the telemetry stream, shared by the device and the host
+// decoder. Every frame is
+//
+//     type (1), sequence (1), payload, CRC-16/CCITT of all before it (2)
+//
+// COBS-encoded and written between two 0x00 delimiters, so a reader can join
+// the stream anywhere and text on the same UART (log lines) only costs the
+// frame it lands in. All fields are little-endian. Payloads:
+//
+//     SAMPLES   count (1), count x {timestamp us (4), raw counts (4, signed)}
+//     EDGE      timestamp us (4), on (1), name length (1), name
+//     STATE     timestamp us (4), name length (1), name
+//     ESTIMATE  timestamp us (4), estimate (1), value (4, float)
+//     DROPPED   timestamp us (4), records dropped so far (4), samples missed so far (4)
+//     JOB       timestamp us (4), kind (1), step (1), steps (1), flush group (1),
+//               amount (4, float), name length (1), name
+//     MODEL     timestamp us (4), flow rate, dead time, drip volume, relative error,
+//               absolute error, flush volume, stall duty (7 x 4, float),
+//               pulse count (2), name length (1), name
+//
+// JOB and MODEL frames tell a replay what the controller was asked to do and
+// what it knew when it started: one of each per recipe step, at job start.
+class TelemetryFrame
+{
+public:
+    enum Type : uint8_t
+    {
+        SAMPLES = 1,
+        EDGE,
+        STATE,
+        ESTIMATE,
+        DROPPED,
+        JOB,
+        MODEL
+    };
+
+    enum Estimate : uint8_t
+    {
+        FLOW_RATE,    // g/s
+        DEAD_TIME,    // s
+        DRIP_VOLUME,  // g
+        MODEL_ERROR,  // Relative
+        SETTLE_TIME,  // ms
+        FLUSH_VOLUME, // g
+        DOSE,         // g dispensed by a step
+        SCALE,        // Raw counts per g, sent at job start
+        STALL_DUTY,   // PWM duty the pump starts turning at
+        ESTIMATE_COUNT
+    };
+
+    enum JobKind : uint8_t
+    {
+        JOB_DOSE, // One frame per recipe step; a single dose is a one-step recipe
+        JOB_FLUSH,
+        JOB_SESSION_OPEN,
+        JOB_SESSION_CLOSE,
+        JOB_KIND_COUNT
+    };
+
+    // Order of the floats in a MODEL frame
+    enum ModelValue : uint8_t
+    {
+        MODEL_FLOW_RATE,
+        MODEL_DEAD_TIME,
+        MODEL_DRIP_VOLUME,
+        MODEL_RELATIVE_ERROR,
+        MODEL_ABSOLUTE_ERROR,
+        MODEL_FLUSH_VOLUME,
+        MODEL_STALL_DUTY,
+        MODEL_VALUE_COUNT
+    };
+
+    static const uint8_t HEADER_SIZE = 2;
+    static const uint8_t CRC_SIZE = 2;
+    static const uint8_t MAX_NAME_LENGTH = 15;
+    static const uint8_t SAMPLES_PER_FRAME = 8;
+    static const size_t MAX_PAYLOAD = 1 + SAMPLES_PER_FRAME * 8;
+    static const size_t MAX_FRAME = HEADER_SIZE + MAX_PAYLOAD + CRC_SIZE;
+    // COBS adds one byte per 254, plus the two delimiters
+    static const size_t MAX_ENCODED = MAX_FRAME + MAX_FRAME / 254 + 1 + 2;
+
+    static const char *getEstimateName(uint8_t estimate);
+    static const char *getJobKindName(uint8_t kind);
+
+    static uint16_t crc16(const uint8_t *data, size_t length);
+    // Returns the encoded length, no delimiters
+    static size_t cobsEncode(const uint8_t *data, size_t length, uint8_t *out);
+    // Returns the decoded length, 0 if the input is not valid COBS
+    static size_t cobsDecode(const uint8_t *data, size_t length, uint8_t *out);
+
+    static void putU32(uint8_t *out, uint32_t value);
+    static uint32_t getU32(const uint8_t *in);
+    static void putFloat(uint8_t *out, float value);
+    static float getFloat(const uint8_t *in);
+};
+
+// One decoded record; a SAMPLES frame yields one per conversion
+struct TelemetryRecord
+{
+    TelemetryFrame::Type type;
+    uint32_t timestampUs;
+    int32_t raw;        // SAMPLES
+    bool on;            // EDGE
+    uint8_t estimate;   // ESTIMATE
+    float value;        // ESTIMATE, JOB: amount
+    uint32_t dropped;   // DROPPED: records
+    uint32_t missed;    // DROPPED: samples
+    uint8_t kind;       // JOB
+    uint8_t step;       // JOB
+    uint8_t steps;      // JOB
+    uint8_t group;      // JOB
+    float model[TelemetryFrame::MODEL_VALUE_COUNT]; // MODEL
+    uint16_t pulseCount;                            // MODEL
+    char name[TelemetryFrame::MAX_NAME_LENGTH + 1]; // EDGE, STATE, JOB, MODEL
+};
+
+// Turns the byte stream back into records. Bytes that do not form a valid
+// frame are skipped and counted; a gap in the sequence numbers counts the
+// frames lost in between.
+class TelemetryDecoder
+{
+public:
+    typedef void (*Handler)(void *arg, const TelemetryRecord &record);
+
+    TelemetryDecoder(Handler handler, void *arg);
+    void push(const uint8_t *data, size_t length);
+
+    uint32_t getFrameCount() const { return frames; }
+    uint32_t getBadFrameCount() const { return badFrames; }
+    uint32_t getLostFrameCount() const { return lostFrames; }
+
+private:
+    void decodeFrame();
+    bool parse(const uint8_t *frame, size_t length);
+
+    Handler handler;
+    void *arg;
+    uint8_t buffer[TelemetryFrame::MAX_ENCODED];
+    size_t bufferLength;
+    bool overflow; // Junk longer than any frame: skip to the next delimiter
+    bool sequenceValid;
+    uint8_t nextSequence;
+    uint32_t frames;
+    uint32_t badFrames;
+    uint32_t lostFrames;
+};
@@ -0,0 +1,176 @@
+#include "TelemetryRecorder.h"
+#include <string.h>
+#include <string>
+#include "Logger.h"
+#include "Profiler.h"
+#ifdef ARDUINO
+#include <LittleFS.h>
+#endif
+
+TelemetryRecorder::TelemetryRecorder()
+    :
+#ifndef ARDUINO
+      file(nullptr),
+#endif
+      holdCheck(nullptr), bufferLength(0), bytesWritten(0), maxBytes(0), droppedBytes(0), reportedDropped(0),
+      full(false)
+{
+}
+
+TelemetryRecorder::~TelemetryRecorder()
+{
+    end();
+}
+
+bool TelemetryRecorder::begin(const char *path, uint32_t maxBytes)
+{
+    end();
+    this->maxBytes = maxBytes;
+    bufferLength = 0;
+    bytesWritten = 0;
+    droppedBytes = 0;
+    reportedDropped = 0;
+    full = false;
+
+    std::string old = std::string(path) + ".old";
+#ifdef ARDUINO
+    if (!LittleFS.begin(true)) // Formats a partition that was never used
+    {
+        LOG_ERROR("Cannot mount LittleFS for the telemetry recording");
+        return false;
+    }
+    if (LittleFS.exists(path))
+    {
+        LittleFS.remove(old.c_str());
+        LittleFS.rename(path, old.c_str());
+    }
+    file = LittleFS.open(path, FILE_APPEND);
+#else
+    std::remove(old.c_str());
+    std::rename(path, old.c_str());
+    file = fopen(path, "ab");
+#endif
+    if (!isRecording())
+    {
+        LOG_ERROR("Cannot open telemetry recording {}", path);
+        return false;
+    }
+    LOG_INFO("Recording telemetry to {}", path);
+    return true;
+}
+
+void TelemetryRecorder::write(const uint8_t *data, size_t length)
+{
+    if (!isRecording())
+    {
+        return;
+    }
+    // Whole frames only: a cut-off frame at the end would only decode as junk
+    if (!full && bytesWritten + length > maxBytes)
+    {
+        full = true;
+        LOG_WARNING("Telemetry recording full at {} bytes", bytesWritten);
+    }
+    if (full)
+    {
+        if (!isHeld())
+        {
+            flush(); // What was held back
+        }
+        return;
+    }
+
+    if (bufferLength + length > BUFFER_SIZE)
+    {
+        droppedBytes += length;
+    }
+    else
+    {
+        memcpy(buffer + bufferLength, data, length);
+        bufferLength += length;
+        bytesWritten += length;
+    }
+    if (!isHeld())
+    {
+        writeOut(false);
+        if (droppedBytes != reportedDropped)
+        {
+            LOG_WARNING("Telemetry recording dropped {} bytes while a pump ran", droppedBytes - reportedDropped);
+            reportedDropped = droppedBytes;
+        }
+    }
+}
+
+void TelemetryRecorder::flush()
+{
+    if (isRecording() && bufferLength > 0)
+    {
+        writeOut(true);
+    }
+}
+
+void TelemetryRecorder::end()
+{
+    if (!isRecording())
+    {
+        return;
+    }
+    flush();
+#ifdef ARDUINO
+    file.close();
+#else
+    fclose(file);
+    file = nullptr;
+#endif
+}
+
+bool TelemetryRecorder::isRecording() const
+{
+#ifdef ARDUINO
+    return static_cast<bool>(file);
+#else
+    return file != nullptr;
+#endif
+}
+
+void TelemetryRecorder::writeOut(bool all)
+{
+    size_t length = all ? bufferLength : bufferLength - bufferLength % BLOCK_SIZE;
+    size_t offset = 0;
+    bool written = true;
+    while (written && offset < length)
+    {
+        // A pass may start while a backlog goes out; the rest waits for its end
+        if (!all && offset > 0 && isHeld())
+        {
+            break;
+        }
+        size_t n = length - offset < BLOCK_SIZE ? length - offset : BLOCK_SIZE;
+        written = writeBlock(buffer + offset, n);
+        offset += n;
+    }
+    if (!written)
+    {
+        offset = bufferLength; // Nothing more goes to the file
+    }
+    memmove(buffer, buffer + offset, bufferLength - offset);
+    bufferLength -= offset;
+}
+
+bool TelemetryRecorder::writeBlock(const uint8_t *data, size_t length)
+{
+    ProfileScope profile(Profiler::FLASH_WRITE);
+#ifdef ARDUINO
+    bool written = file.write(data, length) == length;
+    file.flush(); // Commits the block, so a reset only loses what is still in RAM
+#else
+    bool written = fwrite(data, 1, length, file) == length;
+    fflush(file);
+#endif
+    if (!written)
+    {
+        full = true;
+        LOG_ERROR("Telemetry recording stopped: the file system is full");
+    }
+    return written;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#ifdef ARDUINO
+#include <FS.h>
+#else
+#include <cstdio>
+#endif
+
+// Appends the telemetry stream to a file: on LittleFS on the device, any
+// path on the host. The frames are stored as they go out on the UART, so a
+// recording decodes with tools/telemetry like a capture, and replays into a
+// PumpController with TelemetryReplay (lib/Simulator).
+//
+// Called from the telemetry writer, so from the drain task only. Frames are
+// collected into blocks of BLOCK_SIZE and written a block at a time, a few
+// flash writes per second at most. A recording stops at maxBytes instead of
+// filling the file system; begin() keeps the one before it as <path>.old,
+// so the run that went wrong survives the reboot after it.
+//
+// On the ESP32 a flash write stalls the cache on both cores, the pump
+// cutoff timer and the control task included (Profiler::FLASH_WRITE shows
+// for how long). While the hold check is true, e.g. PumpTimer::isAnyRunning,
+// blocks stay in RAM, up to BUFFER_SIZE; frames beyond that are dropped and
+// counted rather than written in the middle of a pass.
+class TelemetryRecorder
+{
+public:
+    typedef bool (*HoldCheck)();
+
+    static const size_t BLOCK_SIZE = 512;
+    static const size_t BUFFER_SIZE = 32 * BLOCK_SIZE; // Over 20s at the HX711's 80 conversions per second
+    static const uint32_t DEFAULT_MAX_BYTES = 1024 * 1024;
+
+    TelemetryRecorder();
+    ~TelemetryRecorder();
+
+    bool begin(const char *path, uint32_t maxBytes = DEFAULT_MAX_BYTES); // False if the file cannot be opened
+    void setHoldCheck(HoldCheck check) { holdCheck = check; } // nullptr writes each block when it is full
+    void write(const uint8_t *data, size_t length);
+    void flush(); // All that is collected so far, even while held
+    void end();
+
+    bool isRecording() const;
+    bool isFull() const { return full; }
+    uint32_t getBytesWritten() const { return bytesWritten; }
+    uint32_t getDroppedBytes() const { return droppedBytes; } // Of frames that found the buffer full
+
+private:
+    bool isHeld() const { return holdCheck && holdCheck(); }
+    void writeOut(bool all); // The full blocks at the front of the buffer, or all of it
+    bool writeBlock(const uint8_t *data, size_t length);
+
+#ifdef ARDUINO
+    File file;
+#else
+    FILE *file;
+#endif
+    HoldCheck holdCheck;
+    uint8_t buffer[BUFFER_SIZE];
+    size_t bufferLength;
+    uint32_t bytesWritten; // Including the buffer
+    uint32_t maxBytes;
+    uint32_t droppedBytes;
+    uint32_t reportedDropped;
+    bool full;
+};
@@ -1,61 +1,121 @@
 
 // UserInterface.cpp
 #include "UserInterface.h"
+#include "PumpController.h"
 
-UserInterface::UserInterface(int rotaryPin1, int rotaryPin2, int buttonPin)
-    : display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET),
-      encoder(rotaryPin1, rotaryPin2),
-      button(buttonPin),
+UserInterface::UserInterface(HalDisplay &display, HalInput &input)
+    : display(display),
+      input(input),
+      liquidManager(nullptr),
+      controlLink(nullptr),
       currentLiquidIndex(0),
-      dispenseRequested(false),
-      lastEncoderValue(0),
+      lastPosition(0),
+      lastAcceleratedPosition(0),
       currentState(State::SELECT_LIQUID),
-      flushRequest(false)
+      lastProfilerMs(0)
 {
 }
 
-void UserInterface::init(LiquidManager &liquidManager)
+void UserInterface::init(LiquidManager &liquidManager, ControlLink &controlLink)
 {
     this->liquidManager = &liquidManager;
+    this->controlLink = &controlLink;
 
-    Wire.begin(25, 26); // SDA on 25, SCL on 26
-    if (!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS))
+    if (!display.begin())
     {
-        Serial.println(F("SSD1306 allocation failed"));
+        LOG_ERROR("SSD1306 allocation failed");
         for (;;)
             ; // Don't proceed, loop forever
     }
 
-    display.clearDisplay();
-    display.setRotation(2);
-    display.setTextColor(SSD1306_WHITE);
+    displayMainScreen();
+    LOG_INFO("User interface initialized");
+}
 
-    button.attachClick(onButtonClick, this);
-    button.attachLongPressStart(onButtonLongPress, this);
-    button.attachDoubleClick(onButtonDoubleClick, this);
+void UserInterface::attachInterrupts(HalInput::Listener listener, void *arg)
+{
+    input.begin(listener, arg);
+    lastPosition = input.getPosition();
+    lastAcceleratedPosition = input.getAcceleratedPosition();
+}
 
-    displayMainScreen();
-    Logger::log("User interface initialized");
+bool UserInterface::getDeadline(uint32_t &atMs) const
+{
+    bool due = gestures.getDeadline(atMs);
+    if (currentState != State::DISPENSING && isProfilerSelected())
+    {
+        uint32_t refreshMs = lastProfilerMs + PROFILER_REFRESH_MS;
+        if (!due || static_cast<int32_t>(refreshMs - atMs) < 0)
+        {
+            atMs = refreshMs;
+        }
+        due = true;
+    }
+    return due;
 }
 
 void UserInterface::update()
 {
     handleRotaryEncoder();
-    button.tick();
+    handleButton();
+
+    ControlStatus status;
+    if (controlLink->pollStatus(status))
+    {
+        handleStatus(status);
+    }
+    if (currentState != State::DISPENSING && isProfilerSelected() &&
+        Hal::millis() - lastProfilerMs >= PROFILER_REFRESH_MS)
+    {
+        displayProfiler();
+    }
+}
+
+void UserInterface::handleStatus(const ControlStatus &status)
+{
+    if (status.busy)
+    {
+        currentState = State::DISPENSING;
+        displayDispenseProgress(status);
+    }
+    else if (currentState == State::DISPENSING)
+    {
+        currentState = State::SELECT_LIQUID;
+        displayMainScreen();
+    }
 }
 
 void UserInterface::displayMainScreen()
 {
-    display.clearDisplay();
+    if (isProfilerSelected())
+    {
+        displayProfiler();
+        return;
+    }
+    display.clear();
     display.setTextSize(1);
     display.setCursor(0, 0);
     display.println("Select Liquid:");
     display.setTextSize(2);
     display.setCursor(0, 16);
+    Recipe *recipe = getSelectedRecipe();
+    if (recipe)
+    {
+        // Recipes follow the liquids in the selection
+        display.println(recipe->name.c_str());
+        display.setTextSize(1);
+        display.setCursor(0, 40);
+        display.print("Recipe, liquids: ");
+        display.print(recipe->stepCount, 0);
+        display.setCursor(0, 56);
+        display.print("Hold to Start");
+        display.show();
+        return;
+    }
     Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
     if (liquid)
     {
-        display.println(liquid->name);
+        display.println(liquid->name.c_str());
     }
     display.setTextSize(1);
     display.setCursor(0, 40);
@@ -67,38 +127,83 @@ void UserInterface::displayMainScreen()
     }
     display.setCursor(0, 56);
     display.print(currentState == State::EDIT_AMOUNT ? "Editing Amount" : "Press to Edit");
-    display.display();
+    display.show();
 }
-void UserInterface::displayDispenseProgress(const String &pumpState)
+void UserInterface::displayDispenseProgress(const ControlStatus &status)
 {
-    display.clearDisplay();
-    displayHeader("Dispensing");
-    displayLiquidInfo();
-    displayPumpState(pumpState);
-    displayProgressBarWithLabels();
-    display.display();
+    display.clear();
+    char header[24];
+    if (status.queuedJobs > 0)
+    {
+        snprintf(header, sizeof(header), "Dispensing, %u queued", status.queuedJobs);
+    }
+    else
+    {
+        snprintf(header, sizeof(header), "Dispensing");
+    }
+    displayHeader(header);
+    displayLiquidInfo(status.liquidIndex);
+    displayPumpState(status.state);
+    displayProgressBarWithLabels(status.weight, status.targetAmount);
+    display.show();
 }
 
-void UserInterface::displayHeader(const String &title)
+void UserInterface::displayHeader(const char *title)
 {
     display.setTextSize(1);
     display.setCursor(0, 0);
     display.println(title);
-    display.drawFastHLine(0, 9, SCREEN_WIDTH, SSD1306_WHITE);
+    display.drawFastHLine(0, 9, SCREEN_WIDTH);
 }
 
-void UserInterface::displayLiquidInfo()
+// The sections furthest into their budget first, times in us; ! marks overruns
+void UserInterface::displayProfiler()
 {
-    Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
+    lastProfilerMs = Hal::millis();
+    Profiler::Report reports[Profiler::SECTION_COUNT];
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < Profiler::SECTION_COUNT; i++)
+    {
+        Profiler::Report report = Profiler::getReport(static_cast<Profiler::Section>(i));
+        if (report.count == 0)
+        {
+            continue;
+        }
+        uint8_t at = count++;
+        while (at > 0 && static_cast<float>(reports[at - 1].maxUs) / reports[at - 1].budgetUs <
+                             static_cast<float>(report.maxUs) / report.budgetUs)
+        {
+            reports[at] = reports[at - 1];
+            at--;
+        }
+        reports[at] = report;
+    }
+
+    display.clear();
+    displayHeader("Profiler   p99   max");
+    char line[24];
+    for (uint8_t i = 0; i < count && i < 6; i++)
+    {
+        snprintf(line, sizeof(line), "%-9.9s%5lu %5lu%s", reports[i].name, static_cast<unsigned long>(reports[i].p99Us),
+                 static_cast<unsigned long>(reports[i].maxUs), reports[i].overruns > 0 ? "!" : "");
+        display.setCursor(0, 12 + i * 8);
+        display.print(line);
+    }
+    display.show();
+}
+
+void UserInterface::displayLiquidInfo(int liquidIndex)
+{
+    Liquid *liquid = liquidManager->getLiquid(liquidIndex);
     if (liquid)
     {
         display.setTextSize(2);
         display.setCursor(0, 14);
-        display.println(liquid->name);
+        display.println(liquid->name.c_str());
     }
 }
 
-void UserInterface::displayPumpState(const String &pumpState)
+void UserInterface::displayPumpState(const char *pumpState)
 {
     display.setTextSize(1);
     display.setCursor(0, 32);
@@ -106,13 +211,11 @@ void UserInterface::displayPumpState(const String &pumpState)
     display.println(pumpState);
 }
 
-void UserInterface::displayProgressBarWithLabels()
+void UserInterface::displayProgressBarWithLabels(float currentWeight, float targetWeight)
 {
-    Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
-    if (liquid)
+    if (targetWeight > 0)
     {
-        float currentWeight = liquid->dataPoints.empty() ? 0 : liquid->dataPoints.back().weight;
-        float targetWeight = liquid->targetAmount;
+        // Weight as sampled by the control task; the scale is tared before dispensing
         float percentage = min(currentWeight / targetWeight * 100, 100.0f);
 
         // Display progress bar
@@ -125,78 +228,118 @@ void UserInterface::displayProgressBarWithLabels()
         display.print("g");
 
         // Display target weight (right aligned)
-        String targetStr = String(targetWeight, 2) + "g";
-        int16_t targetWidth = targetStr.length() * 6; // Approximate width of the text
+        char target[12];
+        int length = snprintf(target, sizeof(target), "%.2fg", targetWeight);
+        int16_t targetWidth = min(length, static_cast<int>(sizeof(target)) - 1) * 6; // 6px per character at size 1
         display.setCursor(SCREEN_WIDTH - targetWidth, 56);
-        display.print(targetStr);
+        display.print(target);
     }
 }
 
 void UserInterface::drawProgressBar(int x, int y, int width, int height, float percentage)
 {
-    display.drawRect(x, y, width, height, SSD1306_WHITE);
+    display.drawRect(x, y, width, height);
     int fillWidth = (width - 2) * percentage / 100.0;
-    display.fillRect(x + 1, y + 1, fillWidth, height - 2, SSD1306_WHITE);
+    display.fillRect(x + 1, y + 1, fillWidth, height - 2);
 }
 
+// Every detent since the last update counts, however late it comes
 void UserInterface::handleRotaryEncoder()
 {
-    encoder.tick();
-    int newValue = encoder.getPosition();
-    if (newValue != lastEncoderValue)
+    int32_t position = input.getPosition();
+    int32_t acceleratedPosition = input.getAcceleratedPosition();
+    int32_t detents = position - lastPosition;
+    int32_t steps = acceleratedPosition - lastAcceleratedPosition;
+    lastPosition = position;
+    lastAcceleratedPosition = acceleratedPosition;
+    if (detents != 0 && currentState != State::DISPENSING) // The selection is locked while dispensing
     {
-        int direction = (newValue > lastEncoderValue) ? 1 : -1;
         if (currentState == State::SELECT_LIQUID)
         {
-            currentLiquidIndex = (currentLiquidIndex + direction + liquidManager->getLiquidCount()) % liquidManager->getLiquidCount();
-            Logger::log("Selected liquid: " + liquidManager->getLiquid(currentLiquidIndex)->name);
+            // One entry per detent: no acceleration through a short list
+            int entries = liquidManager->getLiquidCount() + liquidManager->getRecipeCount() + 1;
+            currentLiquidIndex = ((currentLiquidIndex + detents) % entries + entries) % entries;
+            Recipe *recipe = getSelectedRecipe();
+            if (isProfilerSelected())
+            {
+                LOG_INFO("Selected: profiler");
+            }
+            else
+            {
+                LOG_INFO("Selected: {}", recipe ? recipe->name : liquidManager->getLiquid(currentLiquidIndex)->name);
+            }
         }
         else if (currentState == State::EDIT_AMOUNT)
         {
-            updateAmount(direction);
+            updateAmount(steps);
         }
         displayMainScreen();
-        lastEncoderValue = newValue;
     }
 }
 
-void UserInterface::updateAmount(int direction)
+void UserInterface::handleButton()
 {
-    Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
-    if (liquid)
+    HalInput::ButtonEdge edge;
+    while (input.pollButton(edge))
     {
-        liquid->targetAmount += direction * 0.1;
-        if (liquid->targetAmount < 0)
-        {
-            liquid->targetAmount = 0;
-        }
-        Logger::log("Updated amount for " + liquid->name + ": " +
-                    String(liquid->targetAmount) + "g");
+        onGesture(gestures.add(edge));
     }
+    onGesture(gestures.update(Hal::millis()));
 }
 
-bool UserInterface::flushRequested()
+void UserInterface::onGesture(ButtonGestures::Gesture gesture)
 {
-    return flushRequest;
+    switch (gesture)
+    {
+    case ButtonGestures::CLICK:
+        onButtonClick(this);
+        break;
+    case ButtonGestures::DOUBLE_CLICK:
+        onButtonDoubleClick(this);
+        break;
+    case ButtonGestures::LONG_PRESS:
+        onButtonLongPress(this);
+        break;
+    default:
+        break;
+    }
 }
 
-void UserInterface::resetFlushRequest()
+// Turned fast, each detent is worth up to RotaryDecoder::MAX_FACTOR steps
+void UserInterface::updateAmount(int32_t steps)
 {
-    flushRequest = false;
+    Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
+    if (liquid)
+    {
+        liquid->targetAmount += steps * AMOUNT_STEP;
+        if (liquid->targetAmount < 0)
+        {
+            liquid->targetAmount = 0;
+        }
+        else if (liquid->targetAmount > PumpController::MAX_DOSE)
+        {
+            liquid->targetAmount = PumpController::MAX_DOSE; // More would be refused at the click
+        }
+        LOG_INFO("Updated amount for {}: {}g", liquid->name, liquid->targetAmount);
+    }
 }
 
 void UserInterface::onButtonClick(void *ptr)
 {
     UserInterface *ui = static_cast<UserInterface *>(ptr);
+    if (ui->currentState == State::DISPENSING || ui->getSelectedRecipe() || ui->isProfilerSelected())
+    {
+        return; // Recipe amounts are fixed
+    }
     if (ui->currentState == State::SELECT_LIQUID)
     {
         ui->currentState = State::EDIT_AMOUNT;
-        Logger::log("Editing amount for " + ui->liquidManager->getLiquid(ui->currentLiquidIndex)->name);
+        LOG_INFO("Editing amount for {}", ui->liquidManager->getLiquid(ui->currentLiquidIndex)->name);
     }
     else if (ui->currentState == State::EDIT_AMOUNT)
     {
         ui->currentState = State::SELECT_LIQUID;
-        Logger::log("Finished editing amount");
+        LOG_INFO("Finished editing amount");
     }
     ui->displayMainScreen();
 }
@@ -204,34 +347,53 @@ void UserInterface::onButtonClick(void *ptr)
 void UserInterface::onButtonLongPress(void *ptr)
 {
     UserInterface *ui = static_cast<UserInterface *>(ptr);
-    ui->dispenseRequested = true;
-    Logger::log("Dispense requested for " + ui->liquidManager->getLiquid(ui->currentLiquidIndex)->name);
+    if (ui->isProfilerSelected())
+    {
+        Profiler::reset();
+        LOG_INFO("Profiler reset");
+        return;
+    }
+    Recipe *recipe = ui->getSelectedRecipe();
+    // Queued behind any running job
+    uint16_t jobId = recipe ? ui->controlLink->requestRecipe(ui->currentLiquidIndex - ui->liquidManager->getLiquidCount())
+                            : ui->controlLink->requestDispense(ui->currentLiquidIndex);
+    if (!jobId)
+    {
+        LOG_WARNING("Control task busy, dispense request dropped");
+        return;
+    }
+    LOG_INFO("Job {} requested for {}", jobId,
+             recipe ? recipe->name : ui->liquidManager->getLiquid(ui->currentLiquidIndex)->name);
 }
 
 void UserInterface::onButtonDoubleClick(void *ptr)
 {
     UserInterface *ui = static_cast<UserInterface *>(ptr);
-    ui->flushRequest = true;
-    Logger::log("Flush requested");
+    if (!ui->controlLink->requestFlush())
+    {
+        LOG_WARNING("Control task busy, flush request dropped");
+        return;
+    }
+    LOG_INFO("Flush requested");
 }
 
-int UserInterface::getCurrentLiquidIndex() const
+Recipe *UserInterface::getSelectedRecipe() const
 {
-    return currentLiquidIndex;
+    return liquidManager->getRecipe(currentLiquidIndex - liquidManager->getLiquidCount());
 }
 
-float UserInterface::getCurrentTargetAmount() const
+bool UserInterface::isProfilerSelected() const
 {
-    Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
-    return liquid ? liquid->targetAmount : 0.0f;
+    return currentLiquidIndex == liquidManager->getLiquidCount() + liquidManager->getRecipeCount();
 }
 
-bool UserInterface::isDispenseRequested() const
+int UserInterface::getCurrentLiquidIndex() const
 {
-    return dispenseRequested;
+    return currentLiquidIndex;
 }
 
-void UserInterface::resetDispenseRequest()
+float UserInterface::getCurrentTargetAmount() const
 {
-    dispenseRequested = false;
-}
\ No newline at end of file
+    Liquid *liquid = liquidManager->getLiquid(currentLiquidIndex);
+    return liquid ? liquid->targetAmount : 0.0f;
+}
@@ -3,28 +3,29 @@
 #define USER_INTERFACE_H
 
 #include <Arduino.h>
-#include <Adafruit_GFX.h>
-#include <Adafruit_SSD1306.h>
-#include <RotaryEncoder.h>
-#include <OneButton.h>
-#include <Wire.h>
+#include "ButtonGestures.h"
+#include "Hal.h"
+#include "ControlLink.h"
 #include "LiquidManager.h"
 #include "Logger.h"
+#include "Profiler.h"
 
 class UserInterface
 {
 public:
-    UserInterface(int rotaryPin1, int rotaryPin2, int buttonPin);
-    void init(LiquidManager &liquidManager);
+    UserInterface(HalDisplay &display, HalInput &input);
+    void init(LiquidManager &liquidManager, ControlLink &controlLink);
+    // Starts the input; the listener is called after each detent and button edge, possibly from an interrupt
+    void attachInterrupts(HalInput::Listener listener, void *arg);
+    // Input and rendering only; dispensing runs on the control task. Due
+    // after a detent or button edge, a status from the control task, and at
+    // the deadline: a click or long press coming due, the profiler page refresh.
     void update();
+    bool getDeadline(uint32_t &atMs) const;
     int getCurrentLiquidIndex() const;
     float getCurrentTargetAmount() const;
-    bool isDispenseRequested() const;
-    void resetDispenseRequest();
-    bool flushRequested();
-    void resetFlushRequest();
     void displayMainScreen();
-    void displayDispenseProgress(const String &pumpState);
+    void displayDispenseProgress(const ControlStatus &status);
 
 private:
     enum class State
@@ -34,29 +35,36 @@ private:
         DISPENSING
     };
 
-    static const int SCREEN_WIDTH = 128;
-    static const int SCREEN_HEIGHT = 64;
-    static const int OLED_RESET = -1;
-    static const int SCREEN_ADDRESS = 0x3C;
+    static const int SCREEN_WIDTH = HalDisplay::WIDTH;
+    static const int SCREEN_HEIGHT = HalDisplay::HEIGHT;
+    static const uint32_t PROFILER_REFRESH_MS = 500;
+    static constexpr float AMOUNT_STEP = 0.1; // g per detent, before acceleration
 
-    Adafruit_SSD1306 display;
-    RotaryEncoder encoder;
-    OneButton button;
+    HalDisplay &display;
+    HalInput &input;
+    ButtonGestures gestures;
     LiquidManager *liquidManager;
+    ControlLink *controlLink;
     int currentLiquidIndex;
-    bool dispenseRequested;
-    bool flushRequest;
-    int lastEncoderValue;
+    int32_t lastPosition;
+    int32_t lastAcceleratedPosition;
     State currentState;
+    uint32_t lastProfilerMs;
 
+    Recipe *getSelectedRecipe() const; // nullptr while a liquid is selected
+    bool isProfilerSelected() const;   // The debug page, after the recipes
     void handleRotaryEncoder();
-    void updateAmount(int direction);
-    void displayHeader(const String &title);
-    void displayLiquidInfo();
+    void handleButton();
+    void onGesture(ButtonGestures::Gesture gesture);
+    void updateAmount(int32_t steps);
+    void displayHeader(const char *title);
+    void displayProfiler();
+    void handleStatus(const ControlStatus &status);
+    void displayLiquidInfo(int liquidIndex);
     void displayWeightProgress();
-    void displayPumpState(const String &pumpState);
+    void displayPumpState(const char *pumpState);
     void displayProgressBar();
-    void displayProgressBarWithLabels();
+    void displayProgressBarWithLabels(float currentWeight, float targetWeight);
     void drawProgressBar(int x, int y, int width, int height, float percentage);
 
     static void onButtonClick(void *ptr);
@@ -0,0 +1,264 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Integer filter stages for raw load-cell conversions, composed at compile
+// time: FilterChain<Median<5>, Ema<2>> runs every conversion through the
+// median and then the EMA. No virtual calls, no heap, no floating point, so
+// a chain is cheap enough to run per conversion and to size statically.
+//
+// Every stage has
+//     bool push(int32_t in, int32_t &out); // false: no output this time
+//     void reset();
+// and a decimating stage only passes on every Nth conversion.
+
+// Median of the last N conversions; drops single spikes (a knock, a servo
+// jolt) completely instead of smearing them into the result. Until N
+// conversions have arrived, the median of those there are.
+template <uint8_t N>
+class Median
+{
+    static_assert(N % 2 == 1 && N <= 31, "N must be odd and at most 31");
+
+public:
+    Median() { reset(); }
+
+    bool push(int32_t in, int32_t &out)
+    {
+        if (count == N)
+        {
+            // Drop the oldest from the sorted copy
+            int32_t oldest = history[next];
+            uint8_t i = 0;
+            while (sorted[i] != oldest)
+            {
+                i++;
+            }
+            for (; i + 1 < count; i++)
+            {
+                sorted[i] = sorted[i + 1];
+            }
+            count--;
+        }
+        history[next] = in;
+        next = next + 1 == N ? 0 : next + 1;
+
+        uint8_t i = count;
+        while (i > 0 && sorted[i - 1] > in)
+        {
+            sorted[i] = sorted[i - 1];
+            i--;
+        }
+        sorted[i] = in;
+        count++;
+        out = sorted[count / 2];
+        return true;
+    }
+
+    void reset()
+    {
+        count = 0;
+        next = 0;
+    }
+
+private:
+    int32_t history[N]; // In arrival order, next is the oldest once full
+    int32_t sorted[N];
+    uint8_t count;
+    uint8_t next;
+};
+
+// Mean of the last N conversions, from a running sum.
+template <uint8_t N>
+class MovingAverage
+{
+    static_assert(N > 0, "N must be positive");
+
+public:
+    MovingAverage() { reset(); }
+
+    bool push(int32_t in, int32_t &out)
+    {
+        if (count == N)
+        {
+            sum -= history[next];
+        }
+        else
+        {
+            count++;
+        }
+        history[next] = in;
+        next = next + 1 == N ? 0 : next + 1;
+        sum += in;
+        out = divide(sum, count);
+        return true;
+    }
+
+    void reset()
+    {
+        sum = 0;
+        count = 0;
+        next = 0;
+    }
+
+private:
+    static int32_t divide(int64_t sum, int64_t count)
+    {
+        // Rounded to nearest, also for negative sums
+        return static_cast<int32_t>((sum >= 0 ? sum + count / 2 : sum - count / 2) / count);
+    }
+
+    int32_t history[N];
+    int64_t sum;
+    uint8_t count;
+    uint8_t next;
+};
+
+// Cascaded integrator-comb decimator: Order running sums, one output every
+// Decimation conversions, Order differences, scaled back by Decimation^Order.
+// Order 1 is the mean of each block of Decimation conversions; higher orders
+// suppress more of the noise above the output rate. The integrators are
+// allowed to wrap; the differences come out right anyway.
+template <uint8_t Decimation, uint8_t Order = 1>
+class Cic
+{
+    static_assert(Decimation > 1, "Decimation must be at least 2");
+    static_assert(Order >= 1 && Order <= 4, "Order must be 1 to 4");
+
+public:
+    Cic() { reset(); }
+
+    bool push(int32_t in, int32_t &out)
+    {
+        uint64_t value = static_cast<uint64_t>(static_cast<int64_t>(in));
+        for (uint8_t i = 0; i < Order; i++)
+        {
+            integrators[i] += value;
+            value = integrators[i];
+        }
+        if (++phase < Decimation)
+        {
+            return false;
+        }
+        phase = 0;
+
+        for (uint8_t i = 0; i < Order; i++)
+        {
+            uint64_t delayed = combs[i];
+            combs[i] = value;
+            value -= delayed;
+        }
+        if (warmup > 0)
+        {
+            // Not a full impulse response of conversions behind this output yet
+            warmup--;
+            return false;
+        }
+        int64_t sum = static_cast<int64_t>(value);
+        int64_t gain = GAIN;
+        out = static_cast<int32_t>((sum >= 0 ? sum + gain / 2 : sum - gain / 2) / gain);
+        return true;
+    }
+
+    void reset()
+    {
+        for (uint8_t i = 0; i < Order; i++)
+        {
+            integrators[i] = 0;
+            combs[i] = 0;
+        }
+        phase = 0;
+        warmup = Order - 1;
+    }
+
+private:
+    static constexpr int64_t power(int64_t base, uint8_t exponent)
+    {
+        return exponent == 0 ? 1 : base * power(base, exponent - 1);
+    }
+    static constexpr int64_t GAIN = power(Decimation, Order);
+
+    uint64_t integrators[Order];
+    uint64_t combs[Order];
+    uint8_t phase;
+    uint8_t warmup;
+};
+
+// Exponential moving average with a weight of 1 / 2^Shift for each new
+// conversion, kept with FRACTION_BITS below the raw count so small steps are
+// not lost to truncation. Starts at the first conversion instead of at zero.
+template <uint8_t Shift>
+class Ema
+{
+    static_assert(Shift >= 1 && Shift <= 15, "Shift must be 1 to 15");
+
+public:
+    static const uint8_t FRACTION_BITS = 16;
+
+    Ema() { reset(); }
+
+    bool push(int32_t in, int32_t &out)
+    {
+        int64_t scaled = static_cast<int64_t>(in) * (1 << FRACTION_BITS);
+        if (!started)
+        {
+            started = true;
+            state = scaled;
+        }
+        else
+        {
+            state += (scaled - state) / (1 << Shift);
+        }
+        int64_t half = 1 << (FRACTION_BITS - 1);
+        out = static_cast<int32_t>((state >= 0 ? state + half : state - half) / (1 << FRACTION_BITS));
+        return true;
+    }
+
+    void reset()
+    {
+        state = 0;
+        started = false;
+    }
+
+private:
+    int64_t state;
+    bool started;
+};
+
+template <typename... Stages>
+class FilterChain;
+
+// The empty chain passes conversions through unchanged
+template <>
+class FilterChain<>
+{
+public:
+    bool push(int32_t in, int32_t &out)
+    {
+        out = in;
+        return true;
+    }
+    void reset() {}
+};
+
+template <typename First, typename... Rest>
+class FilterChain<First, Rest...>
+{
+public:
+    // False while a decimating stage holds the conversion back
+    bool push(int32_t in, int32_t &out)
+    {
+        int32_t stageOut;
+        return first.push(in, stageOut) && rest.push(stageOut, out);
+    }
+
+    void reset()
+    {
+        first.reset();
+        rest.reset();
+    }
+
+private:
+    First first;
+    FilterChain<Rest...> rest;
+};
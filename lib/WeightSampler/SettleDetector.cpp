@@ -0,0 +1,129 @@
+#include "SettleDetector.h"
+#include <math.h>
+
+SettleDetector::SettleDetector()
+    : sampler(nullptr), quietSinceUs(0), seenCount(0), lastSeenUs(0), startMs(0), windowCount(0), windowStart(0),
+      settled(false), timedOut(false), weight(0), settleTimeMs(0)
+{
+}
+
+void SettleDetector::start(WeightSampler *sampler, uint32_t quietSinceUs)
+{
+    this->sampler = sampler;
+    this->quietSinceUs = quietSinceUs;
+    // The first update() looks back through the whole buffer for conversions
+    // taken after quietSinceUs
+    seenCount = sampler->getSampleCount() - WeightSampler::BUFFER_SIZE;
+    lastSeenUs = quietSinceUs - 1;
+    startMs = Hal::millis();
+    windowCount = 0;
+    windowStart = 0;
+    settled = false;
+    timedOut = false;
+    settleTimeMs = 0;
+}
+
+void SettleDetector::hold(uint32_t quietSinceUs)
+{
+    if (static_cast<int32_t>(quietSinceUs - this->quietSinceUs) > 0)
+    {
+        this->quietSinceUs = quietSinceUs;
+        windowCount = 0;
+        windowStart = 0;
+    }
+}
+
+bool SettleDetector::update()
+{
+    if (settled)
+    {
+        return true;
+    }
+
+    // Conversions that arrived since the last call, oldest first. The count
+    // only bounds the copy; the timestamps decide, as more may arrive meanwhile.
+    uint32_t total = sampler->getSampleCount();
+    size_t fresh = total - seenCount + 1;
+    seenCount = total;
+    WeightSampler::Sample buffer[WeightSampler::BUFFER_SIZE];
+    size_t n = sampler->getLatestSamples(buffer, fresh < WeightSampler::BUFFER_SIZE ? fresh : WeightSampler::BUFFER_SIZE);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (static_cast<int32_t>(buffer[i].timestampUs - lastSeenUs) <= 0)
+        {
+            continue; // Already in the window
+        }
+        lastSeenUs = buffer[i].timestampUs;
+        if (static_cast<int32_t>(buffer[i].timestampUs - quietSinceUs) < 0)
+        {
+            continue; // Taken while the pump or a servo was still moving
+        }
+        window[(windowStart + windowCount) % WINDOW] = buffer[i];
+        if (windowCount < WINDOW)
+        {
+            windowCount++;
+        }
+        else
+        {
+            windowStart = (windowStart + 1) % WINDOW;
+        }
+    }
+
+    evaluate();
+    if (!settled && windowCount > 0 && Hal::millis() - startMs >= TIMEOUT_MS)
+    {
+        settled = true;
+        timedOut = true;
+    }
+    if (settled)
+    {
+        settleTimeMs = Hal::millis() - startMs;
+    }
+    return settled;
+}
+
+void SettleDetector::evaluate()
+{
+    while (windowCount > 0)
+    {
+        // Mean, spread and least-squares slope of the window, time relative to its first conversion
+        uint32_t firstUs = window[windowStart].timestampUs;
+        float sumT = 0, sumW = 0;
+        for (uint8_t i = 0; i < windowCount; i++)
+        {
+            const WeightSampler::Sample &sample = window[(windowStart + i) % WINDOW];
+            sumT += (sample.timestampUs - firstUs) / 1e6f;
+            sumW += sampler->toGrams(sample.raw);
+        }
+        float meanT = sumT / windowCount;
+        weight = sumW / windowCount;
+        if (windowCount < MIN_SAMPLES)
+        {
+            return;
+        }
+
+        float varianceW = 0, covariance = 0, varianceT = 0;
+        for (uint8_t i = 0; i < windowCount; i++)
+        {
+            const WeightSampler::Sample &sample = window[(windowStart + i) % WINDOW];
+            float dt = (sample.timestampUs - firstUs) / 1e6f - meanT;
+            float dw = sampler->toGrams(sample.raw) - weight;
+            varianceW += dw * dw;
+            covariance += dt * dw;
+            varianceT += dt * dt;
+        }
+        varianceW /= windowCount - 1;
+        float span = (window[(windowStart + windowCount - 1) % WINDOW].timestampUs - firstUs) / 1e6f;
+        float drift = varianceT > 0 ? fabsf(covariance / varianceT) * span : 0;
+        if (sqrtf(varianceW) <= MAX_DEVIATION && drift <= MAX_DRIFT)
+        {
+            // At rest; done once the mean is precise enough
+            settled = varianceW / windowCount <= MAX_STANDARD_ERROR * MAX_STANDARD_ERROR;
+            return;
+        }
+
+        // Still moving: the oldest conversion is the least likely to be at rest
+        windowStart = (windowStart + 1) % WINDOW;
+        windowCount--;
+    }
+}
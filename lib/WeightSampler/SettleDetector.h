@@ -0,0 +1,50 @@
+#pragma once
+#include "WeightSampler.h"
+
+// Decides when the scale has come to rest, from the conversions as they
+// arrive instead of after a fixed wait. Conversions taken before the quiet
+// time (pump cutoff, end of a servo move) are skipped. The reading counts as
+// settled once the trailing window scatters less than MAX_DEVIATION, its
+// fitted slope moves the weight by less than MAX_DRIFT across the window, and
+// it holds enough conversions for the mean to be within MAX_STANDARD_ERROR:
+// a quiet scale settles with few conversions, a noisy one collects more. The
+// window is long enough for any scatter up to MAX_DEVIATION to get there.
+// After TIMEOUT_MS the window mean is taken as is.
+class SettleDetector
+{
+public:
+    static constexpr float MAX_DEVIATION = 0.05;      // g, standard deviation
+    static constexpr float MAX_DRIFT = 0.05;          // g over the window, e.g. a slow drip
+    static constexpr float MAX_STANDARD_ERROR = 0.006; // g, of the window mean
+    static const uint8_t MIN_SAMPLES = 8;
+    static const uint8_t WINDOW =
+        static_cast<uint8_t>((MAX_DEVIATION / MAX_STANDARD_ERROR) * (MAX_DEVIATION / MAX_STANDARD_ERROR)) + 1;
+    static const uint32_t TIMEOUT_MS = 8000; // A full window at 10 conversions per second
+
+    SettleDetector();
+    void start(WeightSampler *sampler, uint32_t quietSinceUs);
+    // Something moved again: conversions before quietSinceUs are skipped
+    void hold(uint32_t quietSinceUs);
+    // True once settled or timed out; getWeight() is valid from then on
+    bool update();
+
+    float getWeight() const { return weight; }
+    bool isTimedOut() const { return timedOut; }
+    uint32_t getSettleTimeMs() const { return settleTimeMs; }
+
+private:
+    void evaluate();
+
+    WeightSampler *sampler;
+    uint32_t quietSinceUs;
+    uint32_t seenCount; // Sampler conversions already looked at
+    uint32_t lastSeenUs;
+    uint32_t startMs;
+    WeightSampler::Sample window[WINDOW];
+    uint8_t windowCount;
+    uint8_t windowStart;
+    bool settled;
+    bool timedOut;
+    float weight;
+    uint32_t settleTimeMs;
+};
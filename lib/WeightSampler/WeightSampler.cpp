@@ -0,0 +1,302 @@
+#include "WeightSampler.h"
+
+WeightSampler::WeightSampler(HalLoadCell &loadCell)
+    : loadCell(loadCell), listener(nullptr), listenerArg(nullptr), scale(1.0), offset(0), compensation(), temperature(0), offsetTemperature(0),
+      effectiveOffset(0), effectiveScale(1.0), tarePending(false), tareSamples(0), tareStartCount(0),
+      filterCount(0), filteredRaw(0), filterValid(false)
+{
+}
+
+void WeightSampler::begin()
+{
+    loadCell.begin(onSample, this);
+}
+
+void WeightSampler::setListener(Listener listener, void *arg)
+{
+    listenerArg = arg;
+    this->listener = listener;
+}
+
+void IRAM_ATTR WeightSampler::onSample(void *arg, int32_t raw, uint32_t timestampUs)
+{
+    WeightSampler *sampler = static_cast<WeightSampler *>(arg);
+    Sample sample;
+    sample.timestampUs = timestampUs;
+    sample.raw = raw;
+    sampler->ring.push(sample);
+    if (sampler->listener)
+    {
+        sampler->listener(sampler->listenerArg);
+    }
+}
+
+void WeightSampler::setScale(float scale)
+{
+    this->scale = scale;
+    updateConversion();
+}
+
+float WeightSampler::getScale() const
+{
+    return scale;
+}
+
+void WeightSampler::setOffset(long offset)
+{
+    this->offset = offset;
+    offsetTemperature = temperature;
+    updateConversion();
+}
+
+long WeightSampler::getOffset() const
+{
+    return offset;
+}
+
+void WeightSampler::setCompensation(const Compensation &compensation)
+{
+    this->compensation = compensation;
+    updateConversion();
+}
+
+void WeightSampler::setTemperature(float celsius)
+{
+    temperature = celsius;
+    updateConversion();
+}
+
+void WeightSampler::updateConversion()
+{
+    effectiveOffset = offset + compensation.zeroPerDegree * (temperature - offsetTemperature);
+    effectiveScale = scale * (1 + compensation.spanPerDegree * (temperature - compensation.referenceTemperature));
+}
+
+void WeightSampler::tare(uint8_t samples)
+{
+    tareSamples = samples == 0 ? 1 : (samples > BUFFER_SIZE ? BUFFER_SIZE : samples);
+    tareStartCount = ring.totalCount();
+    tarePending = true;
+}
+
+bool WeightSampler::isTareComplete()
+{
+    updateTare();
+    return !tarePending;
+}
+
+void WeightSampler::updateTare()
+{
+    if (!tarePending || ring.totalCount() - tareStartCount < tareSamples)
+    {
+        return;
+    }
+
+    Sample buffer[BUFFER_SIZE];
+    size_t n = ring.copyLatest(buffer, tareSamples);
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += buffer[i].raw;
+    }
+    if (n > 0)
+    {
+        setOffset(sum / static_cast<int64_t>(n));
+    }
+    tarePending = false;
+}
+
+bool WeightSampler::hasSamples() const
+{
+    return ring.totalCount() > 0;
+}
+
+uint32_t WeightSampler::getSampleCount() const
+{
+    return ring.totalCount();
+}
+
+bool WeightSampler::getLatestSample(Sample &sample) const
+{
+    return ring.latest(sample);
+}
+
+size_t WeightSampler::getLatestSamples(Sample *out, size_t count) const
+{
+    return ring.copyLatest(out, count);
+}
+
+size_t WeightSampler::getSamplesFrom(uint32_t &first, Sample *out, size_t count) const
+{
+    return ring.copyFrom(first, out, count);
+}
+
+float WeightSampler::toGrams(int32_t raw) const
+{
+    float grams = (raw - effectiveOffset) / effectiveScale;
+    return grams + compensation.curvature * grams * grams;
+}
+
+float WeightSampler::getWeight()
+{
+    updateTare();
+    Sample sample;
+    if (!ring.latest(sample))
+    {
+        return 0.0;
+    }
+    return toGrams(sample.raw);
+}
+
+float WeightSampler::getFilteredWeight(uint8_t samples)
+{
+    updateTare();
+    Sample buffer[BUFFER_SIZE];
+    size_t n = ring.copyLatest(buffer, samples);
+    if (n == 0)
+    {
+        return 0.0;
+    }
+
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += buffer[i].raw;
+    }
+    return toGrams(static_cast<int32_t>(sum / static_cast<int64_t>(n)));
+}
+
+float WeightSampler::getSmoothedWeight()
+{
+    updateTare();
+    updateFilter();
+    return filterValid ? toGrams(filteredRaw) : 0.0;
+}
+
+void WeightSampler::updateFilter()
+{
+    Sample buffer[BUFFER_SIZE];
+    uint32_t first = filterCount;
+    size_t n = ring.copyFrom(first, buffer, BUFFER_SIZE);
+    if (first != filterCount)
+    {
+        // Conversions were missed: start over rather than filter across the gap
+        filter.reset();
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t out;
+        if (filter.push(buffer[i].raw, out))
+        {
+            filteredRaw = out;
+            filterValid = true;
+        }
+    }
+    filterCount = first + n;
+}
+
+bool WeightSampler::getAverageSince(uint32_t sinceUs, uint8_t samples, float &weight)
+{
+    updateTare();
+    if (samples == 0)
+    {
+        samples = 1;
+    }
+    Sample buffer[BUFFER_SIZE];
+    size_t n = ring.copyLatest(buffer, samples);
+    if (n < samples || static_cast<int32_t>(buffer[0].timestampUs - sinceUs) < 0)
+    {
+        return false; // Not enough samples taken after sinceUs yet
+    }
+
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += buffer[i].raw;
+    }
+    weight = toGrams(static_cast<int32_t>(sum / static_cast<int64_t>(n)));
+    return true;
+}
+
+bool WeightSampler::getAverageBetween(uint32_t fromUs, uint32_t toUs, float &weight, uint32_t &timestampUs)
+{
+    updateTare();
+    Sample buffer[BUFFER_SIZE];
+    size_t n = ring.copyLatest(buffer, BUFFER_SIZE);
+
+    int64_t sum = 0;
+    int64_t timeSum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t sinceFrom = static_cast<int32_t>(buffer[i].timestampUs - fromUs);
+        int32_t untilTo = static_cast<int32_t>(toUs - buffer[i].timestampUs);
+        if (sinceFrom >= 0 && untilTo >= 0)
+        {
+            sum += buffer[i].raw;
+            timeSum += sinceFrom;
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        return false;
+    }
+
+    weight = toGrams(static_cast<int32_t>(sum / static_cast<int64_t>(count)));
+    timestampUs = fromUs + static_cast<uint32_t>(timeSum / static_cast<int64_t>(count));
+    return true;
+}
+
+bool WeightSampler::getTrendBetween(uint32_t fromUs, uint32_t toUs, float &weight, uint32_t &timestampUs,
+                                    float &slope, float &timeSpread)
+{
+    updateTare();
+    Sample buffer[BUFFER_SIZE];
+    size_t n = ring.copyLatest(buffer, BUFFER_SIZE);
+
+    // Seconds from fromUs and grams from the first conversion, small enough for float sums
+    float reference = 0;
+    float timeSum = 0;
+    float weightSum = 0;
+    float timeSquares = 0;
+    float products = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t sinceFrom = static_cast<int32_t>(buffer[i].timestampUs - fromUs);
+        int32_t untilTo = static_cast<int32_t>(toUs - buffer[i].timestampUs);
+        if (sinceFrom < 0 || untilTo < 0)
+        {
+            continue;
+        }
+        float grams = toGrams(buffer[i].raw);
+        if (count == 0)
+        {
+            reference = grams;
+        }
+        float t = sinceFrom / 1000000.0f;
+        float w = grams - reference;
+        timeSum += t;
+        weightSum += w;
+        timeSquares += t * t;
+        products += t * w;
+        count++;
+    }
+    if (count < 2)
+    {
+        return false;
+    }
+
+    float meanTime = timeSum / count;
+    float meanWeight = weightSum / count;
+    timeSpread = timeSquares - count * meanTime * meanTime;
+    if (timeSpread <= 0)
+    {
+        return false;
+    }
+    slope = (products - count * meanTime * meanWeight) / timeSpread;
+    weight = reference + meanWeight;
+    timestampUs = fromUs + static_cast<uint32_t>(meanTime * 1000000);
+    return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include "FilterChain.h"
+#include "Hal.h"
+#include "RingBuffer.h"
+
+// Interrupt-driven load-cell sampler. Every conversion is delivered by the
+// load cell's data-ready callback and pushed, timestamped, into a lock-free ring buffer.
+// All readers (PumpController, ScaleModule, UserInterface) share one instance
+// and never block waiting for the ADC.
+class WeightSampler
+{
+public:
+    struct Sample
+    {
+        uint32_t timestampUs;
+        int32_t raw;
+    };
+
+    typedef void (*Listener)(void *arg);
+
+    static const size_t BUFFER_SIZE = 64;
+
+    // Spike rejection, then smoothing, for a steady reading of a load at rest
+    typedef FilterChain<Median<5>, Ema<2>> SampleFilter;
+
+    // Corrections on top of the linear scale; all zero is none
+    struct Compensation
+    {
+        float curvature;            // 1/g: grams + curvature * grams^2
+        float zeroPerDegree;        // Raw counts of zero drift per degree C
+        float spanPerDegree;        // Relative drift of the scale per degree C
+        float referenceTemperature; // Degrees C the scale was calibrated at
+    };
+
+    WeightSampler(HalLoadCell &loadCell);
+    void begin();
+    // Called after each conversion is buffered, from the data-ready
+    // interrupt: it only wakes whoever reads the samples. Before begin().
+    void setListener(Listener listener, void *arg);
+
+    void setScale(float scale);
+    float getScale() const;
+    void setOffset(long offset);
+    long getOffset() const;
+    float getEffectiveOffset() const { return effectiveOffset; } // At the current temperature
+    void setCompensation(const Compensation &compensation);
+    const Compensation &getCompensation() const { return compensation; }
+    // Latest temperature of the cell; the offset is taken to belong to the
+    // temperature at the time it was set
+    void setTemperature(float celsius);
+
+    // Non-blocking tare: the offset is taken from the next `samples` conversions.
+    void tare(uint8_t samples = 10);
+    bool isTareComplete();
+
+    bool hasSamples() const;
+    uint32_t getSampleCount() const;
+    bool getLatestSample(Sample &sample) const;
+    size_t getLatestSamples(Sample *out, size_t count) const;
+    // Conversions from number `first` on, see RingBuffer::copyFrom()
+    size_t getSamplesFrom(uint32_t &first, Sample *out, size_t count) const;
+
+    float getWeight();                           // Latest conversion in grams
+    float getFilteredWeight(uint8_t samples = 10); // Mean of the newest samples in grams
+    float getSmoothedWeight();                   // Newest SampleFilter output in grams
+    bool getAverageSince(uint32_t sinceUs, uint8_t samples, float &weight);
+    // Mean weight and mean timestamp of the buffered conversions taken in [fromUs, toUs]
+    bool getAverageBetween(uint32_t fromUs, uint32_t toUs, float &weight, uint32_t &timestampUs);
+    // Least-squares line through the same conversions: the weight at their mean
+    // timestamp, its slope in g/s, and the spread of the timestamps in s^2 that
+    // the slope is as certain as
+    bool getTrendBetween(uint32_t fromUs, uint32_t toUs, float &weight, uint32_t &timestampUs, float &slope,
+                         float &timeSpread);
+    float toGrams(int32_t raw) const;
+
+private:
+    static void IRAM_ATTR onSample(void *arg, int32_t raw, uint32_t timestampUs);
+    void updateTare();
+    void updateConversion();
+    void updateFilter();
+
+    HalLoadCell &loadCell;
+    Listener listener;
+    void *listenerArg;
+    RingBuffer<Sample, BUFFER_SIZE> ring;
+    float scale;
+    long offset;
+    Compensation compensation;
+    float temperature;
+    float offsetTemperature;
+    // Offset and scale at the current temperature, so toGrams() stays cheap
+    float effectiveOffset;
+    float effectiveScale;
+    bool tarePending;
+    uint8_t tareSamples;
+    uint32_t tareStartCount;
+    // Run over the conversions on the reader side, outside the interrupt
+    SampleFilter filter;
+    uint32_t filterCount; // Number of the next conversion to filter
+    int32_t filteredRaw;
+    bool filterValid;
+};
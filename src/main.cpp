@@ -1,6 +1,16 @@
 #include <Arduino.h>
-#include "LiquidManager.h"
-#include "PumpController.h"
+#include "ControlLink.h"
+#include "Esp32Hal.h"
+#include "Esp32RotaryInput.h"
+#include "EventLoop.h"
+#include "Hx711LoadCell.h"
+#include "Ssd1306Display.h"
+#include "Logger.h"
+#include "Profiler.h"
+#include "SerialCommands.h"
+#include "StationScheduler.h"
+#include "Telemetry.h"
+#include "TelemetryRecorder.h"
 #include "UserInterface.h"
 
 // Pin definitions
@@ -11,67 +21,163 @@ const int SCALE_CLOCK_PIN = 16;
 const int ROTARY_PIN1 = 35;
 const int ROTARY_PIN2 = 32;
 const int BUTTON_PIN = 34;
+const int DISPLAY_SDA_PIN = 25;
+const int DISPLAY_SCL_PIN = 26;
 
-LiquidManager &liquidManager = LiquidManager::getInstance();
-ServoSwitch flushSwitch(FLUSH_SWITCH_PIN, "Flush");
-PumpController pumpController(PUMP_PIN, &flushSwitch);
-UserInterface userInterface(ROTARY_PIN1, ROTARY_PIN2, BUTTON_PIN);
-// Define switches in an array
-ServoSwitch switches[] = {
-    ServoSwitch(5, "Bio Grow"),
-    ServoSwitch(18, "Bio Bloom"),
-    ServoSwitch(19, "Top Max")};
+// Core split: the control loop owns the application core, the UI, the
+// display transfer and the log drain share the protocol core
+const int CONTROL_CORE = 1;
+const int UI_CORE = 0;
+const UBaseType_t CONTROL_PRIORITY = configMAX_PRIORITIES - 2;
+const UBaseType_t UI_PRIORITY = 2;
 
-void setup()
+const uint8_t NUTRIENT_GROUP = 1;
+
+// Every boot is recorded for the replay on the host; the last boot's is kept as .old
+const char *RECORDING_PATH = "/telemetry.bin";
+TelemetryRecorder recorder;
+
+// Telemetry frames share the UART with the log lines; tools/telemetry skips the text
+void writeTelemetry(const uint8_t *data, size_t length)
 {
-  Serial.begin(115200);
+  Serial.write(data, length);
+  recorder.write(data, length);
+}
 
-  flushSwitch.close();
-  for (auto &sw : switches)
-  {
-    sw.close();
-  }
+void writeReply(const char *line)
+{
+  Serial.println(line);
+}
 
-  // Add liquids with corresponding switches
-  liquidManager.addLiquid("Bio Grow", 1.5, &switches[0]);
-  liquidManager.addLiquid("Bio Bloom", 1.5, &switches[1]);
-  liquidManager.addLiquid("Top Max", 1.5, &switches[2]);
+Esp32Clock halClock;
+Esp32Gpio halGpio;
+Esp32Storage storage;
+Esp32Thermometer thermometer;
+Hx711LoadCell loadCell(SCALE_DATA_PIN, SCALE_CLOCK_PIN);
+Ssd1306Display display(DISPLAY_SDA_PIN, DISPLAY_SCL_PIN, UI_CORE);
+Esp32ServoDriver flushServo(FLUSH_SWITCH_PIN);
+Esp32ServoDriver liquidServos[] = {
+    Esp32ServoDriver(5),
+    Esp32ServoDriver(18),
+    Esp32ServoDriver(19)};
 
-  userInterface.init(liquidManager);
-  pumpController.init(SCALE_DATA_PIN, SCALE_CLOCK_PIN);
-  // pumpController.calibrateScale(100.0); // Calibrate with a known 100g weight
+// One station on this board. More pumps and load cells: one Station each,
+// with its own id, all added to the scheduler
+Station station(0, PUMP_PIN, loadCell, flushServo, storage, &thermometer);
+StationScheduler scheduler;
+Esp32RotaryInput input(ROTARY_PIN1, ROTARY_PIN2, BUTTON_PIN);
+UserInterface userInterface(display, input);
+SerialCommands serialCommands(station.getLink(), station.getLiquidManager(), writeReply);
 
-  // Other initialization code...
-}
+// Each task sleeps until one of its events or deadlines comes up
+EventLoop controlEvents(Profiler::CONTROL_LATENCY);
+EventLoop uiEvents;
 
-void loop()
+// Sampling, the PumpController FSM and the actuators. Never waits on the UI.
+// A station steps on its conversions, pump timer edges, commands and deadlines.
+void controlTask(void *)
 {
-  userInterface.update();
-  pumpController.update();
-
-  if (pumpController.isBusy())
+  controlEvents.begin();
+  for (;;)
   {
-    String state = pumpController.getState();
-    userInterface.displayDispenseProgress(state);
+    {
+      ProfileScope profile(Profiler::CONTROL_PASS);
+      controlEvents.runOnce();
+    }
+    controlEvents.sleep();
   }
+}
 
-  if (userInterface.isDispenseRequested())
-  {
-    int currentLiquidIndex = userInterface.getCurrentLiquidIndex();
-    Liquid *selectedLiquid = liquidManager.getLiquid(currentLiquidIndex);
+void updateUi(void *);
+Trigger uiWakeup(updateUi, nullptr);
+TimerWheel::Timer uiDeadline(Trigger::notify, &uiWakeup);
 
-    if (selectedLiquid)
+// Encoder, button, display and serial jobs; talks to the control task only through the station's link
+void updateUi(void *)
+{
+  {
+    ProfileScope profile(Profiler::SERIAL_COMMANDS);
+    while (Serial.available() > 0)
     {
-      pumpController.dispense(selectedLiquid);
+      serialCommands.receive(Serial.read());
     }
+    serialCommands.update();
+  }
+  {
+    ProfileScope profile(Profiler::UI_UPDATE);
+    userInterface.update();
+  }
+  uint32_t atMs;
+  if (userInterface.getDeadline(atMs))
+  {
+    uiEvents.startAt(uiDeadline, atMs);
+  }
+  else
+  {
+    uiEvents.stop(uiDeadline);
+  }
+}
 
-    userInterface.resetDispenseRequest();
+// Woken by the encoder and button interrupts, received bytes and whatever the control task publishes
+void uiTask(void *)
+{
+  uiEvents.begin();
+  for (;;)
+  {
+    uiEvents.runOnce();
+    uiEvents.sleep();
   }
-  else if (userInterface.flushRequested())
+}
+
+void setup()
+{
+  Serial.begin(Telemetry::BAUD_RATE);
+  Hal::install(&halClock, &halGpio);
+  Logger::begin(UI_CORE);
+  recorder.setHoldCheck(PumpTimer::isAnyRunning); // No flash stall while a pump runs
+  recorder.begin(RECORDING_PATH);
+  Telemetry::begin(writeTelemetry, UI_CORE);
+
+  // Add liquids with their valves; one nutrient line, no flush needed between them
+  station.addLiquid("Bio Grow", 1.5, liquidServos[0], NUTRIENT_GROUP);
+  station.addLiquid("Bio Bloom", 1.5, liquidServos[1], NUTRIENT_GROUP);
+  station.addLiquid("Top Max", 1.5, liquidServos[2], NUTRIENT_GROUP);
+
+  LiquidManager &liquidManager = station.getLiquidManager();
+  Recipe *feed = liquidManager.addRecipe("Feed");
+  feed->addStep(liquidManager.getLiquid(0), 1.5);
+  feed->addStep(liquidManager.getLiquid(1), 1.5);
+  feed->addStep(liquidManager.getLiquid(2), 1.5);
+
+  // Warm start from the calibration and flow models of the last run; the
+  // recording starts with the first conversion, which the boot tare uses.
+  // The listeners are in place before the load cell interrupts.
+  Telemetry::watch(&station.getSampler());
+  scheduler.add(station);
+  scheduler.attach(controlEvents);
+  if (!station.begin())
   {
-    pumpController.flush();
-    userInterface.resetFlushRequest();
+    // Found at boot rather than on the first dose; the UI still shows the scale
+    LOG_ERROR("Station {} cannot drive its pump on pin {}", station.getId(), PUMP_PIN);
   }
 
-  // Other loop code...
-}
\ No newline at end of file
+  userInterface.init(liquidManager, station.getLink());
+  uiWakeup.attach(uiEvents);
+  uiWakeup.fire(); // The first screen
+  userInterface.attachInterrupts(Trigger::notify, &uiWakeup);
+  station.getLink().setPublishListener(Trigger::notify, &uiWakeup);
+  Serial.onReceive([]() { uiWakeup.fire(); });
+  // Calibration runs from the control task's scaleModule.update(): call
+  // station.getScaleModule().startCalibration(), measurePoint(0) on the empty platform,
+  // measurePoint() for each known weight, then finishCalibration(2, residual)
+
+  // Setup ran on the loop task; from here on each object belongs to one task
+  xTaskCreatePinnedToCore(controlTask, "control", 4096, nullptr, CONTROL_PRIORITY, nullptr, CONTROL_CORE);
+  xTaskCreatePinnedToCore(uiTask, "ui", 4096, nullptr, UI_PRIORITY, nullptr, UI_CORE);
+}
+
+void loop()
+{
+  // All work happens in controlTask and uiTask
+  vTaskDelete(nullptr);
+}
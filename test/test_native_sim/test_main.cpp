@@ -0,0 +1,1888 @@
+#include <unity.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CalibrationStore.h"
+#include "ControlLink.h"
+#include "ButtonDebouncer.h"
+#include "ButtonGestures.h"
+#include "DispenseSimulator.h"
+#include "EventLoop.h"
+#include "FlowModel.h"
+#include "HeapCounter.h"
+#include "LiquidManager.h"
+#include "PagedFrame.h"
+#include "Logger.h"
+#include "Profiler.h"
+#include "PumpController.h"
+#include "PumpTimer.h"
+#include "RotaryDecoder.h"
+#include "SampleHistory.h"
+#include "ScaleModule.h"
+#include "SerialCommands.h"
+#include "ServoSwitch.h"
+#include "SettleDetector.h"
+#include "StationScheduler.h"
+#include "Telemetry.h"
+#include "TelemetryRecorder.h"
+#include "TelemetryReplay.h"
+#include "TimerWheel.h"
+#include "WeightSampler.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+const int PUMP_PIN = 14;
+const unsigned long MAX_DISPENSE_MS = 120000;
+
+// Runs the controller against the simulator until it is idle again.
+// Returns the simulated time the dispense took in ms.
+static unsigned long runDispense(DispenseSimulator &sim, PumpController &pumpController, Liquid *liquid)
+{
+    unsigned long start = Hal::millis();
+    pumpController.dispense(liquid);
+    while (pumpController.isBusy() && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        pumpController.update();
+        sim.clock().advance(1000);
+    }
+    return Hal::millis() - start;
+}
+
+// Lets the scale module see an idle platform for a while
+static void runIdle(DispenseSimulator &sim, ScaleModule &scaleModule, unsigned long ms)
+{
+    for (unsigned long i = 0; i < ms; i++)
+    {
+        scaleModule.update(true);
+        sim.clock().advance(1000);
+    }
+}
+
+void setUp(void)
+{
+    Logger::setMinimumLevel(Logger::WARNING);
+}
+
+void tearDown(void)
+{
+}
+
+void test_pump_timer_cuts_off_at_deadline(void)
+{
+    DispenseSimulator sim;
+    PumpTimer pumpTimer(PUMP_PIN);
+    pumpTimer.begin();
+
+    pumpTimer.start(123456);
+    TEST_ASSERT_TRUE(pumpTimer.isRunning());
+    TEST_ASSERT_EQUAL(HIGH, sim.gpio().digitalRead(PUMP_PIN));
+
+    sim.clock().advance(100000);
+    TEST_ASSERT_TRUE(pumpTimer.isRunning());
+
+    // Polled late on purpose; the cutoff still happens at the deadline
+    sim.clock().advance(500000);
+    TEST_ASSERT_FALSE(pumpTimer.isRunning());
+    TEST_ASSERT_EQUAL(LOW, sim.gpio().digitalRead(PUMP_PIN));
+    TEST_ASSERT_EQUAL_UINT32(123456, pumpTimer.getLastOnTimeUs());
+}
+
+void test_pump_without_pwm_refuses_jobs(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.5), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(SimGpio::PIN_COUNT, &flushSwitch); // No PWM to be had for it
+    Liquid liquid("Bio Grow", 1.0, &liquidSwitch);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    // Refused up front instead of running into the state timeout
+    TEST_ASSERT_FALSE(pumpController.dispense(&liquid));
+    TEST_ASSERT_FALSE(pumpController.flush());
+    TEST_ASSERT_FALSE(pumpController.isBusy());
+}
+
+void test_sampler_reads_without_blocking(void)
+{
+    DispenseSimulator sim;
+    WeightSampler sampler(sim.loadCell());
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+
+    TEST_ASSERT_FALSE(sampler.hasSamples());
+    sampler.tare();
+    TEST_ASSERT_FALSE(sampler.isTareComplete());
+
+    sim.clock().advance(1500000);
+    TEST_ASSERT_TRUE(sampler.isTareComplete());
+    TEST_ASSERT_EQUAL_UINT32(15, sampler.getSampleCount());
+    TEST_ASSERT_FLOAT_WITHIN(0.05, 0.0, sampler.getFilteredWeight());
+}
+
+void test_filter_chain_rejects_recorded_spikes(void)
+{
+    SimConfig config;
+    config.spikeChance = 0.05;
+    DispenseSimulator sim(config);
+    WeightSampler sampler(sim.loadCell());
+    sampler.setScale(config.scaleFactor);
+    sampler.begin();
+    sampler.tare();
+    sim.clock().advance(1500000);
+    TEST_ASSERT_TRUE(sampler.isTareComplete());
+
+    // Record the noise of the empty platform, one conversion at a time
+    std::vector<int32_t> recorded;
+    for (int i = 0; i < 600; i++)
+    {
+        sim.clock().advance(100000);
+        WeightSampler::Sample sample;
+        TEST_ASSERT_TRUE(sampler.getLatestSample(sample));
+        recorded.push_back(sample.raw);
+    }
+
+    // The plain mean of 10 smears every spike into the reading, the median drops it
+    WeightSampler::SampleFilter filter;
+    float worstMean = 0, worstFiltered = 0;
+    for (size_t i = 0; i < recorded.size(); i++)
+    {
+        int32_t out;
+        TEST_ASSERT_TRUE(filter.push(recorded[i], out));
+        if (i < 10)
+        {
+            continue;
+        }
+        int64_t sum = 0;
+        for (size_t j = i - 9; j <= i; j++)
+        {
+            sum += recorded[j];
+        }
+        float mean = fabsf(sampler.toGrams(static_cast<int32_t>(sum / 10)));
+        float filtered = fabsf(sampler.toGrams(out));
+        worstMean = mean > worstMean ? mean : worstMean;
+        worstFiltered = filtered > worstFiltered ? filtered : worstFiltered;
+    }
+    TEST_ASSERT_TRUE(worstMean > 0.15);
+    TEST_ASSERT_TRUE(worstFiltered < 0.05);
+    TEST_ASSERT_FLOAT_WITHIN(0.05, 0.0, sampler.getSmoothedWeight());
+
+    // Decimators pass a level through unchanged once their history is full
+    FilterChain<Cic<4, 2>, MovingAverage<3>> decimator;
+    int outputs = 0;
+    for (int i = 0; i < 40; i++)
+    {
+        int32_t out;
+        if (decimator.push(-84210, out))
+        {
+            TEST_ASSERT_EQUAL_INT32(-84210, out);
+            outputs++;
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(9, outputs);
+}
+
+void test_settle_detector_skips_servo_travel(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch liquidSwitch(sim.addLiquid(2.2), "Top Max");
+    WeightSampler sampler(sim.loadCell());
+    sampler.setScale(sim.getConfig().scaleFactor);
+    liquidSwitch.begin();
+    sampler.begin();
+    sampler.tare();
+    sim.clock().advance(1500000);
+    TEST_ASSERT_TRUE(sampler.isTareComplete());
+
+    // The valve shakes the scale while it travels
+    liquidSwitch.open();
+    SettleDetector settleDetector;
+    settleDetector.start(&sampler, liquidSwitch.getSettledAtUs());
+    while (!settleDetector.update())
+    {
+        sim.clock().advance(1000);
+    }
+    TEST_ASSERT_FALSE(settleDetector.isTimedOut());
+    TEST_ASSERT_LESS_THAN(1500, settleDetector.getSettleTimeMs());
+    TEST_ASSERT_FLOAT_WITHIN(0.02, 0.0, settleDetector.getWeight());
+}
+
+void test_settle_detector_waits_out_a_noisy_scale(void)
+{
+    SimConfig config;
+    config.noiseStdDev = 0.04;
+    DispenseSimulator sim(config);
+    WeightSampler sampler(sim.loadCell());
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    sampler.tare();
+    sim.clock().advance(1500000);
+    TEST_ASSERT_TRUE(sampler.isTareComplete());
+
+    // Noisier than the target precision, but at rest: more conversions, no timeout
+    sim.placeWeight(5.0);
+    SettleDetector settleDetector;
+    settleDetector.start(&sampler, static_cast<uint32_t>(Hal::micros()));
+    while (!settleDetector.update())
+    {
+        sim.clock().advance(1000);
+    }
+    TEST_ASSERT_FALSE(settleDetector.isTimedOut());
+    TEST_ASSERT_GREATER_THAN(2000, settleDetector.getSettleTimeMs());
+    TEST_ASSERT_FLOAT_WITHIN(0.02, 5.0, settleDetector.getWeight());
+}
+
+void test_flow_model_identifies_pump(void)
+{
+    // 2 g/s after 50ms dead time, 0.03g drip
+    FlowModel model;
+    const float onTimes[] = {0.4, 1.5, 0.2, 2.5, 0.8, 0.1, 3.0, 0.5};
+    for (int i = 0; i < 4; i++)
+    {
+        for (float onTime : onTimes)
+        {
+            model.addPulse(onTime, 2.0 * (onTime - 0.05) + 0.03);
+            model.addDripObservation(0.03);
+        }
+    }
+
+    TEST_ASSERT_FLOAT_WITHIN(0.02, 2.0, model.getFlowRate());
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 0.05, model.getDeadTime());
+    TEST_ASSERT_FLOAT_WITHIN(0.005, 0.03, model.getDripVolume());
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 1.0, model.predict(model.onTimeFor(1.0)));
+    // Well-identified: one coarse pulse close to the target, then a trim
+    TEST_ASSERT_TRUE(model.planDose(5.0) > 4.5);
+    TEST_ASSERT_EQUAL_FLOAT(0.1, model.planDose(0.1));
+}
+
+void test_flow_model_learns_stall_duty_once_per_pass(void)
+{
+    FlowModel model(2.0, 0.05, 0.03);
+    float stallDuty = model.getStallDuty();
+
+    // A pass slow throughout leaves the model alone: the controller measures
+    // its flow on the weight while it runs instead
+    model.addPass(0, 2.0, 0.5, 0.6);
+    TEST_ASSERT_EQUAL_FLOAT(stallDuty, model.getStallDuty());
+    TEST_ASSERT_EQUAL_FLOAT(2.0, model.getFlowRate());
+
+    // That measurement is one smoothing step (0.3) towards the stall duty it implies
+    float observed = 0.1;
+    model.addDutyObservation(0.5, (0.5 - observed) / (1 - observed));
+    TEST_ASSERT_FLOAT_WITHIN(1e-5, stallDuty + 0.3 * (observed - stallDuty), model.getStallDuty());
+}
+
+void test_dispense_reaches_target(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.2), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Bio Grow", 1.5, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    runDispense(sim, pumpController, &liquid);
+
+    TEST_ASSERT_FALSE(pumpController.isBusy());
+    TEST_ASSERT_FALSE(liquidSwitch.isOpen());
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.5, sim.getLiquidDelivered(0));
+}
+
+void test_dose_ends_when_flush_and_dosing_disagree(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.2), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Bio Grow", 1.5, &liquidSwitch);
+    // A drip learned far too large leaves doses short by up to half of it
+    liquid.flowModel.setParameters({1.2, 0.05, 0.5, 0.05, 0.02, 0.15, 10});
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    runDispense(sim, pumpController, &liquid);
+
+    // Dosing and the final flush agree on when the dose is done, and the
+    // flush goes back to dosing only a bounded number of times
+    TEST_ASSERT_FALSE(pumpController.isBusy());
+    TEST_ASSERT_FLOAT_WITHIN(0.15, 1.5, sim.getLiquidDelivered(0));
+    TEST_ASSERT_TRUE(sim.getFlushDelivered() < 5 * Liquid::DEFAULT_FLUSH_VOLUME);
+}
+
+void test_many_dispense_cycles(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(0.9), "Bio Bloom");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Bio Bloom", 2.0, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    const int cycles = 1000;
+    float previous = 0;
+    for (int i = 0; i < cycles; i++)
+    {
+        runDispense(sim, pumpController, &liquid);
+        TEST_ASSERT_FALSE(pumpController.isBusy());
+
+        float dose = sim.getLiquidDelivered(0) - previous;
+        previous = sim.getLiquidDelivered(0);
+        TEST_ASSERT_FLOAT_WITHIN(0.15, 2.0, dose);
+        if (i >= 10)
+        {
+            // The flow model is trained by now
+            TEST_ASSERT_LESS_OR_EQUAL(4, pumpController.getLastDispenseStats().dispensingIterations);
+        }
+        sim.emptyContainer();
+    }
+}
+
+void test_fine_phase_finishes_dose_in_one_pass(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(2.5), "Bio Bloom");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Bio Bloom", 20.0, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    // A large dose keeps the model's margin wide enough for the fine phase
+    int onePass = 0;
+    float squaredError = 0;
+    float previous = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        runDispense(sim, pumpController, &liquid);
+        float dose = sim.getLiquidDelivered(0) - previous;
+        previous = sim.getLiquidDelivered(0);
+        TEST_ASSERT_FLOAT_WITHIN(0.05, 20.0, dose);
+        if (i >= 2)
+        {
+            // The pump slows down before the target and stops on the weight
+            onePass += pumpController.getLastDispenseStats().dispensingIterations == 1 ? 1 : 0;
+            squaredError += (dose - 20.0f) * (dose - 20.0f);
+        }
+        sim.emptyContainer();
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(6, onePass);
+    TEST_ASSERT_FLOAT_WITHIN(0.02, 0.0, sqrtf(squaredError / 8));
+    TEST_ASSERT_FLOAT_WITHIN(0.05, sim.getConfig().stallDuty, liquid.flowModel.getStallDuty());
+}
+
+void test_recipe_groups_liquids_to_save_flushes(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch growSwitch(sim.addLiquid(1.2), "Bio Grow");
+    ServoSwitch calMagSwitch(sim.addLiquid(0.9), "CalMag");
+    ServoSwitch bloomSwitch(sim.addLiquid(1.5), "Bio Bloom");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid grow("Bio Grow", 0, &growSwitch, 1);
+    Liquid calMag("CalMag", 0, &calMagSwitch); // Group 0: always flushed out
+    Liquid bloom("Bio Bloom", 0, &bloomSwitch, 1);
+    Recipe recipe("Feed");
+    recipe.addStep(&grow, 2.0);
+    recipe.addStep(&calMag, 1.0);
+    recipe.addStep(&bloom, 1.5);
+
+    flushSwitch.begin();
+    growSwitch.begin();
+    calMagSwitch.begin();
+    bloomSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    // Every step is held to the single-dose limits
+    Recipe broken("Broken");
+    broken.addStep(&grow, 2.0);
+    broken.addStep(&bloom, 0);
+    TEST_ASSERT_FALSE(pumpController.dispense(&broken));
+    broken.steps[1].amount = PumpController::MAX_DOSE + 1;
+    TEST_ASSERT_FALSE(pumpController.dispense(&broken));
+    TEST_ASSERT_FALSE(pumpController.isBusy());
+
+    unsigned long start = Hal::millis();
+    TEST_ASSERT_TRUE(pumpController.dispense(&recipe));
+    while (pumpController.isBusy() && Hal::millis() - start < 3 * MAX_DISPENSE_MS)
+    {
+        pumpController.update();
+        sim.clock().advance(1000);
+    }
+
+    const float targets[] = {2.0, 1.0, 1.5};
+    TEST_ASSERT_FALSE(pumpController.isBusy());
+    TEST_ASSERT_TRUE(pumpController.getLastDispenseStats().completed);
+    TEST_ASSERT_EQUAL_UINT8(3, pumpController.getStepCount());
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_TRUE(pumpController.getStepStats(i).completed);
+        TEST_ASSERT_FLOAT_WITHIN(0.1, targets[i], pumpController.getStepStats(i).dispensedAmount);
+        TEST_ASSERT_FLOAT_WITHIN(0.1, targets[i], sim.getLiquidDelivered(i));
+    }
+
+    // Bloom is moved up behind Grow, so the line is only flushed before
+    // CalMag and at the end: the unknown line at boot plus two flushes
+    // instead of three, 8s each
+    TEST_ASSERT_EQUAL_UINT32(0, pumpController.getStepStats(0).flushPumpTimeMs);
+    TEST_ASSERT_TRUE(pumpController.getLastDispenseStats().flushPumpTimeMs < 26000);
+    TEST_ASSERT_FALSE(growSwitch.isOpen() || calMagSwitch.isOpen() || bloomSwitch.isOpen());
+}
+
+void test_flush_learns_volume_from_flow(void)
+{
+    SimConfig config;
+    config.flushToScale = true;
+    config.lineVolume = 2.0; // A thick liquid slows the flush water until it is out
+    DispenseSimulator sim(config);
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(0.9), "CalMag");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("CalMag", 2.0, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    float firstFlush = 0;
+    float lastFlush = 0;
+    float previous = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        float flushBefore = sim.getFlushDelivered();
+        runDispense(sim, pumpController, &liquid);
+        lastFlush = sim.getFlushDelivered() - flushBefore;
+        firstFlush = i == 0 ? lastFlush : firstFlush;
+
+        // The flush water on the scale is not counted as dose
+        float dose = sim.getLiquidDelivered(0) - previous;
+        previous = sim.getLiquidDelivered(0);
+        TEST_ASSERT_FLOAT_WITHIN(0.1, 2.0, dose);
+        TEST_ASSERT_FLOAT_WITHIN(0.1, 2.0, pumpController.getLastDispenseStats().dispensedAmount);
+        sim.emptyContainer();
+    }
+    TEST_ASSERT_TRUE(liquid.flushVolume < Liquid::DEFAULT_FLUSH_VOLUME / 2);
+    TEST_ASSERT_TRUE(lastFlush < firstFlush / 3);
+
+    // A manual flush runs in update() too. The line holds water by now, so
+    // it gets the default volume.
+    sim.clock().advance(2000000); // The scale sees the emptied container
+    float flushBefore = sim.getFlushDelivered();
+    pumpController.flush();
+    TEST_ASSERT_TRUE(pumpController.isBusy());
+    TEST_ASSERT_EQUAL_STRING("FLUSHING", pumpController.getState());
+    unsigned long start = Hal::millis();
+    while (pumpController.isBusy() && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        pumpController.update();
+        sim.clock().advance(1000);
+    }
+    TEST_ASSERT_FALSE(flushSwitch.isOpen());
+    TEST_ASSERT_FLOAT_WITHIN(1.0, Liquid::DEFAULT_FLUSH_VOLUME, sim.getFlushDelivered() - flushBefore);
+}
+
+// Runs a dispense like runDispense() and tells whether it tared
+static bool runDispenseTared(DispenseSimulator &sim, PumpController &pumpController, Liquid *liquid, float amount)
+{
+    bool tared = false;
+    unsigned long start = Hal::millis();
+    pumpController.dispense(liquid, amount);
+    while (pumpController.isBusy() && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        tared |= !strcmp(pumpController.getState(), "TARING");
+        pumpController.update();
+        sim.clock().advance(1000);
+    }
+    return tared;
+}
+
+void test_container_session_weighs_doses_without_taring(void)
+{
+    SimConfig config;
+    config.flushToScale = true; // Every final flush ends up in the container
+    DispenseSimulator sim(config);
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch growSwitch(sim.addLiquid(1.2), "Bio Grow");
+    ServoSwitch bloomSwitch(sim.addLiquid(1.5), "Bio Bloom");
+    ServoSwitch calMagSwitch(sim.addLiquid(0.9), "CalMag");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid grow("Bio Grow", 1.0, &growSwitch, 1);
+    Liquid bloom("Bio Bloom", 1.5, &bloomSwitch, 1);
+    Liquid calMag("CalMag", 1.0, &calMagSwitch);
+
+    flushSwitch.begin();
+    growSwitch.begin();
+    bloomSwitch.begin();
+    calMagSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+    sim.clock().advance(1000000);
+
+    TEST_ASSERT_TRUE(pumpController.beginSession());
+    // The first job flushes the unknown line, then tares: the session starts there
+    float contentsAtTare = 0, flushAtTare = 0;
+    unsigned long start = Hal::millis();
+    pumpController.dispense(&grow, 1.0);
+    while (pumpController.isBusy() && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        if (!strcmp(pumpController.getState(), "TARING"))
+        {
+            contentsAtTare = sim.getScaleContents();
+            flushAtTare = sim.getFlushDelivered();
+        }
+        pumpController.update();
+        sim.clock().advance(1000);
+    }
+
+    // The container stays put: no tare, the flush water in it is accounted for
+    TEST_ASSERT_FALSE(runDispenseTared(sim, pumpController, &bloom, 1.5));
+    TEST_ASSERT_FALSE(runDispenseTared(sim, pumpController, &calMag, 1.0));
+    TEST_ASSERT_FALSE(runDispenseTared(sim, pumpController, &grow, 0.5));
+    TEST_ASSERT_FLOAT_WITHIN(0.1, sim.getLiquidDelivered(0), pumpController.getSessionAmount(&grow));
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.5, pumpController.getSessionAmount(&grow));
+    TEST_ASSERT_FLOAT_WITHIN(0.1, sim.getLiquidDelivered(1), pumpController.getSessionAmount(&bloom));
+    TEST_ASSERT_FLOAT_WITHIN(0.1, sim.getLiquidDelivered(2), pumpController.getSessionAmount(&calMag));
+    float flushWater = sim.getFlushDelivered() - flushAtTare;
+    TEST_ASSERT_TRUE(flushWater > 5);
+    TEST_ASSERT_FLOAT_WITHIN(0.3, flushWater, pumpController.getSessionFlushWater());
+    TEST_ASSERT_FLOAT_WITHIN(0.3, sim.getScaleContents() - contentsAtTare,
+                             pumpController.getSessionTotal() + pumpController.getSessionFlushWater());
+
+    // A swapped container breaks the chain: the next dose tares again
+    sim.emptyContainer();
+    sim.clock().advance(2000000);
+    TEST_ASSERT_TRUE(runDispenseTared(sim, pumpController, &grow, 0.5));
+    pumpController.endSession();
+    TEST_ASSERT_FALSE(pumpController.isSessionOpen());
+    TEST_ASSERT_FLOAT_WITHIN(0.15, 2.0, pumpController.getSessionAmount(&grow));
+}
+
+void test_scale_module_fits_quadratic_calibration(void)
+{
+    SimConfig config;
+    config.containerWeight = 0;
+    config.nonlinearity = 2e-5; // 0.8g high at 200g
+    DispenseSimulator sim(config);
+    WeightSampler sampler(sim.loadCell());
+    ScaleModule scaleModule(sampler);
+    sampler.setScale(2000); // Only roughly right before the calibration
+    sampler.begin();
+
+    const float weights[] = {0, 50, 100, 200};
+    scaleModule.startCalibration();
+    for (float weight : weights)
+    {
+        sim.placeWeight(weight);
+        scaleModule.measurePoint(weight);
+        TEST_ASSERT_TRUE(scaleModule.isMeasuring());
+        runIdle(sim, scaleModule, 5000);
+        TEST_ASSERT_FALSE(scaleModule.isMeasuring());
+    }
+    TEST_ASSERT_EQUAL_UINT8(4, scaleModule.getPointCount());
+
+    // A line cannot follow the curvature, a parabola can
+    float linearResidual;
+    float residual;
+    TEST_ASSERT_TRUE(scaleModule.finishCalibration(1, linearResidual));
+    TEST_ASSERT_TRUE(scaleModule.finishCalibration(2, residual));
+    TEST_ASSERT_TRUE(linearResidual > 0.1);
+    TEST_ASSERT_TRUE(residual < 0.02);
+    TEST_ASSERT_FLOAT_WITHIN(10, sim.getConfig().scaleFactor, sampler.getScale());
+
+    // Read before zero tracking would take the new load as a tare
+    sim.placeWeight(150);
+    sim.clock().advance(2000000);
+    TEST_ASSERT_FLOAT_WITHIN(0.03, 150, sampler.getFilteredWeight());
+}
+
+void test_scale_module_rejects_degenerate_calibration(void)
+{
+    SimConfig config;
+    config.containerWeight = 0;
+    DispenseSimulator sim(config);
+    WeightSampler sampler(sim.loadCell());
+    ScaleModule scaleModule(sampler);
+    sampler.setScale(2000);
+    sampler.begin();
+
+    // The same weight twice pins down no curvature
+    const float weights[] = {0, 100, 100};
+    scaleModule.startCalibration();
+    for (float weight : weights)
+    {
+        sim.placeWeight(weight);
+        scaleModule.measurePoint(weight);
+        runIdle(sim, scaleModule, 5000);
+    }
+    float residual;
+    TEST_ASSERT_FALSE(scaleModule.finishCalibration(2, residual));
+    TEST_ASSERT_EQUAL_FLOAT(2000, sampler.getScale());
+
+    // A weight that never made it onto the platform pins down nothing
+    scaleModule.startCalibration();
+    sim.placeWeight(0);
+    scaleModule.measurePoint(0);
+    runIdle(sim, scaleModule, 5000);
+    scaleModule.measurePoint(50);
+    runIdle(sim, scaleModule, 5000);
+    TEST_ASSERT_FALSE(scaleModule.finishCalibration(1, residual));
+    TEST_ASSERT_EQUAL_FLOAT(2000, sampler.getScale());
+}
+
+void test_scale_module_tracks_zero_and_temperature_drift(void)
+{
+    SimConfig config;
+    config.zeroDrift = 0.05; // g per degree C
+    DispenseSimulator sim(config);
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.5), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    ScaleModule scaleModule(sampler, &sim.thermometer());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Bio Grow", 2.0, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler, nullptr, &scaleModule);
+    runDispense(sim, pumpController, &liquid);
+    sim.emptyContainer();
+
+    // Idle while the enclosure warms up by 10 degrees: the new load is
+    // zeroed, the zero follows the drift and the drift is learned
+    TEST_ASSERT_FALSE(scaleModule.isZeroed());
+    for (int second = 0; second < 600; second++)
+    {
+        sim.setTemperature(25 + second / 60.0f);
+        for (int ms = 0; ms < 1000; ms++)
+        {
+            pumpController.update();
+            sim.clock().advance(1000);
+        }
+    }
+    TEST_ASSERT_TRUE(scaleModule.isZeroed());
+    TEST_ASSERT_FLOAT_WITHIN(0.03, 0, sampler.getFilteredWeight());
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 0.05, scaleModule.getZeroDriftPerDegree());
+
+    // No tare before the dose, and the zero is compensated while the
+    // temperature drops by 5 degrees during it (0.25g uncompensated)
+    float delivered = sim.getLiquidDelivered(0);
+    pumpController.dispense(&liquid);
+    TEST_ASSERT_EQUAL_STRING("DISPENSING", pumpController.getState());
+    sim.setTemperature(30);
+    unsigned long start = Hal::millis();
+    while (pumpController.isBusy() && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        pumpController.update();
+        sim.clock().advance(1000);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 2.0, sim.getLiquidDelivered(0) - delivered);
+}
+
+void test_calibration_store_warm_start(void)
+{
+    const char *path = "test_calibration.bin";
+    remove(path);
+    FlowModel::Parameters learned;
+    uint16_t warmedUpIterations;
+    {
+        DispenseSimulator sim;
+        FileStorage storage(path);
+        CalibrationStore store(storage);
+        ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+        ServoSwitch liquidSwitch(sim.addLiquid(2.2), "Top Max");
+        WeightSampler sampler(sim.loadCell());
+        PumpController pumpController(PUMP_PIN, &flushSwitch);
+        Liquid liquid("Top Max", 3.0, &liquidSwitch);
+
+        TEST_ASSERT_TRUE(store.begin());
+        TEST_ASSERT_FALSE(store.loadScale(sampler));
+        TEST_ASSERT_EQUAL_FLOAT(CalibrationStore::DEFAULT_SCALE, sampler.getScale());
+        flushSwitch.begin();
+        liquidSwitch.begin();
+        sampler.begin();
+        pumpController.init(&sampler, &store);
+        for (int i = 0; i < 8; i++)
+        {
+            runDispense(sim, pumpController, &liquid);
+            sim.emptyContainer();
+        }
+        warmedUpIterations = pumpController.getLastDispenseStats().dispensingIterations;
+        learned = liquid.flowModel.getParameters();
+    }
+
+    // After a "reboot" the first dose is as quick as a warmed-up one
+    DispenseSimulator sim;
+    FileStorage storage(path);
+    CalibrationStore store(storage);
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(2.2), "Top Max");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Top Max", 3.0, &liquidSwitch);
+
+    TEST_ASSERT_TRUE(store.begin());
+    TEST_ASSERT_TRUE(store.loadScale(sampler));
+    TEST_ASSERT_TRUE(store.loadLiquid(liquid));
+    TEST_ASSERT_EQUAL_FLOAT(learned.flowRate, liquid.flowModel.getFlowRate());
+    TEST_ASSERT_EQUAL_UINT16(learned.pulseCount, liquid.flowModel.getPulseCount());
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.begin();
+    pumpController.init(&sampler, &store);
+    runDispense(sim, pumpController, &liquid);
+    TEST_ASSERT_LESS_OR_EQUAL(warmedUpIterations, pumpController.getLastDispenseStats().dispensingIterations);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 3.0, sim.getLiquidDelivered(0));
+    remove(path);
+}
+
+void test_calibration_store_rejects_corrupt_record(void)
+{
+    const char *path = "test_calibration.bin";
+    remove(path);
+    DispenseSimulator sim;
+    WeightSampler sampler(sim.loadCell());
+    Liquid liquid("Bio Grow", 1.5, nullptr);
+    liquid.flowModel.addPulse(1.0, 1.7);
+    {
+        FileStorage storage(path);
+        CalibrationStore store(storage);
+        store.begin();
+        sampler.setScale(1234.5);
+        store.saveScale(sampler);
+        store.saveLiquid(liquid);
+    }
+
+    // Flip one byte of the stored flow rate. The flow record's key sorts
+    // first: 1 + 9 key bytes, 2 length bytes, then version and name.
+    const long flowRateOffset = 12 + 2 + 16;
+    FILE *file = fopen(path, "r+b");
+    TEST_ASSERT_NOT_NULL(file);
+    fseek(file, flowRateOffset, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, flowRateOffset, SEEK_SET);
+    fputc(byte ^ 0x40, file);
+    fclose(file);
+
+    FileStorage storage(path);
+    CalibrationStore store(storage);
+    Liquid reloaded("Bio Grow", 1.5, nullptr);
+    TEST_ASSERT_TRUE(store.begin());
+    TEST_ASSERT_TRUE(store.loadScale(sampler));
+    TEST_ASSERT_EQUAL_FLOAT(1234.5, sampler.getScale());
+    TEST_ASSERT_FALSE(store.loadLiquid(reloaded));
+    TEST_ASSERT_EQUAL_UINT16(0, reloaded.flowModel.getPulseCount());
+    remove(path);
+}
+
+void test_control_loop_runs_commands_and_reports_status(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.2), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    LiquidManager liquidManager;
+    liquidManager.addLiquid("Bio Grow", 1.5, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    ControlLink link;
+    ControlLoop controlLoop(link, pumpController, liquidManager);
+    for (size_t i = 0; i < ControlLink::QUEUE_SIZE; i++)
+    {
+        TEST_ASSERT_TRUE(link.requestDispense(i == 0 ? 0 : 99));
+    }
+    TEST_ASSERT_FALSE(link.requestDispense(0)); // Full: rejected, never overwritten
+
+    // The UI side polls far less often than the control loop steps
+    ControlStatus status;
+    bool sawDispensing = false;
+    bool idle = false;
+    unsigned long start = Hal::millis();
+    while (!idle && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            controlLoop.step();
+            sim.clock().advance(1000);
+        }
+        if (link.pollStatus(status))
+        {
+            TEST_ASSERT_EQUAL_INT(0, status.liquidIndex);
+            sawDispensing |= strcmp(status.state, "DISPENSING") == 0;
+            idle = !status.busy;
+        }
+    }
+
+    TEST_ASSERT_TRUE(sawDispensing);
+    TEST_ASSERT_TRUE(idle);
+    TEST_ASSERT_EQUAL_STRING("IDLE", status.state);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.5, status.targetAmount);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.5, sim.getLiquidDelivered(0));
+}
+
+static std::vector<std::string> serialLines;
+
+static void collectLine(const char *line)
+{
+    serialLines.push_back(line);
+}
+
+void test_job_queue_runs_serial_jobs_back_to_back(void)
+{
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.2), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    LiquidManager liquidManager;
+    liquidManager.addLiquid("Bio Grow", 1.5, &liquidSwitch);
+
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    ControlLink link;
+    ControlLoop controlLoop(link, pumpController, liquidManager);
+    SerialCommands serial(link, liquidManager, collectLine);
+    serialLines.clear();
+    const char *input = "DISPENSE bio_grow 1.0\r\n"
+                        "DISPENSE 0 0.5\n"
+                        "dispense 0 0.8 5\n" // Jumps the queue
+                        "DISPENSE 0 0.3\n"
+                        "CANCEL 4\n"
+                        "DISPENSE Top_Max\n"
+                        "DISPENSE 0 abc\n"
+                        "DISPENSE 0 inf\n"
+                        "DISPENSE 0 1e9\n"
+                        "DISPENSE 0abc 0.5\n"
+                        "DISPENSE 0 0.5 abc\n"
+                        "FLUSH -1\n"
+                        "CANCEL 4x\n";
+    for (const char *c = input; *c; c++)
+    {
+        serial.receive(*c);
+    }
+    const char *replies[] = {"OK 1", "OK 2", "OK 3", "OK 4", "OK", "ERR unknown liquid or bad amount",
+                             "ERR unknown liquid or bad amount", "ERR unknown liquid or bad amount",
+                             "ERR unknown liquid or bad amount", "ERR unknown liquid or bad amount",
+                             "ERR bad priority", "ERR bad priority", "ERR cannot cancel"};
+    TEST_ASSERT_EQUAL_UINT32(13, serialLines.size());
+    for (size_t i = 0; i < 13; i++)
+    {
+        TEST_ASSERT_EQUAL_STRING(replies[i], serialLines[i].c_str());
+    }
+
+    std::vector<unsigned> started;
+    unsigned long startedMs[5] = {}, doneMs[5] = {};
+    float dispensed[5] = {};
+    bool cancelled = false;
+    unsigned long start = Hal::millis();
+    while (!(doneMs[2] && !pumpController.isBusy()) && Hal::millis() - start < 3 * MAX_DISPENSE_MS)
+    {
+        controlLoop.step();
+        size_t first = serialLines.size();
+        serial.update();
+        for (size_t i = first; i < serialLines.size(); i++)
+        {
+            unsigned id, queued;
+            char event[16];
+            float grams;
+            if (sscanf(serialLines[i].c_str(), "JOB %u %15s %f %u", &id, event, &grams, &queued) < 2 || id > 4)
+            {
+                continue;
+            }
+            if (!strcmp(event, "STARTED"))
+            {
+                started.push_back(id);
+                startedMs[id] = Hal::millis();
+            }
+            else if (!strcmp(event, "DONE"))
+            {
+                doneMs[id] = Hal::millis();
+                dispensed[id] = grams;
+            }
+            cancelled |= id == 4 && !strcmp(event, "CANCELLED");
+        }
+        sim.clock().advance(1000);
+    }
+
+    // Priority first, then in order; each job starts in the step the last one ended
+    TEST_ASSERT_EQUAL_UINT32(3, started.size());
+    TEST_ASSERT_EQUAL_UINT32(3, started[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, started[1]);
+    TEST_ASSERT_EQUAL_UINT32(2, started[2]);
+    TEST_ASSERT_TRUE(cancelled);
+    TEST_ASSERT_EQUAL_UINT32(doneMs[3], startedMs[1]);
+    TEST_ASSERT_EQUAL_UINT32(doneMs[1], startedMs[2]);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 0.8, dispensed[3]);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.0, dispensed[1]);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 0.5, dispensed[2]);
+    TEST_ASSERT_FLOAT_WITHIN(0.2, 2.3, sim.getLiquidDelivered(0));
+    TEST_ASSERT_FALSE(pumpController.dispense(liquidManager.getLiquid(0), 1e9));
+}
+
+void test_stations_dispense_in_parallel(void)
+{
+    const uint8_t STATIONS = 8;
+    const char *path = "test_stations.bin";
+    remove(path);
+
+    // One clock, a pump pin, load cell and pump of its own per station
+    std::vector<std::unique_ptr<DispenseSimulator>> sims;
+    for (uint8_t i = 0; i < STATIONS; i++)
+    {
+        SimConfig config;
+        config.pumpPin = 20 + i;
+        config.seed = i + 1;
+        sims.emplace_back(i == 0 ? new DispenseSimulator(config) : new DispenseSimulator(*sims[0], config));
+    }
+    FileStorage storage(path);
+    std::deque<Station> stations;
+    StationScheduler scheduler;
+    for (uint8_t i = 0; i < STATIONS; i++)
+    {
+        DispenseSimulator &sim = *sims[i];
+        stations.emplace_back(i, sim.getConfig().pumpPin, sim.loadCell(), sim.flushServo(), storage,
+                              &sim.thermometer());
+        stations[i].addLiquid("Bio Grow", 1.0f + 0.1f * i, sim.addLiquid(0.8f + 0.1f * i));
+        stations[i].begin();
+        TEST_ASSERT_TRUE(scheduler.add(stations[i]));
+        TEST_ASSERT_TRUE(stations[i].getLink().requestDispense(0) != 0);
+    }
+
+    // A loaded control task: the period wanders between 1 and 3ms
+    unsigned long startedMs[STATIONS] = {}, doneMs[STATIONS] = {};
+    float dispensed[STATIONS] = {};
+    uint8_t done = 0, maxPumping = 0;
+    unsigned long start = Hal::millis();
+    for (uint32_t pass = 0; done < STATIONS && Hal::millis() - start < MAX_DISPENSE_MS; pass++)
+    {
+        scheduler.step();
+        uint8_t pumping = 0;
+        for (uint8_t i = 0; i < STATIONS; i++)
+        {
+            ControlEvent event;
+            while (stations[i].getLink().pollEvent(event))
+            {
+                if (event.type == ControlEvent::STARTED)
+                {
+                    startedMs[i] = event.timestampMs;
+                }
+                else if (event.type == ControlEvent::DONE)
+                {
+                    doneMs[i] = event.timestampMs;
+                    dispensed[i] = event.dispensed;
+                    done++;
+                }
+            }
+            pumping += sims[0]->gpio().digitalRead(sims[i]->getConfig().pumpPin) == HIGH;
+        }
+        maxPumping = pumping > maxPumping ? pumping : maxPumping;
+        sims[0]->clock().advance(1000 * (1 + pass % 3));
+    }
+
+    TEST_ASSERT_EQUAL_UINT8(STATIONS, done);
+    TEST_ASSERT_EQUAL_UINT8(STATIONS, maxPumping);
+    unsigned long busyMs = 0;
+    for (uint8_t i = 0; i < STATIONS; i++)
+    {
+        float target = 1.0f + 0.1f * i;
+        TEST_ASSERT_FLOAT_WITHIN(0.1, target, dispensed[i]);
+        TEST_ASSERT_FLOAT_WITHIN(0.15, target, sims[i]->getLiquidDelivered(0));
+        // No station waits more than one control period for its next step
+        TEST_ASSERT_TRUE(scheduler.getMaxGapUs(i) <= 3000);
+        busyMs += doneMs[i] - startedMs[i];
+    }
+    // Side by side, not one after the other
+    TEST_ASSERT_TRUE(Hal::millis() - start < busyMs / 4);
+
+    // Same liquid name, a flow model per station
+    for (uint8_t i = 0; i < STATIONS; i++)
+    {
+        CalibrationStore store(storage, i);
+        store.begin();
+        Liquid liquid("Bio Grow", 1.0, nullptr);
+        TEST_ASSERT_TRUE(store.loadLiquid(liquid));
+        float learned = stations[i].getLiquidManager().getLiquid(0)->flowModel.getFlowRate();
+        TEST_ASSERT_FLOAT_WITHIN(0.0001, learned, liquid.flowModel.getFlowRate());
+        TEST_ASSERT_FLOAT_WITHIN(0.2, 0.8f + 0.1f * i, learned);
+    }
+    remove(path);
+}
+
+struct WheelProbe
+{
+    uint32_t deadlineMs;
+    const uint32_t *nowMs;
+    uint32_t firedAtMs;
+    int fired;
+};
+
+static void fireProbe(void *arg)
+{
+    WheelProbe *probe = static_cast<WheelProbe *>(arg);
+    probe->firedAtMs = *probe->nowMs;
+    probe->fired++;
+}
+
+void test_timer_wheel_fires_at_deadlines(void)
+{
+    // Every level, past the coarsest one, and across the wrap of the 32-bit clock
+    const uint32_t START_MS = 0xffffffff - 5000;
+    const uint32_t DELAYS_MS[] = {1, 63, 64, 65, 4095, 4096, 4097, 262143, 300000, 20000000};
+    const size_t COUNT = sizeof(DELAYS_MS) / sizeof(DELAYS_MS[0]);
+    uint32_t nowMs = START_MS;
+    TimerWheel wheel(START_MS);
+    WheelProbe probes[COUNT];
+    std::deque<TimerWheel::Timer> timers;
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        probes[i] = {START_MS + DELAYS_MS[i], &nowMs, 0, 0};
+        timers.emplace_back(fireProbe, &probes[i]);
+        wheel.start(timers[i], probes[i].deadlineMs);
+    }
+    // Moved before it fires, and stopped
+    WheelProbe stopped = {START_MS + 100, &nowMs, 0, 0};
+    TimerWheel::Timer stoppedTimer(fireProbe, &stopped);
+    wheel.start(stoppedTimer, START_MS + 10);
+    wheel.start(stoppedTimer, stopped.deadlineMs);
+
+    // Sleep until the wheel has work, as the event loop does
+    uint32_t wakeups = 0;
+    uint32_t atMs;
+    while (wheel.getNextMs(atMs))
+    {
+        for (size_t i = 0; i < COUNT; i++)
+        {
+            TEST_ASSERT_TRUE(probes[i].fired || static_cast<int32_t>(probes[i].deadlineMs - atMs) >= 0);
+        }
+        nowMs = atMs;
+        wheel.advance(nowMs);
+        if (wakeups == 0)
+        {
+            wheel.stop(stoppedTimer);
+        }
+        wakeups++;
+    }
+    for (size_t i = 0; i < COUNT; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(1, probes[i].fired);
+        TEST_ASSERT_EQUAL_UINT32(probes[i].deadlineMs, probes[i].firedAtMs);
+    }
+    TEST_ASSERT_EQUAL_INT(0, stopped.fired);
+    TEST_ASSERT_EQUAL_UINT32(0, wheel.getArmedCount());
+    // A few moves between levels per timer, not a wake-up per millisecond
+    TEST_ASSERT_TRUE(wakeups < 6 * COUNT);
+
+    // Started for a time already past: fires on the next advance
+    WheelProbe late = {nowMs - 5, &nowMs, 0, 0};
+    TimerWheel::Timer lateTimer(fireProbe, &late);
+    wheel.start(lateTimer, late.deadlineMs);
+    TEST_ASSERT_EQUAL_UINT32(1, wheel.advance(nowMs));
+    TEST_ASSERT_EQUAL_INT(1, late.fired);
+}
+
+void test_event_loop_steps_station_on_events(void)
+{
+    const char *path = "test_events.bin";
+    remove(path);
+    DispenseSimulator sim;
+    FileStorage storage(path);
+    Station station(0, PUMP_PIN, sim.loadCell(), sim.flushServo(), storage, &sim.thermometer());
+    station.addLiquid("Bio Grow", 1.5, sim.addLiquid(1.0));
+    EventLoop loop(Profiler::CONTROL_LATENCY);
+    StationScheduler scheduler;
+    scheduler.add(station);
+    scheduler.attach(loop);
+    TEST_ASSERT_TRUE(station.begin());
+    Profiler::reset();
+
+    // Woken only by conversions, pump timer edges, commands and deadlines;
+    // the clock runs in 100us steps so a late deadline would show
+    uint16_t jobId = station.getLink().requestDispense(0);
+    TEST_ASSERT_TRUE(jobId != 0);
+    uint32_t wakeups = 0;
+    float dispensed = -1;
+    unsigned long start = Hal::millis();
+    while (dispensed < 0 && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        wakeups += loop.runOnce() > 0;
+        loop.sleep();
+        ControlEvent event;
+        while (station.getLink().pollEvent(event))
+        {
+            if (event.type == ControlEvent::DONE && event.jobId == jobId)
+            {
+                dispensed = event.dispensed;
+            }
+        }
+        sim.clock().advance(100);
+    }
+    unsigned long busyMs = Hal::millis() - start;
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.5, dispensed);
+    TEST_ASSERT_FLOAT_WITHIN(0.15, 1.5, sim.getLiquidDelivered(0));
+    // The polling loop stepped every 1ms
+    TEST_ASSERT_TRUE(wakeups < busyMs / 20);
+    Profiler::Report latency = Profiler::getReport(Profiler::CONTROL_LATENCY);
+    TEST_ASSERT_TRUE(latency.count > 0);
+    TEST_ASSERT_TRUE(latency.maxUs <= 100);
+
+    // Idle, the station only wakes for its 10 conversions a second
+    wakeups = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        wakeups += loop.runOnce() > 0;
+        loop.sleep();
+        sim.clock().advance(100);
+    }
+    TEST_ASSERT_TRUE(wakeups >= 9 && wakeups <= 11);
+    TEST_ASSERT_EQUAL_UINT32(0, loop.getDroppedCount());
+    remove(path);
+}
+
+// The host's FileStorage keeps its entries in a std::map; flash on the
+// device has no heap in it
+class DiscardStorage : public HalStorage
+{
+public:
+    bool begin() override { return true; }
+    bool read(const char *key, void *data, size_t size) override { return false; }
+    bool write(const char *key, const void *data, size_t size) override { return true; }
+};
+
+static size_t sunkLines = 0;
+
+static void sinkLine(const char *line)
+{
+    sunkLines++;
+}
+
+void test_control_loop_never_allocates(void)
+{
+    DispenseSimulator sim;
+    DiscardStorage storage;
+    Station station(0, PUMP_PIN, sim.loadCell(), sim.flushServo(), storage, &sim.thermometer());
+    station.addLiquid("Bio Grow", 1.5, sim.addLiquid(1.0));
+    station.addLiquid("Bio Bloom", 1.0, sim.addLiquid(1.2));
+    EventLoop loop(Profiler::CONTROL_LATENCY);
+    StationScheduler scheduler;
+    scheduler.add(station);
+    scheduler.attach(loop);
+    station.begin();
+    Logger::setMinimumLevel(Logger::INFO);
+    Logger::setSink(sinkLine);
+    Logger::setInlineDrain(false);
+    sunkLines = 0;
+
+    // Two jobs back to back: taring, pumping, settling, flushing, the status
+    // and event traffic and the log records, all without touching the heap
+    uint16_t lastJob = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        lastJob = station.getLink().requestDispense(i);
+        TEST_ASSERT_TRUE(lastJob != 0);
+    }
+    uint32_t iterations = 0;
+    uint32_t allocations = 0;
+    bool done = false;
+    unsigned long start = Hal::millis();
+    while (!done && Hal::millis() - start < 2 * MAX_DISPENSE_MS)
+    {
+        uint32_t before = HeapCounter::getAllocations();
+        loop.runOnce();
+        loop.sleep();
+        ControlStatus status;
+        station.getLink().pollStatus(status);
+        ControlEvent event;
+        while (station.getLink().pollEvent(event))
+        {
+            done = done || (event.type == ControlEvent::DONE && event.jobId == lastJob);
+        }
+        Logger::drain();
+        allocations += HeapCounter::getAllocations() - before;
+        iterations++;
+        sim.clock().advance(1000);
+    }
+    TEST_ASSERT_TRUE(done);
+    TEST_ASSERT_TRUE(sunkLines > 0);
+    TEST_ASSERT_EQUAL_UINT32(0, allocations);
+    TEST_ASSERT_TRUE(iterations > 1000);
+
+    Logger::setInlineDrain(true);
+    Logger::setSink(nullptr);
+}
+
+// Channel levels for one detent clockwise, from rest to rest
+const uint8_t DETENT_CW[] = {2, 0, 1, 3};
+const uint8_t DETENT_CCW[] = {1, 0, 2, 3};
+
+void turnDetent(RotaryDecoder &decoder, const uint8_t *levels, uint32_t atUs)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        decoder.update(levels[i], atUs + i);
+    }
+}
+
+void test_rotary_input_decodes_and_accelerates(void)
+{
+    RotaryDecoder decoder;
+    decoder.begin(3);
+    // A contact bouncing between two states adds nothing
+    const uint8_t bouncing[] = {2, 3, 2, 3, 2, 0, 2, 0, 1, 3};
+    for (uint8_t levels : bouncing)
+    {
+        decoder.update(levels, 0);
+    }
+    TEST_ASSERT_EQUAL_INT32(1, decoder.getPosition());
+    // Half a detent and back is no detent
+    decoder.update(2, 1000);
+    decoder.update(0, 1001);
+    decoder.update(2, 1002);
+    decoder.update(3, 1003);
+    TEST_ASSERT_EQUAL_INT32(1, decoder.getPosition());
+
+    // Slow detents count one step each, fast ones up to MAX_FACTOR
+    uint32_t nowUs = 1000000;
+    for (int i = 0; i < 3; i++)
+    {
+        nowUs += 2 * RotaryDecoder::SLOW_US;
+        turnDetent(decoder, DETENT_CW, nowUs);
+    }
+    TEST_ASSERT_EQUAL_INT32(4, decoder.getPosition());
+    TEST_ASSERT_EQUAL_INT32(4, decoder.getAcceleratedPosition());
+    for (int i = 0; i < 5; i++)
+    {
+        nowUs += RotaryDecoder::FAST_US;
+        turnDetent(decoder, DETENT_CW, nowUs);
+    }
+    TEST_ASSERT_EQUAL_INT32(9, decoder.getPosition());
+    TEST_ASSERT_EQUAL_INT32(4 + 5 * RotaryDecoder::MAX_FACTOR, decoder.getAcceleratedPosition());
+    // Turning back, however fast, is fine again
+    nowUs += RotaryDecoder::FAST_US;
+    turnDetent(decoder, DETENT_CCW, nowUs);
+    TEST_ASSERT_EQUAL_INT32(8, decoder.getPosition());
+    TEST_ASSERT_EQUAL_INT32(3 + 5 * RotaryDecoder::MAX_FACTOR, decoder.getAcceleratedPosition());
+
+    // Edges keep the time of the first bounce; a glitch that settles back is no edge
+    ButtonDebouncer debouncer;
+    debouncer.onEdge(100);
+    debouncer.onEdge(103);
+    debouncer.onEdge(104);
+    TEST_ASSERT_TRUE(debouncer.settle(true));
+    debouncer.onEdge(300);
+    TEST_ASSERT_FALSE(debouncer.settle(true));
+    debouncer.onEdge(350);
+    debouncer.onEdge(352);
+    TEST_ASSERT_TRUE(debouncer.settle(false));
+    HalInput::ButtonEdge edge;
+    TEST_ASSERT_TRUE(debouncer.poll(edge));
+    TEST_ASSERT_TRUE(edge.pressed);
+    TEST_ASSERT_EQUAL_UINT32(100, edge.timestampMs);
+    TEST_ASSERT_TRUE(debouncer.poll(edge));
+    TEST_ASSERT_FALSE(edge.pressed);
+    TEST_ASSERT_EQUAL_UINT32(350, edge.timestampMs);
+    TEST_ASSERT_FALSE(debouncer.poll(edge));
+
+    // A click, a double click and a long press, read as they come
+    ButtonGestures gestures;
+    uint32_t atMs;
+    TEST_ASSERT_FALSE(gestures.getDeadline(atMs));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, gestures.add({true, 1000}));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, gestures.add({false, 1100}));
+    TEST_ASSERT_TRUE(gestures.getDeadline(atMs));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, gestures.update(atMs - 1));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::CLICK, gestures.update(atMs));
+    gestures.add({true, 2000});
+    gestures.add({false, 2100});
+    gestures.add({true, 2300});
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::DOUBLE_CLICK, gestures.add({false, 2400}));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, gestures.update(5000));
+    gestures.add({true, 6000});
+    TEST_ASSERT_TRUE(gestures.getDeadline(atMs));
+    TEST_ASSERT_EQUAL_UINT32(6000 + ButtonGestures::LONG_PRESS_MS, atMs);
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::LONG_PRESS, gestures.update(atMs));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, gestures.add({false, 9000}));
+
+    // Read seconds late, the same edges make the same gestures
+    ButtonGestures late;
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, late.add({true, 1000}));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, late.add({false, 1100}));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::CLICK, late.add({true, 2000}));
+    late.add({false, 2100});
+    late.add({true, 2300});
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::DOUBLE_CLICK, late.add({false, 2400}));
+    late.add({true, 6000});
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::LONG_PRESS, late.add({false, 9000}));
+    TEST_ASSERT_EQUAL_INT(ButtonGestures::NONE, late.update(20000));
+}
+
+void test_paged_frame_sends_only_changed_pages(void)
+{
+    PagedFrame frame;
+    uint8_t buffer[PagedFrame::SIZE] = {0};
+    uint8_t sent[PagedFrame::SIZE];
+
+    // The first frame goes out whole, whatever it contains
+    TEST_ASSERT_EQUAL_HEX8(0x00, frame.submit(buffer));
+    TEST_ASSERT_EQUAL_HEX8(0xFF, frame.take(sent));
+
+    TEST_ASSERT_EQUAL_HEX8(0x00, frame.submit(buffer));
+    TEST_ASSERT_EQUAL_HEX8(0x00, frame.take(sent));
+
+    // Weight digits in page 7, then the progress bar in page 5, before the
+    // transfer runs: both coalesce into one transfer
+    buffer[7 * PagedFrame::PAGE_SIZE + 3] = 0x7E;
+    TEST_ASSERT_EQUAL_HEX8(0x80, frame.submit(buffer));
+    buffer[5 * PagedFrame::PAGE_SIZE + 100] = 0xFF;
+    TEST_ASSERT_EQUAL_HEX8(0x20, frame.submit(buffer));
+    TEST_ASSERT_EQUAL_HEX8(0xA0, frame.take(sent));
+    TEST_ASSERT_EQUAL_HEX8(0x7E, sent[7 * PagedFrame::PAGE_SIZE + 3]);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, sent[5 * PagedFrame::PAGE_SIZE + 100]);
+    TEST_ASSERT_EQUAL_HEX8(0x00, frame.getDirtyPages());
+}
+
+void test_sample_history_decimates_keeping_extremes(void)
+{
+    SampleHistory<8> history;
+    const float weights[] = {0.0, 0.4, 2.5, 0.8, 1.0, 1.2, -0.3, 1.4};
+    for (int i = 0; i < 8; i++)
+    {
+        history.add(1000 + i * 100, 10.0 + weights[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(8, history.size());
+    TEST_ASSERT_EQUAL_UINT16(0, history.getDecimationCount());
+
+    // Full: each group of four keeps its dip and its peak
+    history.add(70000, 11.5); // Gap longer than a 16-bit delta, saturated
+    TEST_ASSERT_EQUAL_UINT16(1, history.getDecimationCount());
+    TEST_ASSERT_EQUAL_UINT32(5, history.size());
+
+    const uint32_t expectedMs[] = {1000, 1200, 1600, 1700, 1700 + 65535};
+    const float expectedWeights[] = {10.0, 12.5, 9.7, 11.4, 11.5};
+    int i = 0;
+    for (SampleHistory<8>::Point point : history)
+    {
+        TEST_ASSERT_EQUAL_UINT32(expectedMs[i], point.timestampMs);
+        TEST_ASSERT_FLOAT_WITHIN(0.006, expectedWeights[i], point.weight);
+        i++;
+    }
+    TEST_ASSERT_EQUAL_INT(5, i);
+
+    history.clear();
+    TEST_ASSERT_TRUE(history.empty());
+}
+
+static uint32_t fakeTicks = 0;
+
+static uint32_t readFakeTicks()
+{
+    return fakeTicks;
+}
+
+void test_profiler_reports_percentiles_and_overruns(void)
+{
+    DispenseSimulator sim; // Hal::millis() for the time of the longest call
+    Profiler::setTickSource(readFakeTicks, 240);
+    Profiler::reset();
+
+    // 1000 control passes, 1ms apart: 1% take 1.5ms, over the 1ms budget
+    for (int i = 0; i < 1000; i++)
+    {
+        Profiler::mark(Profiler::CONTROL_LATENCY);
+        {
+            ProfileScope profile(Profiler::CONTROL_PASS);
+            fakeTicks += (i % 100 == 99 ? 1500 : 100) * 240;
+        }
+        fakeTicks += 240000 - (i % 100 == 99 ? 1500 : 100) * 240;
+        sim.clock().advance(1000);
+    }
+    Profiler::Report pass = Profiler::getReport(Profiler::CONTROL_PASS);
+    TEST_ASSERT_EQUAL_STRING("control", pass.name);
+    TEST_ASSERT_EQUAL_UINT32(1000, pass.count);
+    TEST_ASSERT_EQUAL_UINT32(100, pass.minUs);
+    TEST_ASSERT_EQUAL_UINT32(114, pass.averageUs);
+    TEST_ASSERT_EQUAL_UINT32(1500, pass.maxUs);
+    TEST_ASSERT_EQUAL_UINT32(99, pass.maxAtMs);
+    TEST_ASSERT_EQUAL_UINT32(10, pass.overruns);
+    // The 99th percentile is still a fast pass, give or take its bucket
+    TEST_ASSERT_TRUE(pass.p99Us >= 100 && pass.p99Us < 119);
+    Profiler::Report period = Profiler::getReport(Profiler::CONTROL_LATENCY);
+    TEST_ASSERT_EQUAL_UINT32(999, period.count);
+    TEST_ASSERT_EQUAL_UINT32(1000, period.minUs);
+    TEST_ASSERT_EQUAL_UINT32(1000, period.maxUs);
+    TEST_ASSERT_EQUAL_UINT32(0, period.overruns);
+    TEST_ASSERT_EQUAL_UINT8(Profiler::CONTROL_PASS, Profiler::getWorstOffender());
+
+    // Four times its budget beats one and a half
+    {
+        ProfileScope profile(Profiler::PUMP_UPDATE);
+        fakeTicks += 2000 * 240;
+    }
+    TEST_ASSERT_EQUAL_UINT8(Profiler::PUMP_UPDATE, Profiler::getWorstOffender());
+
+    ControlLink link;
+    LiquidManager liquidManager;
+    SerialCommands commands(link, liquidManager, collectLine);
+    serialLines.clear();
+    for (const char *c = "profile\n"; *c; c++)
+    {
+        commands.receive(*c);
+    }
+    TEST_ASSERT_EQUAL_UINT32(4, serialLines.size());
+    TEST_ASSERT_EQUAL_STRING("PROFILE control n=1000 min=100 avg=114 p99=111 max=1500@99ms budget=1000 over=10",
+                             serialLines[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("PROFILE WORST pump", serialLines[3].c_str());
+
+    serialLines.clear();
+    for (const char *c = "PROFILE RESET\n"; *c; c++)
+    {
+        commands.receive(*c);
+    }
+    TEST_ASSERT_EQUAL_STRING("OK", serialLines[0].c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, Profiler::getReport(Profiler::CONTROL_PASS).count);
+    TEST_ASSERT_EQUAL_UINT8(Profiler::SECTION_COUNT, Profiler::getWorstOffender());
+    Profiler::setTickSource(nullptr);
+}
+
+static std::vector<std::string> loggedLines;
+
+static void captureLine(const char *line)
+{
+    loggedLines.push_back(line);
+}
+
+void test_logger_defers_and_counts_overflow(void)
+{
+    DispenseSimulator sim;
+    loggedLines.clear();
+    Logger::setMinimumLevel(Logger::INFO);
+    Logger::setSink(captureLine);
+    Logger::setInlineDrain(false);
+    uint32_t droppedBefore = Logger::getDroppedCount();
+
+    sim.clock().advance(1234000);
+    LOG_INFO("Dispensing {}g of {} in {}us, retry {}", 1.5f, "Bio Grow", 450000u, -2);
+    TEST_ASSERT_EQUAL(0, loggedLines.size()); // Nothing is written by the caller
+
+    for (size_t i = 1; i < Logger::QUEUE_SIZE + 6; i++)
+    {
+        LOG_WARNING("Filler {}", static_cast<int>(i));
+    }
+    TEST_ASSERT_EQUAL_UINT32(6, Logger::getDroppedCount() - droppedBefore);
+
+    TEST_ASSERT_EQUAL(Logger::QUEUE_SIZE, Logger::drain());
+    TEST_ASSERT_EQUAL(Logger::QUEUE_SIZE + 1, loggedLines.size());
+    TEST_ASSERT_EQUAL_STRING("[1234] INFO: Dispensing 1.50g of Bio Grow in 450000us, retry -2", loggedLines[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("[1234] WARNING: Filler 63", loggedLines[Logger::QUEUE_SIZE - 1].c_str());
+    TEST_ASSERT_EQUAL_STRING("[1234] WARNING: 6 log records dropped", loggedLines.back().c_str());
+
+    Logger::setInlineDrain(true);
+    Logger::setSink(nullptr);
+}
+
+#ifdef __linux__
+static int telemetryFd = -1;
+
+static void writeTelemetry(const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(telemetryFd, data, length);
+        TEST_ASSERT_TRUE(n > 0);
+        data += n;
+        length -= n;
+    }
+}
+
+static void collectRecord(void *arg, const TelemetryRecord &record)
+{
+    static_cast<std::vector<TelemetryRecord> *>(arg)->push_back(record);
+}
+
+// Feeds what the pty has to the decoder, waiting up to timeoutMs for more
+static void readPty(int fd, TelemetryDecoder &decoder, int timeoutMs)
+{
+    pollfd request = {fd, POLLIN, 0};
+    uint8_t buffer[256];
+    while (poll(&request, 1, timeoutMs) > 0)
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+        {
+            return;
+        }
+        decoder.push(buffer, n);
+    }
+}
+
+void test_telemetry_decodes_through_pty(void)
+{
+    // The device side writes to the pty master, the decoder reads the other end like a serial port
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    TEST_ASSERT_TRUE(master >= 0);
+    TEST_ASSERT_EQUAL_INT(0, grantpt(master));
+    TEST_ASSERT_EQUAL_INT(0, unlockpt(master));
+    int port = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    TEST_ASSERT_TRUE(port >= 0);
+    termios tty;
+    tcgetattr(port, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(port, TCSANOW, &tty);
+    telemetryFd = master;
+
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch liquidSwitch(sim.addLiquid(1.2), "Bio Grow");
+    WeightSampler sampler(sim.loadCell());
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid liquid("Bio Grow", 1.5, &liquidSwitch);
+    flushSwitch.begin();
+    liquidSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler);
+
+    std::vector<TelemetryRecord> records;
+    TelemetryDecoder decoder(collectRecord, &records);
+    Telemetry::setWriter(writeTelemetry);
+    Telemetry::watch(&sampler);
+    uint32_t firstSample = sampler.getSampleCount();
+
+    pumpController.dispense(&liquid);
+    unsigned long start = Hal::millis();
+    while (pumpController.isBusy() && Hal::millis() - start < MAX_DISPENSE_MS)
+    {
+        pumpController.update();
+        sim.clock().advance(1000);
+        if (Hal::millis() % 10 == 0)
+        {
+            Telemetry::drain();
+            readPty(port, decoder, 0);
+        }
+        if (Hal::millis() - start == 500)
+        {
+            // A log line on the same UART costs nothing but itself
+            const char *line = "[500] INFO: Pump turned on\r\n";
+            writeTelemetry(reinterpret_cast<const uint8_t *>(line), strlen(line));
+        }
+    }
+    Telemetry::drain();
+    readPty(port, decoder, 200);
+    Telemetry::setWriter(nullptr);
+    Telemetry::watch(nullptr);
+    close(port);
+    close(master);
+
+    TEST_ASSERT_EQUAL_UINT32(1, decoder.getBadFrameCount());
+    TEST_ASSERT_EQUAL_UINT32(0, decoder.getLostFrameCount());
+    uint32_t samples = 0, pumpOn = 0, pumpOff = 0, valveEdges = 0, jobs = 0, models = 0, dropped = 0;
+    uint32_t lastSampleUs = 0;
+    bool sawDispensing = false, sawFlowRate = false;
+    const char *lastState = "";
+    float dose = 0;
+    for (const TelemetryRecord &record : records)
+    {
+        switch (record.type)
+        {
+        case TelemetryFrame::SAMPLES:
+            // Every conversion, in order
+            TEST_ASSERT_TRUE(samples == 0 || record.timestampUs - lastSampleUs == 100000);
+            lastSampleUs = record.timestampUs;
+            samples++;
+            break;
+        case TelemetryFrame::EDGE:
+            pumpOn += strcmp(record.name, "pump") == 0 && record.on;
+            pumpOff += strcmp(record.name, "pump") == 0 && !record.on;
+            valveEdges += strcmp(record.name, "Bio Grow") == 0;
+            break;
+        case TelemetryFrame::STATE:
+            sawDispensing |= strcmp(record.name, "DISPENSING") == 0;
+            lastState = record.name;
+            break;
+        case TelemetryFrame::ESTIMATE:
+            sawFlowRate |= record.estimate == TelemetryFrame::FLOW_RATE;
+            dose = record.estimate == TelemetryFrame::DOSE ? record.value : dose;
+            break;
+        case TelemetryFrame::JOB:
+            jobs += record.kind == TelemetryFrame::JOB_DOSE && strcmp(record.name, "Bio Grow") == 0;
+            TEST_ASSERT_FLOAT_WITHIN(1e-6, 1.5, record.value);
+            break;
+        case TelemetryFrame::MODEL:
+            models++;
+            TEST_ASSERT_FLOAT_WITHIN(1e-6, liquid.flushVolume, record.model[TelemetryFrame::MODEL_FLUSH_VOLUME]);
+            break;
+        default:
+            dropped++;
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, dropped);
+    TEST_ASSERT_EQUAL_UINT32(1, jobs);
+    TEST_ASSERT_EQUAL_UINT32(1, models);
+    TEST_ASSERT_EQUAL_UINT32(sampler.getSampleCount() - firstSample, samples);
+    TEST_ASSERT_TRUE(pumpOn > 1);
+    TEST_ASSERT_EQUAL_UINT32(pumpOn, pumpOff);
+    TEST_ASSERT_EQUAL_UINT32(2, valveEdges);
+    TEST_ASSERT_TRUE(sawDispensing);
+    TEST_ASSERT_EQUAL_STRING("IDLE", lastState);
+    TEST_ASSERT_TRUE(sawFlowRate);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 1.5, dose);
+}
+#endif
+
+static TelemetryRecorder *activeRecorder = nullptr;
+
+static void writeRecording(const uint8_t *data, size_t length)
+{
+    activeRecorder->write(data, length);
+}
+
+void test_recording_replays_into_controller(void)
+{
+    const char *path = "test_recording.bin";
+    DispenseSimulator sim;
+    ServoSwitch flushSwitch(sim.flushServo(), "Flush");
+    ServoSwitch growSwitch(sim.addLiquid(1.2), "Bio Grow");
+    ServoSwitch calMagSwitch(sim.addLiquid(0.9), "CalMag");
+    WeightSampler sampler(sim.loadCell());
+    ScaleModule scaleModule(sampler);
+    PumpController pumpController(PUMP_PIN, &flushSwitch);
+    Liquid grow("Bio Grow", 1.5, &growSwitch, 1);
+    Liquid calMag("CalMag", 1.0, &calMagSwitch);
+    grow.flowModel.setParameters({1.1, 0.05, 0.02, 0.05, 0.02, 12}); // As loaded at boot
+    grow.flushVolume = 9.0;
+    Recipe recipe("Feed");
+    recipe.addStep(&grow, 2.0);
+    recipe.addStep(&calMag, 1.0);
+
+    // Recorded from boot, like on the device
+    TelemetryRecorder recorder;
+    TEST_ASSERT_TRUE(recorder.begin(path));
+    activeRecorder = &recorder;
+    Telemetry::setWriter(writeRecording);
+    Telemetry::watch(&sampler);
+    flushSwitch.begin();
+    growSwitch.begin();
+    calMagSwitch.begin();
+    sampler.setScale(sim.getConfig().scaleFactor);
+    sampler.begin();
+    pumpController.init(&sampler, nullptr, &scaleModule);
+
+    // Three jobs, 2s apart, stepped like the control task does
+    uint8_t started = 0;
+    unsigned long idleSince = Hal::millis();
+    while ((started < 3 || pumpController.isBusy()) && Hal::millis() < 10 * MAX_DISPENSE_MS)
+    {
+        pumpController.update();
+        if (pumpController.isBusy())
+        {
+            idleSince = Hal::millis();
+        }
+        else if (Hal::millis() - idleSince >= 2000)
+        {
+            if (started == 0)
+            {
+                pumpController.dispense(&recipe);
+            }
+            else if (started == 1)
+            {
+                pumpController.dispense(&grow);
+            }
+            else
+            {
+                pumpController.flush();
+            }
+            started++;
+        }
+        Telemetry::drain();
+        sim.clock().advance(1000);
+    }
+    Telemetry::drain();
+    Telemetry::setWriter(nullptr);
+    Telemetry::watch(nullptr);
+    recorder.end();
+    TEST_ASSERT_FALSE(pumpController.isBusy());
+    TEST_ASSERT_TRUE(pumpController.getLastDispenseStats().completed);
+    unsigned long recordedMs = Hal::millis();
+
+    TelemetryReplay replay;
+    TEST_ASSERT_TRUE(replay.load(path));
+    TEST_ASSERT_EQUAL_UINT32(0, replay.getBadFrameCount());
+    TEST_ASSERT_EQUAL_UINT32(sampler.getSampleCount(), replay.getSampleCount());
+    TelemetryReplay::Result result = replay.run();
+    remove(path);
+    remove("test_recording.bin.old");
+
+    // Same stream, same controller: every pump and valve edge at the same
+    // microsecond and the same doses
+    TEST_ASSERT_EQUAL_UINT32(3, result.recordedJobs);
+    TEST_ASSERT_EQUAL_UINT32(3, result.jobs);
+    TEST_ASSERT_TRUE(result.recordedEdges > 12);
+    TEST_ASSERT_EQUAL_UINT32(result.recordedEdges, result.edges);
+    TEST_ASSERT_EQUAL_UINT32(result.recordedEdges, result.matchedEdges);
+    TEST_ASSERT_TRUE(result.firstDivergenceUs == 0);
+    TEST_ASSERT_EQUAL_UINT32(0, result.maxEdgeShiftUs);
+    TEST_ASSERT_EQUAL_UINT32(3, result.doses);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 0, result.maxDoseError);
+    TEST_ASSERT_TRUE(result.durationUs / 1000 + 1000 > recordedMs);
+}
+
+// Every read of the tick counter is a few ms on: a block written to flash
+// takes that long on the device, with both cores waiting
+static uint32_t readFlashTicks()
+{
+    return fakeTicks += 3000 * 240;
+}
+
+static long getFileSize(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+void test_recording_waits_for_the_pump(void)
+{
+    const char *path = "test_held.bin";
+    DispenseSimulator sim;
+    PumpTimer pumpTimer(PUMP_PIN);
+    pumpTimer.begin();
+    TelemetryRecorder recorder;
+    TEST_ASSERT_TRUE(recorder.begin(path));
+    recorder.setHoldCheck(PumpTimer::isAnyRunning);
+    Profiler::setTickSource(readFlashTicks, 240);
+    Profiler::reset();
+    uint8_t frame[64];
+    memset(frame, 0x55, sizeof(frame));
+
+    // Five blocks during a pass stay in RAM, and go out once the pump is off
+    pumpTimer.start(100000);
+    TEST_ASSERT_TRUE(PumpTimer::isAnyRunning());
+    for (int i = 0; i < 40; i++)
+    {
+        recorder.write(frame, sizeof(frame));
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, Profiler::getReport(Profiler::FLASH_WRITE).count);
+    TEST_ASSERT_EQUAL_INT32(0, getFileSize(path));
+    sim.clock().advance(200000);
+    TEST_ASSERT_FALSE(PumpTimer::isAnyRunning());
+    recorder.write(frame, sizeof(frame));
+    TEST_ASSERT_EQUAL_INT32(5 * TelemetryRecorder::BLOCK_SIZE, getFileSize(path));
+
+    // Each of those writes would have stalled the cutoff past its budget
+    Profiler::Report flash = Profiler::getReport(Profiler::FLASH_WRITE);
+    TEST_ASSERT_EQUAL_UINT32(5, flash.count);
+    TEST_ASSERT_EQUAL_UINT32(5, flash.overruns);
+    TEST_ASSERT_EQUAL_UINT8(Profiler::FLASH_WRITE, Profiler::getWorstOffender());
+
+    // A pass longer than the buffer drops what does not fit, never writes
+    pumpTimer.start();
+    const int frames = TelemetryRecorder::BUFFER_SIZE / sizeof(frame) + 4;
+    for (int i = 0; i < frames; i++)
+    {
+        recorder.write(frame, sizeof(frame));
+    }
+    TEST_ASSERT_EQUAL_UINT32(5, Profiler::getReport(Profiler::FLASH_WRITE).count);
+    TEST_ASSERT_EQUAL_UINT32(5 * sizeof(frame), recorder.getDroppedBytes());
+    pumpTimer.stop();
+    recorder.end();
+    TEST_ASSERT_EQUAL_INT32(recorder.getBytesWritten(), getFileSize(path));
+    TEST_ASSERT_EQUAL_UINT32((41 + frames - 5) * sizeof(frame), recorder.getBytesWritten());
+    Profiler::setTickSource(nullptr);
+    remove(path);
+    remove("test_held.bin.old");
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_pump_timer_cuts_off_at_deadline);
+    RUN_TEST(test_pump_without_pwm_refuses_jobs);
+    RUN_TEST(test_sampler_reads_without_blocking);
+    RUN_TEST(test_filter_chain_rejects_recorded_spikes);
+    RUN_TEST(test_settle_detector_skips_servo_travel);
+    RUN_TEST(test_settle_detector_waits_out_a_noisy_scale);
+    RUN_TEST(test_flow_model_identifies_pump);
+    RUN_TEST(test_flow_model_learns_stall_duty_once_per_pass);
+    RUN_TEST(test_dispense_reaches_target);
+    RUN_TEST(test_dose_ends_when_flush_and_dosing_disagree);
+    RUN_TEST(test_many_dispense_cycles);
+    RUN_TEST(test_fine_phase_finishes_dose_in_one_pass);
+    RUN_TEST(test_recipe_groups_liquids_to_save_flushes);
+    RUN_TEST(test_flush_learns_volume_from_flow);
+    RUN_TEST(test_container_session_weighs_doses_without_taring);
+    RUN_TEST(test_scale_module_fits_quadratic_calibration);
+    RUN_TEST(test_scale_module_rejects_degenerate_calibration);
+    RUN_TEST(test_scale_module_tracks_zero_and_temperature_drift);
+    RUN_TEST(test_calibration_store_warm_start);
+    RUN_TEST(test_calibration_store_rejects_corrupt_record);
+    RUN_TEST(test_control_loop_runs_commands_and_reports_status);
+    RUN_TEST(test_job_queue_runs_serial_jobs_back_to_back);
+    RUN_TEST(test_stations_dispense_in_parallel);
+    RUN_TEST(test_timer_wheel_fires_at_deadlines);
+    RUN_TEST(test_event_loop_steps_station_on_events);
+    RUN_TEST(test_control_loop_never_allocates);
+    RUN_TEST(test_rotary_input_decodes_and_accelerates);
+    RUN_TEST(test_paged_frame_sends_only_changed_pages);
+    RUN_TEST(test_sample_history_decimates_keeping_extremes);
+    RUN_TEST(test_profiler_reports_percentiles_and_overruns);
+    RUN_TEST(test_logger_defers_and_counts_overflow);
+    RUN_TEST(test_recording_replays_into_controller);
+    RUN_TEST(test_recording_waits_for_the_pump);
+#ifdef __linux__
+    RUN_TEST(test_telemetry_decodes_through_pty);
+#endif
+
+    return UNITY_END();
+}
@@ -0,0 +1,217 @@
+// Telemetry decoder. Reads the COBS-framed telemetry stream of the device
+// (see lib/Telemetry) from a serial port, a pty, a capture file, a recording
+// copied off the device's LittleFS or stdin and writes one CSV file per
+// record type, one column per field:
+//
+//   <prefix>_samples.csv    timestamp_us,raw
+//   <prefix>_edges.csv      timestamp_us,channel,on
+//   <prefix>_states.csv     timestamp_us,state
+//   <prefix>_estimates.csv  timestamp_us,estimate,value
+//   <prefix>_dropped.csv    timestamp_us,records,samples
+//   <prefix>_jobs.csv       timestamp_us,kind,step,steps,group,amount,liquid
+//   <prefix>_models.csv     timestamp_us,liquid,flow_rate,dead_time,drip_volume,relative_error,
+//                           absolute_error,flush_volume,stall_duty,pulses
+//
+//   pio run -e telemetry && .pio/build/telemetry/program /dev/ttyUSB0 run1
+//
+//   --baud N     serial speed when the input is a tty (default 921600)
+//
+// Runs until end of input or Ctrl-C and prints a summary of good, bad and
+// lost frames. Log lines sharing the UART are skipped.
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <termios.h>
+#include <unistd.h>
+#include "TelemetryFrame.h"
+
+struct Outputs
+{
+    FILE *samples;
+    FILE *edges;
+    FILE *states;
+    FILE *estimates;
+    FILE *dropped;
+    FILE *jobs;
+    FILE *models;
+    unsigned long records;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+    stopRequested = 1;
+}
+
+static speed_t toSpeed(long baud)
+{
+    switch (baud)
+    {
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    default:
+        return 0;
+    }
+}
+
+// Raw mode for a tty; anything else is read as is
+static bool configureTty(int fd, long baud)
+{
+    if (!isatty(fd))
+    {
+        return true;
+    }
+    termios tty;
+    if (tcgetattr(fd, &tty) != 0)
+    {
+        return false;
+    }
+    cfmakeraw(&tty);
+    speed_t speed = toSpeed(baud);
+    if (speed == 0 || cfsetispeed(&tty, speed) != 0 || cfsetospeed(&tty, speed) != 0)
+    {
+        fprintf(stderr, "Unsupported baud rate %ld\n", baud);
+        return false;
+    }
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+static FILE *openCsv(const std::string &prefix, const char *name, const char *header)
+{
+    std::string path = prefix + "_" + name + ".csv";
+    FILE *file = fopen(path.c_str(), "w");
+    if (file)
+    {
+        fprintf(file, "%s\n", header);
+    }
+    return file;
+}
+
+static void writeRecord(void *arg, const TelemetryRecord &record)
+{
+    Outputs &out = *static_cast<Outputs *>(arg);
+    out.records++;
+    switch (record.type)
+    {
+    case TelemetryFrame::SAMPLES:
+        fprintf(out.samples, "%lu,%ld\n", static_cast<unsigned long>(record.timestampUs), static_cast<long>(record.raw));
+        break;
+    case TelemetryFrame::EDGE:
+        fprintf(out.edges, "%lu,%s,%d\n", static_cast<unsigned long>(record.timestampUs), record.name, record.on ? 1 : 0);
+        break;
+    case TelemetryFrame::STATE:
+        fprintf(out.states, "%lu,%s\n", static_cast<unsigned long>(record.timestampUs), record.name);
+        break;
+    case TelemetryFrame::ESTIMATE:
+        fprintf(out.estimates, "%lu,%s,%.6g\n", static_cast<unsigned long>(record.timestampUs),
+                TelemetryFrame::getEstimateName(record.estimate), record.value);
+        break;
+    case TelemetryFrame::DROPPED:
+        fprintf(out.dropped, "%lu,%lu,%lu\n", static_cast<unsigned long>(record.timestampUs),
+                static_cast<unsigned long>(record.dropped), static_cast<unsigned long>(record.missed));
+        break;
+    case TelemetryFrame::JOB:
+        fprintf(out.jobs, "%lu,%s,%u,%u,%u,%.6g,%s\n", static_cast<unsigned long>(record.timestampUs),
+                TelemetryFrame::getJobKindName(record.kind), record.step, record.steps, record.group, record.value,
+                record.name);
+        break;
+    case TelemetryFrame::MODEL:
+        fprintf(out.models, "%lu,%s", static_cast<unsigned long>(record.timestampUs), record.name);
+        for (float value : record.model)
+        {
+            fprintf(out.models, ",%.6g", value);
+        }
+        fprintf(out.models, ",%u\n", record.pulseCount);
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *input = nullptr;
+    const char *prefix = nullptr;
+    long baud = 921600;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--baud") && i + 1 < argc)
+        {
+            baud = atol(argv[++i]);
+        }
+        else if (!input)
+        {
+            input = argv[i];
+        }
+        else if (!prefix)
+        {
+            prefix = argv[i];
+        }
+        else
+        {
+            input = nullptr;
+            break;
+        }
+    }
+    if (!input || !prefix)
+    {
+        fprintf(stderr, "Usage: %s <port|file|-> <output prefix> [--baud N]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = strcmp(input, "-") ? open(input, O_RDONLY | O_NOCTTY) : STDIN_FILENO;
+    if (fd < 0 || !configureTty(fd, baud))
+    {
+        fprintf(stderr, "Cannot open %s\n", input);
+        return 1;
+    }
+
+    Outputs out = {};
+    out.samples = openCsv(prefix, "samples", "timestamp_us,raw");
+    out.edges = openCsv(prefix, "edges", "timestamp_us,channel,on");
+    out.states = openCsv(prefix, "states", "timestamp_us,state");
+    out.estimates = openCsv(prefix, "estimates", "timestamp_us,estimate,value");
+    out.dropped = openCsv(prefix, "dropped", "timestamp_us,records,samples");
+    out.jobs = openCsv(prefix, "jobs", "timestamp_us,kind,step,steps,group,amount,liquid");
+    out.models = openCsv(prefix, "models",
+                         "timestamp_us,liquid,flow_rate,dead_time,drip_volume,relative_error,absolute_error,"
+                         "flush_volume,stall_duty,pulses");
+    if (!out.samples || !out.edges || !out.states || !out.estimates || !out.dropped || !out.jobs || !out.models)
+    {
+        fprintf(stderr, "Cannot write %s_*.csv\n", prefix);
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    TelemetryDecoder decoder(writeRecord, &out);
+    uint8_t buffer[4096];
+    while (!stopRequested)
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+        {
+            break; // End of input, the port went away, or a signal
+        }
+        decoder.push(buffer, static_cast<size_t>(n));
+    }
+
+    for (FILE *file : {out.samples, out.edges, out.states, out.estimates, out.dropped, out.jobs, out.models})
+    {
+        fclose(file);
+    }
+    fprintf(stderr, "%lu records from %lu frames; %lu bad, %lu lost\n", out.records,
+            static_cast<unsigned long>(decoder.getFrameCount()), static_cast<unsigned long>(decoder.getBadFrameCount()),
+            static_cast<unsigned long>(decoder.getLostFrameCount()));
+    return 0;
+}